@@ -2,6 +2,18 @@
 --
 -- REQUEST: curl -k https://127.0.0.1:1443/hi
 -- EXPECT: hello, HTTPS world!
+--
+-- Hosts are located by the SNI name first, and each Host uses its own
+-- SSL settings.
+--
+-- REQUEST: curl -k --resolve www.example.com:1444:127.0.0.1 https://www.example.com:1444/hi
+-- EXPECT: hello, HTTPS www!
+--
+-- REQUEST: curl -k --resolve img.example.org:1444:127.0.0.1 https://img.example.org:1444/hi
+-- EXPECT: hello, HTTPS example.org!
+--
+-- REQUEST: curl -k https://127.0.0.1:1444/hi
+-- EXPECT: hello, HTTPS others!
 
 Listen "1443" {
     ssl = {
@@ -10,3 +22,28 @@ Listen "1443" {
     },
     echo = "hello, HTTPS world!\n",
 }
+
+Listen "1444" {
+    Host "www.example.com" {
+        ssl = {
+            certificate = "../misc/unsafe-test-only.crt",
+            private_key = "../misc/unsafe-test-only.key",
+        },
+        echo = "hello, HTTPS www!\n",
+    },
+    Host "*.example.org" {
+        ssl = {
+            certificate = "../misc/unsafe-test-only.crt",
+            private_key = "../misc/unsafe-test-only.key",
+            session_timeout = 600,
+        },
+        echo = "hello, HTTPS example.org!\n",
+    },
+    Host "*" {
+        ssl = {
+            certificate = "../misc/unsafe-test-only.crt",
+            private_key = "../misc/unsafe-test-only.key",
+        },
+        echo = "hello, HTTPS others!\n",
+    },
+}
@@ -32,6 +32,18 @@
 -- REQUEST: curl http://127.0.0.1:8080/hi -H'Host: www.example.org'
 -- EXPECT: hello, subfix-*!
 --
+-- REQUEST: curl http://127.0.0.1:8080/hi -H'Host: www.example.co.uk'
+-- EXPECT: hello, subfix-*!
+--
+-- REQUEST: curl http://127.0.0.1:8080/hi -H'Host: www.example.net'
+-- EXPECT: hello, net prefix-*!
+--
+-- REQUEST: curl http://127.0.0.1:8080/hi -H'Host: WWW.Example.COM'
+-- EXPECT: hello, www!
+--
+-- REQUEST: curl http://127.0.0.1:8080/hi -H'Host: example.com'
+-- EXPECT: hello, *!
+--
 -- REQUEST: curl http://127.0.0.1:8080/hi
 -- EXPECT: hello, *!
 
@@ -51,6 +63,10 @@ Listen "8080" {
         echo = "hello, longer prefix-*!\n",
     },
 
+    Host "*.example.net" { -- leading wildcard wins "www.example.*"
+        echo = "hello, net prefix-*!\n",
+    },
+
     Host "www.example.*" {
         echo = "hello, subfix-*!\n",
     },
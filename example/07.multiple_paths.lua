@@ -1,7 +1,8 @@
 -- Multiple Paths in Host
 --
 -- A pathname must starts with `/`, `=` or `~`, indicate prefix,
--- exactly, and Lua regex matching respectively.
+-- exactly, and Lua regex matching respectively. A pathname starts
+-- with `@` names the Path, which is never matched by client requests.
 --
 -- For each requests, Phorklift locates Path by comparing the pathnames
 -- one by one in the order that Path appears in Host.
@@ -22,6 +23,30 @@
 --
 -- REQUEST: curl http://127.0.0.1:8080/waka
 -- EXPECT: hello, all!
+--
+-- The earlier Path wins whatever the kinds are, so a regex in front
+-- of a prefix takes the priority, and vice versa.
+--
+-- REQUEST: curl http://127.0.0.1:8081/api/status
+-- EXPECT: hello, exact status!
+--
+-- REQUEST: curl http://127.0.0.1:8081/api/status/more
+-- EXPECT: hello, regex api!
+--
+-- REQUEST: curl http://127.0.0.1:8081/api/v1/users
+-- EXPECT: hello, prefix v1!
+--
+-- REQUEST: curl http://127.0.0.1:8081/api/v2/users
+-- EXPECT: hello, regex api!
+--
+-- REQUEST: curl http://127.0.0.1:8081/static/logo.png
+-- EXPECT: hello, regex png!
+--
+-- REQUEST: curl http://127.0.0.1:8081/static/style.css
+-- EXPECT: hello, prefix static!
+--
+-- REQUEST: curl http://127.0.0.1:8081/@fallback
+-- EXPECT: hello, others!
 
 Listen "8080" {
     Host "*" { -- The Host level can be omitted
@@ -39,3 +64,27 @@ Listen "8080" {
         },
     },
 }
+
+Listen "8081" {
+    Path "=/api/status" {
+        echo = "hello, exact status!\n",
+    },
+    Path "/api/v1/" {
+        echo = "hello, prefix v1!\n",
+    },
+    Path "~^/api/" {
+        echo = "hello, regex api!\n",
+    },
+    Path "~%.png$" {
+        echo = "hello, regex png!\n",
+    },
+    Path "/static/" {
+        echo = "hello, prefix static!\n",
+    },
+    Path "@fallback" { -- named, not matched by "/@fallback"
+        echo = "hello, named!\n",
+    },
+    Path "/" {
+        echo = "hello, others!\n",
+    },
+}
@@ -17,6 +17,15 @@
 --
 -- REQUEST: curl http://127.0.0.1:8080/hash?id=1234
 -- EXPECT: hello, world!
+--
+-- REQUEST: curl http://127.0.0.1:8080/outlier
+-- EXPECT: hello, world!
+--
+-- REQUEST: curl http://127.0.0.1:8080/outlier
+-- EXPECT: hello, world!
+--
+-- REQUEST: curl http://127.0.0.1:8080/stats?scope=upstream
+-- EXPECT: outlier_eject
 
 local down_upstream = {
     "127.0.0.1:8083", -- down
@@ -40,6 +49,16 @@ local hash_upstream = {
     "127.0.0.1:8083",
     hash = function() return phl.req.get_uri_query("id") end,
 }
+local outlier_upstream = {
+    "127.0.0.1:8081",
+    "127.0.0.1:8084",
+    outlier = {
+        interval = 1,
+        min_requests = 1,
+        latency_factor = 2.0,
+        max_eject_percent = 50,
+    },
+}
 
 Listen "8080" {
     Path "/down" {
@@ -54,6 +73,12 @@ Listen "8080" {
     Path "/hash" {
         proxy = { hash_upstream },
     },
+    Path "/outlier" {
+        proxy = { outlier_upstream },
+    },
+    Path "=/stats" {
+        stats = true,
+    },
 }
 
 -- backend
@@ -64,3 +89,6 @@ Listen "8082" {
     echo = { "not avaiable now!\n",
         status_code = 503 },
 }
+Listen "8084" {
+    echo = "hello, world!\n",
+}
@@ -15,6 +15,16 @@
 --
 -- REQUEST: curl 127.0.0.1:8081/hi --interface 127.0.0.2
 -- EXPECT: hello, world!
+--
+--
+-- REQUEST: curl 127.0.0.1:8082/hi --interface 127.0.0.1 -v
+-- EXPECT: 403 Forbidden
+--
+-- REQUEST: curl 127.0.0.1:8082/hi --interface 127.0.0.2
+-- EXPECT: hello, world!
+--
+-- REQUEST: curl 127.0.0.1:8082/hi --interface 127.0.0.3 -v
+-- EXPECT: 403 Forbidden
 
 Listen "8080" {
     acl = {
@@ -30,3 +40,13 @@ Listen "8081" {
     },
     echo = "hello, world!\n",
 }
+
+Listen "8082" {
+    acl = {
+        "!2001:db8::/32", -- IPv6 rules never match IPv4 clients
+        "::1",
+        "fe80::/10",
+        file = "good_confs/modules/acl.rules", -- appended after the rules above
+    },
+    echo = "hello, world!\n",
+}
@@ -0,0 +1,87 @@
+-- File cache, with a shared-memory tier for small items, and collapsing
+-- concurrent misses of one key into one upstream request. Expired items
+-- are served stale while being refreshed in background. The total size
+-- is bounded, with the items indexed in shared-memory. Disk I/O runs in
+-- the `aio` threads, and opened files are kept in `open_cache`.
+--
+-- REQUEST: curl 127.0.0.1:8080/hot
+-- EXPECT: /hot: 1
+--
+-- REQUEST: curl 127.0.0.1:8080/hot
+-- EXPECT: /hot: 1
+--
+-- REQUEST: curl 127.0.0.1:8080/stats
+-- EXPECT: hit_memory
+--
+-- REQUEST: curl 127.0.0.1:8080/stats
+-- EXPECT: item_num
+--
+-- REQUEST: curl 127.0.0.1:8080/stats?scope=aio
+-- EXPECT: queue_depth_max
+--
+-- REQUEST: curl 127.0.0.1:8080/stats?scope=open_cache
+-- EXPECT: open_cache
+--
+-- REQUEST: for i in 1 2 3; do curl -s 127.0.0.1:8080/slow & done; wait
+-- EXPECT: /slow: 1
+--
+-- REQUEST: curl 127.0.0.1:8081/slow
+-- EXPECT: /slow: 2
+--
+-- REQUEST: curl 127.0.0.1:8080/stale
+-- EXPECT: /stale: 1
+--
+-- REQUEST: sleep 2; curl 127.0.0.1:8080/stale
+-- EXPECT: /stale: 1
+--
+-- REQUEST: sleep 1; curl 127.0.0.1:8080/stale
+-- EXPECT: /stale: 2
+
+-- start with empty cache directories, one for each file_cache
+local cache_dir = "/tmp/phl_file_cache_test/"
+os.execute("rm -rf " .. cache_dir .. " && mkdir -p " .. cache_dir .. "hot/ " .. cache_dir .. "stale/")
+
+Runtime {
+    worker = 2,
+    aio = { threads = 2 },
+    open_cache = { max_items = 1000, valid_time = 5 },
+    shared = {
+        { "counter" },
+    },
+}
+
+Listen "8080" {
+    Path "=/stats" {
+        stats = true,
+    },
+    Path "/stale" {
+        file_cache = { cache_dir .. "stale/",
+            default_expire = 1,
+            stale_while_revalidate = 10,
+        },
+        proxy = { { "127.0.0.1:8081" } },
+    },
+    Path "/" {
+        file_cache = { cache_dir .. "hot/",
+            default_expire = 60,
+            max_size = 16,  -- MiB
+            index_max_items = 1000,
+            memory_size = 1024*1024,
+            memory_item_max = 4096,
+            lock_timeout = 3,
+        },
+        proxy = { { "127.0.0.1:8081" } },
+    },
+}
+
+-- backend, which counts the requests of each path
+Listen "8081" {
+    script = function()
+        local path = phl.req.uri_path
+        if path == "/slow" then
+            phl.sleep(0.5)
+        end
+        local n = phl.shared.counter:incr(path, 1, 0)
+        return string.format("%s: %d\n", path, n)
+    end,
+}
@@ -0,0 +1,56 @@
+-- Compression, with gzip, brotli and zstd chosen by Accept-Encoding.
+-- Data that can not be compressed may make more output than input.
+-- Compressed responses are kept in shared-memory, so they are compressed once.
+--
+-- REQUEST: curl -v http://127.0.0.1:8080/modules/static_service.lua -H'Accept-Encoding: gzip'
+-- EXPECT: Content-Encoding: gzip
+--
+-- REQUEST: curl -v http://127.0.0.1:8080/modules/static_service.lua -H'Accept-Encoding: gzip, br'
+-- EXPECT: Content-Encoding: br
+--
+-- REQUEST: curl -v http://127.0.0.1:8080/modules/static_service.lua -H'Accept-Encoding: gzip;q=0.5, zstd'
+-- EXPECT: Content-Encoding: zstd
+--
+-- REQUEST: curl http://127.0.0.1:8080/01.hello_world.lua -H'Accept-Encoding: gzip, br, zstd'
+-- EXPECT: hello, world!
+--
+-- REQUEST: curl -s --compressed http://127.0.0.1:8080/random -H'Accept-Encoding: gzip' | tail -c 4
+-- EXPECT: END
+--
+-- REQUEST: curl -s --compressed http://127.0.0.1:8080/random -H'Accept-Encoding: gzip' | wc -c
+-- EXPECT: 100003
+--
+-- REQUEST: curl -s --compressed http://127.0.0.1:8080/modules/static_service.lua -H'Accept-Encoding: gzip'
+-- EXPECT: Static file service.
+--
+-- REQUEST: curl -s --compressed http://127.0.0.1:8080/modules/static_service.lua -H'Accept-Encoding: gzip'
+-- EXPECT: Static file service.
+--
+-- REQUEST: curl http://127.0.0.1:8080/stats
+-- EXPECT: cache_hit
+
+Listen "8080" {
+    Path "=/stats" {
+        stats = true,
+    },
+    Path "=/random" {
+        gzip = { 9, brotli = 11, zstd = 19 },
+        script = function()
+            -- random bytes, which become larger after compressing
+            local t = {}
+            for i = 1, 100000 do
+                t[i] = string.char(math.random(0, 255))
+            end
+            return table.concat(t) .. "END"
+        end,
+    },
+    Path "/" {
+        gzip = { 5,
+            brotli = 4,
+            zstd = 3,
+            min_length = 200,  -- so 01.hello_world.lua is not compressed
+            cache = { total = 1024*1024, max_item = 64*1024 },
+        },
+        static = "good_confs/",
+    },
+}
@@ -44,6 +44,42 @@
 --
 -- REQUEST: curl -v 127.0.0.1:8080/key?id=456
 -- EXPECT: 503 Service Unavailable
+--
+--
+-- REQUEST: curl 127.0.0.1:8080/shards
+-- EXPECT: hello, world!
+--
+-- REQUEST: curl -v 127.0.0.1:8080/shards
+-- EXPECT: 503 Service Unavailable
+--
+-- REQUEST: sleep 1.1; curl 127.0.0.1:8080/shards
+-- EXPECT: hello, world!
+--
+--
+-- REQUEST: curl 127.0.0.1:8080/approximate
+-- EXPECT: hello, world!
+--
+-- REQUEST: curl -v 127.0.0.1:8080/approximate
+-- EXPECT: 503 Service Unavailable
+--
+-- REQUEST: sleep 1.1; curl 127.0.0.1:8080/approximate
+-- EXPECT: hello, world!
+--
+--
+-- REQUEST: curl 127.0.0.1:8080/expr?id=123
+-- EXPECT: hello, world!
+--
+-- REQUEST: curl 127.0.0.1:8080/expr?id=456
+-- EXPECT: hello, world!
+--
+-- REQUEST: curl -v 127.0.0.1:8080/expr?id=456
+-- EXPECT: 503 Service Unavailable
+--
+-- REQUEST: curl 127.0.0.1:8080/short?id=456
+-- EXPECT: hello, world!
+--
+-- REQUEST: curl -v 127.0.0.1:8080/short?id=456
+-- EXPECT: 503 Service Unavailable
 
 Runtime {
     worker = 1
@@ -64,4 +100,19 @@ Listen "8080" {
     Path "/key" {
         limit_req = { key = function() return phl.req.get_uri_query("id") end }
     },
+    Path "/shards" {
+        -- IPv6 clients are limited by /48 prefix here
+        limit_req = { 1, shards = 4, ipv6_prefix = 48 }
+    },
+    Path "/approximate" {
+        -- decided in worker by leases, with 1 request error at most
+        limit_req = { 1, approximate = { error = 1, lease_time = 100 } }
+    },
+    Path "/expr" {
+        -- evaluated in C, without calling Lua
+        limit_req = { key = phl.key "${uri_path}:${arg_id}" }
+    },
+    Path "/short" {
+        limit_req = { key = phl.key.query "id" }
+    },
 }
@@ -0,0 +1,50 @@
+-- Shared dictionaries, used by Lua as `phl.shared.<name>` in all workers.
+--
+-- REQUEST: curl 127.0.0.1:8080/incr
+-- EXPECT: count: 1
+--
+-- REQUEST: curl 127.0.0.1:8080/incr
+-- EXPECT: count: 2
+--
+-- REQUEST: curl 127.0.0.1:8080/set?v=hello
+-- EXPECT: set: true
+--
+-- REQUEST: curl 127.0.0.1:8080/get
+-- EXPECT: get: hello
+--
+-- REQUEST: curl 127.0.0.1:8080/add
+-- EXPECT: add: false exists
+
+Runtime {
+    worker = 2,
+    shared = {
+        { "foo" },
+        { "bar", size = 128*1024, stripes = 4, max_item = 256 },
+    },
+}
+
+Listen "8080" {
+    Path "=/incr" {
+        script = function()
+            local n = phl.shared.foo:incr("count", 1, 0)
+            return string.format("count: %d\n", n)
+        end,
+    },
+    Path "=/set" {
+        script = function()
+            local ok = phl.shared.bar:set("key", phl.req.get_uri_query("v"), 60)
+            return "set: " .. tostring(ok) .. "\n"
+        end,
+    },
+    Path "=/get" {
+        script = function()
+            return "get: " .. tostring(phl.shared.bar:get("key")) .. "\n"
+        end,
+    },
+    Path "=/add" {
+        script = function()
+            local ok, err = phl.shared.bar:add("key", "again")
+            return "add: " .. tostring(ok) .. " " .. tostring(err) .. "\n"
+        end,
+    },
+}
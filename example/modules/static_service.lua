@@ -17,6 +17,15 @@
 --
 -- REQUEST: curl http://127.0.0.1:8081/
 -- EXPECT: hello, HTTPS world!
+--
+-- REQUEST: curl http://127.0.0.1:8082/01.hello_world.lua -H'Accept-Encoding: br, zstd, gzip'
+-- EXPECT: hello, world!
+--
+-- REQUEST: curl http://127.0.0.1:8082/01.hello_world.lua
+-- EXPECT: hello, world!
+--
+-- REQUEST: curl -v http://127.0.0.1:8082/01.hello_world.lua -H'Range: bytes=1-20'
+-- EXPECT: 206 Partial Content
 
 Listen "8080" {
     static = { "good_confs/", list_dir=true }
@@ -24,3 +33,10 @@ Listen "8080" {
 Listen "8081" {
     static = { "good_confs/", index="03.ssl.lua" }
 }
+Listen "8082" {
+    static = {
+        "good_confs/",
+        precompressed = true,  -- no sibling file, so the original one is served
+        memory_cache = { total = 1024*1024, max_file = 4096, valid_time = 2 },
+    }
+}
@@ -0,0 +1,55 @@
+-- Lua TCP stream by `phl.stream`, with idle connections pooled in each
+-- worker by `keepalive()`, and reused by later `connect()`.
+--
+-- REQUEST: curl 127.0.0.1:8080/
+-- EXPECT: pong, keepalive: true
+--
+-- REQUEST: curl 127.0.0.1:8080/
+-- EXPECT: pong, keepalive: true
+--
+-- REQUEST: curl 127.0.0.1:8080/close
+-- EXPECT: pong, closed
+
+Runtime {
+    worker = 1,
+}
+
+-- send a HTTP request and read the response body
+local function ping(sock)
+    sock:send("GET /ping HTTP/1.1\r\nHost: backend\r\n\r\n")
+
+    local headers, err = sock:receive_until("\r\n\r\n")
+    if not headers then
+        return nil, err
+    end
+    local length = tonumber(headers:match("[Cc]ontent%-[Ll]ength: *(%d+)"))
+    return sock:receive(length)
+end
+
+Listen "8080" {
+    Path "=/close" {
+        script = function()
+            local sock = phl.stream.connect("127.0.0.1:8081")
+            local body = ping(sock)
+            sock:close()
+            return body .. ", closed\n"
+        end,
+    },
+    Path "/" {
+        script = function()
+            local sock = phl.stream.connect("127.0.0.1:8081",
+                    { pool = "backend", read_timeout = 1 })
+            local body, err = ping(sock)
+            if not body then
+                return phl.HTTP_500
+            end
+            local ok = sock:keepalive(60, 8)
+            return body .. ", keepalive: " .. tostring(ok) .. "\n"
+        end,
+    },
+}
+
+-- backend
+Listen "8081" {
+    echo = "pong",
+}
@@ -0,0 +1,84 @@
+-- Lua subrequests, by `phl.subrequest()` for one, and `phl.subrequests()`
+-- for several concurrently. The subrequest's response body is passed to
+-- the father in buffers, and the subrequest pauses when too many are pending.
+--
+-- REQUEST: curl 127.0.0.1:8080/one
+-- EXPECT: 200 A
+--
+-- REQUEST: curl 127.0.0.1:8080/all
+-- EXPECT: n=2 A B
+--
+-- REQUEST: curl 127.0.0.1:8080/any
+-- EXPECT: n=1 A aborted
+--
+-- REQUEST: curl 127.0.0.1:8080/timeout
+-- EXPECT: n=1 A timeout
+--
+-- REQUEST: curl 127.0.0.1:8080/one_big
+-- EXPECT: 200 1048576
+--
+-- REQUEST: curl 127.0.0.1:8080/all_big
+-- EXPECT: n=2 1048576 1048576
+
+Listen "8080" {
+    Path "=/one" {
+        script = function()
+            local res = phl.subrequest("/a")
+            return res.status_code .. " " .. res.body .. "\n"
+        end,
+    },
+    Path "=/all" {
+        script = function()
+            local results, n = phl.subrequests({ "/a", "/b" })
+            return string.format("n=%d %s %s\n", n, results[1].body, results[2].body)
+        end,
+    },
+    Path "=/any" {
+        script = function()
+            local results, n = phl.subrequests({ "/a", "/slow" }, { wait = "any" })
+            return string.format("n=%d %s %s\n", n, results[1].body,
+                    results[2].error and "aborted" or "done")
+        end,
+    },
+    Path "=/timeout" {
+        script = function()
+            local results, n = phl.subrequests({
+                "/a",
+                { "/slow", timeout = 0.2 },
+            })
+            return string.format("n=%d %s %s\n", n, results[1].body,
+                    results[2].error and "timeout" or "done")
+        end,
+    },
+    Path "=/one_big" {
+        script = function()
+            local res = phl.subrequest("/big")
+            return res.status_code .. " " .. #res.body .. "\n"
+        end,
+    },
+    Path "=/all_big" {
+        script = function()
+            local results, n = phl.subrequests({ "/big", "/big" })
+            return string.format("n=%d %d %d\n", n, #results[1].body, #results[2].body)
+        end,
+    },
+
+    -- backends
+    Path "=/a" {
+        echo = "A",
+    },
+    Path "=/b" {
+        echo = "B",
+    },
+    Path "=/big" {
+        script = function()
+            return string.rep("x", 1024*1024)  -- larger than the pipe limit
+        end,
+    },
+    Path "=/slow" {
+        script = function()
+            phl.sleep(1)
+            return "slow"
+        end,
+    },
+}
@@ -0,0 +1,39 @@
+-- Lua timers by `phl.timer`, which run in background in each worker.
+--
+-- REQUEST: sleep 1; curl 127.0.0.1:8080/
+-- EXPECT: ticked: true, once: 1
+--
+-- REQUEST: curl 127.0.0.1:8080/stats?scope=lua
+-- EXPECT: tick
+
+Runtime {
+    worker = 1,
+    shared = {
+        { "timer" },
+    },
+    lua = {
+        init_worker = function()
+            phl.timer.every(0.2, function()
+                phl.shared.timer:incr("tick", 1, 0)
+            end, "tick")
+
+            phl.timer.at(0.1, function()
+                phl.sleep(0.1) -- blocking APIs work in timers
+                phl.shared.timer:incr("once", 1, 0)
+            end, "once")
+        end,
+    },
+}
+
+Listen "8080" {
+    Path "=/stats" {
+        stats = true,
+    },
+    Path "/" {
+        script = function()
+            local ticks = phl.shared.timer:get("tick") or 0
+            local once = phl.shared.timer:get("once") or 0
+            return string.format("ticked: %s, once: %d\n", tostring(ticks > 1), once)
+        end,
+    },
+}
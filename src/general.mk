@@ -1,4 +1,6 @@
-CFLAGS = -g -Wall -O2
+include ../lua.mk
+
+CFLAGS = -g -Wall -O2 $(LUA_CFLAGS)
 CFLAGS += -I../
 
 SOURCES = $(wildcard *.c)
@@ -81,11 +81,10 @@ static struct phl_upstream_address *phl_upstream_hash_pick(
 	struct phl_upstream_hash_ctx *ctx = upstream->lb_ctx;
 
 	int key_len;
-	const char *key_str = phl_lua_call_lstring(r, conf->key, &key_len);
-	if (key_str == NULL) {
+	uint64_t hash;
+	if (phl_key_get(r, conf->key, &key_len, &hash) == NULL) {
 		return NULL;
 	}
-	uint64_t hash = wuy_vhash64(key_str, key_len);
 
 	/* pick one address */
 	struct phl_upstream_hash_vnode *vnode = NULL;
@@ -120,7 +119,7 @@ static struct phl_upstream_address *phl_upstream_hash_pick(
 
 static struct wuy_cflua_command phl_upstream_hash_commands[] = {
 	{	.type = WUY_CFLUA_TYPE_FUNCTION,
-		.description = "Return string as hash key.",
+		.description = "Return string as hash key. Use `phl.key` to avoid calling Lua.",
 		.is_single_array = true,
 		.offset = offsetof(struct phl_upstream_hash_conf, key),
 	},
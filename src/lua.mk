@@ -0,0 +1,13 @@
+# Lua runtime: `luajit` (default) or `lua5.1`, e.g. `make LUA=lua5.1`.
+# Included by all Makefiles so that all objects use the same headers.
+LUA ?= luajit
+
+ifeq ($(LUA), luajit)
+LUA_CFLAGS = -DPHL_LUAJIT
+LUA_LDLIBS = -lluajit-5.1
+else ifeq ($(LUA), lua5.1)
+LUA_CFLAGS =
+LUA_LDLIBS = -llua5.1
+else
+$(error invalid LUA=$(LUA), use `luajit` or `lua5.1`)
+endif
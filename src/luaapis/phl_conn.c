@@ -1,6 +1,4 @@
-#include <lua5.1/lua.h>
-#include <lua5.1/lauxlib.h>
-#include <lua5.1/lualib.h>
+#include "phl_lua.h"
 
 #include "phl_main.h"
 
@@ -24,6 +22,13 @@ static int phl_conn_mm_index(lua_State *L)
 	return 1;
 }
 
+/* FFI fast path, see phl_lua_api.h */
+int phl_ffi_conn_client_ip(char *buf, int size)
+{
+	wuy_sockaddr_dumps_iponly(&phl_lua_api_current->c->client_addr, buf, size);
+	return strlen(buf);
+}
+
 static const struct phl_lua_api_reg_func phl_conn_functions[] = {
 	{ "__index", phl_conn_mm_index },
 	{ NULL }  /* sentinel */
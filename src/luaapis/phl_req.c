@@ -1,6 +1,4 @@
-#include <lua5.1/lua.h>
-#include <lua5.1/lauxlib.h>
-#include <lua5.1/lualib.h>
+#include "phl_lua.h"
 
 #include "phl_main.h"
 
@@ -120,37 +118,14 @@ static int phl_req_get_cookie(lua_State *L)
 		return 0;
 	}
 
-	struct phl_header *h;
-	wuy_slist_iter_type(&phl_lua_api_current->req.headers, h, list_node) {
-		if (strcasecmp(h->str, "Cookie") != 0) {
-			continue;
-		}
-		const char *p = phl_header_value(h);
-		int value_len = h->value_len;
-		while (1) {
-			if (memcmp(p, name, name_len) == 0 && p[name_len] == '=') {
-				/* find */
-				p += name_len + 1;
-				value_len -= name_len + 1;
-				const char *end = memchr(p, ';', value_len);
-				if (end != NULL) {
-					value_len = end - p;
-				}
-				lua_pushlstring(L, p, value_len);
-				return 1;
-			}
-
-			const char *end = memchr(p, ';', value_len);
-			if (end == NULL) {
-				break;
-			}
-			end++;
-			while (*end == ' ') end++;
-			value_len -= end - p;
-			p = end;
-		}
+	int value_len;
+	const char *value = phl_request_get_cookie(phl_lua_api_current,
+			name, name_len, &value_len);
+	if (value == NULL) {
+		return 0;
 	}
-	return 0;
+	lua_pushlstring(L, value, value_len);
+	return 1;
 }
 
 static int phl_req_mm_index(lua_State *L)
@@ -210,6 +185,47 @@ static const struct phl_lua_api_reg_func phl_req_functions[] = {
 	{ NULL }  /* sentinel */
 };
 
+/* FFI fast paths, see phl_lua_api.h */
+
+int phl_ffi_req_uri_path(const char **p_value)
+{
+	const char *path = phl_lua_api_current->req.uri.path;
+	if (path == NULL) {
+		return -1;
+	}
+	*p_value = path;
+	return strlen(path);
+}
+
+int phl_ffi_req_host(const char **p_value)
+{
+	const char *host = phl_lua_api_current->req.host;
+	if (host == NULL) {
+		return -1;
+	}
+	*p_value = host;
+	return strlen(host);
+}
+
+int phl_ffi_req_header(const char *name, int name_len, const char **p_value)
+{
+	struct phl_header *h;
+	phl_header_iter(&phl_lua_api_current->req.headers, h) {
+		if (h->name_len == name_len && strncasecmp(h->str, name, name_len) == 0) {
+			*p_value = phl_header_value(h);
+			return h->value_len;
+		}
+	}
+	return -1;
+}
+
+int phl_ffi_req_cookie(const char *name, int name_len, const char **p_value)
+{
+	int value_len;
+	*p_value = phl_request_get_cookie(phl_lua_api_current, name, name_len, &value_len);
+	return *p_value != NULL ? value_len : -1;
+}
+
 const struct phl_lua_api_package phl_req_package = {
 	.name = "req",
 	.funcs = phl_req_functions,
@@ -0,0 +1,195 @@
+#include "phl_lua.h"
+
+#include "phl_main.h"
+
+/* phl.shared.<name> are userdata of dictionaries, with methods:
+ *
+ *   dict:get(key)                  -> value, or nil
+ *   dict:set(key, value, ttl)      -> true, or false and error
+ *   dict:add(key, value, ttl)      -> true, or false and error
+ *   dict:incr(key, n, init, ttl)   -> new value, or nil and error
+ *   dict:delete(key)
+ *
+ * The value may be string, number or boolean. Set nil to delete.
+ * The ttl is in seconds, and never expires if not set or 0. */
+
+static int phl_shared_meta_ref;
+
+static struct phl_shared_dict *phl_shared_check(lua_State *L, const char *fname,
+		const char **p_key, size_t *p_key_len)
+{
+	struct phl_shared_dict **udata = lua_touserdata(L, 1);
+	if (udata == NULL) {
+		lua_pushfstring(L, "shared:%s(): invalid dictionary", fname);
+		lua_error(L);
+	}
+
+	*p_key = lua_tolstring(L, 2, p_key_len);
+	if (*p_key == NULL) {
+		lua_pushfstring(L, "shared:%s(): invalid key", fname);
+		lua_error(L);
+	}
+	return *udata;
+}
+
+static int phl_shared_push_error(lua_State *L, int ret, bool is_false)
+{
+	if (is_false) {
+		lua_pushboolean(L, 0);
+	} else {
+		lua_pushnil(L);
+	}
+	lua_pushstring(L, phl_shared_dict_strerror(ret));
+	return 2;
+}
+
+static int phl_shared_get(lua_State *L)
+{
+	const char *key;
+	size_t key_len;
+	struct phl_shared_dict *dict = phl_shared_check(L, "get", &key, &key_len);
+
+	struct phl_shared_dict_value value;
+	if (!phl_shared_dict_get(dict, key, key_len, &value)) {
+		return 0;
+	}
+
+	switch (value.type) {
+	case PHL_SHARED_DICT_NUMBER:
+		lua_pushnumber(L, value.number);
+		return 1;
+	case PHL_SHARED_DICT_BOOLEAN:
+		lua_pushboolean(L, value.number != 0);
+		return 1;
+	case PHL_SHARED_DICT_STRING:
+		lua_pushlstring(L, value.str, value.len);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int phl_shared_do_set(lua_State *L, const char *fname, bool only_add)
+{
+	const char *key;
+	size_t key_len;
+	struct phl_shared_dict *dict = phl_shared_check(L, fname, &key, &key_len);
+
+	struct phl_shared_dict_value value;
+	switch (lua_type(L, 3)) {
+	case LUA_TNIL:
+		value.type = PHL_SHARED_DICT_NIL;
+		break;
+	case LUA_TNUMBER:
+		value.type = PHL_SHARED_DICT_NUMBER;
+		value.number = lua_tonumber(L, 3);
+		break;
+	case LUA_TBOOLEAN:
+		value.type = PHL_SHARED_DICT_BOOLEAN;
+		value.number = lua_toboolean(L, 3);
+		break;
+	case LUA_TSTRING:
+		value.type = PHL_SHARED_DICT_STRING;
+		size_t len;
+		value.str = lua_tolstring(L, 3, &len);
+		value.len = len;
+		break;
+	default:
+		lua_pushfstring(L, "shared:%s(): invalid value type %s",
+				fname, luaL_typename(L, 3));
+		return lua_error(L);
+	}
+
+	int ret = phl_shared_dict_set(dict, key, key_len, &value,
+			lua_tonumber(L, 4), only_add);
+	if (ret != PHL_OK) {
+		return phl_shared_push_error(L, ret, true);
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int phl_shared_set(lua_State *L)
+{
+	return phl_shared_do_set(L, "set", false);
+}
+
+static int phl_shared_add(lua_State *L)
+{
+	return phl_shared_do_set(L, "add", true);
+}
+
+static int phl_shared_incr(lua_State *L)
+{
+	const char *key;
+	size_t key_len;
+	struct phl_shared_dict *dict = phl_shared_check(L, "incr", &key, &key_len);
+
+	double n = lua_isnoneornil(L, 3) ? 1 : lua_tonumber(L, 3);
+
+	double init, *p_init = NULL;
+	if (!lua_isnoneornil(L, 4)) {
+		init = lua_tonumber(L, 4);
+		p_init = &init;
+	}
+
+	double result;
+	int ret = phl_shared_dict_incr(dict, key, key_len, n, p_init,
+			lua_tonumber(L, 5), &result);
+	if (ret != PHL_OK) {
+		return phl_shared_push_error(L, ret, false);
+	}
+
+	lua_pushnumber(L, result);
+	return 1;
+}
+
+static int phl_shared_delete(lua_State *L)
+{
+	const char *key;
+	size_t key_len;
+	struct phl_shared_dict *dict = phl_shared_check(L, "delete", &key, &key_len);
+
+	phl_shared_dict_delete(dict, key, key_len);
+	return 0;
+}
+
+static const struct phl_lua_api_reg_func phl_shared_methods[] = {
+	{ "get", phl_shared_get },
+	{ "set", phl_shared_set },
+	{ "add", phl_shared_add },
+	{ "incr", phl_shared_incr },
+	{ "delete", phl_shared_delete },
+	{ NULL }  /* sentinel */
+};
+
+/* create userdata for each dictionary into the package table */
+static void phl_shared_init(void)
+{
+	lua_newtable(phl_L);
+	for (const struct phl_lua_api_reg_func *r = phl_shared_methods; r->name != NULL; r++) {
+		lua_pushcfunction(phl_L, r->f);
+		lua_setfield(phl_L, -2, r->name);
+	}
+	lua_pushvalue(phl_L, -1);
+	lua_setfield(phl_L, -2, "__index");
+	phl_shared_meta_ref = luaL_ref(phl_L, LUA_REGISTRYINDEX);
+
+	struct phl_shared_dict **dicts = phl_conf_runtime->shared;
+	for (int i = 0; dicts != NULL && dicts[i] != NULL; i++) {
+		struct phl_shared_dict **udata = lua_newuserdata(phl_L,
+				sizeof(struct phl_shared_dict *));
+		*udata = dicts[i];
+
+		lua_rawgeti(phl_L, LUA_REGISTRYINDEX, phl_shared_meta_ref);
+		lua_setmetatable(phl_L, -2);
+
+		lua_setfield(phl_L, -2, dicts[i]->name);
+	}
+}
+
+const struct phl_lua_api_package phl_shared_package = {
+	.name = "shared",
+	.init = phl_shared_init,
+};
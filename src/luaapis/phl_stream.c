@@ -1,156 +1,588 @@
-#include <lua5.1/lua.h>
-#include <lua5.1/lauxlib.h>
-#include <lua5.1/lualib.h>
+#include "phl_lua.h"
 
 #include "phl_main.h"
 
 #define _log(level, fmt, ...) phl_request_log(r, level, "lua: " fmt, ##__VA_ARGS__)
 
+/* TCP sockets for Lua, e.g. for Redis or memcached clients.
+ *
+ *   sock = phl.stream.connect(address, options)
+ *   sock:send(data)              -> true, or nil and error
+ *   sock:receive(n)              -> n bytes, or nil, error and partial data
+ *   sock:receive_until(pattern)  -> data before pattern, or nil, error and partial data
+ *   sock:recv()                  -> any data, or nil and error
+ *   sock:settimeouts(connect, send, read)
+ *   sock:keepalive(idle_timeout, idle_max)
+ *   sock:close()
+ *
+ * The options are `pool`, `connect_timeout`, `send_timeout` and
+ * `read_timeout`. The timeouts are in seconds.
+ *
+ * Connections put by keepalive() are kept in pools in each worker,
+ * by the `pool` option which is the address by default, and are reused
+ * by later connect() with the same pool. */
+
+#define PHL_STREAM_DEFAULT_TIMEOUT	10
+#define PHL_STREAM_DEFAULT_IDLE_TIMEOUT	60
+#define PHL_STREAM_DEFAULT_IDLE_MAX	100
+
+#define PHL_STREAM_BUF_MIN		4096
+#define PHL_STREAM_BUF_MAX		(1024*1024) /* for receive_until() */
+
+struct phl_stream_pool {
+	char			*name;
+	int			idle_num;
+	wuy_list_t		idle_head;
+	wuy_dict_node_t		dict_node;
+};
+
+struct phl_stream_socket {
+	loop_stream_t		*s;
+	struct phl_request	*r; /* waiting for events, NULL if not */
+	char			*pool_name;
+	struct phl_stream_pool	*idle_pool; /* in idle pool, NULL if not */
+	wuy_list_node_t		list_node;
+
+	bool			connected;
+	int			connect_timeout; /* in ms */
+	int			send_timeout;
+	int			read_timeout;
+
+	int			send_pos;
+
+	/* read buffer, holding data read but not consumed */
+	char			*buf;
+	int			buf_size;
+	int			buf_start;
+	int			buf_end;
+};
+
+static wuy_dict_t *phl_stream_pool_dict;
+static int phl_stream_meta_ref;
+
+static void phl_stream_socket_close(struct phl_stream_socket *sock)
+{
+	if (sock->idle_pool != NULL) {
+		wuy_list_delete(&sock->list_node);
+		sock->idle_pool->idle_num--;
+	}
+	loop_stream_close(sock->s);
+	free(sock->pool_name);
+	free(sock->buf);
+	free(sock);
+}
 
 static void phl_stream_on_active(loop_stream_t *s)
 {
-	phl_request_run(loop_stream_get_app_data(s), "lua phl.stream active");
+	struct phl_stream_socket *sock = loop_stream_get_app_data(s);
+	if (sock->idle_pool != NULL) {
+		/* closed by peer, or unexpected data */
+		phl_stream_socket_close(sock);
+		return;
+	}
+	if (sock->r != NULL) {
+		phl_request_run(sock->r, "lua phl.stream active");
+	}
+}
+static void phl_stream_on_close(loop_stream_t *s, enum loop_stream_close_reason r)
+{
+	if (r == LOOP_STREAM_TIMEOUT) {
+		phl_stream_on_active(s);
+	}
 }
 
 static loop_stream_ops_t phl_stream_ops = {
 	.on_readable = phl_stream_on_active,
 	.on_writable = phl_stream_on_active,
+	.on_close = phl_stream_on_close,
 
-	PHL_SSL_LOOP_STREAM_UNDERLYINGS 
+	PHL_SSL_LOOP_STREAM_UNDERLYINGS
 };
 
+static struct phl_stream_socket *phl_stream_arg_socket(lua_State *L, int i)
+{
+	struct phl_stream_socket **udata = lua_touserdata(L, i);
+	if (udata == NULL || *udata == NULL) {
+		luaL_error(L, "invalid or closed stream");
+		return NULL;
+	}
+	return *udata;
+}
+
+/* in seconds, as phl.sleep() */
+static int phl_stream_arg_timeout(lua_State *L, int i, int def)
+{
+	if (lua_isnoneornil(L, i)) {
+		return def;
+	}
+	return lua_tonumber(L, i) * 1000;
+}
+
+static int phl_stream_error(lua_State *L, const char *err)
+{
+	lua_pushnil(L);
+	lua_pushstring(L, err);
+	return 2;
+}
+
+/* wait for events, with @timeout in ms */
+static void phl_stream_wait(struct phl_stream_socket *sock, int timeout)
+{
+	sock->r = phl_lua_api_current;
+	loop_stream_set_timeout(sock->s, timeout);
+}
+
+/* Called in resume-handlers. If the Lua thread is being killed, stop
+ * waiting so the closed request is not referred by later events. */
+static bool phl_stream_killed(struct phl_stream_socket *sock)
+{
+	if (!phl_lua_thread_killing) {
+		return false;
+	}
+	sock->r = NULL;
+	return true;
+}
+
+static struct phl_stream_socket *phl_stream_pool_pop(const char *pool_name)
+{
+	struct phl_stream_pool *pool = wuy_dict_get(phl_stream_pool_dict, pool_name);
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	struct phl_stream_socket *sock;
+	if (!wuy_list_pop_type(&pool->idle_head, sock, list_node)) {
+		return NULL;
+	}
+	pool->idle_num--;
+	sock->idle_pool = NULL;
+	return sock;
+}
+
 static int phl_stream_connect(lua_State *L)
 {
 	const char *address = lua_tostring(L, 1);
 	if (address == NULL) {
-		lua_pushstring(L, "stream.connect(): invalid address");
-		return lua_error(L);
+		return luaL_error(L, "stream.connect(): invalid address");
 	}
 
-	loop_stream_t *s = loop_tcp_connect(phl_loop, address, 0, &phl_stream_ops);
-	if (s == NULL) {
-		return 0;
+	const char *pool_name = address;
+	int connect_timeout = PHL_STREAM_DEFAULT_TIMEOUT * 1000;
+	int send_timeout = PHL_STREAM_DEFAULT_TIMEOUT * 1000;
+	int read_timeout = PHL_STREAM_DEFAULT_TIMEOUT * 1000;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "pool");
+		if (lua_isstring(L, -1)) {
+			pool_name = lua_tostring(L, -1);
+		}
+		lua_getfield(L, 2, "connect_timeout");
+		connect_timeout = phl_stream_arg_timeout(L, -1, connect_timeout);
+		lua_getfield(L, 2, "send_timeout");
+		send_timeout = phl_stream_arg_timeout(L, -1, send_timeout);
+		lua_getfield(L, 2, "read_timeout");
+		read_timeout = phl_stream_arg_timeout(L, -1, read_timeout);
+		/* keep the pool name on stack */
+	}
+
+	/* reuse an idle one, or create new */
+	struct phl_stream_socket *sock = phl_stream_pool_pop(pool_name);
+	if (sock == NULL) {
+		loop_stream_t *s = loop_tcp_connect(phl_loop, address, 0, &phl_stream_ops);
+		if (s == NULL) {
+			return phl_stream_error(L, "connect fail");
+		}
+		loop_stream_set_timeout(s, connect_timeout);
+
+		sock = calloc(1, sizeof(struct phl_stream_socket));
+		sock->s = s;
+		sock->pool_name = strdup(pool_name);
+		loop_stream_set_app_data(s, sock);
 	}
 
-	loop_stream_set_app_data(s, phl_lua_api_current);
+	sock->connect_timeout = connect_timeout;
+	sock->send_timeout = send_timeout;
+	sock->read_timeout = read_timeout;
+
+	struct phl_stream_socket **udata = lua_newuserdata(L, sizeof(struct phl_stream_socket *));
+	*udata = sock;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, phl_stream_meta_ref);
+	lua_setmetatable(L, -2);
 
-	lua_pushlightuserdata(L, s);
 	return 1;
 }
 
-static int phl_stream_send_resume(lua_State *L)
+static int phl_stream_settimeouts(lua_State *L)
 {
-	loop_stream_t *s = lua_touserdata(L, 2);
+	struct phl_stream_socket *sock = phl_stream_arg_socket(L, 1);
+	sock->connect_timeout = phl_stream_arg_timeout(L, 2, sock->connect_timeout);
+	sock->send_timeout = phl_stream_arg_timeout(L, 3, sock->send_timeout);
+	sock->read_timeout = phl_stream_arg_timeout(L, 4, sock->read_timeout);
+	return 0;
+}
 
-	size_t data_len;
-	const char *data = lua_tolstring(L, 3, &data_len);
+/* stack: [resume-handler,] socket, data.
+ * Returns the number of results, or PHL_AGAIN if blocks. */
+static int phl_stream_do_send(lua_State *L)
+{
+	struct phl_stream_socket *sock = phl_stream_arg_socket(L, -2);
+	if (phl_stream_killed(sock)) {
+		return 0;
+	}
 
-	int prewrite_len = lua_tointeger(L, 4);
+	size_t data_len;
+	const char *data = lua_tolstring(L, -1, &data_len);
 
-	int write_len = loop_stream_write(s, data + prewrite_len, data_len - prewrite_len);
-	if (write_len < 0) {
-		lua_pushstring(L, loop_stream_close_string(write_len));
-		return 1;
+	while (sock->send_pos < data_len) {
+		int write_len = loop_stream_write(sock->s, data + sock->send_pos,
+				data_len - sock->send_pos);
+		if (write_len < 0) {
+			sock->r = NULL;
+			return phl_stream_error(L, loop_stream_close_string(write_len));
+		}
+		if (write_len == 0) {
+			phl_stream_wait(sock, sock->connected ? sock->send_timeout
+					: sock->connect_timeout);
+			return PHL_AGAIN;
+		}
+		sock->send_pos += write_len;
+		sock->connected = true;
 	}
-	if (write_len == data_len - prewrite_len) {
-		return 0;
+
+	sock->r = NULL;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int phl_stream_send(lua_State *L)
+{
+	struct phl_stream_socket *sock = phl_stream_arg_socket(L, 1);
+	if (!lua_isstring(L, 2)) {
+		return luaL_error(L, "stream.send(): invalid data");
 	}
+	lua_settop(L, 2);
 
-	/* write blocks, again */
-	lua_pop(L, 1);
-	lua_pushinteger(L, prewrite_len + write_len);
+	sock->send_pos = 0;
+	int ret = phl_stream_do_send(L);
+	if (ret != PHL_AGAIN) {
+		return ret;
+	}
 
-	return PHL_AGAIN;
+	/* insert the resume-handler at index=1 in stack */
+	lua_pushcfunction(L, phl_stream_do_send);
+	lua_insert(L, 1);
+	return lua_yield(L, 3);
 }
 
-static int phl_stream_send(lua_State *L)
+/* Read more data into buffer.
+ * Returns PHL_OK, PHL_AGAIN, or PHL_ERROR with error message pushed. */
+static int phl_stream_fill(lua_State *L, struct phl_stream_socket *sock, int want)
 {
-	loop_stream_t *s = lua_touserdata(L, 1);
-	if (s == NULL) {
-		lua_pushstring(L, "stream.send(): invalid address");
-		return lua_error(L);
+	/* move the left data to front */
+	if (sock->buf_start > 0) {
+		memmove(sock->buf, sock->buf + sock->buf_start, sock->buf_end - sock->buf_start);
+		sock->buf_end -= sock->buf_start;
+		sock->buf_start = 0;
 	}
 
-	size_t data_len;
-	const char *data = lua_tolstring(L, 2, &data_len);
-	if (data == NULL) {
-		lua_pushstring(L, "stream.send(): invalid data");
-		return lua_error(L);
+	/* expand */
+	if (want < PHL_STREAM_BUF_MIN) {
+		want = PHL_STREAM_BUF_MIN;
+	}
+	if (sock->buf_size < want) {
+		sock->buf_size = want;
+		sock->buf = realloc(sock->buf, want);
 	}
 
-	int write_len = loop_stream_write(s, data, data_len);
-	if (write_len < 0) {
-		lua_pushstring(L, loop_stream_close_string(write_len));
-		return 1;
+	int read_len = loop_stream_read(sock->s, sock->buf + sock->buf_end,
+			sock->buf_size - sock->buf_end);
+	if (read_len < 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, loop_stream_close_string(read_len));
+		return PHL_ERROR;
+	}
+	if (read_len == 0) {
+		phl_stream_wait(sock, sock->read_timeout);
+		return PHL_AGAIN;
+	}
+
+	sock->buf_end += read_len;
+	return PHL_OK;
+}
+
+/* push and consume @len bytes in buffer, and skip more @skip bytes */
+static void phl_stream_consume(lua_State *L, struct phl_stream_socket *sock,
+		int len, int skip)
+{
+	lua_pushlstring(L, sock->buf + sock->buf_start, len);
+	sock->buf_start += len + skip;
+	if (sock->buf_start == sock->buf_end) {
+		sock->buf_start = sock->buf_end = 0;
 	}
-	if (write_len == data_len) {
+}
+
+/* return nil, error, and the partial data */
+static int phl_stream_receive_error(lua_State *L, struct phl_stream_socket *sock)
+{
+	phl_stream_consume(L, sock, sock->buf_end - sock->buf_start, 0);
+	return 3;
+}
+
+/* stack: [resume-handler,] socket, size */
+static int phl_stream_do_receive(lua_State *L)
+{
+	struct phl_stream_socket *sock = phl_stream_arg_socket(L, -2);
+	if (phl_stream_killed(sock)) {
 		return 0;
 	}
 
-	/* write blocks */
-	lua_pushcfunction(L, phl_stream_send_resume);
+	int size = lua_tointeger(L, -1);
+
+	while (sock->buf_end - sock->buf_start < size) {
+		int ret = phl_stream_fill(L, sock, size);
+		if (ret == PHL_AGAIN) {
+			return PHL_AGAIN;
+		}
+		if (ret == PHL_ERROR) {
+			sock->r = NULL;
+			return phl_stream_receive_error(L, sock);
+		}
+	}
+
+	sock->r = NULL;
+	phl_stream_consume(L, sock, size, 0);
+	return 1;
+}
+
+static int phl_stream_receive(lua_State *L)
+{
+	phl_stream_arg_socket(L, 1);
+	if (!lua_isnumber(L, 2) || lua_tointeger(L, 2) < 0) {
+		return luaL_error(L, "stream.receive(): invalid size");
+	}
+	lua_settop(L, 2);
+
+	int ret = phl_stream_do_receive(L);
+	if (ret != PHL_AGAIN) {
+		return ret;
+	}
+
+	/* insert the resume-handler at index=1 in stack */
+	lua_pushcfunction(L, phl_stream_do_receive);
 	lua_insert(L, 1);
-	lua_pushinteger(L, write_len);
+	return lua_yield(L, 3);
+}
 
-	return lua_yield(L, 4);
+static const char *phl_stream_search(const char *data, int len,
+		const char *pattern, int pattern_len)
+{
+	const char *end = data + len - pattern_len;
+	for (const char *p = data; p <= end; p++) {
+		p = memchr(p, pattern[0], end - p + 1);
+		if (p == NULL) {
+			return NULL;
+		}
+		if (memcmp(p, pattern, pattern_len) == 0) {
+			return p;
+		}
+	}
+	return NULL;
 }
 
-static int phl_stream_recv_resume(lua_State *L)
+/* stack: [resume-handler,] socket, pattern */
+static int phl_stream_do_receive_until(lua_State *L)
 {
-	loop_stream_t *s = lua_touserdata(L, -1);
+	struct phl_stream_socket *sock = phl_stream_arg_socket(L, -2);
+	if (phl_stream_killed(sock)) {
+		return 0;
+	}
 
-	char buffer[4096];
-	int read_len = loop_stream_read(s, buffer, sizeof(buffer));
-	if (read_len < 0) {
-		lua_pushnil(L);
-		lua_pushstring(L, loop_stream_close_string(read_len));
-		return 2;
+	size_t pattern_len;
+	const char *pattern = lua_tolstring(L, -1, &pattern_len);
+
+	/* search from here, for the data before were searched */
+	int checked = 0;
+
+	while (1) {
+		const char *data = sock->buf + sock->buf_start;
+		int len = sock->buf_end - sock->buf_start;
+		const char *p = phl_stream_search(data + checked, len - checked,
+				pattern, pattern_len);
+		if (p != NULL) {
+			sock->r = NULL;
+			phl_stream_consume(L, sock, p - data, pattern_len);
+			return 1;
+		}
+		if (len >= pattern_len) {
+			checked = len - pattern_len + 1;
+		}
+
+		if (len >= PHL_STREAM_BUF_MAX) {
+			sock->r = NULL;
+			lua_pushnil(L);
+			lua_pushstring(L, "too long");
+			return phl_stream_receive_error(L, sock);
+		}
+
+		int want = sock->buf_size - sock->buf_start;
+		if (len == want) { /* full */
+			want *= 2;
+		}
+		int ret = phl_stream_fill(L, sock, want);
+		if (ret == PHL_AGAIN) {
+			return PHL_AGAIN;
+		}
+		if (ret == PHL_ERROR) {
+			sock->r = NULL;
+			return phl_stream_receive_error(L, sock);
+		}
 	}
-	if (read_len > 0) {
-		lua_pushlstring(L, buffer, read_len);
-		return 1;
+}
+
+static int phl_stream_receive_until(lua_State *L)
+{
+	phl_stream_arg_socket(L, 1);
+	size_t pattern_len;
+	if (lua_tolstring(L, 2, &pattern_len) == NULL || pattern_len == 0) {
+		return luaL_error(L, "stream.receive_until(): invalid pattern");
+	}
+	lua_settop(L, 2);
+
+	int ret = phl_stream_do_receive_until(L);
+	if (ret != PHL_AGAIN) {
+		return ret;
 	}
 
-	/* read blocks, again */
-	return lua_yield(L, 1);
+	/* insert the resume-handler at index=1 in stack */
+	lua_pushcfunction(L, phl_stream_do_receive_until);
+	lua_insert(L, 1);
+	return lua_yield(L, 3);
 }
 
-static int phl_stream_recv(lua_State *L)
+/* stack: [resume-handler,] socket */
+static int phl_stream_do_recv(lua_State *L)
 {
-	loop_stream_t *s = lua_touserdata(L, 1);
-	if (s == NULL) {
-		lua_pushstring(L, "stream.send(): invalid address");
-		return lua_error(L);
+	struct phl_stream_socket *sock = phl_stream_arg_socket(L, -1);
+	if (phl_stream_killed(sock)) {
+		return 0;
 	}
 
-	char buffer[4096];
-	int read_len = loop_stream_read(s, buffer, sizeof(buffer));
-	if (read_len < 0) {
-		lua_pushnil(L);
-		lua_pushstring(L, loop_stream_close_string(read_len));
-		return 2;
+	if (sock->buf_start == sock->buf_end) {
+		int ret = phl_stream_fill(L, sock, 0);
+		if (ret == PHL_AGAIN) {
+			return PHL_AGAIN;
+		}
+		if (ret == PHL_ERROR) {
+			sock->r = NULL;
+			return 2;
+		}
 	}
-	if (read_len > 0) {
-		lua_pushlstring(L, buffer, read_len);
-		return 1;
+
+	sock->r = NULL;
+	phl_stream_consume(L, sock, sock->buf_end - sock->buf_start, 0);
+	return 1;
+}
+
+static int phl_stream_recv(lua_State *L)
+{
+	phl_stream_arg_socket(L, 1);
+	lua_settop(L, 1);
+
+	int ret = phl_stream_do_recv(L);
+	if (ret != PHL_AGAIN) {
+		return ret;
 	}
 
-	/* read blocks */
-	lua_pushcfunction(L, phl_stream_recv_resume);
+	/* insert the resume-handler at index=1 in stack */
+	lua_pushcfunction(L, phl_stream_do_recv);
 	lua_insert(L, 1);
 	return lua_yield(L, 2);
 }
 
+static int phl_stream_keepalive(lua_State *L)
+{
+	struct phl_stream_socket **udata = lua_touserdata(L, 1);
+	struct phl_stream_socket *sock = phl_stream_arg_socket(L, 1);
+	int idle_timeout = phl_stream_arg_timeout(L, 2, PHL_STREAM_DEFAULT_IDLE_TIMEOUT * 1000);
+	int idle_max = lua_isnoneornil(L, 3) ? PHL_STREAM_DEFAULT_IDLE_MAX : lua_tointeger(L, 3);
+
+	*udata = NULL;
+
+	/* the connection is not clean */
+	if (sock->buf_start != sock->buf_end || loop_stream_is_closed(sock->s)
+			|| idle_max <= 0) {
+		phl_stream_socket_close(sock);
+		return phl_stream_error(L, "not reusable");
+	}
+
+	struct phl_stream_pool *pool = wuy_dict_get(phl_stream_pool_dict, sock->pool_name);
+	if (pool == NULL) {
+		pool = calloc(1, sizeof(struct phl_stream_pool));
+		pool->name = strdup(sock->pool_name);
+		wuy_list_init(&pool->idle_head);
+		wuy_dict_add(phl_stream_pool_dict, pool);
+	}
+
+	/* close the oldest one if pool is full */
+	while (pool->idle_num >= idle_max) {
+		struct phl_stream_socket *oldest;
+		wuy_list_first_type(&pool->idle_head, oldest, list_node);
+		phl_stream_socket_close(oldest);
+	}
+
+	sock->r = NULL;
+	sock->idle_pool = pool;
+	wuy_list_append(&pool->idle_head, &sock->list_node);
+	pool->idle_num++;
+
+	/* release the buffer, which is empty */
+	free(sock->buf);
+	sock->buf = NULL;
+	sock->buf_size = 0;
+
+	loop_stream_set_timeout(sock->s, idle_timeout);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int phl_stream_close(lua_State *L)
+{
+	struct phl_stream_socket **udata = lua_touserdata(L, 1);
+	if (udata == NULL || *udata == NULL) {
+		return 0;
+	}
+	phl_stream_socket_close(*udata);
+	*udata = NULL;
+	return 0;
+}
+
+static void phl_stream_init(void)
+{
+	if (phl_stream_pool_dict == NULL) {
+		phl_stream_pool_dict = wuy_dict_new_type(WUY_DICT_KEY_STRING,
+				offsetof(struct phl_stream_pool, name),
+				offsetof(struct phl_stream_pool, dict_node));
+	}
+}
+
 static const struct phl_lua_api_reg_func phl_stream_functions[] = {
 	{ "connect", phl_stream_connect },
+	{ "settimeouts", phl_stream_settimeouts },
 	{ "send", phl_stream_send },
+	{ "receive", phl_stream_receive },
+	{ "receive_until", phl_stream_receive_until },
 	{ "recv", phl_stream_recv },
-	{ "close", phl_stream_send },
-	{ "keepalive", phl_stream_send },
+	{ "keepalive", phl_stream_keepalive },
+	{ "close", phl_stream_close },
+
+	{ "__gc", phl_stream_close },
 	{ NULL }  /* sentinel */
 };
 
 const struct phl_lua_api_package phl_stream_package = {
 	.name = "stream",
+	.ref = &phl_stream_meta_ref,
+	.init = phl_stream_init,
 	.funcs = phl_stream_functions,
 };
@@ -0,0 +1,61 @@
+#include "phl_lua.h"
+
+#include "phl_main.h"
+
+/* Timers run in current worker only:
+ *
+ *   phl.timer.at(delay, fn, name)       -> true, or nil and error
+ *   phl.timer.every(interval, fn, name) -> true, or nil and error
+ *
+ * The delay and interval are in seconds. The next run of every() starts
+ * the interval after the previous run finishes, so runs never overlap.
+ * The name is used in stats, and the function's source if not set. */
+
+static int phl_timer_create(lua_State *L, const char *fname, bool is_every)
+{
+	double sec = lua_tonumber(L, 1);
+	if (sec < 0 || (is_every && sec <= 0)) {
+		lua_pushfstring(L, "timer.%s(): invalid time", fname);
+		return lua_error(L);
+	}
+	if (!lua_isfunction(L, 2)) {
+		lua_pushfstring(L, "timer.%s(): invalid function", fname);
+		return lua_error(L);
+	}
+
+	long ms = sec * 1000;
+	if (is_every && ms == 0) {
+		ms = 1;
+	}
+	const char *err = phl_lua_timer_new(L, 2, ms, is_every ? ms : 0,
+			lua_tostring(L, 3));
+	if (err != NULL) {
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int phl_timer_at(lua_State *L)
+{
+	return phl_timer_create(L, "at", false);
+}
+
+static int phl_timer_every(lua_State *L)
+{
+	return phl_timer_create(L, "every", true);
+}
+
+static const struct phl_lua_api_reg_func phl_timer_functions[] = {
+	{ "at", phl_timer_at },
+	{ "every", phl_timer_every },
+	{ NULL }  /* sentinel */
+};
+
+const struct phl_lua_api_package phl_timer_package = {
+	.name = "timer",
+	.funcs = phl_timer_functions,
+};
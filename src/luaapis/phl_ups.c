@@ -1,6 +1,4 @@
-#include <lua5.1/lua.h>
-#include <lua5.1/lauxlib.h>
-#include <lua5.1/lualib.h>
+#include "phl_lua.h"
 
 #include "phl_main.h"
 
@@ -0,0 +1,86 @@
+-- Fast accessors of current request by LuaJIT FFI.
+--
+-- The `phl.req` and `phl.conn` accessors go through `__index` metamethods
+-- and push new strings. These call the C functions declared in
+-- phl_lua_api.h directly, which return pointer and length pairs, so no
+-- Lua string is created until it is really needed, e.g. `header_is()`
+-- compares in place.
+--
+-- With the original Lua, it falls back to the ordinary APIs, so the
+-- scripts work with both runtimes.
+--
+-- Usage:
+--   local req = require "luapkgs/phl_ffi"
+--   local id = req.cookie("id")
+--   if req.header_is("User-Agent", "curl") then ... end
+
+local _M = {}
+
+local ok, ffi = pcall(require, "ffi")
+
+if not ok then
+	_M.is_ffi = false
+
+	function _M.uri_path() return phl.req.uri_path end
+	function _M.host() return phl.req.host end
+	function _M.header(name) return phl.req.get_header(name) end
+	function _M.cookie(name) return phl.req.get_cookie(name) end
+	function _M.client_ip() return phl.conn.client_ip end
+
+	function _M.header_is(name, value)
+		return phl.req.get_header(name) == value
+	end
+
+	return _M
+end
+
+-- keep the same with phl_lua_api.h
+ffi.cdef[[
+int phl_ffi_req_uri_path(const char **p_value);
+int phl_ffi_req_host(const char **p_value);
+int phl_ffi_req_header(const char *name, int name_len, const char **p_value);
+int phl_ffi_req_cookie(const char *name, int name_len, const char **p_value);
+int phl_ffi_conn_client_ip(char *buf, int size);
+int memcmp(const void *s1, const void *s2, size_t n);
+]]
+
+local C = ffi.C
+local value_ptr = ffi.new("const char *[1]")
+local ip_buf = ffi.new("char[64]")
+
+local function to_string(len)
+	if len < 0 then
+		return nil
+	end
+	return ffi.string(value_ptr[0], len)
+end
+
+_M.is_ffi = true
+
+function _M.uri_path()
+	return to_string(C.phl_ffi_req_uri_path(value_ptr))
+end
+
+function _M.host()
+	return to_string(C.phl_ffi_req_host(value_ptr))
+end
+
+function _M.header(name)
+	return to_string(C.phl_ffi_req_header(name, #name, value_ptr))
+end
+
+function _M.cookie(name)
+	return to_string(C.phl_ffi_req_cookie(name, #name, value_ptr))
+end
+
+function _M.client_ip()
+	local len = C.phl_ffi_conn_client_ip(ip_buf, 64)
+	return ffi.string(ip_buf, len)
+end
+
+function _M.header_is(name, value)
+	local len = C.phl_ffi_req_header(name, #name, value_ptr)
+	return len == #value and C.memcmp(value_ptr[0], value, len) == 0
+end
+
+return _M
@@ -1,43 +1,120 @@
 #include "phl_main.h"
 
 #include <arpa/inet.h>
+#include <limits.h>
 
-// TODO support ipv6
+/* The rules are compiled into a path-compressed binary trie for each
+ * address family, so the lookup costs O(prefix length) regardless of
+ * the rule number. Each node records the first rule with its prefix,
+ * and the lookup picks the first one of all matched nodes on the path,
+ * which keeps the first-match semantics of the rule list. */
 
-struct phl_acl_rule {
-	uint32_t	start;
-	uint32_t	end;
-	bool		is_deny;
+struct phl_acl_node {
+	uint8_t		prefix[16]; /* bits after len are zero */
+	uint8_t		len;
+	int		rule; /* index of the first rule, or INT_MAX if none */
+	uint32_t	child[2]; /* index in nodes, 0 for none */
 };
+
+struct phl_acl_trie {
+	struct phl_acl_node	*nodes; /* nodes[0] is root */
+	int			node_num;
+	int			node_cap;
+	int			width; /* 32 for IPv4, 128 for IPv6 */
+};
+
 struct phl_acl_conf {
 	char			**strs;
 	int			num;
-	struct phl_acl_rule	*rules;
+	const char		*filename;
+
+	int			rule_num;
+	bool			*rule_denies;
+	bool			default_deny;
+
+	struct phl_acl_trie	ipv4;
+	struct phl_acl_trie	ipv6;
 };
 
 struct phl_module phl_acl_module;
 
+static int phl_acl_bit(const uint8_t *addr, int i)
+{
+	return (addr[i / 8] >> (7 - i % 8)) & 1;
+}
+
+/* length of common prefix of @a and @b, at most @max */
+static int phl_acl_common_len(const uint8_t *a, const uint8_t *b, int max)
+{
+	int len = 0;
+	for (int i = 0; len < max; i++) {
+		uint8_t x = a[i] ^ b[i];
+		if (x != 0) {
+			len += __builtin_clz(x) - 24;
+			break;
+		}
+		len += 8;
+	}
+	return len < max ? len : max;
+}
+
+static int phl_acl_lookup(struct phl_acl_trie *trie, const uint8_t *addr)
+{
+	int first = INT_MAX;
+	if (trie->node_num == 0) {
+		return first;
+	}
+
+	struct phl_acl_node *node = &trie->nodes[0];
+	while (1) {
+		if (phl_acl_common_len(node->prefix, addr, node->len) < node->len) {
+			break;
+		}
+		if (node->rule < first) {
+			first = node->rule;
+		}
+		if (node->len == trie->width) {
+			break;
+		}
+		uint32_t child = node->child[phl_acl_bit(addr, node->len)];
+		if (child == 0) {
+			break;
+		}
+		node = &trie->nodes[child];
+	}
+	return first;
+}
+
 static int phl_acl_process_headers(struct phl_request *r)
 {
 	struct phl_acl_conf *conf = r->conf_path->module_confs[phl_acl_module.index];
-	if (conf->strs == NULL) {
+	if (conf->rule_num == 0) {
 		return PHL_OK;
 	}
 
-	struct sockaddr_in *sin = (struct sockaddr_in *)&r->c->client_addr;
-	uint32_t addr = ntohl(sin->sin_addr.s_addr);
-	for (int i = 0; i < conf->num; i++) {
-		struct phl_acl_rule *rule = &conf->rules[i];
-		if (addr >= rule->start && addr <= rule->end) {
-			if (rule->is_deny) {
-				printf("[info] denied by ACL rule #%d\n", i+1);
-				return WUY_HTTP_403;
-			}
-			return PHL_OK;
+	int rule;
+	struct sockaddr *sa = &r->c->client_addr;
+	if (sa->sa_family == AF_INET6) {
+		const uint8_t *addr = r->c->client_addr_in6.sin6_addr.s6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(&r->c->client_addr_in6.sin6_addr)) {
+			rule = phl_acl_lookup(&conf->ipv4, addr + 12);
+		} else {
+			rule = phl_acl_lookup(&conf->ipv6, addr);
+		}
+	} else {
+		const uint8_t *addr = (const uint8_t *)&((struct sockaddr_in *)sa)->sin_addr;
+		rule = phl_acl_lookup(&conf->ipv4, addr);
+	}
+
+	if (rule == INT_MAX) {
+		if (conf->default_deny) {
+			phl_request_log(r, PHL_LOG_INFO, "acl: denied by default rule");
+			return WUY_HTTP_403;
 		}
+		return PHL_OK;
 	}
-	if (!conf->rules[conf->num-1].is_deny) {
-		printf("[info] denied by ACL default rule\n");
+	if (conf->rule_denies[rule]) {
+		phl_request_log(r, PHL_LOG_INFO, "acl: denied by rule #%d", rule + 1);
 		return WUY_HTTP_403;
 	}
 	return PHL_OK;
@@ -45,59 +122,210 @@ static int phl_acl_process_headers(struct phl_request *r)
 
 /* configuration */
 
-static const char *phl_acl_conf_post(void *data)
+static uint32_t phl_acl_node_new(struct phl_acl_trie *trie, const uint8_t *prefix,
+		int len, int rule)
 {
-	struct phl_acl_conf *conf = data;
+	if (trie->node_num == trie->node_cap) {
+		trie->node_cap = trie->node_cap ? trie->node_cap * 2 : 64;
+		trie->nodes = realloc(trie->nodes, sizeof(struct phl_acl_node) * trie->node_cap);
+	}
 
-	if (conf->strs == NULL) {
-		return WUY_CFLUA_OK;
+	struct phl_acl_node *node = &trie->nodes[trie->node_num];
+	memset(node, 0, sizeof(struct phl_acl_node));
+
+	/* keep the first @len bits only */
+	memcpy(node->prefix, prefix, (len + 7) / 8);
+	if (len % 8 != 0) {
+		node->prefix[len / 8] &= 0xFF << (8 - len % 8);
 	}
+	node->len = len;
+	node->rule = rule;
+	return trie->node_num++;
+}
 
-	conf->rules = wuy_pool_alloc(wuy_cflua_pool, conf->num * sizeof(struct phl_acl_rule));
+static void phl_acl_insert(struct phl_acl_trie *trie, const uint8_t *prefix,
+		int len, int rule)
+{
+	if (trie->node_num == 0) {
+		phl_acl_node_new(trie, prefix, 0, INT_MAX); /* root */
+	}
+
+	uint32_t n = 0;
+	while (1) {
+		/* the prefix of nodes[n] is a prefix of @prefix here */
+		if (trie->nodes[n].len == len) {
+			if (rule < trie->nodes[n].rule) {
+				trie->nodes[n].rule = rule;
+			}
+			return;
+		}
 
-	for (int i = 0; i < conf->num; i++) {
-		char *str = conf->strs[i];
-		struct phl_acl_rule *rule = &conf->rules[i];
+		int b = phl_acl_bit(prefix, trie->nodes[n].len);
+		uint32_t c = trie->nodes[n].child[b];
+		if (c == 0) {
+			uint32_t leaf = phl_acl_node_new(trie, prefix, len, rule);
+			trie->nodes[n].child[b] = leaf;
+			return;
+		}
 
-		if (str[0] == '!') {
-			rule->is_deny = true;
-			str++;
+		int c_len = trie->nodes[c].len;
+		int common = phl_acl_common_len(trie->nodes[c].prefix, prefix,
+				c_len < len ? c_len : len);
+		if (common == c_len) {
+			n = c;
+			continue;
+		}
+
+		/* split, with a new node of the common prefix */
+		uint32_t m = phl_acl_node_new(trie, prefix, common, INT_MAX);
+		trie->nodes[m].child[phl_acl_bit(trie->nodes[c].prefix, common)] = c;
+		if (common == len) {
+			trie->nodes[m].rule = rule;
 		} else {
-			rule->is_deny = false;
-		}
-
-		int mask = -1;
-		char *p = strchr(str, '/');
-		if (p != NULL) {
-			*p++ = '\0';
-			errno = 0;
-			char *endp;
-			mask = strtol(p, &endp, 10);
-			if (errno != 0 || *endp != '\0') {
-				wuy_cflua_post_arg = str;
-				return "invalid mask";
-			}
-			if (mask < 0 || mask > 32) {
-				wuy_cflua_post_arg = str;
-				return "invalid mask";
-			}
+			uint32_t leaf = phl_acl_node_new(trie, prefix, len, rule);
+			trie->nodes[m].child[phl_acl_bit(prefix, common)] = leaf;
 		}
+		trie->nodes[n].child[b] = m;
+		return;
+	}
+}
+
+/* move the nodes into configuration pool */
+static void phl_acl_trie_finish(struct phl_acl_trie *trie)
+{
+	if (trie->node_num == 0) {
+		return;
+	}
+	struct phl_acl_node *nodes = wuy_pool_alloc(wuy_cflua_pool,
+			sizeof(struct phl_acl_node) * trie->node_num);
+	memcpy(nodes, trie->nodes, sizeof(struct phl_acl_node) * trie->node_num);
+	free(trie->nodes);
+	trie->nodes = nodes;
+	trie->node_cap = trie->node_num;
+}
+
+/* parse rule as "[!]IP[/prefix]" and insert it */
+static const char *phl_acl_add_rule(struct phl_acl_conf *conf, char *str)
+{
+	int rule = conf->rule_num++;
+
+	conf->rule_denies[rule] = false;
+	if (str[0] == '!') {
+		conf->rule_denies[rule] = true;
+		str++;
+	}
 
-		struct in_addr ip;
-		if (!inet_pton(AF_INET, str, &ip)) {
+	int len = -1;
+	char *p = strchr(str, '/');
+	if (p != NULL) {
+		*p++ = '\0';
+		errno = 0;
+		char *endp;
+		len = strtol(p, &endp, 10);
+		if (errno != 0 || *endp != '\0' || len < 0) {
 			wuy_cflua_post_arg = str;
-			return "invalid IP";
+			return "invalid mask";
 		}
+	}
 
-		rule->start = ntohl(ip.s_addr);
+	uint8_t addr[16];
+	struct phl_acl_trie *trie;
+	if (inet_pton(AF_INET, str, addr) == 1) {
+		trie = &conf->ipv4;
+	} else if (inet_pton(AF_INET6, str, addr) == 1) {
+		trie = &conf->ipv6;
+	} else {
+		wuy_cflua_post_arg = str;
+		return "invalid IP";
+	}
 
-		if (mask == -1) {
-			rule->end = rule->start;
-		} else {
-			rule->end = rule->start & (UINT32_MAX << (32-mask));
+	if (len == -1) {
+		len = trie->width;
+	} else if (len > trie->width) {
+		wuy_cflua_post_arg = str;
+		return "invalid mask";
+	}
+
+	phl_acl_insert(trie, addr, len, rule);
+	return WUY_CFLUA_OK;
+}
+
+/* load rules from file, one rule each line, and '#' for comments */
+static const char *phl_acl_load_file(struct phl_acl_conf *conf)
+{
+	FILE *fp = fopen(conf->filename, "r");
+	if (fp == NULL) {
+		wuy_cflua_post_arg = conf->filename;
+		return "fail to open file";
+	}
+
+	const char *err = WUY_CFLUA_OK;
+	int capacity = conf->num + 64;
+	char line[200];
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *str = line;
+		while (isspace((unsigned char)*str)) {
+			str++;
+		}
+		char *end = str + strcspn(str, "# \t\r\n");
+		*end = '\0';
+		if (*str == '\0') {
+			continue;
+		}
+
+		if (conf->rule_num == capacity) {
+			capacity *= 2;
+			conf->rule_denies = realloc(conf->rule_denies, sizeof(bool) * capacity);
+		}
+
+		str = wuy_pool_strdup(wuy_cflua_pool, str);
+		err = phl_acl_add_rule(conf, str);
+		if (err != WUY_CFLUA_OK) {
+			break;
 		}
 	}
 
+	fclose(fp);
+	return err;
+}
+
+static const char *phl_acl_conf_post(void *data)
+{
+	struct phl_acl_conf *conf = data;
+
+	if (conf->strs == NULL && conf->filename == NULL) {
+		return WUY_CFLUA_OK;
+	}
+
+	conf->ipv4 = (struct phl_acl_trie){ .width = 32 };
+	conf->ipv6 = (struct phl_acl_trie){ .width = 128 };
+	conf->rule_num = 0;
+	conf->rule_denies = malloc(sizeof(bool) * (conf->num + 64));
+
+	const char *err = WUY_CFLUA_OK;
+	for (int i = 0; i < conf->num && err == WUY_CFLUA_OK; i++) {
+		err = phl_acl_add_rule(conf, conf->strs[i]);
+	}
+
+	if (err == WUY_CFLUA_OK && conf->filename != NULL) {
+		err = phl_acl_load_file(conf);
+	}
+
+	phl_acl_trie_finish(&conf->ipv4);
+	phl_acl_trie_finish(&conf->ipv6);
+
+	bool *denies = wuy_pool_alloc(wuy_cflua_pool, sizeof(bool) * (conf->rule_num + 1));
+	memcpy(denies, conf->rule_denies, sizeof(bool) * conf->rule_num);
+	free(conf->rule_denies);
+	conf->rule_denies = denies;
+
+	if (err != WUY_CFLUA_OK) {
+		return err;
+	}
+
+	if (conf->rule_num > 0) {
+		conf->default_deny = !conf->rule_denies[conf->rule_num - 1];
+	}
 	return WUY_CFLUA_OK;
 }
 
@@ -105,10 +333,19 @@ static struct wuy_cflua_command phl_acl_conf_commands[] = {
 	{	.type = WUY_CFLUA_TYPE_STRING,
 		.description = "Rule list. " \
 				"Deny-rules begin with '!', e.g \"!123.234.0.0/24\". " \
+				"Both IPv4 and IPv6 are supported. " \
+				"The first matched rule is applied. " \
 				"The default policy is the negative of the last rule.",
 		.offset = offsetof(struct phl_acl_conf, strs),
 		.array_number_offset = offsetof(struct phl_acl_conf, num),
 	},
+	{	.name = "file",
+		.description = "Load more rules from this file, one rule each line, " \
+				"which are appended after the rule list. " \
+				"Content after '#' is comment.",
+		.type = WUY_CFLUA_TYPE_STRING,
+		.offset = offsetof(struct phl_acl_conf, filename),
+	},
 	{ NULL }
 };
 
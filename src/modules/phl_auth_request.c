@@ -16,6 +16,7 @@ static int phl_auth_request_process_headers(struct phl_request *r)
 	struct phl_request *subr = r->module_ctxs[phl_auth_request_module.index];
 	if (subr == NULL) { /* first time get in */
 		subr = phl_request_subr_new(r, conf->pathname);
+		subr->subr_pipe.discard = true; /* only status and headers needed */
 		phl_header_dup_list(&subr->req.headers, &r->req.headers, r->pool);
 		// TODO req-body
 		// subr->req.method = r->req.method;
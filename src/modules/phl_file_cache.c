@@ -1,8 +1,14 @@
 #include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include "phl_main.h"
 
 struct phl_file_cache_stats {
 	atomic_long		total;
+	atomic_long		hit_memory;
 	atomic_long		hit_current;
 	atomic_long		hit_last;
 	atomic_long		miss;
@@ -14,10 +20,136 @@ struct phl_file_cache_stats {
 	atomic_long		store_fail;
 	atomic_long		create;
 	atomic_long		remove;
+	atomic_long		memory_store;
+	atomic_long		memory_store_fail;
+	atomic_long		memory_evict;
+	atomic_long		memory_expired;
+	atomic_long		lock_wait;
+	atomic_long		lock_timeout;
+	atomic_long		lock_full;
+	atomic_long		stale_revalidate;
+	atomic_long		stale_if_error;
+	atomic_long		refresh_start;
+	atomic_long		refresh_not_modified;
+	atomic_long		refresh_modified;
+	atomic_long		index_evict;
+	atomic_long		index_full;
+	atomic_long		journal_compact;
 };
 
+/* memory tier, in shared-memory */
+struct phl_file_cache_memory_entry {
+	struct phl_slab_node	slab_node;
+	uint64_t		hash[2];
+	wuy_nop_hlist_node_t	hash_node;
+	int			length;
+	char			data[0]; /* item, headers and body */
+};
+
+struct phl_file_cache_memory {
+	pthread_mutex_t		lock;
+	bool			has_inited;
+
+	struct phl_slab		slab;
+
+	int			hash_buckets;
+	wuy_nop_hlist_t		buckets[0];
+};
+
+/* index of items on disk, in shared-memory */
+struct phl_file_cache_index_node {
+	uint64_t		hash[2];
+	size_t			size; /* 0 if not used */
+	time_t			expire_at;
+	time_t			last_access;
+	time_t			dir; /* timestamp of the P_<ts> directory */
+	wuy_nop_hlist_node_t	hash_node;
+	wuy_nop_list_node_t	list_node; /* on LRU or free list */
+};
+
+struct phl_file_cache_index {
+	pthread_mutex_t		lock;
+	bool			has_inited;
+
+	size_t			total_size;
+	int			item_num;
+
+	wuy_nop_list_t		lru_list;
+	wuy_nop_list_t		free_list;
+
+	struct phl_file_cache_index_node	*nodes_start;
+	struct phl_file_cache_index_node	*used_pos;
+	const struct phl_file_cache_index_node	*nodes_end;
+
+	atomic_int		sweeper_pid; /* the worker sweeping and writing journal */
+
+	int			journal_generation;
+	long			journal_records;
+	bool			journal_busy; /* flushing or compacting */
+	bool			journal_lost; /* some records lost, so compact */
+
+	/* records are buffered here, and written by sweeper out of lock */
+	struct phl_file_cache_journal_record	*journal_buf;
+	int			journal_buf_num;
+
+	int			hash_buckets;
+	wuy_nop_hlist_t		buckets[0];
+};
+
+/* compact journal record of index, for fast startup */
+#define PHL_FILE_CACHE_JOURNAL_NAME		"journal"
+#define PHL_FILE_CACHE_JOURNAL_BUFFER		4096
+#define PHL_FILE_CACHE_SWEEP_INTERVAL		1000
+#define PHL_FILE_CACHE_SWEEP_BATCH		256
+
+struct phl_file_cache_journal_record {
+	uint64_t		hash[2];
+	size_t			size; /* 0 means removed */
+	time_t			expire_at;
+	time_t			dir;
+};
+
+/* evicted from the index when it is full, and unlinked by sweeper */
+struct phl_file_cache_victim {
+	uint64_t		hash[2];
+	time_t			dir;
+};
+
+/* cache locks, in shared-memory */
+#define PHL_FILE_CACHE_LOCK_SLOTS		4096
+#define PHL_FILE_CACHE_LOCK_PROBES		16
+#define PHL_FILE_CACHE_LOCK_POLL_MS		50 /* if no notifier */
+#define PHL_FILE_CACHE_REFRESH_LOCK_TIMEOUT	60 /* in second */
+
+struct phl_file_cache_lock {
+	uint64_t		hash[2];
+	long			expire_at; /* in millisecond, free if expired */
+	uint64_t		waiters; /* bitmap of notifiers */
+};
+
+struct phl_file_cache_locks {
+	pthread_mutex_t		lock;
+	bool			has_inited;
+	struct phl_file_cache_lock	slots[PHL_FILE_CACHE_LOCK_SLOTS];
+};
+
+/* eventfds to wake up the lock waiters in other workers. They are
+ * created in master, and each worker claims one. */
+#define PHL_FILE_CACHE_NOTIFIERS		64
+
+struct phl_file_cache_notifier {
+	atomic_int		pid; /* owner worker, or 0 */
+	int			fd;
+};
+
+static struct phl_file_cache_notifier *phl_file_cache_notifiers; /* shared */
+static int phl_file_cache_notifier_index = -1; /* claimed by this worker */
+static WUY_LIST(phl_file_cache_lock_waiters); /* ctxs in this worker */
+
 struct phl_file_cache_conf {
 	const char		*dir_name;
+	int			max_size;
+	int			index_max_items;
 	wuy_cflua_function_t	key;
 	wuy_cflua_function_t	expire_time;
 	int			default_expire;
@@ -27,13 +159,35 @@ struct phl_file_cache_conf {
 	int			*status_codes;
 	const char		**include_headers;
 	const char		**exclude_headers;
+	int			memory_size;
+	int			memory_item_max;
+	int			lock_timeout;
+	int			stale_while_revalidate;
+	int			stale_if_error;
 	struct phl_log		*log;
 
 	int			dirfd;
 	int			current_dirfd;
 	int			last_dirfd;
+	int			closing_dirfd;
 	const char		*current_dirname;
 	const char		*last_dirname;
+	time_t			current_ts;
+	time_t			last_ts;
+
+	loop_timer_t		*renew_timer;
+	loop_timer_t		*sweep_timer;
+
+	struct phl_file_cache_index	*index;
+	int			journal_fd;
+	int			journal_generation;
+
+	struct phl_file_cache_victim	*victims;
+	int			victim_num;
+	int			victim_capacity;
+
+	struct phl_file_cache_memory	*memory;
+	struct phl_file_cache_locks	*locks;
 
 	struct phl_file_cache_stats	*stats;
 };
@@ -41,16 +195,84 @@ struct phl_file_cache_conf {
 struct phl_file_cache_item {
 	size_t				content_length;
 	time_t				expire_at;
+	int				stale_while_revalidate;
+	int				stale_if_error;
 	enum wuy_http_status_code	status_code;
 	int				header_num;
 	int				header_total_length;
 	struct phl_header		headers[0];
 };
 
+/* result of looking up the item file, maybe in aio thread */
+#define PHL_FILE_CACHE_LOOKUP_READ		4096
+
+struct phl_file_cache_lookup {
+	/* arguments */
+	int				current_dirfd;
+	int				last_dirfd;
+	int				dir_level;
+	int				memory_item_max; /* 0 if no memory tier */
+	char				filename[100];
+
+	/* results */
+	enum {
+		PHL_FILE_CACHE_LOOKUP_MISS = 0,
+		PHL_FILE_CACHE_LOOKUP_CURRENT,
+		PHL_FILE_CACHE_LOOKUP_LAST,
+	}				hit;
+	bool				moved; /* from last directory to current */
+	int				fd;
+	int				err;
+	struct stat			st;
+	ssize_t				read_len;
+	size_t				data_size;
+	char				data[0];
+};
+
+/* storing the item body, maybe by aio. This may live longer than
+ * the request, until all writes finish. */
+struct phl_file_cache_store {
+	struct phl_file_cache_conf	*conf;
+	int				fd; /* -1 before created */
+	uint64_t			hash[2];
+	char				filename[100];
+	struct phl_file_cache_lock	*lock;
+	bool				created;
+	struct phl_aio_task		**queued; /* body writes before created */
+	int				queued_num;
+	int				queued_capacity;
+	size_t				header_length;
+	time_t				expire_at;
+	off_t				offset;
+	size_t				content_length;
+	int				pending;
+	bool				replace; /* remove the old file before creating */
+	bool				failed;
+	bool				finished;
+	bool				aborted;
+};
+
 struct phl_file_cache_ctx {
 	int				fd;
+	uint64_t			hash[2];
+	const char			*filename;
 	const char			*new_filename;
 	size_t				new_length;
+	struct phl_aio_task		*lookup_task;
+	struct phl_file_cache_lookup	*lookup;
+	struct phl_file_cache_store	*store;
+	struct phl_open_cache_entry	*entry; /* the item is opened in cache */
+	char				*mem_buf; /* to store into memory tier */
+	int				mem_len;
+	struct phl_file_cache_lock	*lock; /* held */
+	long				lock_wait_until;
+	loop_timer_t			*lock_timer;
+	wuy_list_node_t			lock_wait_node;
+	struct phl_request		*r; /* for lock waiting */
+	bool				is_refresh; /* background refresh subrequest */
+	bool				replace_file; /* the old file is removed before storing */
+	int				stale_fd; /* used if fail to fetch */
+	char				*stale_headers;
 	struct phl_file_cache_item	item;
 };
 
@@ -64,16 +286,103 @@ struct phl_module phl_file_cache_module;
 
 /* === directory oprations */
 
+static void phl_file_cache_remove_tree(int parentfd, const char *name)
+{
+	int fd = openat(parentfd, name, O_RDONLY|O_DIRECTORY);
+	if (fd >= 0) {
+		DIR *dir = fdopendir(fd);
+		struct dirent *e;
+		while ((e = readdir(dir)) != NULL) {
+			if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+				continue;
+			}
+			if (e->d_type == DT_DIR) {
+				phl_file_cache_remove_tree(fd, e->d_name);
+			} else {
+				unlinkat(fd, e->d_name, 0);
+			}
+		}
+		closedir(dir);
+	}
+	unlinkat(parentfd, name, AT_REMOVEDIR);
+}
+
+struct phl_file_cache_remove_arg {
+	int	dirfd;
+	char	name[100];
+};
+static void *phl_file_cache_remove_thread(void *data)
+{
+	struct phl_file_cache_remove_arg *arg = data;
+	phl_file_cache_remove_tree(arg->dirfd, arg->name);
+	close(arg->dirfd);
+	free(arg);
+	return NULL;
+}
+
+/* remove the directory in a thread, because there may be many files in it */
+static void phl_file_cache_remove_dir(struct phl_file_cache_conf *conf, const char *name)
+{
+	struct phl_file_cache_remove_arg *arg = malloc(sizeof(struct phl_file_cache_remove_arg));
+	arg->dirfd = dup(conf->dirfd);
+	snprintf(arg->name, sizeof(arg->name), "%s", name);
+
+	pthread_t tid;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&tid, &attr, phl_file_cache_remove_thread, arg) != 0) {
+		_log_conf(PHL_LOG_ERROR, "fail to create thread to remove %s", name);
+		close(arg->dirfd);
+		free(arg);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void phl_file_cache_index_purge_dir(struct phl_file_cache_conf *conf, time_t dir);
+
+/* Rename the directory to D_<ts> first, so only one worker gets it
+ * and removes it. */
+static void phl_file_cache_delete_dir(struct phl_file_cache_conf *conf,
+		const char *name, time_t ts)
+{
+	char tmpname[100];
+	sprintf(tmpname, "D_%ld", ts);
+	if (renameat(conf->dirfd, name, conf->dirfd, tmpname) < 0) {
+		if (errno != ENOENT) {
+			_log_conf(PHL_LOG_ERROR, "fail to rename %s: %s", name, strerror(errno));
+		}
+		return;
+	}
+
+	_log_conf(PHL_LOG_INFO, "delete directory %s/%s", conf->dir_name, name);
+
+	atomic_fetch_add(&conf->stats->remove, 1);
+
+	if (conf->index != NULL) {
+		phl_file_cache_index_purge_dir(conf, ts);
+	}
+
+	phl_file_cache_remove_dir(conf, tmpname);
+}
+
 static void phl_file_cache_delete_last_dir(struct phl_file_cache_conf *conf)
 {
 	if (conf->last_dirfd == 0) {
 		return;
 	}
 
-	close(conf->last_dirfd);
+	/* drop the opened files in it, before its dirfd number is reused */
+	phl_open_cache_remove_dir(conf->last_dirfd);
+
+	/* close it later, because it may be used in aio threads now */
+	if (conf->closing_dirfd > 0) {
+		close(conf->closing_dirfd);
+	}
+	conf->closing_dirfd = conf->last_dirfd;
+
+	phl_file_cache_delete_dir(conf, conf->last_dirname, conf->last_ts);
 
-	// TODO
-	printf("delete dir: %s/%s\n", conf->dir_name, conf->last_dirname);
 	free((char *)conf->last_dirname);
 }
 
@@ -85,7 +394,7 @@ static bool phl_file_cache_mkdir(int dirfd, const char *pathname)
 static bool phl_file_cache_new_dir(struct phl_file_cache_conf *conf, time_t now)
 {
 	char dirname[100];
-	sprintf(dirname, "P_%ld", time(NULL));
+	sprintf(dirname, "P_%ld", now);
 	if (!phl_file_cache_mkdir(conf->dirfd, dirname)) {
 		_log_conf(PHL_LOG_ERROR, "new directory %s", strerror(errno));
 		return false;
@@ -103,6 +412,10 @@ static bool phl_file_cache_new_dir(struct phl_file_cache_conf *conf, time_t now)
 	conf->current_dirfd = new_dirfd;
 	conf->last_dirname = conf->current_dirname;
 	conf->current_dirname = strdup(dirname);
+	conf->last_ts = conf->current_ts;
+	conf->current_ts = now;
+
+	atomic_fetch_add(&conf->stats->create, 1);
 
 	return true;
 }
@@ -128,93 +441,1602 @@ static bool phl_file_cache_do_prepare_prefix(int dirfd, const char *filename, in
 		return false;
 	}
 
-	/* try again */
-	return phl_file_cache_mkdir(dirfd, pathname);
+	/* try again */
+	return phl_file_cache_mkdir(dirfd, pathname);
+}
+
+/* === memory tier
+ *
+ * Small items are kept in shared-memory too, to be served without
+ * any syscall. Items are also stored on disk, so they are just dropped from memory
+ * when evicted. */
+
+static struct phl_file_cache_memory_entry *phl_file_cache_memory_search(
+		struct phl_file_cache_memory *memory, const uint64_t *hash)
+{
+	wuy_nop_hlist_t *bucket = &memory->buckets[hash[0] % memory->hash_buckets];
+
+	struct phl_file_cache_memory_entry *entry;
+	wuy_nop_hlist_iter_type(bucket, entry, hash_node, memory) {
+		if (entry->hash[0] == hash[0] && entry->hash[1] == hash[1]) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void phl_file_cache_memory_free(struct phl_file_cache_memory *memory,
+		struct phl_file_cache_memory_entry *entry)
+{
+	wuy_nop_hlist_delete(&entry->hash_node, memory);
+	phl_slab_free(&memory->slab, entry);
+}
+
+static void phl_file_cache_memory_evict(void *slot, void *data)
+{
+	struct phl_file_cache_conf *conf = data;
+	struct phl_file_cache_memory_entry *entry = slot;
+	atomic_fetch_add(&conf->stats->memory_evict, 1);
+	wuy_nop_hlist_delete(&entry->hash_node, conf->memory);
+}
+
+static void phl_file_cache_memory_store(struct phl_file_cache_conf *conf,
+		const uint64_t *hash, const char *data, int length)
+{
+	struct phl_file_cache_memory *memory = conf->memory;
+
+	pthread_mutex_lock(&memory->lock);
+
+	/* delete the old one if any */
+	struct phl_file_cache_memory_entry *entry = phl_file_cache_memory_search(memory, hash);
+	if (entry != NULL) {
+		phl_file_cache_memory_free(memory, entry);
+	}
+
+	entry = phl_slab_alloc(&memory->slab, sizeof(struct phl_file_cache_memory_entry) + length,
+			phl_file_cache_memory_evict, conf);
+	if (entry == NULL) {
+		pthread_mutex_unlock(&memory->lock);
+		atomic_fetch_add(&conf->stats->memory_store_fail, 1);
+		return;
+	}
+
+	entry->hash[0] = hash[0];
+	entry->hash[1] = hash[1];
+	entry->length = length;
+	memcpy(entry->data, data, length);
+
+	wuy_nop_hlist_insert(&memory->buckets[hash[0] % memory->hash_buckets],
+			&entry->hash_node, memory);
+
+	pthread_mutex_unlock(&memory->lock);
+
+	atomic_fetch_add(&conf->stats->memory_store, 1);
+}
+
+/* copy the item into @pool if hit */
+static struct phl_file_cache_item *phl_file_cache_memory_load(
+		struct phl_file_cache_conf *conf, const uint64_t *hash, wuy_pool_t *pool)
+{
+	struct phl_file_cache_memory *memory = conf->memory;
+
+	pthread_mutex_lock(&memory->lock);
+
+	struct phl_file_cache_memory_entry *entry = phl_file_cache_memory_search(memory, hash);
+	if (entry == NULL) {
+		pthread_mutex_unlock(&memory->lock);
+		return NULL;
+	}
+
+	struct phl_file_cache_item *item = (struct phl_file_cache_item *)entry->data;
+	if (item->expire_at < time(NULL)) {
+		phl_file_cache_memory_free(memory, entry);
+		pthread_mutex_unlock(&memory->lock);
+		atomic_fetch_add(&conf->stats->memory_expired, 1);
+		return NULL;
+	}
+
+	phl_slab_touch(&memory->slab, entry);
+
+	item = wuy_pool_alloc(pool, entry->length);
+	memcpy(item, entry->data, entry->length);
+
+	pthread_mutex_unlock(&memory->lock);
+	return item;
+}
+
+static void phl_file_cache_memory_set_expire(struct phl_file_cache_conf *conf,
+		const uint64_t *hash, time_t expire_at)
+{
+	struct phl_file_cache_memory *memory = conf->memory;
+
+	pthread_mutex_lock(&memory->lock);
+
+	struct phl_file_cache_memory_entry *entry = phl_file_cache_memory_search(memory, hash);
+	if (entry != NULL) {
+		struct phl_file_cache_item *item = (struct phl_file_cache_item *)entry->data;
+		item->expire_at = expire_at;
+	}
+
+	pthread_mutex_unlock(&memory->lock);
+}
+
+static const char *phl_file_cache_memory_init(struct phl_file_cache_conf *conf)
+{
+	/* the page size is the max slot size */
+	int page_size = phl_slab_page_size(
+			sizeof(struct phl_file_cache_memory_entry) + conf->memory_item_max);
+	if (page_size == 0) {
+		return "too big memory_item_max";
+	}
+	int page_num = conf->memory_size / page_size;
+	if (page_num < 2) {
+		return "too small memory_size";
+	}
+
+	int hash_buckets = page_num * 8;
+	size_t head_size = sizeof(struct phl_file_cache_memory)
+			+ sizeof(wuy_nop_hlist_t) * hash_buckets;
+
+	conf->memory = wuy_shmpool_alloc(head_size + (size_t)page_size * page_num);
+
+	struct phl_file_cache_memory *memory = conf->memory;
+	if (memory->has_inited) {
+		return WUY_CFLUA_OK;
+	}
+
+	memory->has_inited = true;
+	phl_slab_init(&memory->slab, (char *)memory + head_size, page_size, page_num);
+	memory->hash_buckets = hash_buckets;
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, 1);
+	pthread_mutex_init(&memory->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	return WUY_CFLUA_OK;
+}
+
+/* === disk index
+ *
+ * All items on disk are indexed in shared-memory, with their sizes,
+ * so the total occupation is limited by `max_size`. The least recently
+ * used items are removed by a sweeper timer in background.
+ *
+ * The index is recorded in a journal file too, so it does not need to
+ * walk all the cache files at startup. Each record is appended when an
+ * item is stored, moved or removed, and the journal is compacted when
+ * it grows much bigger than the index. */
+
+static void phl_file_cache_build_filename(struct phl_file_cache_conf *conf,
+		const uint64_t *hash, char *filename)
+{
+	char *p = filename;
+	uint64_t tmpdirhash = hash[1];
+	for (int i = 0; i < conf->dir_level; i++) {
+		p += sprintf(p, "%02lx/", tmpdirhash & 0xFF);
+		tmpdirhash >>= 8;
+	}
+	sprintf(p, "%016lx%016lx", hash[0], hash[1]);
+}
+
+/* unlink in aio thread while nobody waits for it. The dirfd is
+ * still valid then, see phl_file_cache_delete_last_dir(). */
+static void phl_file_cache_unlink(int dirfd, const char *filename)
+{
+	struct phl_aio_task *task = phl_aio_task_new(phl_aio_work_unlink,
+			phl_aio_done_free, NULL);
+	task->dirfd = dirfd;
+	task->path = strdup(filename);
+	phl_aio_submit(task);
+}
+
+static void phl_file_cache_index_unlink(struct phl_file_cache_conf *conf,
+		const uint64_t *hash, time_t dir)
+{
+	int dirfd;
+	if (dir == conf->current_ts) {
+		dirfd = conf->current_dirfd;
+	} else if (dir == conf->last_ts && conf->last_dirfd > 0) {
+		dirfd = conf->last_dirfd;
+	} else { /* the directory has been deleted */
+		return;
+	}
+
+	char filename[100];
+	phl_file_cache_build_filename(conf, hash, filename);
+	phl_file_cache_unlink(dirfd, filename);
+	phl_open_cache_remove(dirfd, filename);
+}
+
+/* called with the index lock held. The record is buffered, and written
+ * by phl_file_cache_journal_flush() in sweeper. */
+static void phl_file_cache_journal_append(struct phl_file_cache_conf *conf,
+		const uint64_t *hash, size_t size, time_t expire_at, time_t dir)
+{
+	struct phl_file_cache_index *index = conf->index;
+
+	if (index->journal_buf_num == PHL_FILE_CACHE_JOURNAL_BUFFER) {
+		/* the journal will be rewritten by the index */
+		index->journal_lost = true;
+		return;
+	}
+
+	struct phl_file_cache_journal_record *rec = &index->journal_buf[index->journal_buf_num++];
+	rec->hash[0] = hash[0];
+	rec->hash[1] = hash[1];
+	rec->size = size;
+	rec->expire_at = expire_at;
+	rec->dir = dir;
+}
+
+/* write the buffered records in aio thread. This may be run
+ * in aio thread, so no log here. */
+static void phl_file_cache_journal_flush_work(struct phl_aio_task *task)
+{
+	/* re-open it if compacted by others */
+	if (task->fd < 0) {
+		task->fd = openat(task->dirfd, PHL_FILE_CACHE_JOURNAL_NAME,
+				O_WRONLY|O_APPEND|O_CREAT, 0644);
+		if (task->fd < 0) {
+			task->ret = -1;
+			task->err = errno;
+			return;
+		}
+		task->opened_fd = task->fd;
+	}
+
+	task->ret = write(task->fd, task->buf, task->len);
+	task->err = errno;
+}
+
+static void phl_file_cache_journal_flush_done(struct phl_aio_task *task)
+{
+	struct phl_file_cache_conf *conf = task->data;
+	struct phl_file_cache_index *index = conf->index;
+
+	if (task->opened_fd > 0) {
+		conf->journal_fd = task->opened_fd;
+	}
+
+	bool lost = false;
+	if (task->ret != task->len) {
+		_log_conf(PHL_LOG_ERROR, "write journal fail %s", strerror(task->err));
+		lost = true;
+	}
+
+	pthread_mutex_lock(&index->lock);
+	index->journal_busy = false;
+	if (lost) {
+		index->journal_lost = true;
+	} else {
+		index->journal_records += task->len / sizeof(struct phl_file_cache_journal_record);
+	}
+	pthread_mutex_unlock(&index->lock);
+
+	phl_aio_task_free(task);
+}
+
+/* take the buffered records out of lock, and write them by aio */
+static void phl_file_cache_journal_flush(struct phl_file_cache_conf *conf)
+{
+	struct phl_file_cache_index *index = conf->index;
+
+	pthread_mutex_lock(&index->lock);
+	int num = index->journal_buf_num;
+	if (num == 0 || index->journal_busy) {
+		pthread_mutex_unlock(&index->lock);
+		return;
+	}
+	size_t len = sizeof(struct phl_file_cache_journal_record) * num;
+	char *recs = malloc(len);
+	memcpy(recs, index->journal_buf, len);
+	index->journal_buf_num = 0;
+	index->journal_busy = true;
+	int generation = index->journal_generation;
+	pthread_mutex_unlock(&index->lock);
+
+	/* re-opened in aio thread if compacted by others */
+	if (conf->journal_generation != generation) {
+		if (conf->journal_fd > 0) {
+			close(conf->journal_fd);
+		}
+		conf->journal_fd = -1;
+		conf->journal_generation = generation;
+	}
+
+	struct phl_aio_task *task = phl_aio_task_new(phl_file_cache_journal_flush_work,
+			phl_file_cache_journal_flush_done, conf);
+	task->dirfd = conf->dirfd;
+	task->fd = conf->journal_fd;
+	task->buf = recs;
+	task->len = len;
+	phl_aio_submit(task);
+}
+
+static struct phl_file_cache_index_node *phl_file_cache_index_search(
+		struct phl_file_cache_index *index, const uint64_t *hash)
+{
+	wuy_nop_hlist_t *bucket = &index->buckets[hash[0] % index->hash_buckets];
+
+	struct phl_file_cache_index_node *node;
+	wuy_nop_hlist_iter_type(bucket, node, hash_node, index) {
+		if (node->hash[0] == hash[0] && node->hash[1] == hash[1]) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+static void phl_file_cache_index_free(struct phl_file_cache_index *index,
+		struct phl_file_cache_index_node *node)
+{
+	wuy_nop_hlist_delete(&node->hash_node, index);
+	wuy_nop_list_delete(&index->lru_list, &node->list_node);
+	wuy_nop_list_append(&index->free_list, &node->list_node);
+	index->total_size -= node->size;
+	index->item_num--;
+	node->size = 0;
+}
+
+/* called with the index lock held, and returns NULL if full */
+static struct phl_file_cache_index_node *phl_file_cache_index_alloc(
+		struct phl_file_cache_index *index)
+{
+	struct phl_file_cache_index_node *node;
+	wuy_nop_list_pop_type(&index->free_list, node, list_node);
+	if (node != NULL) {
+		return node;
+	}
+	if (index->used_pos < index->nodes_end) {
+		return index->used_pos++;
+	}
+	return NULL;
+}
+
+/* The item is stored into current directory, or moved from last directory,
+ * or refreshed. Zero @size or @expire_at means keeping the old value. */
+static void phl_file_cache_index_update(struct phl_file_cache_conf *conf,
+		const uint64_t *hash, size_t size, time_t expire_at)
+{
+	struct phl_file_cache_index *index = conf->index;
+	struct phl_file_cache_index_node evicted = { .size = 0 };
+
+	pthread_mutex_lock(&index->lock);
+
+	struct phl_file_cache_index_node *node = phl_file_cache_index_search(index, hash);
+	if (node != NULL) {
+		wuy_nop_list_delete(&index->lru_list, &node->list_node);
+		index->total_size -= node->size;
+		if (size == 0) {
+			size = node->size;
+		}
+		if (expire_at == 0) {
+			expire_at = node->expire_at;
+		}
+	} else {
+		if (size == 0) { /* unknown item */
+			pthread_mutex_unlock(&index->lock);
+			return;
+		}
+
+		node = phl_file_cache_index_alloc(index);
+		if (node == NULL) {
+			/* evict the least recently used one, while its file
+			 * is left to sweeper */
+			wuy_nop_list_first_type(&index->lru_list, node, list_node);
+			evicted = *node;
+			phl_file_cache_index_free(index, node);
+			phl_file_cache_journal_append(conf, evicted.hash, 0, 0, 0);
+			node = phl_file_cache_index_alloc(index);
+			atomic_fetch_add(&conf->stats->index_full, 1);
+		}
+
+		node->hash[0] = hash[0];
+		node->hash[1] = hash[1];
+		wuy_nop_hlist_insert(&index->buckets[hash[0] % index->hash_buckets],
+				&node->hash_node, index);
+		index->item_num++;
+	}
+
+	node->size = size;
+	node->expire_at = expire_at;
+	node->last_access = time(NULL);
+	node->dir = conf->current_ts;
+	wuy_nop_list_append(&index->lru_list, &node->list_node);
+	index->total_size += size;
+
+	phl_file_cache_journal_append(conf, hash, size, expire_at, node->dir);
+
+	pthread_mutex_unlock(&index->lock);
+
+	if (evicted.size != 0) {
+		if (conf->victim_num == conf->victim_capacity) {
+			conf->victim_capacity = conf->victim_capacity ? conf->victim_capacity * 2 : 64;
+			conf->victims = realloc(conf->victims, sizeof(struct
+						phl_file_cache_victim) * conf->victim_capacity);
+		}
+		struct phl_file_cache_victim *victim = &conf->victims[conf->victim_num++];
+		victim->hash[0] = evicted.hash[0];
+		victim->hash[1] = evicted.hash[1];
+		victim->dir = evicted.dir;
+	}
+}
+
+/* the item is hit in current directory. Returns false if it is not
+ * in the index, e.g. evicted by the sweeper in another worker */
+static bool phl_file_cache_index_touch(struct phl_file_cache_conf *conf,
+		const uint64_t *hash)
+{
+	struct phl_file_cache_index *index = conf->index;
+
+	pthread_mutex_lock(&index->lock);
+
+	struct phl_file_cache_index_node *node = phl_file_cache_index_search(index, hash);
+	if (node != NULL) {
+		node->last_access = time(NULL);
+		wuy_nop_list_delete(&index->lru_list, &node->list_node);
+		wuy_nop_list_append(&index->lru_list, &node->list_node);
+	}
+
+	pthread_mutex_unlock(&index->lock);
+
+	return node != NULL;
+}
+
+/* the item is removed from disk by caller */
+static void phl_file_cache_index_remove(struct phl_file_cache_conf *conf,
+		const uint64_t *hash)
+{
+	struct phl_file_cache_index *index = conf->index;
+
+	pthread_mutex_lock(&index->lock);
+
+	struct phl_file_cache_index_node *node = phl_file_cache_index_search(index, hash);
+	if (node != NULL) {
+		phl_file_cache_index_free(index, node);
+		phl_file_cache_journal_append(conf, hash, 0, 0, 0);
+	}
+
+	pthread_mutex_unlock(&index->lock);
+}
+
+/* the directory is deleted, so drop all its items */
+static void phl_file_cache_index_purge_dir(struct phl_file_cache_conf *conf, time_t dir)
+{
+	struct phl_file_cache_index *index = conf->index;
+	int count = 0;
+
+	pthread_mutex_lock(&index->lock);
+
+	for (struct phl_file_cache_index_node *node = index->nodes_start;
+			node < index->used_pos; node++) {
+		if (node->size != 0 && node->dir == dir) {
+			phl_file_cache_index_free(index, node);
+			count++;
+		}
+	}
+
+	pthread_mutex_unlock(&index->lock);
+
+	/* no journal record because the journal loading skips
+	 * items in deleted directories */
+
+	_log_conf(PHL_LOG_INFO, "purge %d items in deleted directory", count);
+}
+
+/* write the temporary file, and replace. This may be run
+ * in aio thread, so no log here. */
+static void phl_file_cache_journal_compact_work(struct phl_aio_task *task)
+{
+	const char *tmpname = PHL_FILE_CACHE_JOURNAL_NAME ".tmp";
+	int fd = openat(task->dirfd, tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		task->ret = -1;
+		task->err = errno;
+		return;
+	}
+	task->ret = write(fd, task->buf, task->len);
+	task->err = errno;
+	close(fd);
+	if (task->ret != task->len) {
+		unlinkat(task->dirfd, tmpname, 0);
+		return;
+	}
+	if (renameat(task->dirfd, tmpname, task->dirfd, PHL_FILE_CACHE_JOURNAL_NAME) < 0) {
+		task->ret = -1;
+		task->err = errno;
+	}
+}
+
+static void phl_file_cache_journal_compact_done(struct phl_aio_task *task)
+{
+	struct phl_file_cache_conf *conf = task->data;
+	struct phl_file_cache_index *index = conf->index;
+
+	int num = task->len / sizeof(struct phl_file_cache_journal_record);
+	bool done = task->ret == task->len;
+	if (done) {
+		_log_conf(PHL_LOG_INFO, "journal compacted, %d records", num);
+		atomic_fetch_add(&conf->stats->journal_compact, 1);
+	} else {
+		_log_conf(PHL_LOG_ERROR, "compact journal fail %s", strerror(task->err));
+	}
+
+	pthread_mutex_lock(&index->lock);
+	index->journal_busy = false;
+	if (done) {
+		index->journal_generation++;
+		index->journal_records = num;
+	} else {
+		/* the dropped buffered records are lost, so retry */
+		index->journal_lost = true;
+	}
+	pthread_mutex_unlock(&index->lock);
+
+	phl_aio_task_free(task);
+}
+
+/* rewrite the journal by the current index */
+static void phl_file_cache_journal_compact(struct phl_file_cache_conf *conf)
+{
+	struct phl_file_cache_index *index = conf->index;
+
+	pthread_mutex_lock(&index->lock);
+	if (index->journal_busy) {
+		pthread_mutex_unlock(&index->lock);
+		return;
+	}
+	index->journal_busy = true;
+
+	/* snapshot */
+	int num = 0;
+	struct phl_file_cache_journal_record *recs = malloc(
+			sizeof(struct phl_file_cache_journal_record) * (index->item_num + 1));
+	for (struct phl_file_cache_index_node *node = index->nodes_start;
+			node < index->used_pos; node++) {
+		if (node->size == 0) {
+			continue;
+		}
+		struct phl_file_cache_journal_record *rec = &recs[num++];
+		rec->hash[0] = node->hash[0];
+		rec->hash[1] = node->hash[1];
+		rec->size = node->size;
+		rec->expire_at = node->expire_at;
+		rec->dir = node->dir;
+	}
+
+	/* the buffered records are included in the snapshot, and the
+	 * later ones are buffered until the new journal is in place */
+	index->journal_buf_num = 0;
+	index->journal_lost = false;
+
+	pthread_mutex_unlock(&index->lock);
+
+	/* write out of lock */
+	struct phl_aio_task *task = phl_aio_task_new(phl_file_cache_journal_compact_work,
+			phl_file_cache_journal_compact_done, conf);
+	task->dirfd = conf->dirfd;
+	task->buf = (char *)recs;
+	task->len = sizeof(struct phl_file_cache_journal_record) * num;
+	phl_aio_submit(task);
+}
+
+/* Only one worker sweeps the index and writes the journal.
+ * Claim it if the owner is gone, like the notifiers. */
+static bool phl_file_cache_sweeper_claim(struct phl_file_cache_index *index)
+{
+	int pid = atomic_load(&index->sweeper_pid);
+	if (pid == phl_pid) {
+		return true;
+	}
+	if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH)) {
+		return false;
+	}
+	return atomic_compare_exchange_strong(&index->sweeper_pid, &pid, phl_pid);
+}
+
+static int64_t phl_file_cache_sweep(int64_t at, void *data)
+{
+	struct phl_file_cache_conf *conf = data;
+	struct phl_file_cache_index *index = conf->index;
+
+	/* the files evicted by phl_file_cache_index_update() in this worker */
+	for (int i = 0; i < conf->victim_num; i++) {
+		struct phl_file_cache_victim *victim = &conf->victims[i];
+		phl_file_cache_index_unlink(conf, victim->hash, victim->dir);
+	}
+	conf->victim_num = 0;
+
+	if (!phl_file_cache_sweeper_claim(index)) {
+		return PHL_FILE_CACHE_SWEEP_INTERVAL;
+	}
+
+	/* keep some free nodes so phl_file_cache_index_update()
+	 * evicts rarely */
+	size_t max_size = (size_t)conf->max_size * 1024 * 1024;
+	size_t low_size = max_size / 100 * 95;
+	int max_items = conf->index_max_items / 100 * 95;
+	int low_items = conf->index_max_items / 100 * 90;
+
+	while (index->total_size > max_size || index->item_num > max_items) {
+		/* pop a batch under lock, and unlink them out of lock */
+		struct phl_file_cache_index_node batch[PHL_FILE_CACHE_SWEEP_BATCH];
+		int num = 0;
+
+		pthread_mutex_lock(&index->lock);
+		struct phl_file_cache_index_node *node;
+		while (num < PHL_FILE_CACHE_SWEEP_BATCH
+				&& (index->total_size > low_size || index->item_num > low_items)
+				&& wuy_nop_list_first_type(&index->lru_list, node, list_node)) {
+			batch[num] = *node;
+			phl_file_cache_index_free(index, node);
+			phl_file_cache_journal_append(conf, batch[num].hash, 0, 0, 0);
+			num++;
+		}
+		pthread_mutex_unlock(&index->lock);
+
+		if (num == 0) {
+			break;
+		}
+
+		for (int i = 0; i < num; i++) {
+			phl_file_cache_index_unlink(conf, batch[i].hash, batch[i].dir);
+		}
+
+		_log_conf(PHL_LOG_DEBUG, "sweep %d items", num);
+		atomic_fetch_add(&conf->stats->index_evict, num);
+
+		if (num < PHL_FILE_CACHE_SWEEP_BATCH) {
+			break;
+		}
+	}
+
+	if (index->journal_lost || index->journal_records > index->item_num * 2 + 10000) {
+		phl_file_cache_journal_compact(conf);
+	} else {
+		phl_file_cache_journal_flush(conf);
+	}
+
+	return PHL_FILE_CACHE_SWEEP_INTERVAL;
+}
+
+/* load the index from journal, only at the first time */
+static void phl_file_cache_journal_load(struct phl_file_cache_conf *conf)
+{
+	struct phl_file_cache_index *index = conf->index;
+
+	int fd = openat(conf->dirfd, PHL_FILE_CACHE_JOURNAL_NAME, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+
+	time_t now = time(NULL);
+	int count = 0;
+	struct phl_file_cache_journal_record recs[1024];
+	ssize_t ret;
+	while ((ret = read(fd, recs, sizeof(recs))) > 0) {
+		int num = ret / sizeof(struct phl_file_cache_journal_record);
+		for (int i = 0; i < num; i++) {
+			struct phl_file_cache_journal_record *rec = &recs[i];
+			count++;
+
+			struct phl_file_cache_index_node *node = phl_file_cache_index_search(index, rec->hash);
+			if (node != NULL) {
+				phl_file_cache_index_free(index, node);
+			}
+			if (rec->size == 0) {
+				continue;
+			}
+			if (rec->dir != conf->current_ts && rec->dir != conf->last_ts) {
+				continue;
+			}
+
+			node = phl_file_cache_index_alloc(index);
+			if (node == NULL) {
+				continue;
+			}
+			node->hash[0] = rec->hash[0];
+			node->hash[1] = rec->hash[1];
+			node->size = rec->size;
+			node->expire_at = rec->expire_at;
+			node->last_access = now;
+			node->dir = rec->dir;
+			wuy_nop_hlist_insert(&index->buckets[rec->hash[0] % index->hash_buckets],
+					&node->hash_node, index);
+			wuy_nop_list_append(&index->lru_list, &node->list_node);
+			index->total_size += node->size;
+			index->item_num++;
+		}
+	}
+	close(fd);
+
+	index->journal_records = count;
+
+	_log_conf(PHL_LOG_INFO, "load journal %d records, %d items, %zu bytes",
+			count, index->item_num, index->total_size);
+}
+
+static void phl_file_cache_index_init(struct phl_file_cache_conf *conf)
+{
+	int hash_buckets = conf->index_max_items / 2 + 1;
+	size_t head_size = sizeof(struct phl_file_cache_index)
+			+ sizeof(wuy_nop_hlist_t) * hash_buckets;
+
+	size_t nodes_size = sizeof(struct phl_file_cache_index_node) * conf->index_max_items;
+
+	conf->index = wuy_shmpool_alloc(head_size + nodes_size + sizeof(struct
+				phl_file_cache_journal_record) * PHL_FILE_CACHE_JOURNAL_BUFFER);
+	conf->journal_generation = -1; /* open it at the first flush */
+
+	conf->sweep_timer = loop_timer_new(phl_loop, phl_file_cache_sweep, conf);
+	loop_timer_set_after(conf->sweep_timer, PHL_FILE_CACHE_SWEEP_INTERVAL);
+
+	struct phl_file_cache_index *index = conf->index;
+	if (index->has_inited) {
+		return;
+	}
+	index->has_inited = true;
+	index->hash_buckets = hash_buckets;
+	index->nodes_start = (struct phl_file_cache_index_node *)((char *)index + head_size);
+	index->used_pos = index->nodes_start;
+	index->nodes_end = index->nodes_start + conf->index_max_items;
+	index->journal_buf = (struct phl_file_cache_journal_record *)((char *)index + head_size + nodes_size);
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, 1);
+	pthread_mutex_init(&index->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	phl_file_cache_journal_load(conf);
+
+	/* rewrite it to drop the deleted items */
+	phl_file_cache_journal_compact(conf);
+}
+
+/* === cache lock
+ *
+ * Only one request fetches an item from upstream if missing, while
+ * other requests for the same key, in any worker, wait until the item
+ * is stored or the lock times out. The waiter marks its worker's
+ * notifier in the lock, and is woken up when the lock is released. */
+
+/* returns PHL_OK if acquired, PHL_AGAIN if held by others,
+ * or PHL_ERROR if no free slot. The caller is to be notified
+ * when the lock is released if @wait is set. */
+static int phl_file_cache_lock_acquire(struct phl_file_cache_conf *conf,
+		struct phl_file_cache_ctx *ctx, int timeout, bool wait)
+{
+	struct phl_file_cache_locks *locks = conf->locks;
+	long now = wuy_time_ms();
+	struct phl_file_cache_lock *idle = NULL;
+
+	pthread_mutex_lock(&locks->lock);
+
+	for (int i = 0; i < PHL_FILE_CACHE_LOCK_PROBES; i++) {
+		struct phl_file_cache_lock *lock = &locks->slots[(ctx->hash[0] + i) % PHL_FILE_CACHE_LOCK_SLOTS];
+		if (lock->expire_at < now) {
+			if (idle == NULL) {
+				idle = lock;
+			}
+			continue;
+		}
+		if (lock->hash[0] == ctx->hash[0] && lock->hash[1] == ctx->hash[1]) {
+			if (wait && phl_file_cache_notifier_index >= 0) {
+				lock->waiters |= 1ULL << phl_file_cache_notifier_index;
+			}
+			pthread_mutex_unlock(&locks->lock);
+			return PHL_AGAIN;
+		}
+	}
+
+	if (idle == NULL) {
+		pthread_mutex_unlock(&locks->lock);
+		atomic_fetch_add(&conf->stats->lock_full, 1);
+		return PHL_ERROR;
+	}
+
+	idle->hash[0] = ctx->hash[0];
+	idle->hash[1] = ctx->hash[1];
+	idle->expire_at = now + timeout * 1000;
+
+	pthread_mutex_unlock(&locks->lock);
+
+	ctx->lock = idle;
+	return PHL_OK;
+}
+
+static void phl_file_cache_lock_do_release(struct phl_file_cache_conf *conf,
+		struct phl_file_cache_lock *lock, const uint64_t *hash)
+{
+	uint64_t waiters = 0;
+
+	pthread_mutex_lock(&conf->locks->lock);
+	/* the lock may have expired and been taken by others */
+	if (lock->hash[0] == hash[0] && lock->hash[1] == hash[1]) {
+		lock->expire_at = 0;
+		waiters = lock->waiters;
+		lock->waiters = 0;
+	}
+	pthread_mutex_unlock(&conf->locks->lock);
+
+	/* notify out of lock, even to this worker, so the waiters
+	 * are not run inside the current request */
+	uint64_t one = 1;
+	for (int i = 0; waiters != 0; i++, waiters >>= 1) {
+		if ((waiters & 1) && write(phl_file_cache_notifiers[i].fd, &one, sizeof(one)) < 0) {
+			/* the counter is overflow, never happen */
+		}
+	}
+}
+
+static void phl_file_cache_lock_release(struct phl_file_cache_conf *conf,
+		struct phl_file_cache_ctx *ctx)
+{
+	if (ctx->lock == NULL) {
+		return;
+	}
+	phl_file_cache_lock_do_release(conf, ctx->lock, ctx->hash);
+	ctx->lock = NULL;
+}
+
+static int64_t phl_file_cache_lock_poll(int64_t at, void *data)
+{
+	struct phl_request *r = data;
+	struct phl_file_cache_ctx *ctx = r->module_ctxs[phl_file_cache_module.index];
+	wuy_list_del_if(&ctx->lock_wait_node);
+	phl_request_run(r, "file_cache lock poll");
+	return 0;
+}
+
+/* some lock is released, so wake up all waiters in this worker,
+ * and they try again */
+static void phl_file_cache_notifier_on_readable(loop_stream_t *s)
+{
+	uint64_t count;
+	if (read(phl_file_cache_notifiers[phl_file_cache_notifier_index].fd,
+				&count, sizeof(count)) < 0) {
+		return;
+	}
+
+	/* move them out first, because they may wait again */
+	WUY_LIST(wakes);
+	struct phl_file_cache_ctx *ctx;
+	while (wuy_list_pop_type(&phl_file_cache_lock_waiters, ctx, lock_wait_node)) {
+		wuy_list_append(&wakes, &ctx->lock_wait_node);
+	}
+	while (wuy_list_pop_type(&wakes, ctx, lock_wait_node)) {
+		loop_timer_delete(ctx->lock_timer);
+		ctx->lock_timer = NULL;
+		phl_request_run(ctx->r, "file_cache lock released");
+	}
+}
+
+static loop_stream_ops_t phl_file_cache_notifier_ops = {
+	.on_readable = phl_file_cache_notifier_on_readable,
+};
+
+/* in master, before forking workers */
+static void phl_file_cache_notifiers_init(void)
+{
+	if (phl_file_cache_notifiers != NULL || phl_in_worker) {
+		return;
+	}
+
+	size_t size = sizeof(struct phl_file_cache_notifier) * PHL_FILE_CACHE_NOTIFIERS;
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		phl_conf_log(PHL_LOG_ERROR, "file_cache: fail to mmap notifiers %s", strerror(errno));
+		return;
+	}
+
+	phl_file_cache_notifiers = p;
+	for (int i = 0; i < PHL_FILE_CACHE_NOTIFIERS; i++) {
+		phl_file_cache_notifiers[i].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	}
+}
+
+/* claim a notifier whose owner is gone */
+static void phl_file_cache_worker_init(void)
+{
+	if (phl_file_cache_notifiers == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < PHL_FILE_CACHE_NOTIFIERS; i++) {
+		struct phl_file_cache_notifier *notifier = &phl_file_cache_notifiers[i];
+		if (notifier->fd < 0) {
+			continue;
+		}
+		int pid = atomic_load(&notifier->pid);
+		if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH)) {
+			continue;
+		}
+		if (!atomic_compare_exchange_strong(&notifier->pid, &pid, phl_pid)) {
+			continue;
+		}
+
+		/* clear the notifications to the last owner */
+		uint64_t count;
+		if (read(notifier->fd, &count, sizeof(count)) < 0) {
+			/* no notification */
+		}
+
+		loop_stream_new(phl_loop, notifier->fd, &phl_file_cache_notifier_ops, false);
+		phl_file_cache_notifier_index = i;
+		return;
+	}
+
+	phl_conf_log(PHL_LOG_INFO, "file_cache: no free notifier, so poll the lock");
+}
+
+static void phl_file_cache_locks_init(struct phl_file_cache_conf *conf)
+{
+	conf->locks = wuy_shmpool_alloc(sizeof(struct phl_file_cache_locks));
+
+	struct phl_file_cache_locks *locks = conf->locks;
+	if (locks->has_inited) {
+		return;
+	}
+	locks->has_inited = true;
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, 1);
+	pthread_mutex_init(&locks->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/* === disk I/O, maybe in aio thread
+ *
+ * Looking up the item file, including moving it from last directory,
+ * is done in one aio task. The body is written by a series of aio
+ * tasks, and the item is finished after all of them are done. */
+
+/* This may be run in aio thread, so no log here. Returns the lookup,
+ * which may be reallocated to read more. */
+static struct phl_file_cache_lookup *phl_file_cache_lookup_do(
+		struct phl_file_cache_lookup *lookup)
+{
+	lookup->fd = openat(lookup->current_dirfd, lookup->filename, O_RDONLY);
+	if (lookup->fd >= 0) {
+		lookup->hit = PHL_FILE_CACHE_LOOKUP_CURRENT;
+
+	} else if (lookup->last_dirfd > 0) {
+		lookup->fd = openat(lookup->last_dirfd, lookup->filename, O_RDONLY);
+		if (lookup->fd < 0) {
+			return lookup;
+		}
+		lookup->hit = PHL_FILE_CACHE_LOOKUP_LAST;
+
+		lookup->moved = renameat(lookup->last_dirfd, lookup->filename,
+				lookup->current_dirfd, lookup->filename) == 0;
+		if (!lookup->moved && errno == ENOENT && lookup->dir_level > 0) {
+			phl_file_cache_do_prepare_prefix(lookup->current_dirfd,
+					lookup->filename, lookup->dir_level);
+			lookup->moved = renameat(lookup->last_dirfd, lookup->filename,
+					lookup->current_dirfd, lookup->filename) == 0;
+		}
+		if (!lookup->moved) {
+			lookup->err = errno;
+		}
+
+	} else {
+		return lookup;
+	}
+
+	fstat(lookup->fd, &lookup->st);
+	lookup->read_len = read(lookup->fd, lookup->data, lookup->data_size);
+	if (lookup->read_len < 0) {
+		lookup->err = errno;
+		return lookup;
+	}
+	if (lookup->read_len < sizeof(struct phl_file_cache_item)) {
+		return lookup;
+	}
+
+	/* read all headers, and the body too if small enough for the
+	 * memory tier, so there is no more reading in phl_loop */
+	struct phl_file_cache_item *item = (struct phl_file_cache_item *)lookup->data;
+	if (item->content_length == PHL_CONTENT_LENGTH_INIT) {
+		return lookup;
+	}
+	size_t length = sizeof(struct phl_file_cache_item) + item->header_total_length;
+	if (length + item->content_length <= lookup->memory_item_max) {
+		length += item->content_length;
+	}
+	if (length <= lookup->read_len) {
+		return lookup;
+	}
+
+	lookup = realloc(lookup, sizeof(struct phl_file_cache_lookup) + length);
+	lookup->data_size = length;
+	ssize_t ret = pread(lookup->fd, lookup->data + lookup->read_len,
+			length - lookup->read_len, lookup->read_len);
+	if (ret < 0) {
+		lookup->read_len = -1;
+		lookup->err = errno;
+	} else {
+		lookup->read_len += ret;
+	}
+	return lookup;
+}
+
+static void phl_file_cache_lookup_work(struct phl_aio_task *task)
+{
+	struct phl_file_cache_lookup *lookup = phl_file_cache_lookup_do(
+			(struct phl_file_cache_lookup *)task->buf);
+	task->buf = (char *)lookup;
+	task->opened_fd = lookup->fd;
+	task->ret = lookup->read_len;
+}
+
+/* returns PHL_OK with ctx->lookup set, or PHL_AGAIN if in aio */
+static int phl_file_cache_lookup(struct phl_request *r)
+{
+	struct phl_file_cache_conf *conf = r->conf_path->module_confs[phl_file_cache_module.index];
+	struct phl_file_cache_ctx *ctx = r->module_ctxs[phl_file_cache_module.index];
+
+	struct phl_aio_task *task = ctx->lookup_task;
+	if (task != NULL) {
+		if (!task->finished) {
+			return PHL_AGAIN;
+		}
+		ctx->lookup_task = NULL;
+		goto done;
+	}
+
+	struct phl_file_cache_lookup *lookup = calloc(1, sizeof(struct
+				phl_file_cache_lookup) + PHL_FILE_CACHE_LOOKUP_READ);
+	lookup->current_dirfd = conf->current_dirfd;
+	lookup->last_dirfd = conf->last_dirfd;
+	lookup->dir_level = conf->dir_level;
+	lookup->memory_item_max = conf->memory != NULL ? conf->memory_item_max : 0;
+	lookup->data_size = PHL_FILE_CACHE_LOOKUP_READ;
+	strcpy(lookup->filename, ctx->filename);
+
+	task = phl_aio_task_new(phl_file_cache_lookup_work, phl_aio_done_request, r);
+	task->buf = (char *)lookup;
+
+	if (!phl_aio_is_enabled()) {
+		phl_file_cache_lookup_work(task);
+		goto done;
+	}
+
+	phl_aio_submit(task);
+	ctx->lookup_task = task;
+	return PHL_AGAIN;
+
+done:
+	lookup = (struct phl_file_cache_lookup *)task->buf;
+	size_t size = sizeof(struct phl_file_cache_lookup);
+	if (lookup->read_len > 0) {
+		size += lookup->read_len;
+	}
+	ctx->lookup = wuy_pool_alloc(r->pool, size);
+	memcpy(ctx->lookup, lookup, size);
+	phl_aio_task_free(task);
+	return PHL_OK;
+}
+
+static void phl_file_cache_store_free(struct phl_file_cache_store *store)
+{
+	if (store->fd >= 0) {
+		close(store->fd);
+	}
+	if (store->lock != NULL) {
+		phl_file_cache_lock_do_release(store->conf, store->lock, store->hash);
+	}
+	free(store->queued);
+	free(store);
+}
+
+static void phl_file_cache_store_remove_done(struct phl_aio_task *task)
+{
+	struct phl_file_cache_store *store = task->data;
+	phl_aio_task_free(task);
+	phl_file_cache_store_free(store);
+}
+
+/* remove the failed file, and release the lock after that */
+static void phl_file_cache_store_remove(struct phl_file_cache_store *store)
+{
+	struct phl_aio_task *task = phl_aio_task_new(phl_aio_work_unlink,
+			phl_file_cache_store_remove_done, store);
+	task->dirfd = store->conf->current_dirfd;
+	task->path = strdup(store->filename);
+	phl_aio_submit(task);
+}
+
+static void phl_file_cache_store_mark_done(struct phl_aio_task *task)
+{
+	struct phl_file_cache_store *store = task->data;
+	struct phl_file_cache_conf *conf = store->conf;
+
+	if (task->ret != task->len) {
+		_log_conf(PHL_LOG_ERROR, "mark finished fail %s %s",
+				store->filename, strerror(task->err));
+		atomic_fetch_add(&conf->stats->store_fail, 1);
+		phl_aio_task_free(task);
+		phl_file_cache_store_remove(store);
+		return;
+	}
+
+	atomic_fetch_add(&conf->stats->store_ok, 1);
+
+	if (conf->index != NULL) {
+		phl_file_cache_index_update(conf, store->hash, store->header_length
+				+ store->content_length, store->expire_at);
+	}
+
+	phl_aio_task_free(task);
+	phl_file_cache_store_free(store);
+}
+
+static void phl_file_cache_store_close(struct phl_file_cache_store *store)
+{
+	struct phl_file_cache_conf *conf = store->conf;
+
+	if (store->finished && !store->failed && !store->aborted) {
+		/* mark finished, and the lock is released after that */
+		struct phl_aio_task *task = phl_aio_task_new(phl_aio_work_write,
+				phl_file_cache_store_mark_done, store);
+		task->fd = store->fd;
+		task->buf = malloc(sizeof(size_t));
+		memcpy(task->buf, &store->content_length, sizeof(size_t));
+		task->len = sizeof(size_t);
+		task->offset = offsetof(struct phl_file_cache_item, content_length);
+		phl_aio_submit(task);
+		return;
+	}
+
+	atomic_fetch_add(&conf->stats->store_fail, 1);
+	if (store->fd >= 0) { /* not created by others */
+		phl_file_cache_store_remove(store);
+		return;
+	}
+	phl_file_cache_store_free(store);
+}
+
+static void phl_file_cache_store_check(struct phl_file_cache_store *store)
+{
+	if (store->pending == 0 && (store->finished || store->aborted)) {
+		phl_file_cache_store_close(store);
+	}
+}
+
+static void phl_file_cache_store_write_done(struct phl_aio_task *task)
+{
+	struct phl_file_cache_store *store = task->data;
+	struct phl_file_cache_conf *conf = store->conf;
+
+	if (task->ret != task->len) {
+		_log_conf(PHL_LOG_ERROR, "write body fail %s %s",
+				store->filename, strerror(task->err));
+		store->failed = true;
+	}
+
+	phl_aio_task_free(task);
+
+	store->pending--;
+	phl_file_cache_store_check(store);
+}
+
+static void phl_file_cache_store_write(struct phl_file_cache_store *store,
+		const uint8_t *data, int data_len)
+{
+	if (store->failed || data_len == 0) {
+		return;
+	}
+
+	struct phl_aio_task *task = phl_aio_task_new(phl_aio_work_write,
+			phl_file_cache_store_write_done, store);
+	task->fd = store->fd;
+	task->buf = malloc(data_len);
+	memcpy(task->buf, data, data_len);
+	task->len = data_len;
+	task->offset = store->offset;
+
+	store->offset += data_len;
+	store->pending++;
+
+	/* submit it after the file is created */
+	if (!store->created) {
+		if (store->queued_num == store->queued_capacity) {
+			store->queued_capacity = store->queued_capacity ? store->queued_capacity * 2 : 8;
+			store->queued = realloc(store->queued, sizeof(struct
+						phl_aio_task *) * store->queued_capacity);
+		}
+		store->queued[store->queued_num++] = task;
+		return;
+	}
+
+	/* the done handler is called synchronously if aio is not enabled */
+	phl_aio_submit(task);
+}
+
+/* create the item file and write the headers. This may be run
+ * in aio thread, so no log here. */
+static void phl_file_cache_store_create_work(struct phl_aio_task *task)
+{
+	struct phl_file_cache_store *store = task->data;
+	int dir_level = store->conf->dir_level;
+
+	/* in the same task, so before the creating */
+	if (store->replace) {
+		unlinkat(task->dirfd, task->path, 0);
+	}
+
+	task->fd = openat(task->dirfd, task->path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+	if (task->fd < 0 && errno == ENOENT && dir_level > 0) {
+		phl_file_cache_do_prepare_prefix(task->dirfd, task->path, dir_level);
+		task->fd = openat(task->dirfd, task->path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+	}
+	if (task->fd < 0) {
+		task->ret = -1;
+		task->err = errno;
+		return;
+	}
+	task->opened_fd = task->fd;
+
+	task->ret = write(task->fd, task->buf, task->len);
+	task->err = errno;
+}
+
+static void phl_file_cache_store_create_done(struct phl_aio_task *task)
+{
+	struct phl_file_cache_store *store = task->data;
+	struct phl_file_cache_conf *conf = store->conf;
+
+	store->created = true;
+	store->fd = task->fd;
+	if (task->ret != task->len) {
+		_log_conf(PHL_LOG_ERROR, "create item fail %s %s",
+				store->filename, strerror(task->err));
+		store->failed = true;
+	}
+
+	phl_aio_task_free(task);
+
+	/* submit the queued writes. Hold the store by the pending
+	 * count, because the done handlers may be called here. */
+	for (int i = 0; i < store->queued_num; i++) {
+		struct phl_aio_task *write_task = store->queued[i];
+		if (store->failed || store->aborted) {
+			phl_aio_task_free(write_task);
+			store->pending--;
+			continue;
+		}
+		write_task->fd = store->fd;
+		phl_aio_submit(write_task);
+	}
+	store->queued_num = 0;
+
+	store->pending--; /* for the creating */
+	phl_file_cache_store_check(store);
+}
+
+static void phl_file_cache_store_finish(struct phl_file_cache_store *store,
+		size_t content_length)
+{
+	store->content_length = content_length;
+	store->finished = true;
+	phl_file_cache_store_check(store);
+}
+
+static void phl_file_cache_store_abort(struct phl_file_cache_store *store)
+{
+	store->aborted = true;
+	phl_file_cache_store_check(store);
+}
+
+
+/* === module handlers */
+
+static void phl_file_cache_ctx_free(struct phl_request *r)
+{
+	struct phl_file_cache_conf *conf = r->conf_path->module_confs[phl_file_cache_module.index];
+	struct phl_file_cache_ctx *ctx = r->module_ctxs[phl_file_cache_module.index];
+
+	if (ctx->fd > 0) {
+		close(ctx->fd);
+	}
+	if (ctx->stale_fd > 0) {
+		close(ctx->stale_fd);
+	}
+	if (ctx->lookup_task != NULL) {
+		phl_aio_cancel(ctx->lookup_task);
+	}
+	if (ctx->entry != NULL) {
+		phl_open_cache_put(ctx->entry);
+	}
+	if (ctx->store != NULL) {
+		phl_file_cache_store_abort(ctx->store);
+	}
+	if (ctx->lock_timer != NULL) {
+		loop_timer_delete(ctx->lock_timer);
+	}
+	wuy_list_del_if(&ctx->lock_wait_node);
+	if (ctx->replace_file) { /* not stored */
+		phl_file_cache_unlink(conf->current_dirfd, ctx->filename);
+	}
+	phl_file_cache_lock_release(conf, ctx);
+}
+
+static void phl_file_cache_abort(struct phl_request *r)
+{
+	phl_file_cache_ctx_free(r);
+	r->module_ctxs[phl_file_cache_module.index] = NULL;
+}
+
+static void phl_file_cache_load_headers(struct phl_request *r,
+		struct phl_file_cache_item *item, char *buf_pos)
+{
+	for (int i = 0; i < item->header_num; i++) {
+		struct phl_header *h = phl_header_load_from(buf_pos);
+		phl_header_add(&r->resp.headers, h->str, h->name_len,
+				phl_header_value(h), h->value_len, r->pool);
+		buf_pos += phl_header_dump_length(h);
+	}
+}
+
+/* serve the item that has been loaded in memory totally */
+static int phl_file_cache_serve_memory(struct phl_request *r,
+		struct phl_file_cache_item *item, char *headers, const char *body)
+{
+	phl_file_cache_load_headers(r, item, headers);
+
+	r->resp.content_length = item->content_length;
+	r->resp.easy_string = body;
+	r->resp.easy_str_len = item->content_length;
+
+	return item->status_code;
+}
+
+/* Serve the item whose fd and meta are cached in phl_open_cache.
+ * Returns 0 if miss. */
+static int phl_file_cache_serve_open_cache(struct phl_request *r)
+{
+	struct phl_file_cache_conf *conf = r->conf_path->module_confs[phl_file_cache_module.index];
+	struct phl_file_cache_ctx *ctx = r->module_ctxs[phl_file_cache_module.index];
+
+	struct phl_open_cache_entry *entry = phl_open_cache_get(conf->current_dirfd, ctx->filename);
+	if (entry == NULL) {
+		return 0;
+	}
+
+	/* leave the expired one to the routine on disk, and drop the one
+	 * removed from index, whose file may have been unlinked by the
+	 * sweeper in other worker */
+	struct phl_file_cache_item *item = entry->data;
+	if (item == NULL || item->expire_at < time(NULL)
+			|| (conf->index != NULL && !phl_file_cache_index_touch(conf, ctx->hash))) {
+		phl_open_cache_put(entry);
+		phl_open_cache_remove(conf->current_dirfd, ctx->filename);
+		return 0;
+	}
+
+	_log(PHL_LOG_DEBUG, "hit open cache");
+	atomic_fetch_add(&conf->stats->hit_current, 1);
+
+	ctx->entry = entry;
+
+	phl_file_cache_load_headers(r, item, (char *)(item + 1));
+
+	r->resp.content_length = item->content_length;
+	r->resp.easy_fd = entry->fd;
+	r->resp.easy_fd_offset = sizeof(struct phl_file_cache_item) + item->header_total_length;
+
+	return item->status_code;
 }
 
-static void phl_file_cache_prepare_prefix(struct phl_file_cache_conf *conf,
-		const char *filename)
+/* returns seconds to expire, or -1 if not cacheable */
+static time_t phl_file_cache_parse_expire(struct phl_request *r,
+		struct phl_file_cache_conf *conf, struct phl_file_cache_item *item)
 {
-	if (conf->dir_level == 0) {
-		return;
+	time_t max_age = -1, expires = -1;
+
+	item->stale_while_revalidate = conf->stale_while_revalidate;
+	item->stale_if_error = conf->stale_if_error;
+
+	struct phl_header *h;
+	phl_header_iter(&r->resp.headers, h) {
+		const char *value = phl_header_value(h);
+		if (strcasecmp(h->str, "Cache-Control") == 0) {
+			const char *p = value;
+			while (p != NULL) {
+				while (*p == ' ' || *p == ',') {
+					p++;
+				}
+				if (strncasecmp(p, "max-age=", 8) == 0) {
+					max_age = atoi(p + 8);
+				} else if (strncasecmp(p, "s-maxage=", 9) == 0) {
+					max_age = atoi(p + 9);
+				} else if (strncasecmp(p, "stale-while-revalidate=", 23) == 0) {
+					item->stale_while_revalidate = atoi(p + 23);
+				} else if (strncasecmp(p, "stale-if-error=", 15) == 0) {
+					item->stale_if_error = atoi(p + 15);
+				} else if (strncasecmp(p, "no-store", 8) == 0
+						|| strncasecmp(p, "no-cache", 8) == 0
+						|| strncasecmp(p, "private", 7) == 0) {
+					return -1;
+				}
+				p = strchr(p, ',');
+			}
+		} else if (strcasecmp(h->str, "Expires") == 0) {
+			expires = wuy_http_date_parse(value) - time(NULL);
+		}
 	}
 
-	if (!phl_file_cache_do_prepare_prefix(conf->current_dirfd,
-				filename, conf->dir_level)) {
-		_log_conf(PHL_LOG_ERROR, "prepare prefix for %s: %s",
-				filename, strerror(errno));
+	if (max_age != -1) {
+		return max_age;
+	}
+	if (expires != -1) {
+		return expires;
 	}
+	return conf->default_expire;
 }
 
-static bool phl_file_cache_rename_file(struct phl_file_cache_conf *conf,
-		const char *filename)
+/* revalidate the stale item by a detached subrequest in background */
+static void phl_file_cache_refresh(struct phl_request *r)
 {
-	_log_conf(PHL_LOG_DEBUG, "move to current directory %s", filename);
+	struct phl_file_cache_conf *conf = r->conf_path->module_confs[phl_file_cache_module.index];
+	struct phl_file_cache_ctx *ctx = r->module_ctxs[phl_file_cache_module.index];
 
-	if (renameat(conf->last_dirfd, filename, conf->current_dirfd, filename) == 0) {
-		return true;
+	/* only one refresh for one item, whether lock_timeout is set or not */
+	if (phl_file_cache_lock_acquire(conf, ctx, PHL_FILE_CACHE_REFRESH_LOCK_TIMEOUT, false) != PHL_OK) {
+		_log(PHL_LOG_DEBUG, "refresh in process");
+		return;
 	}
-	if (errno != ENOENT) {
-		_log_conf(PHL_LOG_ERROR, "fail to move %s", strerror(errno));
-		return false;
+
+	struct phl_request *subr = phl_request_subr_new(r, r->req.uri.raw);
+	if (subr == NULL) {
+		phl_file_cache_lock_release(conf, ctx);
+		return;
 	}
 
-	phl_file_cache_prepare_prefix(conf, filename);
+	_log(PHL_LOG_DEBUG, "refresh in background");
+	atomic_fetch_add(&conf->stats->refresh_start, 1);
 
-	if (renameat(conf->last_dirfd, filename, conf->current_dirfd, filename) < 0) {
-		_log_conf(PHL_LOG_ERROR, "fail to move again: %s", strerror(errno));
-		return false;
+	/* conditional request */
+	struct phl_header *h;
+	phl_header_iter(&r->resp.headers, h) {
+		if (strcasecmp(h->str, "ETag") == 0) {
+			phl_header_add_lite(&subr->req.headers, "If-None-Match",
+					phl_header_value(h), h->value_len, subr->pool);
+		} else if (strcasecmp(h->str, "Last-Modified") == 0) {
+			phl_header_add_lite(&subr->req.headers, "If-Modified-Since",
+					phl_header_value(h), h->value_len, subr->pool);
+		}
 	}
-	return true;
+
+	/* the subrequest takes over the lock */
+	struct phl_file_cache_ctx *subr_ctx = wuy_pool_alloc(subr->pool, sizeof(struct phl_file_cache_ctx));
+	subr_ctx->hash[0] = ctx->hash[0];
+	subr_ctx->hash[1] = ctx->hash[1];
+	subr_ctx->filename = wuy_pool_strdup(subr->pool, ctx->filename);
+	subr_ctx->is_refresh = true;
+	subr_ctx->lock = ctx->lock;
+	ctx->lock = NULL;
+	subr->module_ctxs[phl_file_cache_module.index] = subr_ctx;
+
+	phl_request_subr_detach(subr);
 }
 
-static int phl_file_cache_create_file(struct phl_file_cache_conf *conf,
-		const char *filename)
+/* update the expire time of item file. This may be run in aio thread */
+static void phl_file_cache_refresh_work(struct phl_aio_task *task)
 {
-	_log_conf(PHL_LOG_DEBUG, "create new file %s", filename);
-
-	int fd = openat(conf->current_dirfd, filename, O_CREAT | O_EXCL | O_WRONLY, 0644);
-	if (fd >= 0) {
-		return fd;
-	}
-	if (errno != ENOENT) {
-		_log_conf(PHL_LOG_ERROR, "fail to create %s", strerror(errno));
-		return fd;
+	task->fd = openat(task->dirfd, task->path, O_WRONLY);
+	if (task->fd < 0) {
+		task->ret = -1;
+		task->err = errno;
+		return;
 	}
+	task->ret = pwrite(task->fd, task->buf, task->len, task->offset);
+	task->err = errno;
+	close(task->fd);
+}
 
-	phl_file_cache_prepare_prefix(conf, filename);
-
-	fd = openat(conf->current_dirfd, filename, O_CREAT | O_EXCL | O_WRONLY, 0644);
-	if (fd < 0) {
-		_log_conf(PHL_LOG_ERROR, "fail to create again: %s", strerror(errno));
-		return fd;
+static void phl_file_cache_refresh_done(struct phl_aio_task *task)
+{
+	struct phl_file_cache_conf *conf = task->data;
+	if (task->ret != task->len) {
+		_log_conf(PHL_LOG_ERROR, "refresh write fail %s %s",
+				task->path, strerror(task->err));
 	}
-	return fd;
+	phl_aio_task_free(task);
 }
 
-/* === module handlers */
-
-static void phl_file_cache_ctx_free(struct phl_request *r)
+/* the refresh gets 304, so just update the expire time in place */
+static void phl_file_cache_refresh_not_modified(struct phl_request *r)
 {
 	struct phl_file_cache_conf *conf = r->conf_path->module_confs[phl_file_cache_module.index];
 	struct phl_file_cache_ctx *ctx = r->module_ctxs[phl_file_cache_module.index];
 
-	if (ctx->fd > 0) {
-		close(ctx->fd);
+	atomic_fetch_add(&conf->stats->refresh_not_modified, 1);
+
+	struct phl_file_cache_item tmp;
+	time_t expire_after = phl_file_cache_parse_expire(r, conf, &tmp);
+	if (expire_after <= 0) {
+		expire_after = conf->default_expire;
 	}
-	if (ctx->new_filename != NULL) {
-		/* created a new item but not finished */
-		if (ctx->new_length > 0) {
-			atomic_fetch_add(&conf->stats->store_fail, 1);
-		}
-		unlinkat(conf->current_dirfd, ctx->new_filename, 0);
+	time_t expire_at = time(NULL) + expire_after;
+
+	_log(PHL_LOG_DEBUG, "refresh not modified, expire after %ld", expire_after);
+
+	struct phl_aio_task *task = phl_aio_task_new(phl_file_cache_refresh_work,
+			phl_file_cache_refresh_done, conf);
+	task->dirfd = conf->current_dirfd;
+	task->path = strdup(ctx->filename);
+	task->buf = malloc(sizeof(time_t));
+	memcpy(task->buf, &expire_at, sizeof(time_t));
+	task->len = sizeof(time_t);
+	task->offset = offsetof(struct phl_file_cache_item, expire_at);
+	phl_aio_submit(task);
+
+	if (conf->memory != NULL) {
+		phl_file_cache_memory_set_expire(conf, ctx->hash, expire_at);
+	}
+	if (conf->index != NULL) {
+		phl_file_cache_index_update(conf, ctx->hash, 0, expire_at);
 	}
 }
 
-static void phl_file_cache_abort(struct phl_request *r)
+/* fetch from upstream and store the response later in filters */
+static int phl_file_cache_miss(struct phl_request *r)
 {
-	phl_file_cache_ctx_free(r);
-	r->module_ctxs[phl_file_cache_module.index] = NULL;
+	struct phl_file_cache_conf *conf = r->conf_path->module_confs[phl_file_cache_module.index];
+	struct phl_file_cache_ctx *ctx = r->module_ctxs[phl_file_cache_module.index];
+
+	if (conf->lock_timeout == 0) {
+		goto fetch;
+	}
+
+	int ret = phl_file_cache_lock_acquire(conf, ctx, conf->lock_timeout, true);
+	if (ret == PHL_OK) {
+		_log(PHL_LOG_DEBUG, "lock acquired");
+		goto fetch;
+	}
+	if (ret == PHL_ERROR) {
+		_log(PHL_LOG_INFO, "no free lock slot");
+		goto fetch;
+	}
+
+	/* locked by others, wait */
+	long now = wuy_time_ms();
+	if (ctx->lock_wait_until == 0) {
+		atomic_fetch_add(&conf->stats->lock_wait, 1);
+		ctx->lock_wait_until = now + conf->lock_timeout * 1000;
+	} else if (now >= ctx->lock_wait_until) {
+		_log(PHL_LOG_INFO, "lock timeout");
+		atomic_fetch_add(&conf->stats->lock_timeout, 1);
+		goto fetch;
+	}
+
+	_log(PHL_LOG_DEBUG, "wait for lock");
+	if (ctx->lock_timer == NULL) {
+		ctx->lock_timer = loop_timer_new(phl_loop, phl_file_cache_lock_poll, r);
+	}
+	if (phl_file_cache_notifier_index < 0) {
+		loop_timer_set_after(ctx->lock_timer, PHL_FILE_CACHE_LOCK_POLL_MS);
+		return PHL_AGAIN;
+	}
+
+	/* woken up by the notifier, or timeout */
+	loop_timer_set_after(ctx->lock_timer, ctx->lock_wait_until - now);
+	ctx->r = r;
+	if (!wuy_list_node_linked(&ctx->lock_wait_node)) {
+		wuy_list_append(&phl_file_cache_lock_waiters, &ctx->lock_wait_node);
+	}
+	return PHL_AGAIN;
+
+fetch:
+	_log(PHL_LOG_DEBUG, "miss");
+	atomic_fetch_add(&conf->stats->miss, 1);
+	ctx->new_filename = ctx->filename;
+	return PHL_OK;
 }
 
 static int phl_file_cache_filter_process_headers(struct phl_request *r)
@@ -227,108 +2049,273 @@ static int phl_file_cache_filter_process_headers(struct phl_request *r)
 		return PHL_OK;
 	}
 
-	/* get key and calculate hash */
-	int len;
-	const char *key = r->req.uri.raw;
-	if (wuy_cflua_is_function_set(conf->key)) {
-		key = phl_lua_call_lstring(r, conf->key, &len);
-		if (key == NULL) {
-			_log(PHL_LOG_ERROR, "none key");
-			return PHL_OK;
+	/* this may be called again after waiting for the cache lock */
+	struct phl_file_cache_ctx *ctx = r->module_ctxs[phl_file_cache_module.index];
+	if (ctx == NULL) {
+		/* get key and calculate hash */
+		int len;
+		const char *key = r->req.uri.raw;
+		if (wuy_cflua_is_function_set(conf->key)) {
+			key = phl_key_get(r, conf->key, &len, NULL);
+			if (key == NULL) {
+				_log(PHL_LOG_ERROR, "none key");
+				return PHL_OK;
+			}
+		} else {
+			len = strlen(key);
 		}
-	} else {
-		len = strlen(key);
+
+		ctx = wuy_pool_alloc(r->pool, sizeof(struct phl_file_cache_ctx));
+		r->module_ctxs[phl_file_cache_module.index] = ctx;
+
+		wuy_vhash128(key, len, ctx->hash);
+
+		/* build filename */
+		char filename[100];
+		phl_file_cache_build_filename(conf, ctx->hash, filename);
+
+		ctx->filename = wuy_pool_strdup(r->pool, filename);
+
+		_log(PHL_LOG_DEBUG, "key: %*s, filename: %s", len, key, filename);
+
+		atomic_fetch_add(&conf->stats->total, 1);
 	}
 
-	uint64_t hash[2];
-	wuy_vhash128(key, len, hash);
+	/* background refresh subrequest, go to upstream directly */
+	if (ctx->is_refresh) {
+		ctx->new_filename = ctx->filename;
+		return PHL_OK;
+	}
 
-	atomic_fetch_add(&conf->stats->total, 1);
+	const char *filename = ctx->filename;
 
-	/* build filename */
-	char filename[100], *p = filename;
-	uint64_t tmpdirhash = hash[1];
-	for (int i = 0; i < conf->dir_level; i++) {
-		p += sprintf(p, "%02lx/", tmpdirhash & 0xFF);
-		tmpdirhash >>= 8;
+	/* try memory tier first */
+	if (conf->memory != NULL && ctx->lookup_task == NULL) {
+		struct phl_file_cache_item *item = phl_file_cache_memory_load(conf, ctx->hash, r->pool);
+		if (item != NULL) {
+			_log(PHL_LOG_DEBUG, "hit memory");
+			atomic_fetch_add(&conf->stats->hit_memory, 1);
+			if (conf->index != NULL) {
+				phl_file_cache_index_touch(conf, ctx->hash);
+			}
+			char *headers = (char *)(item + 1);
+			return phl_file_cache_serve_memory(r, item, headers,
+					headers + item->header_total_length);
+		}
 	}
-	sprintf(p, "%016lx%016lx", hash[0], hash[1]);
 
-	_log(PHL_LOG_DEBUG, "key: %*s, filename: %s", len, key, filename);
+	/* then the opened files */
+	if (phl_open_cache_is_enabled() && ctx->lookup_task == NULL) {
+		int status_code = phl_file_cache_serve_open_cache(r);
+		if (status_code != 0) {
+			return status_code;
+		}
+	}
 
-	struct phl_file_cache_ctx *ctx = wuy_pool_alloc(r->pool, sizeof(struct phl_file_cache_ctx));
-	r->module_ctxs[phl_file_cache_module.index] = ctx;
+	/* try to open file and read the beginning */
+	int ret = phl_file_cache_lookup(r);
+	if (ret != PHL_OK) {
+		return ret;
+	}
 
-	/* try to open file */
-	ctx->fd = openat(conf->current_dirfd, filename, O_RDONLY);
-	if (ctx->fd > 0) {
-		atomic_fetch_add(&conf->stats->hit_current, 1);
+	struct phl_file_cache_lookup *lookup = ctx->lookup;
+	switch (lookup->hit) {
+	case PHL_FILE_CACHE_LOOKUP_MISS:
+		return phl_file_cache_miss(r);
 
-	} else if (conf->last_dirfd > 0) {
-		ctx->fd = openat(conf->last_dirfd, filename, O_RDONLY);
-		if (ctx->fd < 0) {
-			goto cache_miss;
+	case PHL_FILE_CACHE_LOOKUP_CURRENT:
+		atomic_fetch_add(&conf->stats->hit_current, 1);
+		if (conf->index != NULL) {
+			phl_file_cache_index_touch(conf, ctx->hash);
 		}
+		break;
 
+	case PHL_FILE_CACHE_LOOKUP_LAST:
 		atomic_fetch_add(&conf->stats->hit_last, 1);
-		phl_file_cache_rename_file(conf, filename);
-
-	} else {
-cache_miss:
-		/* save the filename and store response into it in filters later */
-		_log(PHL_LOG_DEBUG, "miss");
-		atomic_fetch_add(&conf->stats->miss, 1);
-		ctx->new_filename = wuy_pool_strdup(r->pool, filename);
-		return PHL_OK;
+		_log(PHL_LOG_DEBUG, "move to current directory");
+		if (!lookup->moved) {
+			_log(PHL_LOG_ERROR, "fail to move %s", strerror(lookup->err));
+		} else if (conf->index != NULL) {
+			phl_file_cache_index_update(conf, ctx->hash, 0, 0);
+		}
+		break;
 	}
 
+	ctx->fd = lookup->fd;
+
 	/* cache hit! */
 	_log(PHL_LOG_DEBUG, "hit");
 
-	/* read meta information */
-	int ret = read(ctx->fd, &ctx->item, sizeof(struct phl_file_cache_item));
-	if (ret < 0) {
-		_log(PHL_LOG_ERROR, "error to read cache file %s %s", filename, strerror(errno));
+	/* meta information */
+	if (lookup->read_len < 0) {
+		_log(PHL_LOG_ERROR, "error to read cache file %s %s", filename, strerror(lookup->err));
 		return PHL_ERROR;
 	}
-	if (ret < sizeof(struct phl_file_cache_item) || ctx->item.content_length == PHL_CONTENT_LENGTH_INIT) {
+	if (lookup->read_len >= sizeof(struct phl_file_cache_item)) {
+		memcpy(&ctx->item, lookup->data, sizeof(struct phl_file_cache_item));
+	}
+	if (lookup->read_len < sizeof(struct phl_file_cache_item) || ctx->item.content_length == PHL_CONTENT_LENGTH_INIT) {
 		_log(PHL_LOG_DEBUG, "not finished");
-		atomic_fetch_add(&conf->stats->not_finished, 1);
-		phl_file_cache_abort(r);
-		return PHL_OK;
+		close(ctx->fd);
+		ctx->fd = 0;
+
+		if (conf->lock_timeout == 0) {
+			atomic_fetch_add(&conf->stats->not_finished, 1);
+			phl_file_cache_abort(r);
+			return PHL_OK;
+		}
+
+		/* wait for the one who is storing it */
+		ret = phl_file_cache_miss(r);
+		if (ret == PHL_OK && ctx->lock != NULL) {
+			/* the storing one has gone, so remove the left file */
+			ctx->replace_file = true;
+		} else if (ret == PHL_OK) {
+			/* can not store into the existing file */
+			atomic_fetch_add(&conf->stats->not_finished, 1);
+			ctx->new_filename = NULL;
+			phl_file_cache_abort(r);
+		}
+		return ret;
 	}
-	if (ctx->item.expire_at < time(NULL)) {
+	bool is_stale = false;
+	time_t now = time(NULL);
+	if (ctx->item.expire_at < now) {
+		/* serve the stale one, and refresh it in background */
+		if (now <= ctx->item.expire_at + ctx->item.stale_while_revalidate) {
+			_log(PHL_LOG_DEBUG, "stale while revalidate");
+			atomic_fetch_add(&conf->stats->stale_revalidate, 1);
+			is_stale = true;
+			goto serve;
+		}
+
 		_log(PHL_LOG_DEBUG, "expired");
-		atomic_fetch_add(&conf->stats->expired, 1);
+
+		/* keep the stale one, and use it if fail to fetch */
+		if (now <= ctx->item.expire_at + ctx->item.stale_if_error) {
+			if (ctx->stale_fd > 0) { /* opened in last waiting for lock */
+				close(ctx->stale_fd);
+			}
+			ctx->stale_fd = ctx->fd;
+			ctx->fd = 0;
+			ctx->stale_headers = NULL;
+			if (lookup->read_len >= sizeof(struct phl_file_cache_item) + ctx->item.header_total_length) {
+				ctx->stale_headers = lookup->data + sizeof(struct phl_file_cache_item);
+			}
+			return phl_file_cache_miss(r);
+		}
 
 		close(ctx->fd);
-		unlinkat(conf->current_dirfd, filename, 0);
-		ctx->fd = -1;
-		ctx->new_filename = wuy_pool_strdup(r->pool, filename);
-		return PHL_OK;
+		ctx->fd = 0;
+
+		ret = phl_file_cache_miss(r);
+		if (ret == PHL_OK) {
+			atomic_fetch_add(&conf->stats->expired, 1);
+			ctx->replace_file = true;
+			if (conf->index != NULL) {
+				phl_file_cache_index_remove(conf, ctx->hash);
+			}
+		}
+		return ret;
 	}
 
-	/* read and set response headers */
-	char buffer[ctx->item.header_total_length], *buf_pos = buffer;
-	ret = read(ctx->fd, buffer, sizeof(buffer));
-	if (ret < 0) {
-		_log(PHL_LOG_ERROR, "read headers %s", strerror(errno));
-		return PHL_ERROR;
+serve:;
+	int meta_length = sizeof(struct phl_file_cache_item) + ctx->item.header_total_length;
+
+	/* promote small item into memory tier, reading headers and body at once */
+	if (!is_stale && conf->memory != NULL && meta_length + ctx->item.content_length
+			<= conf->memory_item_max) {
+
+		int length = meta_length + ctx->item.content_length;
+		struct phl_file_cache_item *item = wuy_pool_alloc(r->pool, length);
+
+		/* all of it has been read in lookup */
+		if (lookup->read_len < length) {
+			_log(PHL_LOG_ERROR, "item file truncated %zd", lookup->read_len);
+			return PHL_ERROR;
+		}
+		memcpy(item, lookup->data, length);
+
+		phl_file_cache_memory_store(conf, ctx->hash, (char *)item, length);
+
+		close(ctx->fd);
+		ctx->fd = 0;
+
+		char *headers = (char *)(item + 1);
+		return phl_file_cache_serve_memory(r, item, headers,
+				headers + item->header_total_length);
 	}
 
-	for (int i = 0; i < ctx->item.header_num; i++) {
-		struct phl_header *h = phl_header_load_from(buf_pos);
-		phl_header_add(&r->resp.headers, h->str, h->name_len,
-				phl_header_value(h), h->value_len, r->pool);
-		buf_pos += phl_header_dump_length(h);
+	/* set response headers, which have been read in lookup */
+	if (meta_length > lookup->read_len) {
+		_log(PHL_LOG_ERROR, "item file truncated %zd", lookup->read_len);
+		return PHL_ERROR;
+	}
+	char *buffer = lookup->data + sizeof(struct phl_file_cache_item);
+
+	phl_file_cache_load_headers(r, &ctx->item, buffer);
+
+	/* keep the fd and meta opened for later requests */
+	int fd = ctx->fd;
+	if (phl_open_cache_is_enabled() && !is_stale
+			&& (lookup->hit == PHL_FILE_CACHE_LOOKUP_CURRENT || lookup->moved)) {
+		struct phl_open_cache_entry *entry = phl_open_cache_add(conf->current_dirfd,
+				filename, fd, &lookup->st);
+		entry->data = malloc(meta_length);
+		memcpy(entry->data, &ctx->item, sizeof(struct phl_file_cache_item));
+		memcpy((char *)entry->data + sizeof(struct phl_file_cache_item),
+				buffer, ctx->item.header_total_length);
+
+		ctx->entry = entry;
+		ctx->fd = 0;
 	}
 
+	/* the body is read from easy_fd */
 	r->resp.content_length = ctx->item.content_length;
-	r->resp.easy_fd = ctx->fd;
+	r->resp.easy_fd = fd;
+	r->resp.easy_fd_offset = meta_length;
+
+	if (is_stale) {
+		phl_file_cache_refresh(r);
+	}
 
 	return ctx->item.status_code;
 }
 
+/* fail to fetch, so serve the stale one */
+static int phl_file_cache_serve_stale(struct phl_request *r)
+{
+	struct phl_file_cache_conf *conf = r->conf_path->module_confs[phl_file_cache_module.index];
+	struct phl_file_cache_ctx *ctx = r->module_ctxs[phl_file_cache_module.index];
+
+	_log(PHL_LOG_INFO, "serve stale for status %d", r->resp.status_code);
+	atomic_fetch_add(&conf->stats->stale_if_error, 1);
+
+	ctx->new_filename = NULL;
+	phl_file_cache_lock_release(conf, ctx);
+
+	/* the headers have been read in lookup */
+	if (ctx->stale_headers == NULL) {
+		_log(PHL_LOG_ERROR, "stale item file truncated");
+		return PHL_OK;
+	}
+
+	phl_request_reset_response(r);
+	phl_file_cache_load_headers(r, &ctx->item, ctx->stale_headers);
+
+	r->resp.status_code = ctx->item.status_code;
+	r->resp.content_length = ctx->item.content_length;
+	r->resp.content_original_length = ctx->item.content_length;
+	r->resp.easy_fd = ctx->stale_fd;
+	r->resp.easy_fd_offset = sizeof(struct phl_file_cache_item) + ctx->item.header_total_length;
+	r->resp.body_replaced = true; /* the upstream's error body is not read */
+
+	ctx->fd = ctx->stale_fd;
+	ctx->stale_fd = 0;
+
+	return PHL_OK;
+}
+
 static int phl_file_cache_filter_response_headers(struct phl_request *r)
 {
 	struct phl_file_cache_conf *conf = r->conf_path->module_confs[phl_file_cache_module.index];
@@ -336,60 +2323,61 @@ static int phl_file_cache_filter_response_headers(struct phl_request *r)
 	if (ctx == NULL || ctx->new_filename == NULL) {
 		return PHL_OK;
 	}
+	if (ctx->stale_fd > 0 && r->resp.status_code >= WUY_HTTP_500) {
+		return phl_file_cache_serve_stale(r);
+	}
+	if (ctx->is_refresh && r->resp.status_code == WUY_HTTP_304) {
+		phl_file_cache_refresh_not_modified(r);
+		phl_file_cache_abort(r);
+		return PHL_OK;
+	}
 	if (r->resp.status_code != WUY_HTTP_200) { // TODO cache more status_code
 		atomic_fetch_add(&conf->stats->ignore_status, 1);
 		phl_file_cache_abort(r);
 		return PHL_OK;
 	}
 
-	time_t expire_after = -1;
-	ctx->item.header_num = 0;
-	ctx->item.header_total_length = 0;
+	time_t expire_after = phl_file_cache_parse_expire(r, conf, &ctx->item);
+	if (expire_after <= 0) {
+		atomic_fetch_add(&conf->stats->ignore_expire, 1);
+		phl_file_cache_abort(r);
+		return PHL_OK;
+	}
 
 	/* count response headers first */
+	ctx->item.header_num = 0;
+	ctx->item.header_total_length = 0;
 	struct phl_header *store_headers[100], *h;
 	phl_header_iter(&r->resp.headers, h) {
-		const char *value = phl_header_value(h);
-		if (strcasecmp(h->str, "Cache-Control") == 0) {
-			if (memcmp(value, "max-age=", 8) != 0) {
-				atomic_fetch_add(&conf->stats->ignore_expire, 1);
-				phl_file_cache_abort(r);
-				return PHL_OK;
-			}
-			expire_after = atoi(value+8);
-		} else if (strcasecmp(h->str, "Expires") == 0) {
-			expire_after = wuy_http_date_parse(phl_header_value(h)) - time(NULL);
-		}
-
 		store_headers[ctx->item.header_num++] = h;
 		ctx->item.header_total_length += phl_header_dump_length(h);
 	}
 
-	if (expire_after == -1) {
-		expire_after = conf->default_expire;
-	}
-	if (expire_after <= 0) {
-		atomic_fetch_add(&conf->stats->ignore_expire, 1);
-		phl_file_cache_abort(r);
-		return PHL_OK;
-	}
-
-	/* create item */
-	ctx->fd = phl_file_cache_create_file(conf, ctx->new_filename);
-	if (ctx->fd < 0) {
-		phl_file_cache_abort(r);
-		return PHL_OK;
+	/* replace the stale one */
+	if (ctx->stale_fd > 0 || ctx->is_refresh) {
+		if (ctx->is_refresh) {
+			atomic_fetch_add(&conf->stats->refresh_modified, 1);
+		}
+		ctx->replace_file = true;
+		phl_open_cache_remove(conf->current_dirfd, ctx->new_filename);
+		if (conf->index != NULL) {
+			phl_file_cache_index_remove(conf, ctx->hash);
+		}
 	}
 
 	/* dump the item and headers infomation into buffer */
-	char buffer[sizeof(struct phl_file_cache_item) + ctx->item.header_total_length];
+	size_t header_length = sizeof(struct phl_file_cache_item) + ctx->item.header_total_length;
+	char *buffer = malloc(header_length);
 
 	struct phl_file_cache_item *item = (struct phl_file_cache_item *)buffer;
 	item->content_length = PHL_CONTENT_LENGTH_INIT; /* mark as not-finished */
 	item->expire_at = expire_after + time(NULL);
+	item->stale_while_revalidate = ctx->item.stale_while_revalidate;
+	item->stale_if_error = ctx->item.stale_if_error;
 	item->status_code = r->resp.status_code;
 	item->header_num = ctx->item.header_num;
 	item->header_total_length = ctx->item.header_total_length;
+	ctx->item.expire_at = item->expire_at;
 
 	char *header_pos = (char *)(item + 1);
 	for (int i = 0; i < item->header_num; i++) {
@@ -399,47 +2387,89 @@ static int phl_file_cache_filter_response_headers(struct phl_request *r)
 		header_pos += len;
 	}
 
-	int ret = write(ctx->fd, buffer, sizeof(buffer));
-	if (ret < 0) {
-		_log(PHL_LOG_ERROR, "write headers fail %s %s", ctx->new_filename, strerror(errno));
-		phl_file_cache_abort(r);
-		return PHL_OK;
+	/* prepare to store into memory tier too, if small enough */
+	if (conf->memory != NULL && (r->resp.content_length == PHL_CONTENT_LENGTH_INIT
+				|| header_length + r->resp.content_length <= conf->memory_item_max)
+			&& header_length <= conf->memory_item_max) {
+		ctx->mem_buf = wuy_pool_alloc(r->pool, conf->memory_item_max);
+		memcpy(ctx->mem_buf, buffer, header_length);
+		ctx->mem_len = header_length;
 	}
 
+	/* the body is written by store, which may live longer than request */
+	struct phl_file_cache_store *store = calloc(1, sizeof(struct phl_file_cache_store));
+	store->conf = conf;
+	store->fd = -1;
+	store->hash[0] = ctx->hash[0];
+	store->hash[1] = ctx->hash[1];
+	strcpy(store->filename, ctx->new_filename);
+	store->lock = ctx->lock;
+	store->header_length = header_length;
+	store->expire_at = item->expire_at;
+	store->offset = header_length;
+	store->pending = 1; /* for the creating */
+	store->replace = ctx->replace_file;
+	ctx->replace_file = false;
+
+	/* the file is created and the headers are written by aio, while
+	 * the body writes are queued until then */
+	struct phl_aio_task *task = phl_aio_task_new(phl_file_cache_store_create_work,
+			phl_file_cache_store_create_done, store);
+	task->dirfd = conf->current_dirfd;
+	task->path = strdup(ctx->new_filename);
+	task->buf = buffer;
+	task->len = header_length;
+
+	ctx->store = store;
+	ctx->lock = NULL;
+	ctx->new_filename = NULL;
+
+	/* the done handler is called synchronously if aio is not enabled */
+	phl_aio_submit(task);
+
 	return PHL_OK;
 }
 
 static int phl_file_cache_filter_response_body(struct phl_request *r,
-		uint8_t *data, int data_len, int buf_len, bool *p_is_last)
+		struct phl_buf_chain *chain)
 {
 	struct phl_file_cache_conf *conf = r->conf_path->module_confs[phl_file_cache_module.index];
 	struct phl_file_cache_ctx *ctx = r->module_ctxs[phl_file_cache_module.index];
 
-	if (ctx == NULL || ctx->new_filename == NULL) {
-		return data_len;
+	if (ctx == NULL || ctx->store == NULL) {
+		return PHL_OK;
 	}
 
-	if (write(ctx->fd, data, data_len) != data_len) {
-		_log(PHL_LOG_ERROR, "write body fail %s %s",
-				ctx->new_filename, strerror(errno));
-		phl_file_cache_abort(r);
-	}
+	/* store the chain, and pass it through */
+	for (struct phl_buf *b = chain->head; b != NULL; b = b->next) {
+		phl_file_cache_store_write(ctx->store, b->data, b->len);
 
-	ctx->new_length += data_len;
+		ctx->new_length += b->len;
 
-	if (*p_is_last) {
-		atomic_fetch_add(&conf->stats->store_ok, 1);
+		if (ctx->mem_buf != NULL) {
+			if (ctx->mem_len + b->len <= conf->memory_item_max) {
+				memcpy(ctx->mem_buf + ctx->mem_len, b->data, b->len);
+				ctx->mem_len += b->len;
+			} else { /* too big */
+				ctx->mem_buf = NULL;
+			}
+		}
+	}
 
-		lseek(ctx->fd, 0, SEEK_SET);
-		if (write(ctx->fd, &ctx->new_length, sizeof(size_t)) < 0) {
-			_log(PHL_LOG_ERROR, "write fail");
+	if (chain->is_last) {
+		if (ctx->mem_buf != NULL) {
+			struct phl_file_cache_item *item = (struct phl_file_cache_item *)ctx->mem_buf;
+			item->content_length = ctx->new_length;
+			phl_file_cache_memory_store(conf, ctx->hash, ctx->mem_buf, ctx->mem_len);
+			ctx->mem_buf = NULL;
 		}
 
-		/* mark finished */
-		ctx->new_filename = NULL;
+		/* the item is marked finished after all writes are done */
+		phl_file_cache_store_finish(ctx->store, ctx->new_length);
+		ctx->store = NULL;
 	}
 
-	return data_len;
+	return PHL_OK;
 }
 
 static void phl_file_cache_stats_path(void *data, wuy_json_t *json)
@@ -452,6 +2482,7 @@ static void phl_file_cache_stats_path(void *data, wuy_json_t *json)
 
 	wuy_json_object_object(json, "file_cache");
 	wuy_json_object_int(json, "total", atomic_load(&stats->total));
+	wuy_json_object_int(json, "hit_memory", atomic_load(&stats->hit_memory));
 	wuy_json_object_int(json, "hit_current", atomic_load(&stats->hit_current));
 	wuy_json_object_int(json, "hit_last", atomic_load(&stats->hit_last));
 	wuy_json_object_int(json, "miss", atomic_load(&stats->miss));
@@ -463,6 +2494,45 @@ static void phl_file_cache_stats_path(void *data, wuy_json_t *json)
 	wuy_json_object_int(json, "store_fail", atomic_load(&stats->store_fail));
 	wuy_json_object_int(json, "create", atomic_load(&stats->create));
 	wuy_json_object_int(json, "remove", atomic_load(&stats->remove));
+	wuy_json_object_int(json, "lock_wait", atomic_load(&stats->lock_wait));
+	wuy_json_object_int(json, "lock_timeout", atomic_load(&stats->lock_timeout));
+	wuy_json_object_int(json, "lock_full", atomic_load(&stats->lock_full));
+	wuy_json_object_int(json, "stale_revalidate", atomic_load(&stats->stale_revalidate));
+	wuy_json_object_int(json, "stale_if_error", atomic_load(&stats->stale_if_error));
+	wuy_json_object_int(json, "refresh_start", atomic_load(&stats->refresh_start));
+	wuy_json_object_int(json, "refresh_not_modified", atomic_load(&stats->refresh_not_modified));
+	wuy_json_object_int(json, "refresh_modified", atomic_load(&stats->refresh_modified));
+
+	struct phl_file_cache_index *index = conf->index;
+	if (index != NULL) {
+		wuy_json_object_object(json, "index");
+		wuy_json_object_int(json, "total_size", index->total_size);
+		wuy_json_object_int(json, "item_num", index->item_num);
+		wuy_json_object_int(json, "evict", atomic_load(&stats->index_evict));
+		wuy_json_object_int(json, "full", atomic_load(&stats->index_full));
+		wuy_json_object_int(json, "journal_records", index->journal_records);
+		wuy_json_object_int(json, "journal_compact", atomic_load(&stats->journal_compact));
+		wuy_json_object_close(json);
+	}
+
+	struct phl_file_cache_memory *memory = conf->memory;
+	if (memory != NULL) {
+		wuy_json_object_object(json, "memory");
+		struct phl_slab *slab = &memory->slab;
+		wuy_json_object_int(json, "size", (long)slab->page_size * slab->page_num);
+		wuy_json_object_int(json, "page_used", slab->page_used);
+		long used = 0;
+		for (int i = 0; i < PHL_SLAB_CLASSES; i++) {
+			used += slab->classes[i].used;
+		}
+		wuy_json_object_int(json, "used", used);
+		wuy_json_object_int(json, "store", atomic_load(&stats->memory_store));
+		wuy_json_object_int(json, "store_fail", atomic_load(&stats->memory_store_fail));
+		wuy_json_object_int(json, "evict", atomic_load(&stats->memory_evict));
+		wuy_json_object_int(json, "expired", atomic_load(&stats->memory_expired));
+		wuy_json_object_close(json);
+	}
+
 	wuy_json_object_close(json);
 }
 
@@ -490,47 +2560,75 @@ static const char *phl_file_cache_conf_post(void *data)
 		return "fail to open dir";
 	}
 
-	/* get current_dirfd and last_dirfd */
+	conf->stats = wuy_shmpool_alloc(sizeof(struct phl_file_cache_stats));
+
+	/* find the latest two directories as current and last */
+	struct dirent **namelist;
+	int name_num = scandir(conf->dir_name, &namelist, NULL, NULL);
+	if (name_num < 0) {
+		wuy_cflua_post_arg = conf->dir_name;
+		return "fail to scan dir";
+	}
 	time_t last_ts = 0, current_ts = 0;
-	DIR *dir = opendir(conf->dir_name);
-	struct dirent *e;
-	while ((e = readdir(dir)) != NULL) {
-		if ((e->d_type & DT_DIR) == 0) {
+	for (int i = 0; i < name_num; i++) {
+		time_t ts;
+		if ((namelist[i]->d_type & DT_DIR) == 0) {
 			continue;
 		}
-		time_t ts;
-		if (sscanf(e->d_name, "P_%ld", &ts) != 1) {
+		if (sscanf(namelist[i]->d_name, "P_%ld", &ts) != 1) {
 			continue;
 		}
 		if (ts > current_ts) {
-			phl_file_cache_delete_last_dir(conf);
-
 			last_ts = current_ts;
 			current_ts = ts;
-			conf->last_dirname = conf->current_dirname;
-			conf->current_dirname = strdup(e->d_name);
-
-			conf->last_dirfd = conf->current_dirfd;
-			conf->current_dirfd = openat(conf->dirfd, e->d_name, O_RDONLY|O_DIRECTORY);
-			if (conf->current_dirfd < 0) {
-				wuy_cflua_post_arg = e->d_name;
-				return "fail to open sub dir";
-			}
-
 		} else if (ts > last_ts) {
-			phl_file_cache_delete_last_dir(conf);
-
 			last_ts = ts;
-			conf->last_dirname = strdup(e->d_name);
+		}
+	}
+
+	/* open them, and delete others */
+	const char *err = WUY_CFLUA_OK;
+	for (int i = 0; i < name_num; i++) {
+		const char *name = namelist[i]->d_name;
+		time_t ts;
+		if ((namelist[i]->d_type & DT_DIR) == 0) {
+			continue;
+		}
+		if (sscanf(name, "D_%ld", &ts) == 1) { /* left by last deleting */
+			phl_file_cache_remove_dir(conf, name);
+			continue;
+		}
+		if (sscanf(name, "P_%ld", &ts) != 1) {
+			continue;
+		}
 
-			conf->last_dirfd = openat(conf->dirfd, e->d_name, O_RDONLY|O_DIRECTORY);
+		if (ts == current_ts) {
+			conf->current_ts = ts;
+			conf->current_dirname = strdup(name);
+			conf->current_dirfd = openat(conf->dirfd, name, O_RDONLY|O_DIRECTORY);
+			if (conf->current_dirfd < 0) {
+				wuy_cflua_post_arg = conf->current_dirname;
+				err = "fail to open sub dir";
+			}
+		} else if (ts == last_ts) {
+			conf->last_ts = ts;
+			conf->last_dirname = strdup(name);
+			conf->last_dirfd = openat(conf->dirfd, name, O_RDONLY|O_DIRECTORY);
 			if (conf->last_dirfd < 0) {
-				wuy_cflua_post_arg = e->d_name;
-				return "fail to open sub dir";
+				wuy_cflua_post_arg = conf->last_dirname;
+				err = "fail to open sub dir";
 			}
+		} else {
+			phl_file_cache_delete_dir(conf, name, ts);
 		}
 	}
-	closedir(dir);
+	for (int i = 0; i < name_num; i++) {
+		free(namelist[i]);
+	}
+	free(namelist);
+	if (err != WUY_CFLUA_OK) {
+		return err;
+	}
 
 	/* create current_dirfd if not found */
 	if (conf->current_dirfd == 0) {
@@ -544,23 +2642,70 @@ static const char *phl_file_cache_conf_post(void *data)
 	}
 
 	if (conf->inactive > 0) {
-		loop_timer_t *timer = loop_timer_new(phl_loop, phl_file_cache_renew_period, conf);
-		loop_timer_set_at(timer, (time(NULL) / conf->inactive + 1) * conf->inactive * 1000);
+		conf->renew_timer = loop_timer_new(phl_loop, phl_file_cache_renew_period, conf);
+		loop_timer_set_at(conf->renew_timer,
+				(time(NULL) / conf->inactive + 1) * conf->inactive * 1000);
 	}
 
-	conf->stats = wuy_shmpool_alloc(sizeof(struct phl_file_cache_stats));
+	if (conf->max_size > 0) {
+		phl_file_cache_index_init(conf);
+	}
+
+	/* used by refresh too, even if lock_timeout is not set */
+	phl_file_cache_locks_init(conf);
+	if (conf->lock_timeout > 0) {
+		phl_file_cache_notifiers_init();
+	}
+
+	if (conf->memory_size > 0) {
+		err = phl_file_cache_memory_init(conf);
+		if (err != WUY_CFLUA_OK) {
+			return err;
+		}
+	}
 
 	return WUY_CFLUA_OK;
 }
 
+/* the timers are created in master, and are inherited by
+ * workers forked later, so delete them when reloading */
+static void phl_file_cache_conf_free(void *data)
+{
+	struct phl_file_cache_conf *conf = data;
+
+	if (conf->renew_timer != NULL) {
+		loop_timer_delete(conf->renew_timer);
+	}
+	if (conf->sweep_timer != NULL) {
+		loop_timer_delete(conf->sweep_timer);
+	}
+	free(conf->victims);
+}
+
 static struct wuy_cflua_command phl_file_cache_conf_commands[] = {
 	{	.type = WUY_CFLUA_TYPE_STRING,
 		.description = "Directory to store the cache content.",
 		.is_single_array = true,
 		.offset = offsetof(struct phl_file_cache_conf, dir_name),
 	},
+	{	.name = "max_size",
+		.description = "Max total size of items on disk, in MiB. The least recently "
+			"used items are removed if exceeded. Set 0 to disable.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_file_cache_conf, max_size),
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+	},
+	{	.name = "index_max_items",
+		.description = "Max number of items indexed in shared-memory, "
+			"used only if `max_size` is set.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_file_cache_conf, index_max_items),
+		.limits.n = WUY_CFLUA_LIMITS_POSITIVE,
+		.default_value.n = 200000,
+	},
 	{	.name = "key",
-		.description = "Return a string as cache key. The raw URL is used if not set.",
+		.description = "Return a string as cache key. The raw URL is used if not set. "
+			"Use `phl.key` to avoid calling Lua.",
 		.type = WUY_CFLUA_TYPE_FUNCTION,
 		.offset = offsetof(struct phl_file_cache_conf, key),
 	},
@@ -607,6 +2752,40 @@ static struct wuy_cflua_command phl_file_cache_conf_commands[] = {
 		.offset = offsetof(struct phl_file_cache_conf, exclude_headers),
 		.u.table = WUY_CFLUA_ARRAY_STRING_TABLE,
 	},
+	{	.name = "memory_size",
+		.description = "Size of shared-memory to store small items. Set 0 to disable.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_file_cache_conf, memory_size),
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+	},
+	{	.name = "memory_item_max",
+		.description = "Items larger than this, including headers, are not stored in memory.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_file_cache_conf, memory_item_max),
+		.limits.n = WUY_CFLUA_LIMITS(1024, 1024*1024),
+		.default_value.n = 64 * 1024,
+	},
+	{	.name = "stale_while_revalidate",
+		.description = "Serve the expired item within this time and refresh it "
+			"in background, if `stale-while-revalidate` is absent in response.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_file_cache_conf, stale_while_revalidate),
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+	},
+	{	.name = "stale_if_error",
+		.description = "Serve the expired item within this time if fail to fetch, "
+			"if `stale-if-error` is absent in response.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_file_cache_conf, stale_if_error),
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+	},
+	{	.name = "lock_timeout",
+		.description = "Only one request fetches a missing item, while others for "
+			"the same key wait for this time at most. Disabled if 0.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_file_cache_conf, lock_timeout),
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+	},
 	{	.name = "log",
 		.type = WUY_CFLUA_TYPE_TABLE,
 		.offset = offsetof(struct phl_file_cache_conf, log),
@@ -620,13 +2799,14 @@ struct phl_module phl_file_cache_module = {
 	.command_path = {
 		.name = "file_cache",
 		.description = "File cache filter module. " \
-				"There is no total size limit of occupation. " \
-				"We just clear items that inactive for a long time.",
+				"Items that inactive for a long time are cleared, " \
+				"and the least recently used items are removed if `max_size` is exceeded.",
 		.type = WUY_CFLUA_TYPE_TABLE,
 		.u.table = &(struct wuy_cflua_table) {
 			.commands = phl_file_cache_conf_commands,
 			.size = sizeof(struct phl_file_cache_conf),
 			.post = phl_file_cache_conf_post,
+			.free = phl_file_cache_conf_free,
 		}
 	},
 
@@ -638,4 +2818,6 @@ struct phl_module phl_file_cache_module = {
 
 	.ctx_free = phl_file_cache_ctx_free,
 	.stats_path = phl_file_cache_stats_path,
+
+	.worker_init = phl_file_cache_worker_init,
 };
@@ -1,22 +1,425 @@
+#include <pthread.h>
+
 #include "phl_main.h"
 
 #include <zlib.h>
+#include <zstd.h>
+#include <brotli/encode.h>
+
+/* codings, in order of preference if same q-value */
+enum phl_gzip_coding {
+	PHL_GZIP_CODING_BR,
+	PHL_GZIP_CODING_ZSTD,
+	PHL_GZIP_CODING_GZIP,
+	PHL_GZIP_CODING_NUM,
+};
+
+static const char *const phl_gzip_coding_names[PHL_GZIP_CODING_NUM] = {
+	"br", "zstd", "gzip",
+};
+
+/* free compress contexts kept in each worker, for reusing */
+#define PHL_GZIP_POOL_SIZE	16
+
+/* size of each output buffer */
+#define PHL_GZIP_OUT_SIZE	16384
+
+/* initial size of the buffer collecting output for cache */
+#define PHL_GZIP_CACHE_CHUNK	4096
+
+/* cache of compressed responses, in shared-memory */
+struct phl_gzip_cache_entry {
+	struct phl_slab_node	slab_node;
+	uint64_t		hash[2];
+	wuy_nop_hlist_node_t	hash_node;
+	int			length;
+	time_t			expire_at;
+	char			data[0];
+};
+
+struct phl_gzip_cache {
+	pthread_mutex_t		lock;
+	bool			has_inited;
+
+	struct phl_slab		slab;
+
+	int			hash_buckets;
+	wuy_nop_hlist_t		buckets[0];
+};
+
+struct phl_gzip_stats {
+	atomic_long		cache_hit;
+	atomic_long		cache_miss;
+	atomic_long		cache_store;
+	atomic_long		cache_evict;
+};
 
 struct phl_gzip_conf {
 	int		level;
 	int		window_bits;
 	int		mem_level;
+	int		brotli_level;
+	int		zstd_level;
 	int		min_length;
 
 	wuy_cflua_function_t	filter;
+
+	struct {
+		int			max_item;
+		int			total;
+		int			expire;
+		wuy_cflua_function_t	key;
+	} cache;
+
+	struct phl_gzip_cache	*cache_shm;
+	struct phl_gzip_stats	*stats;
+
+	/* Brotli encoder can not be reset, so it is not kept */
+	z_streamp	zs_pool[PHL_GZIP_POOL_SIZE];
+	int		zs_pool_num;
+	ZSTD_CCtx	*zc_pool[PHL_GZIP_POOL_SIZE];
+	int		zc_pool_num;
+};
+
+struct phl_gzip_ctx {
+	enum phl_gzip_coding		coding;
+	union {
+		z_streamp		zs;
+		ZSTD_CCtx		*zc;
+		BrotliEncoderState	*bs;
+	};
+
+	/* output buffers, reused at each call */
+	struct phl_buf			*outs;
+	int				out_num;
+
+	/* collect the output to store into cache */
+	bool				cache_store;
+	uint64_t			cache_hash[2];
+	uint8_t				*cache_buf;
+	int				cache_len;
+	int				cache_size;
 };
 
 struct phl_module phl_gzip_module;
 
+static bool phl_gzip_coding_enabled(struct phl_gzip_conf *conf, enum phl_gzip_coding coding)
+{
+	switch (coding) {
+	case PHL_GZIP_CODING_BR:
+		return conf->brotli_level != 0;
+	case PHL_GZIP_CODING_ZSTD:
+		return conf->zstd_level != 0;
+	case PHL_GZIP_CODING_GZIP:
+		return conf->level != 0;
+	default:
+		return false;
+	}
+}
+
+/* choose the coding by q-value, or return -1 if none */
+static int phl_gzip_negotiate(struct phl_request *r, struct phl_gzip_conf *conf)
+{
+	double qvalues[PHL_GZIP_CODING_NUM];
+	phl_request_accept_encodings(r, phl_gzip_coding_names, PHL_GZIP_CODING_NUM, qvalues);
+
+	int best = -1;
+	for (int i = 0; i < PHL_GZIP_CODING_NUM; i++) {
+		if (qvalues[i] <= 0 || !phl_gzip_coding_enabled(conf, i)) {
+			continue;
+		}
+		if (best == -1 || qvalues[i] > qvalues[best]) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* === cache of compressed responses
+ *
+ * The identical responses are compressed once and kept in shared-memory,
+ * keyed by the response identity, the coding and the level. The identity
+ * is returned by `cache.key` if set, or the host, path and ETag. */
+
+static int phl_gzip_coding_level(struct phl_gzip_conf *conf, enum phl_gzip_coding coding)
+{
+	switch (coding) {
+	case PHL_GZIP_CODING_BR:
+		return conf->brotli_level;
+	case PHL_GZIP_CODING_ZSTD:
+		return conf->zstd_level;
+	default:
+		return conf->level;
+	}
+}
+
+/* returns false if the response is not cacheable */
+static bool phl_gzip_cache_hash(struct phl_request *r, struct phl_gzip_conf *conf,
+		enum phl_gzip_coding coding, uint64_t *hash)
+{
+	const char *host = "", *path = "";
+	const char *id;
+	int id_len;
+	if (wuy_cflua_is_function_set(conf->cache.key)) {
+		id = phl_key_get(r, conf->cache.key, &id_len, NULL);
+	} else {
+		struct phl_header *etag = phl_header_get(&r->resp.headers, "ETag");
+		id = etag != NULL ? phl_header_value(etag) : NULL;
+		id_len = etag != NULL ? etag->value_len : 0;
+		host = r->req.host != NULL ? r->req.host : "";
+		path = r->req.uri.path;
+	}
+	if (id == NULL || id_len == 0) {
+		return false;
+	}
+
+	char *key = wuy_pool_alloc(r->pool, strlen(host) + strlen(path) + id_len + 30);
+	int key_len = sprintf(key, "%d:%d:%s:%s:%.*s", coding,
+			phl_gzip_coding_level(conf, coding), host, path, id_len, id);
+
+	wuy_vhash128(key, key_len, hash);
+	return true;
+}
+
+static struct phl_gzip_cache_entry *phl_gzip_cache_search(
+		struct phl_gzip_cache *cache, const uint64_t *hash)
+{
+	wuy_nop_hlist_t *bucket = &cache->buckets[hash[0] % cache->hash_buckets];
+
+	struct phl_gzip_cache_entry *entry;
+	wuy_nop_hlist_iter_type(bucket, entry, hash_node, cache) {
+		if (entry->hash[0] == hash[0] && entry->hash[1] == hash[1]) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void phl_gzip_cache_free(struct phl_gzip_cache *cache,
+		struct phl_gzip_cache_entry *entry)
+{
+	wuy_nop_hlist_delete(&entry->hash_node, cache);
+	phl_slab_free(&cache->slab, entry);
+}
+
+/* Copy the compressed response into r->pool if hit. */
+static char *phl_gzip_cache_load(struct phl_request *r, struct phl_gzip_conf *conf,
+		const uint64_t *hash, int *p_len)
+{
+	struct phl_gzip_cache *cache = conf->cache_shm;
+
+	pthread_mutex_lock(&cache->lock);
+
+	struct phl_gzip_cache_entry *entry = phl_gzip_cache_search(cache, hash);
+	if (entry == NULL) {
+		pthread_mutex_unlock(&cache->lock);
+		return NULL;
+	}
+	if (time(NULL) >= entry->expire_at) {
+		phl_gzip_cache_free(cache, entry);
+		pthread_mutex_unlock(&cache->lock);
+		return NULL;
+	}
+
+	phl_slab_touch(&cache->slab, entry);
+
+	char *data = wuy_pool_alloc(r->pool, entry->length);
+	memcpy(data, entry->data, entry->length);
+	*p_len = entry->length;
+
+	pthread_mutex_unlock(&cache->lock);
+	return data;
+}
+
+static void phl_gzip_cache_evict(void *slot, void *data)
+{
+	struct phl_gzip_conf *conf = data;
+	struct phl_gzip_cache_entry *entry = slot;
+	atomic_fetch_add(&conf->stats->cache_evict, 1);
+	wuy_nop_hlist_delete(&entry->hash_node, conf->cache_shm);
+}
+
+static void phl_gzip_cache_store(struct phl_request *r, struct phl_gzip_conf *conf,
+		const uint64_t *hash, const uint8_t *data, int len)
+{
+	struct phl_gzip_cache *cache = conf->cache_shm;
+
+	pthread_mutex_lock(&cache->lock);
+
+	/* delete the old one if any */
+	struct phl_gzip_cache_entry *entry = phl_gzip_cache_search(cache, hash);
+	if (entry != NULL) {
+		phl_gzip_cache_free(cache, entry);
+	}
+
+	entry = phl_slab_alloc(&cache->slab, sizeof(struct phl_gzip_cache_entry) + len,
+			phl_gzip_cache_evict, conf);
+	if (entry == NULL) {
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+
+	entry->hash[0] = hash[0];
+	entry->hash[1] = hash[1];
+	entry->length = len;
+	entry->expire_at = time(NULL) + conf->cache.expire;
+	memcpy(entry->data, data, len);
+
+	wuy_nop_hlist_insert(&cache->buckets[hash[0] % cache->hash_buckets],
+			&entry->hash_node, cache);
+
+	pthread_mutex_unlock(&cache->lock);
+
+	atomic_fetch_add(&conf->stats->cache_store, 1);
+	phl_request_log(r, PHL_LOG_DEBUG, "gzip: store cache %d", len);
+}
+
+/* collect the output, and store it at last */
+static void phl_gzip_cache_collect(struct phl_request *r, struct phl_gzip_conf *conf,
+		struct phl_gzip_ctx *ctx, struct phl_buf_chain *chain)
+{
+	for (struct phl_buf *b = chain->head; b != NULL; b = b->next) {
+		int need = ctx->cache_len + b->len;
+		if (need > conf->cache.max_item) { /* too big */
+			ctx->cache_store = false;
+			return;
+		}
+		if (need > ctx->cache_size) {
+			/* grow by doubling, capped by max_item */
+			int size = MAX(ctx->cache_size * 2, need);
+			if (size > conf->cache.max_item) {
+				size = conf->cache.max_item;
+			}
+			ctx->cache_buf = wuy_pool_realloc(r->pool, ctx->cache_buf, size);
+			ctx->cache_size = size;
+		}
+		memcpy(ctx->cache_buf + ctx->cache_len, b->data, b->len);
+		ctx->cache_len += b->len;
+	}
+
+	if (chain->is_last) {
+		phl_gzip_cache_store(r, conf, ctx->cache_hash, ctx->cache_buf, ctx->cache_len);
+		ctx->cache_store = false;
+	}
+}
+
+static const char *phl_gzip_cache_init(struct phl_gzip_conf *conf)
+{
+	/* the page size is the max slot size */
+	int page_size = phl_slab_page_size(
+			sizeof(struct phl_gzip_cache_entry) + conf->cache.max_item);
+	if (page_size == 0) {
+		return "too big cache.max_item";
+	}
+	int page_num = conf->cache.total / page_size;
+	if (page_num < 2) {
+		return "too small cache.total";
+	}
+
+	int hash_buckets = page_num * 8;
+	size_t head_size = sizeof(struct phl_gzip_cache)
+			+ sizeof(wuy_nop_hlist_t) * hash_buckets;
+
+	conf->stats = wuy_shmpool_alloc(sizeof(struct phl_gzip_stats));
+	conf->cache_shm = wuy_shmpool_alloc(head_size + (size_t)page_size * page_num);
+
+	struct phl_gzip_cache *cache = conf->cache_shm;
+	if (cache->has_inited) {
+		return WUY_CFLUA_OK;
+	}
+
+	cache->has_inited = true;
+	phl_slab_init(&cache->slab, (char *)cache + head_size, page_size, page_num);
+	cache->hash_buckets = hash_buckets;
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, 1);
+	pthread_mutex_init(&cache->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	return WUY_CFLUA_OK;
+}
+
+static bool phl_gzip_ctx_init(struct phl_gzip_conf *conf, struct phl_gzip_ctx *ctx)
+{
+	switch (ctx->coding) {
+	case PHL_GZIP_CODING_GZIP:
+		if (conf->zs_pool_num > 0) {
+			ctx->zs = conf->zs_pool[--conf->zs_pool_num];
+			return true;
+		}
+		ctx->zs = calloc(1, sizeof(z_stream));
+		if (deflateInit2(ctx->zs, conf->level, Z_DEFLATED, conf->window_bits + 16,
+				conf->mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+			free(ctx->zs);
+			return false;
+		}
+		return true;
+
+	case PHL_GZIP_CODING_ZSTD:
+		if (conf->zc_pool_num > 0) {
+			ctx->zc = conf->zc_pool[--conf->zc_pool_num];
+			return true;
+		}
+		ctx->zc = ZSTD_createCCtx();
+		if (ctx->zc == NULL) {
+			return false;
+		}
+		ZSTD_CCtx_setParameter(ctx->zc, ZSTD_c_compressionLevel, conf->zstd_level);
+		return true;
+
+	case PHL_GZIP_CODING_BR:
+		ctx->bs = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+		if (ctx->bs == NULL) {
+			return false;
+		}
+		BrotliEncoderSetParameter(ctx->bs, BROTLI_PARAM_QUALITY, conf->brotli_level);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/* add Accept-Encoding into Vary, if not listed yet */
+static void phl_gzip_add_vary(struct phl_request *r)
+{
+	struct phl_header *h = phl_header_get(&r->resp.headers, "Vary");
+	if (h == NULL) {
+		phl_header_add_lite(&r->resp.headers, "Vary", "Accept-Encoding", 15, r->pool);
+		return;
+	}
+
+	const char *p = phl_header_value(h);
+	const char *end = p + h->value_len;
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == ',')) {
+			p++;
+		}
+		const char *token = p;
+		while (p < end && *p != ' ' && *p != ',') {
+			p++;
+		}
+		int len = p - token;
+		if (len == 1 && token[0] == '*') {
+			return;
+		}
+		if (len == 15 && strncasecmp(token, "Accept-Encoding", 15) == 0) {
+			return;
+		}
+	}
+
+	char value[h->value_len + 20];
+	int value_len = sprintf(value, "%s, Accept-Encoding", phl_header_value(h));
+	phl_header_delete(&r->resp.headers, "Vary");
+	phl_header_add_lite(&r->resp.headers, "Vary", value, value_len, r->pool);
+}
+
 static int phl_gzip_filter_response_headers(struct phl_request *r)
 {
 	struct phl_gzip_conf *conf = r->conf_path->module_confs[phl_gzip_module.index];
-	if (conf->level == 0) {
+	if (conf->level == 0 && conf->brotli_level == 0 && conf->zstd_level == 0) {
 		return PHL_OK;
 	}
 	if (r->resp.status_code != WUY_HTTP_200) {
@@ -37,59 +440,328 @@ static int phl_gzip_filter_response_headers(struct phl_request *r)
 		return PHL_OK;
 	}
 
-	/* enable gzip */
+	/* the response varies by Accept-Encoding since now */
+	phl_gzip_add_vary(r);
 
-	r->resp.content_length = PHL_CONTENT_LENGTH_INIT,
-	phl_header_add(&r->resp.headers, "Content-Encoding", 16, "gzip", 4, r->pool);
+	int coding = phl_gzip_negotiate(r, conf);
+	if (coding < 0) {
+		return PHL_OK;
+	}
+
+	/* Serve the cached one directly, with Content-Length. The content's
+	 * body is not read then, e.g. the upstream connection of proxy is
+	 * not reused, which is cheaper than compressing again. */
+	uint64_t hash[2];
+	bool cacheable = conf->cache_shm != NULL && phl_gzip_cache_hash(r, conf, coding, hash);
+	if (cacheable) {
+		int len;
+		char *data = phl_gzip_cache_load(r, conf, hash, &len);
+		if (data != NULL) {
+			atomic_fetch_add(&conf->stats->cache_hit, 1);
 
-	z_streamp zs = wuy_pool_alloc(r->pool, sizeof(*zs));
-	deflateInit2(zs, conf->level, Z_DEFLATED, conf->window_bits + 16,
-			conf->mem_level, Z_DEFAULT_STRATEGY);
+			r->resp.easy_string = data;
+			r->resp.easy_str_len = len;
+			r->resp.content_length = len;
+			r->resp.content_original_length = len;
+			r->resp.body_replaced = true;
+			phl_header_add_lite(&r->resp.headers, "Content-Encoding",
+					phl_gzip_coding_names[coding],
+					strlen(phl_gzip_coding_names[coding]), r->pool);
+			return PHL_OK;
+		}
+		atomic_fetch_add(&conf->stats->cache_miss, 1);
+	}
+
+	/* enable compression */
+
+	struct phl_gzip_ctx *ctx = wuy_pool_alloc(r->pool, sizeof(struct phl_gzip_ctx));
+	ctx->coding = coding;
+	ctx->outs = NULL;
+	ctx->out_num = 0;
+	ctx->cache_store = false;
+	ctx->cache_buf = NULL;
+	ctx->cache_len = 0;
+	ctx->cache_size = 0;
+	if (!phl_gzip_ctx_init(conf, ctx)) {
+		phl_request_log(r, PHL_LOG_ERROR, "gzip: fail to init %s",
+				phl_gzip_coding_names[coding]);
+		return PHL_OK;
+	}
 
-	r->module_ctxs[phl_gzip_module.index] = zs;
+	if (cacheable) {
+		ctx->cache_hash[0] = hash[0];
+		ctx->cache_hash[1] = hash[1];
+		ctx->cache_store = true;
+
+		/* the compressed output is mostly smaller than the original,
+		 * so start the collect buffer with the original length */
+		ctx->cache_size = PHL_GZIP_CACHE_CHUNK;
+		if (r->resp.content_length != PHL_CONTENT_LENGTH_INIT
+				&& r->resp.content_length < (size_t)conf->cache.max_item) {
+			ctx->cache_size = MAX((int)r->resp.content_length, PHL_GZIP_CACHE_CHUNK);
+		}
+		if (ctx->cache_size > conf->cache.max_item) {
+			ctx->cache_size = conf->cache.max_item;
+		}
+		ctx->cache_buf = wuy_pool_alloc(r->pool, ctx->cache_size);
+	}
+
+	r->resp.content_length = PHL_CONTENT_LENGTH_INIT;
+	phl_header_add_lite(&r->resp.headers, "Content-Encoding",
+			phl_gzip_coding_names[coding],
+			strlen(phl_gzip_coding_names[coding]), r->pool);
+
+	r->module_ctxs[phl_gzip_module.index] = ctx;
 	return PHL_OK;
 }
 
-static int phl_gzip_filter_response_body(struct phl_request *r, uint8_t *data,
-		int data_len, int buf_len, bool *p_is_last)
+/* Compress from @p_in into @p_out, and move them forward.
+ * Return PHL_BREAK if the stream is finished, or PHL_OK for more. */
+static int phl_gzip_compress(struct phl_request *r, struct phl_gzip_ctx *ctx,
+		const uint8_t **p_in, int *p_in_len, uint8_t **p_out, int *p_out_len,
+		bool is_last)
 {
-	z_streamp zs = r->module_ctxs[phl_gzip_module.index];
-	if (zs == NULL) {
-		return data_len;
+	switch (ctx->coding) {
+	case PHL_GZIP_CODING_GZIP: {
+		z_streamp zs = ctx->zs;
+		zs->next_in = (Bytef *)*p_in;
+		zs->avail_in = *p_in_len;
+		zs->next_out = *p_out;
+		zs->avail_out = *p_out_len;
+
+		/* Z_BUF_ERROR just means no progress */
+		int ret = deflate(zs, is_last ? Z_FINISH : Z_NO_FLUSH);
+		if (ret == Z_STREAM_ERROR) {
+			phl_request_log(r, PHL_LOG_ERROR, "gzip: deflate() %d", ret);
+			return PHL_ERROR;
+		}
+
+		*p_in += *p_in_len - zs->avail_in;
+		*p_in_len = zs->avail_in;
+		*p_out += *p_out_len - zs->avail_out;
+		*p_out_len = zs->avail_out;
+		return ret == Z_STREAM_END ? PHL_BREAK : PHL_OK;
+	}
+
+	case PHL_GZIP_CODING_ZSTD: {
+		ZSTD_inBuffer in = { *p_in, *p_in_len, 0 };
+		ZSTD_outBuffer out = { *p_out, *p_out_len, 0 };
+
+		size_t ret = ZSTD_compressStream2(ctx->zc, &out, &in,
+				is_last ? ZSTD_e_end : ZSTD_e_continue);
+		if (ZSTD_isError(ret)) {
+			phl_request_log(r, PHL_LOG_ERROR, "gzip: ZSTD_compressStream2() %s",
+					ZSTD_getErrorName(ret));
+			return PHL_ERROR;
+		}
+
+		*p_in += in.pos;
+		*p_in_len -= in.pos;
+		*p_out += out.pos;
+		*p_out_len -= out.pos;
+		return is_last && ret == 0 ? PHL_BREAK : PHL_OK;
 	}
 
-	zs->next_in = data;
-	zs->avail_in = data_len;
+	case PHL_GZIP_CODING_BR: {
+		size_t avail_in = *p_in_len, avail_out = *p_out_len;
+
+		if (!BrotliEncoderCompressStream(ctx->bs,
+				is_last ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+				&avail_in, p_in, &avail_out, p_out, NULL)) {
+			phl_request_log(r, PHL_LOG_ERROR, "gzip: BrotliEncoderCompressStream() fail");
+			return PHL_ERROR;
+		}
 
-	uint8_t out_buf[buf_len];
-	zs->next_out = out_buf;
-	zs->avail_out = buf_len;
+		*p_in_len = avail_in;
+		*p_out_len = avail_out;
+		return is_last && BrotliEncoderIsFinished(ctx->bs) ? PHL_BREAK : PHL_OK;
+	}
 
-	int ret = deflate(zs, *p_is_last ? Z_FINISH : Z_NO_FLUSH);
-	if (ret != Z_STREAM_END) {
-		phl_request_log(r, PHL_LOG_ERROR, "gzip: defalte() %d: "
-				"in=%d out=%d, avail_in=%d avail_out=%d",
-				ret, data_len, buf_len, zs->avail_in, zs->avail_out);
+	default:
 		return PHL_ERROR;
 	}
+}
+
+/* get the @i-th output buffer, and allocate it if not yet */
+static struct phl_buf *phl_gzip_out_buf(struct phl_request *r,
+		struct phl_gzip_ctx *ctx, int i)
+{
+	if (i == ctx->out_num) {
+		ctx->out_num++;
+		ctx->outs = wuy_pool_realloc(r->pool, ctx->outs,
+				sizeof(struct phl_buf) * ctx->out_num);
+		ctx->outs[i].data = wuy_pool_alloc(r->pool, PHL_GZIP_OUT_SIZE);
+	}
+
+	struct phl_buf *out = &ctx->outs[i];
+	out->len = 0;
+	out->next = NULL;
+	return out;
+}
+
+/* Replace the chain by the compressed data, which may be several buffers,
+ * or none if the compressor keeps it for now. */
+static int phl_gzip_filter_response_body(struct phl_request *r,
+		struct phl_buf_chain *chain)
+{
+	struct phl_gzip_ctx *ctx = r->module_ctxs[phl_gzip_module.index];
+	if (ctx == NULL) {
+		return PHL_OK;
+	}
+	if (chain->head == NULL && !chain->is_last) {
+		return PHL_OK;
+	}
+
+	int out_i = 0;
+	struct phl_buf *out = phl_gzip_out_buf(r, ctx, out_i);
+
+	struct phl_buf *b = chain->head;
+	do {
+		const uint8_t *in = b != NULL ? b->data : NULL;
+		int in_len = b != NULL ? b->len : 0;
+		bool is_last = chain->is_last && (b == NULL || b->next == NULL);
+
+		while (1) {
+			if (out->len == PHL_GZIP_OUT_SIZE) {
+				out = phl_gzip_out_buf(r, ctx, ++out_i);
+			}
+
+			uint8_t *out_pos = (uint8_t *)out->data + out->len;
+			int out_space = PHL_GZIP_OUT_SIZE - out->len;
 
-	int out_len = buf_len - zs->avail_out;
-	memcpy(data, out_buf, out_len);
+			int ret = phl_gzip_compress(r, ctx, &in, &in_len,
+					&out_pos, &out_space, is_last);
+			if (ret == PHL_ERROR) {
+				return PHL_ERROR;
+			}
 
-	return out_len;
+			out->len = PHL_GZIP_OUT_SIZE - out_space;
+
+			if (ret == PHL_BREAK) { /* finished */
+				break;
+			}
+			if (!is_last && in_len == 0 && out_space > 0) { /* wait for more input */
+				break;
+			}
+		}
+
+		if (b != NULL) {
+			b = b->next;
+		}
+	} while (b != NULL);
+
+	/* link the output buffers, the array is not moved since now */
+	if (out->len == 0) {
+		out_i--;
+	}
+	for (int i = 0; i < out_i; i++) {
+		ctx->outs[i].next = &ctx->outs[i + 1];
+	}
+	chain->head = out_i >= 0 ? &ctx->outs[0] : NULL;
+
+	if (ctx->cache_store) {
+		struct phl_gzip_conf *conf = r->conf_path->module_confs[phl_gzip_module.index];
+		phl_gzip_cache_collect(r, conf, ctx, chain);
+	}
+	return PHL_OK;
 }
 
+/* put the context back into pool, or free it */
 static void phl_gzip_ctx_free(struct phl_request *r)
 {
-	z_streamp zs = r->module_ctxs[phl_gzip_module.index];
-	deflateEnd(zs);
+	struct phl_gzip_conf *conf = r->conf_path->module_confs[phl_gzip_module.index];
+	struct phl_gzip_ctx *ctx = r->module_ctxs[phl_gzip_module.index];
+
+	switch (ctx->coding) {
+	case PHL_GZIP_CODING_GZIP:
+		if (conf->zs_pool_num < PHL_GZIP_POOL_SIZE && deflateReset(ctx->zs) == Z_OK) {
+			conf->zs_pool[conf->zs_pool_num++] = ctx->zs;
+		} else {
+			deflateEnd(ctx->zs);
+			free(ctx->zs);
+		}
+		break;
+
+	case PHL_GZIP_CODING_ZSTD:
+		if (conf->zc_pool_num < PHL_GZIP_POOL_SIZE && !ZSTD_isError(
+					ZSTD_CCtx_reset(ctx->zc, ZSTD_reset_session_only))) {
+			conf->zc_pool[conf->zc_pool_num++] = ctx->zc;
+		} else {
+			ZSTD_freeCCtx(ctx->zc);
+		}
+		break;
+
+	case PHL_GZIP_CODING_BR:
+		BrotliEncoderDestroyInstance(ctx->bs);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void phl_gzip_stats_path(void *data, wuy_json_t *json)
+{
+	struct phl_gzip_conf *conf = data;
+	struct phl_gzip_stats *stats = conf->stats;
+	if (stats == NULL) {
+		return;
+	}
+
+	wuy_json_object_object(json, "gzip");
+	wuy_json_object_int(json, "cache_hit", atomic_load(&stats->cache_hit));
+	wuy_json_object_int(json, "cache_miss", atomic_load(&stats->cache_miss));
+	wuy_json_object_int(json, "cache_store", atomic_load(&stats->cache_store));
+	wuy_json_object_int(json, "cache_evict", atomic_load(&stats->cache_evict));
+	wuy_json_object_close(json);
 }
 
 /* configuration */
 
+static const char *phl_gzip_conf_post(void *data)
+{
+	struct phl_gzip_conf *conf = data;
+
+	if (conf->cache.total > 0) {
+		return phl_gzip_cache_init(conf);
+	}
+	return WUY_CFLUA_OK;
+}
+
+static struct wuy_cflua_command phl_gzip_cache_commands[] = {
+	{	.name = "max_item",
+		.description = "Max size of compressed response to keep.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_gzip_conf, cache.max_item),
+		.limits.n = WUY_CFLUA_LIMITS_POSITIVE,
+		.default_value.n = 256 * 1024,
+	},
+	{	.name = "total",
+		.description = "Size of shared-memory. Set 0 to disable.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_gzip_conf, cache.total),
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+	},
+	{	.name = "expire",
+		.description = "Expire time of the kept responses.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_gzip_conf, cache.expire),
+		.limits.n = WUY_CFLUA_LIMITS_POSITIVE,
+		.default_value.n = 600,
+	},
+	{	.name = "key",
+		.description = "Return a string to identify the original response. "
+			"The host, path and ETag are used if not set, "
+			"and the response is not kept if no ETag.",
+		.type = WUY_CFLUA_TYPE_FUNCTION,
+		.offset = offsetof(struct phl_gzip_conf, cache.key),
+	},
+	{ NULL }
+};
+
 static struct wuy_cflua_command phl_gzip_conf_commands[] = {
 	{	.type = WUY_CFLUA_TYPE_INTEGER,
-		.description = "Compress level. 0 is disable, 1 is fastest, and 9 is best compression.",
+		.description = "Gzip compress level. 0 is disable, 1 is fastest, and 9 is best compression.",
 		.is_single_array = true,
 		.offset = offsetof(struct phl_gzip_conf, level),
 		.limits.n = WUY_CFLUA_LIMITS(0, 9),
@@ -106,6 +778,18 @@ static struct wuy_cflua_command phl_gzip_conf_commands[] = {
 		.limits.n = WUY_CFLUA_LIMITS(1, 9),
 		.default_value.n = 8,
 	},
+	{	.name = "brotli",
+		.description = "Brotli compress level. 0 is disable, 1 is fastest, and 11 is best compression.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_gzip_conf, brotli_level),
+		.limits.n = WUY_CFLUA_LIMITS(0, 11),
+	},
+	{	.name = "zstd",
+		.description = "Zstd compress level. 0 is disable, 1 is fastest, and 19 is best compression.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_gzip_conf, zstd_level),
+		.limits.n = WUY_CFLUA_LIMITS(0, 19),
+	},
 	{	.name = "min_length",
 		.type = WUY_CFLUA_TYPE_INTEGER,
 		.offset = offsetof(struct phl_gzip_conf, min_length),
@@ -117,6 +801,12 @@ static struct wuy_cflua_command phl_gzip_conf_commands[] = {
 		.type = WUY_CFLUA_TYPE_FUNCTION,
 		.offset = offsetof(struct phl_gzip_conf, filter),
 	},
+	{	.name = "cache",
+		.description = "Keep compressed responses in shared-memory, "
+			"so the identical ones are compressed once.",
+		.type = WUY_CFLUA_TYPE_TABLE,
+		.u.table = &(struct wuy_cflua_table) { phl_gzip_cache_commands },
+	},
 	{ NULL }
 };
 
@@ -124,11 +814,13 @@ struct phl_module phl_gzip_module = {
 	.name = "gzip",
 	.command_path = {
 		.name = "gzip",
-		.description = "Gzip filter module.",
+		.description = "Compression filter module, with gzip, brotli and zstd, "
+			"which is chosen by Accept-Encoding.",
 		.type = WUY_CFLUA_TYPE_TABLE,
 		.u.table = &(struct wuy_cflua_table) {
 			.commands = phl_gzip_conf_commands,
 			.size = sizeof(struct phl_gzip_conf),
+			.post = phl_gzip_conf_post,
 		}
 	},
 
@@ -137,4 +829,5 @@ struct phl_module phl_gzip_module = {
 		.response_body = phl_gzip_filter_response_body,
 	},
 	.ctx_free = phl_gzip_ctx_free,
+	.stats_path = phl_gzip_stats_path,
 };
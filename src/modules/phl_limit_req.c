@@ -7,33 +7,76 @@ struct phl_limit_req_node {
 	struct wuy_meter_node	meter;
 	wuy_nop_hlist_node_t	hash_node;
 	wuy_nop_list_node_t	list_node; /* on LRU or free list */
-	char			key[0]; /* length=conf->key_max_len */
+	uint8_t			key_len;
+	char			key[0]; /* binary, length=conf->key_max_len */
 };
 
-struct phl_limit_req_shared {
+/* The table is divided into shards by key hash. Each shard has its own
+ * lock, LRU list, hash buckets and nodes, so requests with different
+ * keys seldom contend. */
+struct phl_limit_req_shard {
 	pthread_mutex_t		lock;
-	bool			has_inited;
 	wuy_nop_list_t		lru_list;
 	wuy_nop_list_t		free_list;
 
-	struct phl_limit_req_node	*used_pos;
-	const struct phl_limit_req_node	*nodes_end;
+	char			*used_pos;
+	const char		*nodes_end;
 
+	/* protected by lock, except contended */
 	long			stats_total;
 	long			stats_limited;
+	long			stats_evicted;
+	atomic_long		stats_contended;
 
 	wuy_nop_hlist_t		hash_buckets[0];
 };
 
+struct phl_limit_req_shared {
+	bool			has_inited;
+};
+
+/* Tokens leased from the shared meter in approximate mode, in each worker.
+ * It is a direct-mapped table, and the old lease is dropped on collision. */
+struct phl_limit_req_lease {
+	uint64_t		hash;
+	long			expire_ms;
+	int			tokens;
+	bool			denied; /* until expire_ms */
+	uint8_t			key_len;
+	char			key[0];
+};
+
+#define PHL_LIMIT_REQ_ROUND(n, a)	(((n) + (a) - 1) / (a) * (a))
+
+/* shards are aligned to cache line to avoid false sharing */
+#define PHL_LIMIT_REQ_ALIGN		64
+#define PHL_LIMIT_REQ_SHARED_SIZE	PHL_LIMIT_REQ_ROUND(sizeof(struct phl_limit_req_shared), PHL_LIMIT_REQ_ALIGN)
+
 struct phl_limit_req_conf {
 	wuy_cflua_function_t	key;
 	int			key_max_len;
+	int			ipv6_prefix;
 	struct wuy_meter_conf	meter;
 	struct phl_log		*log;
 	int			size;
 	int			hash_buckets;
+	int			shards;
 	int			log_mod;
 
+	struct {
+		int		error;
+		int		lease_time;
+		int		items;
+	} approximate;
+
+	int			lease; /* tokens of each lease, 0 for exact mode */
+	int			lease_size;
+	char			*leases; /* allocated in each worker */
+
+	int			node_size;
+	int			shard_size;
+	int			shard_buckets;
+
 	struct phl_limit_req_shared	*shared;
 };
 
@@ -42,117 +85,241 @@ struct phl_module phl_limit_req_module;
 #define _log(level, fmt, ...) phl_request_log_at(r, \
 		conf->log, level, "limit_req: " fmt, ##__VA_ARGS__)
 
-static void phl_limit_req_expire(struct phl_limit_req_conf *conf)
+static struct phl_limit_req_shard *phl_limit_req_shard(struct phl_limit_req_conf *conf, int i)
 {
-	struct phl_limit_req_shared *shared = conf->shared;
+	return (void *)((char *)conf->shared + PHL_LIMIT_REQ_SHARED_SIZE + (long)conf->shard_size * i);
+}
 
+static void phl_limit_req_lock(struct phl_limit_req_shard *shard)
+{
+	if (pthread_mutex_trylock(&shard->lock) != 0) {
+		atomic_fetch_add(&shard->stats_contended, 1);
+		pthread_mutex_lock(&shard->lock);
+	}
+}
+
+static void phl_limit_req_expire(struct phl_limit_req_conf *conf,
+		struct phl_limit_req_shard *shard)
+{
 	struct phl_limit_req_node *node;
-	while (wuy_nop_list_first_type(&shared->lru_list, node, list_node)) {
+	while (wuy_nop_list_first_type(&shard->lru_list, node, list_node)) {
 		if (!wuy_meter_is_expired(&conf->meter, &node->meter)) {
 			break;
 		}
 
-		wuy_nop_hlist_delete(&node->hash_node, shared);
-		wuy_nop_list_delete(&shared->lru_list, &node->list_node);
-		wuy_nop_list_append(&shared->free_list, &node->list_node);
+		wuy_nop_hlist_delete(&node->hash_node, shard);
+		wuy_nop_list_delete(&shard->lru_list, &node->list_node);
+		wuy_nop_list_append(&shard->free_list, &node->list_node);
 	}
 }
 
-static struct phl_limit_req_node *phl_limit_req_alloc_node(struct phl_limit_req_conf *conf)
+static struct phl_limit_req_node *phl_limit_req_alloc_node(struct phl_limit_req_conf *conf,
+		struct phl_limit_req_shard *shard)
 {
-	phl_limit_req_expire(conf);
-
-	struct phl_limit_req_shared *shared = conf->shared;
+	phl_limit_req_expire(conf, shard);
 
 	/* reuse freed node */
 	struct phl_limit_req_node *node;
-	wuy_nop_list_pop_type(&shared->free_list, node, list_node);
+	wuy_nop_list_pop_type(&shard->free_list, node, list_node);
 	if (node != NULL) {
 		return node;
 	}
 
 	/* allocate new node */
-	if (shared->used_pos < shared->nodes_end) {
-		node = shared->used_pos++;
-		shared->used_pos = (void *)((char *)shared->used_pos + conf->key_max_len);
+	if (shard->used_pos + conf->node_size <= shard->nodes_end) {
+		node = (struct phl_limit_req_node *)shard->used_pos;
+		shard->used_pos += conf->node_size;
 		return node;
 	}
 
-	/* LRU list */
-	wuy_nop_list_pop_type(&shared->lru_list, node, list_node);
-	wuy_nop_hlist_delete(&node->hash_node, shared);
-	wuy_nop_list_delete(&shared->lru_list, &node->list_node);
+	/* evict the least recently used one, although not expired */
+	wuy_nop_list_pop_type(&shard->lru_list, node, list_node);
+	wuy_nop_hlist_delete(&node->hash_node, shard);
+	shard->stats_evicted++;
 	return node;
 }
 
+/* Binary key of client address. IPv6 addresses are masked by
+ * conf->ipv6_prefix, because a client usually owns a whole /64. */
+static int phl_limit_req_addr_key(struct phl_limit_req_conf *conf,
+		struct phl_request *r, uint8_t *key)
+{
+	struct sockaddr *sa = &r->c->client_addr;
+	if (sa->sa_family == AF_INET6) {
+		const struct in6_addr *addr = &r->c->client_addr_in6.sin6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(addr)) {
+			memcpy(key, &addr->s6_addr[12], 4);
+			return 4;
+		}
+
+		int len = (conf->ipv6_prefix + 7) / 8;
+		memcpy(key, addr->s6_addr, len);
+		if (conf->ipv6_prefix % 8 != 0) {
+			key[len - 1] &= 0xFF << (8 - conf->ipv6_prefix % 8);
+		}
+		return len;
+	}
+
+	memcpy(key, &((struct sockaddr_in *)sa)->sin_addr, 4);
+	return 4;
+}
+
+/* Take @want tokens from the shared meter, and return the number granted. */
+static int phl_limit_req_take(struct phl_request *r, struct phl_limit_req_conf *conf,
+		const void *key, int len, uint64_t hash, int want)
+{
+	/* locate shard and bucket */
+	struct phl_limit_req_shard *shard = phl_limit_req_shard(conf, hash % conf->shards);
+	wuy_nop_hlist_t *bucket = &shard->hash_buckets[(hash / conf->shards) % conf->shard_buckets];
+
+	phl_limit_req_lock(shard); /* lock here */
+	shard->stats_total++;
+
+	bool found = false;
+	struct phl_limit_req_node *node;
+	wuy_nop_hlist_iter_type(bucket, node, hash_node, shard) {
+		if (node->key_len == len && memcmp(node->key, key, len) == 0) {
+			found = true;
+			break;
+		}
+	}
+
+	int granted = 0;
+
+	/* not found, create new meter, and the first one passes */
+	if (!found) {
+		_log(PHL_LOG_DEBUG, "new meter. %ld", shard->stats_total);
+
+		node = phl_limit_req_alloc_node(conf, shard);
+		node->key_len = len;
+		memcpy(node->key, key, len);
+		wuy_meter_init(&node->meter);
+		wuy_nop_hlist_insert(bucket, &node->hash_node, shard);
+		wuy_nop_list_append(&shard->lru_list, &node->list_node);
+		granted = 1;
+
+	/* found, move to the tail of LRU list */
+	} else {
+		wuy_nop_list_delete(&shard->lru_list, &node->list_node);
+		wuy_nop_list_append(&shard->lru_list, &node->list_node);
+	}
+
+	while (granted < want && wuy_meter_check(&conf->meter, &node->meter)) {
+		granted++;
+	}
+
+	if (granted == 0) {
+		shard->stats_limited++;
+	}
+
+	pthread_mutex_unlock(&shard->lock); /* unlock here */
+	return granted;
+}
+
+/* Approximate mode. Decide by the local lease, and take a new lease
+ * from the shared meter only if it is used up or expired. */
+static int phl_limit_req_approximate(struct phl_request *r, struct phl_limit_req_conf *conf,
+		const void *key, int len, uint64_t hash)
+{
+	if (conf->leases == NULL) {
+		conf->leases = calloc(conf->approximate.items, conf->lease_size);
+	}
+
+	struct phl_limit_req_lease *lease = (void *)(conf->leases
+			+ (long)conf->lease_size * (hash % conf->approximate.items));
+
+	long now = wuy_time_ms();
+	if (now < lease->expire_ms && lease->hash == hash && lease->key_len == len
+			&& memcmp(lease->key, key, len) == 0) {
+		if (lease->tokens > 0) {
+			lease->tokens--;
+			return 1;
+		}
+		if (lease->denied) {
+			return 0;
+		}
+	}
+
+	int granted = phl_limit_req_take(r, conf, key, len, hash, conf->lease);
+
+	lease->hash = hash;
+	lease->key_len = len;
+	memcpy(lease->key, key, len);
+	lease->expire_ms = now + conf->approximate.lease_time;
+	lease->denied = granted == 0;
+	lease->tokens = granted > 0 ? granted - 1 : 0;
+	return granted;
+}
+
 static int phl_limit_req_process_headers(struct phl_request *r)
 {
 	struct phl_limit_req_conf *conf = r->conf_path->module_confs[phl_limit_req_module.index];
-	struct phl_limit_req_shared *shared = conf->shared;
 
-	if (shared == NULL) {
+	if (conf->shared == NULL) {
 		return PHL_OK;
 	}
 
 	/* generate key */
 	int len;
+	uint64_t hash;
 	const void *key;
+	uint8_t addr_key[16];
 	if (wuy_cflua_is_function_set(conf->key)) {
-		key = phl_lua_call_lstring(r, conf->key, &len);
+		key = phl_key_get(r, conf->key, &len, &hash);
 		if (key == NULL) {
 			_log(PHL_LOG_ERROR, "fail in key()");
 			return PHL_ERROR;
 		}
 	} else {
-		// TODO ipv6
-		key = &((struct sockaddr_in *)(&r->c->client_addr))->sin_addr;
-		len = sizeof(struct in_addr);
+		len = phl_limit_req_addr_key(conf, r, addr_key);
+		key = addr_key;
+		hash = wuy_vhash64(key, len);
 	}
 
-	if (len >= conf->key_max_len) {
+	if (len > conf->key_max_len) {
 		_log(PHL_LOG_ERROR, "too long key!");
 		return PHL_ERROR;
 	}
 
-	/* hash search */
-	uint64_t hash = wuy_vhash64(key, len) % conf->hash_buckets;
-	wuy_nop_hlist_t *bucket = &shared->hash_buckets[hash];
-
-	pthread_mutex_lock(&shared->lock); /* lock here */
-	shared->stats_total++;
-
-	bool found = false;
-	struct phl_limit_req_node *node;
-	wuy_nop_hlist_iter_type(bucket, node, hash_node, shared) {
-		if (strcmp(node->key, key) == 0) {
-			found = true;
-			break;
-		}
+	int granted;
+	if (conf->lease > 0) {
+		granted = phl_limit_req_approximate(r, conf, key, len, hash);
+	} else {
+		granted = phl_limit_req_take(r, conf, key, len, hash, 1);
 	}
 
-	/* not found, create new meter */
-	if (!found) {
-		_log(PHL_LOG_DEBUG, "new meter. %d", shared->stats_total);
-
-		node = phl_limit_req_alloc_node(conf);
-		strcpy(node->key, key);
-		wuy_meter_init(&node->meter);
-		wuy_nop_hlist_insert(bucket, &node->hash_node, shared);
-		wuy_nop_list_insert(&shared->lru_list, &node->list_node);
-
-	/* found and limited */
-	} else if (!wuy_meter_check(&conf->meter, &node->meter)) {
-
-		shared->stats_limited++;
-		pthread_mutex_unlock(&shared->lock); /* unlock here */
+	if (granted == 0) {
 		_log(PHL_LOG_INFO, "limited!");
 		return WUY_HTTP_503;
 	}
-
-	pthread_mutex_unlock(&shared->lock); /* unlock here */
 	return PHL_OK;
 }
 
+static void phl_limit_req_stats_path(void *data, wuy_json_t *json)
+{
+	struct phl_limit_req_conf *conf = data;
+	if (conf->shared == NULL) {
+		return;
+	}
+
+	/* read without lock, it does not matter */
+	long total = 0, limited = 0, evicted = 0, contended = 0;
+	for (int i = 0; i < conf->shards; i++) {
+		struct phl_limit_req_shard *shard = phl_limit_req_shard(conf, i);
+		total += shard->stats_total;
+		limited += shard->stats_limited;
+		evicted += shard->stats_evicted;
+		contended += atomic_load(&shard->stats_contended);
+	}
+
+	wuy_json_object_object(json, "limit_req");
+	wuy_json_object_int(json, "total", total);
+	wuy_json_object_int(json, "limited", limited);
+	wuy_json_object_int(json, "evicted", evicted);
+	wuy_json_object_int(json, "lock_contended", contended);
+	wuy_json_object_close(json);
+}
+
 static const char *phl_limit_req_conf_post(void *data)
 {
 	struct phl_limit_req_conf *conf = data;
@@ -167,34 +334,83 @@ static const char *phl_limit_req_conf_post(void *data)
 		return "expect burst >= rate";
 	}
 
-	conf->shared = wuy_shmpool_alloc(conf->size);
+	/* Each worker holds at most one lease of each key, so the error
+	 * is bounded by approximate.error in total of all workers. */
+	if (conf->approximate.error > 0) {
+		int workers = phl_conf_runtime->worker.num > 0 ? phl_conf_runtime->worker.num : 1;
+		conf->lease = conf->approximate.error / workers;
+		if (conf->lease == 0) {
+			conf->lease = 1;
+		}
+		conf->lease_size = PHL_LIMIT_REQ_ROUND(sizeof(struct phl_limit_req_lease)
+				+ conf->key_max_len, 8);
+	}
 
-	//pthread_mutex_lock(&phl_limit_req_conf_lock);
-	if (!conf->shared->has_inited) {
-		struct phl_limit_req_shared *shared = conf->shared;
+	/* layout of shards */
+	conf->node_size = PHL_LIMIT_REQ_ROUND(sizeof(struct phl_limit_req_node) + conf->key_max_len, 8);
+	conf->shard_buckets = conf->hash_buckets / conf->shards;
+	if (conf->shard_buckets == 0) {
+		conf->shard_buckets = 1;
+	}
+	conf->shard_size = (conf->size - PHL_LIMIT_REQ_SHARED_SIZE) / conf->shards
+			/ PHL_LIMIT_REQ_ALIGN * PHL_LIMIT_REQ_ALIGN;
 
-		shared->has_inited = true;
+	int nodes_start = PHL_LIMIT_REQ_ROUND(sizeof(struct phl_limit_req_shard)
+			+ sizeof(wuy_nop_hlist_t) * conf->shard_buckets, 8);
+	if (conf->shard_size < nodes_start + conf->node_size * 4) {
+		return "too small size";
+	}
 
-		shared->used_pos = (void *)((char *)shared + sizeof(wuy_nop_hlist_t) * conf->hash_buckets);
-		shared->nodes_end = (void *)((char *)shared + conf->size
-				- (sizeof(struct phl_limit_req_node) + conf->key_max_len));
+	conf->shared = wuy_shmpool_alloc(conf->size);
 
-		if (shared->nodes_end <= shared->used_pos) {
-			//pthread_mutex_unlock(&phl_limit_req_conf_lock);
-			return "too small size";
-		}
+	struct phl_limit_req_shared *shared = conf->shared;
+	if (shared->has_inited) {
+		return WUY_CFLUA_OK;
+	}
 
-		pthread_mutexattr_t attr;
-		pthread_mutexattr_init(&attr);
-		pthread_mutexattr_setpshared(&attr, 1);
-		pthread_mutex_init(&shared->lock, &attr);
-		pthread_mutexattr_destroy(&attr);
+	shared->has_inited = true;
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, 1);
+
+	for (int i = 0; i < conf->shards; i++) {
+		struct phl_limit_req_shard *shard = phl_limit_req_shard(conf, i);
+		shard->used_pos = (char *)shard + nodes_start;
+		shard->nodes_end = (char *)shard + conf->shard_size;
+		pthread_mutex_init(&shard->lock, &attr);
 	}
-	//pthread_mutex_unlock(&phl_limit_req_conf_lock);
+
+	pthread_mutexattr_destroy(&attr);
 
 	return WUY_CFLUA_OK;
 }
 
+static struct wuy_cflua_command phl_limit_req_approximate_commands[] = {
+	{	.name = "error",
+		.description = "Max number of requests the limit may be off, "
+			"which is divided into leases of each worker. Set 0 for exact mode.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_limit_req_conf, approximate.error),
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+	},
+	{	.name = "lease_time",
+		.description = "Max time in milliseconds to use a lease before syncing.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_limit_req_conf, approximate.lease_time),
+		.limits.n = WUY_CFLUA_LIMITS_POSITIVE,
+		.default_value.n = 100,
+	},
+	{	.name = "items",
+		.description = "Number of leases kept in each worker.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_limit_req_conf, approximate.items),
+		.limits.n = WUY_CFLUA_LIMITS_POSITIVE,
+		.default_value.n = 4096,
+	},
+	{ NULL }
+};
+
 static struct wuy_cflua_command phl_limit_req_conf_commands[] = {
 	{	.type = WUY_CFLUA_TYPE_INTEGER,
 		.description = "Limit rate per second.",
@@ -214,15 +430,24 @@ static struct wuy_cflua_command phl_limit_req_conf_commands[] = {
 		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
 	},
 	{	.name = "key",
-		.description = "Return a string key. Client IP address is used if not set.",
+		.description = "Return a string key, which may be binary. "
+			"Client IP address is used if not set. "
+			"Use `phl.key` to avoid calling Lua.",
 		.type = WUY_CFLUA_TYPE_FUNCTION,
 		.offset = offsetof(struct phl_limit_req_conf, key),
 	},
 	{	.name = "key_max_len",
-		.type = WUY_CFLUA_TYPE_FUNCTION,
+		.type = WUY_CFLUA_TYPE_INTEGER,
 		.offset = offsetof(struct phl_limit_req_conf, key_max_len),
 		.default_value.n = 40, /* UUID=36, IPv6=39 */
-		.limits.n = WUY_CFLUA_LIMITS(8, 255),
+		.limits.n = WUY_CFLUA_LIMITS(16, 255),
+	},
+	{	.name = "ipv6_prefix",
+		.description = "Prefix length of client IPv6 address as key, if `key` is not set.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_limit_req_conf, ipv6_prefix),
+		.default_value.n = 64,
+		.limits.n = WUY_CFLUA_LIMITS(1, 128),
 	},
 	{	.name = "size",
 		.description = "Size of shared-memory.",
@@ -237,6 +462,19 @@ static struct wuy_cflua_command phl_limit_req_conf_commands[] = {
 		.default_value.n = 1024,
 		.limits.n = WUY_CFLUA_LIMITS_LOWER(64),
 	},
+	{	.name = "shards",
+		.description = "Number of shards of the table, each with its own lock.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_limit_req_conf, shards),
+		.default_value.n = 16,
+		.limits.n = WUY_CFLUA_LIMITS(1, 256),
+	},
+	{	.name = "approximate",
+		.description = "Decide in each worker by tokens leased from the shared meter, "
+			"for less contention but less precision.",
+		.type = WUY_CFLUA_TYPE_TABLE,
+		.u.table = &(struct wuy_cflua_table) { phl_limit_req_approximate_commands },
+	},
 	{	.name = "log",
 		.type = WUY_CFLUA_TYPE_TABLE,
 		.offset = offsetof(struct phl_limit_req_conf, log),
@@ -261,4 +499,5 @@ struct phl_module phl_limit_req_module = {
 	.filters = {
 		.process_headers = phl_limit_req_process_headers,
 	},
+	.stats_path = phl_limit_req_stats_path,
 };
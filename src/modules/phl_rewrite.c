@@ -22,6 +22,7 @@ static int phl_rewrite_process_headers(struct phl_request *r)
 			printf("rewrite %s %s\n", r->req.uri.path, new);
 			r->req.uri.path = wuy_pool_strdup(r->pool, new);
 			r->req.uri.is_rewrited = true;
+			r->key_memos = NULL; /* the keys may refer to path */
 			break;
 		}
 	}
@@ -59,9 +59,10 @@ static int phl_save_to_filter_response_headers(struct phl_request *r)
 	struct phl_save_to_ctx *ctx = wuy_pool_alloc(r->pool, sizeof(struct phl_save_to_ctx));
 	ctx->expire_after = expire_after;
 
+	/* by malloc() but not pool, to be passed to the subrequest at last */
 	if (r->resp.content_length != PHL_CONTENT_LENGTH_INIT) {
 		ctx->buf_size = r->resp.content_length;
-		ctx->buffer = wuy_pool_realloc(r->pool, NULL, ctx->buf_size);
+		ctx->buffer = malloc(ctx->buf_size);
 	}
 
 	r->module_ctxs[phl_save_to_module.index] = ctx;
@@ -69,33 +70,43 @@ static int phl_save_to_filter_response_headers(struct phl_request *r)
 }
 
 static int phl_save_to_filter_response_body(struct phl_request *r,
-		uint8_t *data, int data_len, int buf_len, bool *p_is_last)
+		struct phl_buf_chain *chain)
 {
 	struct phl_save_to_conf *conf = r->conf_path->module_confs[phl_save_to_module.index];
 	struct phl_save_to_ctx *ctx = r->module_ctxs[phl_save_to_module.index];
 
 	if (ctx == NULL) {
-		return data_len;
+		return PHL_OK;
 	}
 
-	if (ctx->length + data_len > ctx->buf_size) {
-		ctx->buf_size = ctx->length + data_len;
-		ctx->buffer = wuy_pool_realloc(r->pool, ctx->buffer, ctx->buf_size);
-	}
+	/* keep a copy, and pass the chain through */
+	for (struct phl_buf *b = chain->head; b != NULL; b = b->next) {
+		if (ctx->length + b->len > ctx->buf_size) {
+			ctx->buf_size = ctx->length + b->len;
+			ctx->buffer = realloc(ctx->buffer, ctx->buf_size);
+		}
 
-	memcpy(ctx->buffer + ctx->length, data, data_len);
-	ctx->length += data_len;
+		memcpy(ctx->buffer + ctx->length, b->data, b->len);
+		ctx->length += b->len;
+	}
 
-	if (*p_is_last) {
+	if (chain->is_last) {
 		struct phl_request *subr = phl_request_subr_new(r, conf->pathname);
 		phl_request_subr_detach(subr);
 
+		/* pass the buffer to subrequest without copy */
 		subr->req.method = WUY_HTTP_POST;
-		subr->req.body_buf = (uint8_t *)wuy_pool_strndup(subr->pool, ctx->buffer, ctx->buf_size);
-		subr->req.body_len = ctx->buf_size;
+		phl_request_set_body_ref(subr, ctx->buffer, ctx->length, free, ctx->buffer);
+		ctx->buffer = NULL;
 	}
 
-	return data_len;
+	return PHL_OK;
+}
+
+static void phl_save_to_ctx_free(struct phl_request *r)
+{
+	struct phl_save_to_ctx *ctx = r->module_ctxs[phl_save_to_module.index];
+	free(ctx->buffer);
 }
 
 static struct wuy_cflua_command phl_save_to_conf_commands[] = {
@@ -147,4 +158,5 @@ struct phl_module phl_save_to_module = {
 		.response_headers = phl_save_to_filter_response_headers,
 		.response_body = phl_save_to_filter_response_body,
 	},
+	.ctx_free = phl_save_to_ctx_free,
 };
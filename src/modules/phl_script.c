@@ -1,6 +1,4 @@
-#include <lua5.1/lua.h>
-#include <lua5.1/lauxlib.h>
-#include <lua5.1/lualib.h>
+#include "phl_lua.h"
 
 #include "phl_main.h"
 
@@ -35,11 +33,13 @@ static int phl_script_generate_response_headers(struct phl_request *r)
 	const char *body = lua_tolstring(L, -1, &len);
 	if (body == NULL) {
 		phl_request_log(r, PHL_LOG_ERROR, "script: content fail");
+		phl_lua_thread_done(r);
 		return WUY_HTTP_500;
 	}
 
 	r->resp.easy_str_len = len;
 	r->resp.easy_string = wuy_pool_strndup(r->pool, body, len);
+	phl_lua_thread_done(r);
 
 	r->resp.status_code = status_code;
 	r->resp.content_length = r->resp.easy_str_len;
@@ -59,11 +59,13 @@ static int phl_script_process_headers(struct phl_request *r)
 		return PHL_PTR2RET(L);
 	}
 
-	if (lua_gettop(L) == 0) {
-		return PHL_OK;
+	int ret = PHL_OK;
+	if (lua_gettop(L) > 0) {
+		ret = lua_tointeger(L, 1);
 	}
 
-	return lua_tointeger(L, 1);
+	phl_lua_thread_done(r);
+	return ret;
 }
 
 static int phl_script_response_headers(struct phl_request *r)
@@ -78,6 +80,8 @@ static int phl_script_response_headers(struct phl_request *r)
 	if (!PHL_PTR_IS_OK(L)) {
 		return PHL_PTR2RET(L);
 	}
+
+	phl_lua_thread_done(r);
 	return PHL_OK;
 }
 
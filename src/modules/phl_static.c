@@ -3,16 +3,76 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "phl_main.h"
 
+/* memory cache, in shared-memory */
+struct phl_static_memory_entry {
+	struct phl_slab_node	slab_node;
+	uint64_t		hash[2];
+	wuy_nop_hlist_node_t	hash_node;
+	ino_t			ino;
+	time_t			mtime;
+	off_t			size;
+	time_t			checked_at;
+	char			data[0];
+};
+
+struct phl_static_memory {
+	pthread_mutex_t		lock;
+	bool			has_inited;
+
+	struct phl_slab		slab;
+
+	int			hash_buckets;
+	wuy_nop_hlist_t		buckets[0];
+};
+
 struct phl_static_conf {
 	const char	*dir_name;
 	const char	*index;
 	struct phl_log	*log;
 	bool		list_dir;
+	bool		precompressed;
+
+	struct {
+		int	max_file;
+		int	total;
+		int	valid_time;
+	} memory_cache;
 
 	int		dirfd;
+
+	struct phl_static_memory	*memory;
+};
+
+/* precompressed files, in order of preference */
+static const struct phl_static_encoding {
+	const char	*name;
+	int		name_len;
+	const char	*suffix;
+} phl_static_encodings[] = {
+	{ "br", 2, ".br" },
+	{ "zstd", 4, ".zst" },
+	{ "gzip", 4, ".gz" },
+};
+#define PHL_STATIC_ENCODING_NUM (int)(sizeof(phl_static_encodings) / sizeof(phl_static_encodings[0]))
+
+struct phl_static_ctx {
+	int			fd;
+	struct stat		st_buf;
+	struct phl_aio_task	*task;
+
+	const char			*cache_path;
+	bool				cache_checked;
+	struct phl_open_cache_entry	*entry;
+	const char			*mem_data; /* served from memory cache */
+	char				*read_buf; /* small file read with opening */
+
+	int				accept_encodings; /* bitmap */
+	int				encoding_try;
+	const struct phl_static_encoding *encoding; /* precompressed */
 };
 
 
@@ -59,7 +119,7 @@ static int phl_static_dir_headers(struct phl_request *r, int fd)
 }
 
 static int phl_static_range_headers(struct phl_request *r, struct phl_header *h,
-		struct stat *st_buf, int fd)
+		struct stat *st_buf)
 {
 	struct phl_static_conf *conf = r->conf_path->module_confs[phl_static_module.index];
 
@@ -89,12 +149,18 @@ static int phl_static_range_headers(struct phl_request *r, struct phl_header *h,
 	}
 
 	struct wuy_http_range *range = ranges;
-	lseek(fd, range->first, SEEK_SET);
 
 	/* response status code and headers */
 	r->resp.status_code = WUY_HTTP_206;
 	r->resp.content_length = range->last - range->first + 1;
 
+	if (r->resp.easy_string != NULL) { /* from memory cache */
+		r->resp.easy_string += range->first;
+		r->resp.easy_str_len = r->resp.content_length;
+	} else {
+		r->resp.easy_fd_offset = range->first;
+	}
+
 	char buf[100];
 	int len = sprintf(buf, "bytes %ld-%ld/%ld", range->first,
 			range->last, st_buf->st_size);
@@ -103,62 +169,365 @@ static int phl_static_range_headers(struct phl_request *r, struct phl_header *h,
 	return PHL_OK;
 }
 
-static int phl_static_generate_response_headers(struct phl_request *r)
+/* return bitmap of phl_static_encodings accepted by client */
+static int phl_static_accept_encodings(struct phl_request *r)
 {
-	struct phl_static_conf *conf = r->conf_path->module_confs[phl_static_module.index];
+	const char *codings[PHL_STATIC_ENCODING_NUM];
+	double qvalues[PHL_STATIC_ENCODING_NUM];
+	for (int i = 0; i < PHL_STATIC_ENCODING_NUM; i++) {
+		codings[i] = phl_static_encodings[i].name;
+	}
 
-	phl_header_add_lite(&r->resp.headers, "Server", "phorklift", 5, r->pool);
+	phl_request_accept_encodings(r, codings, PHL_STATIC_ENCODING_NUM, qvalues);
 
-	const char *filename = r->req.uri.path + 1;
-	if (filename[0] == '\0') { /* "/" */
-		filename = ".";
+	int accepts = 0;
+	for (int i = 0; i < PHL_STATIC_ENCODING_NUM; i++) {
+		if (qvalues[i] > 0) {
+			accepts |= 1 << i;
+		}
+	}
+	return accepts;
+}
+
+/* Open file and get stat, and read the content too if not bigger
+ * than task->len, for the memory cache. This may be run in aio
+ * thread, so no log here. */
+static void phl_static_open_work(struct phl_aio_task *task)
+{
+	phl_aio_work_open(task);
+	if (task->ret < 0 || !S_ISREG(task->st.st_mode) || task->st.st_size == 0
+			|| task->st.st_size > task->len) {
+		return;
 	}
 
-	phl_request_log_at(r, conf->log, PHL_LOG_DEBUG, "open file %s", filename);
+	task->buf = malloc(task->st.st_size);
+	if (pread(task->fd, task->buf, task->st.st_size, 0) != task->st.st_size) {
+		free(task->buf);
+		task->buf = NULL;
+	}
+}
 
-	int fd = openat(conf->dirfd, filename, O_RDONLY);
-	if (fd < 0) {
-		phl_request_log_at(r, conf->log, PHL_LOG_INFO, "error to open file %s %s",
-				filename, strerror(errno));
-		return WUY_HTTP_404;
+/* open file and get stat, in aio if enabled.
+ * Returns fd, or -1 with errno set, or PHL_AGAIN if in process. */
+static int phl_static_open(struct phl_request *r, int dirfd, const char *filename)
+{
+	struct phl_static_conf *conf = r->conf_path->module_confs[phl_static_module.index];
+	struct phl_static_ctx *ctx = r->module_ctxs[phl_static_module.index];
+
+	struct phl_aio_task *task = ctx->task;
+	if (task == NULL) {
+		task = phl_aio_task_new(phl_static_open_work, phl_aio_done_request, r);
+		task->dirfd = dirfd;
+		task->path = strdup(filename);
+		task->len = (conf->memory != NULL) ? conf->memory_cache.max_file : 0;
+
+		/* run it directly if aio is not enabled, because
+		 * phl_aio_done_request() can not be called synchronously */
+		if (!phl_aio_is_enabled()) {
+			phl_static_open_work(task);
+		} else {
+			phl_aio_submit(task);
+			ctx->task = task;
+			return PHL_AGAIN;
+		}
+	} else if (!task->finished) {
+		return PHL_AGAIN;
+	}
+
+	int fd = task->fd;
+	errno = task->err;
+	ctx->st_buf = task->st;
+	if (task->buf != NULL) {
+		free(ctx->read_buf);
+		ctx->read_buf = task->buf;
+		task->buf = NULL;
 	}
 
+	phl_aio_task_free(task);
+	ctx->task = NULL;
+	return fd < 0 ? -1 : fd;
+}
+
+/* === memory cache
+ *
+ * Small files are kept in shared-memory, to be served without any
+ * syscall. The file is checked by stat() after `valid_time` since last check. */
+
+static struct phl_static_memory_entry *phl_static_memory_search(
+		struct phl_static_memory *memory, const uint64_t *hash)
+{
+	wuy_nop_hlist_t *bucket = &memory->buckets[hash[0] % memory->hash_buckets];
+
+	struct phl_static_memory_entry *entry;
+	wuy_nop_hlist_iter_type(bucket, entry, hash_node, memory) {
+		if (entry->hash[0] == hash[0] && entry->hash[1] == hash[1]) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void phl_static_memory_free(struct phl_static_memory *memory,
+		struct phl_static_memory_entry *entry)
+{
+	wuy_nop_hlist_delete(&entry->hash_node, memory);
+	phl_slab_free(&memory->slab, entry);
+}
+
+/* Copy the file content into r->pool if hit, and set ctx->st_buf. */
+static bool phl_static_memory_load(struct phl_request *r, const char *path)
+{
+	struct phl_static_conf *conf = r->conf_path->module_confs[phl_static_module.index];
+	struct phl_static_ctx *ctx = r->module_ctxs[phl_static_module.index];
+	struct phl_static_memory *memory = conf->memory;
+
+	uint64_t hash[2];
+	wuy_vhash128(path, strlen(path), hash);
+
+	time_t now = time(NULL);
 	struct stat st_buf;
-	fstat(fd, &st_buf);
+	bool checked = false;
 
-	/* if directory */
-	mode_t ftype = st_buf.st_mode & S_IFMT;
-	if (ftype == S_IFDIR) {
-		if (conf->list_dir) {
-			return phl_static_dir_headers(r, fd);
+again:
+	pthread_mutex_lock(&memory->lock);
+
+	struct phl_static_memory_entry *entry = phl_static_memory_search(memory, hash);
+	if (entry == NULL) {
+		pthread_mutex_unlock(&memory->lock);
+		return false;
+	}
+
+	/* check if the file is changed, without the lock held */
+	if (!checked && now >= entry->checked_at + conf->memory_cache.valid_time) {
+		pthread_mutex_unlock(&memory->lock);
+		if (fstatat(conf->dirfd, path, &st_buf, 0) != 0) {
+			st_buf.st_ino = 0;
 		}
-		if (conf->index == NULL) {
-			phl_request_log_at(r, conf->log, PHL_LOG_INFO, "request directory");
-			return WUY_HTTP_404;
+		checked = true;
+		goto again;
+	}
+	if (checked) {
+		if (st_buf.st_ino != entry->ino || st_buf.st_mtime != entry->mtime
+				|| st_buf.st_size != entry->size) {
+			phl_request_log_at(r, conf->log, PHL_LOG_DEBUG,
+					"memory cache changed %s", path);
+			phl_static_memory_free(memory, entry);
+			pthread_mutex_unlock(&memory->lock);
+			return false;
 		}
+		entry->checked_at = now;
+	}
 
-		int index_fd = openat(fd, conf->index, O_RDONLY);
-		close(fd);
-		fd = index_fd;
+	phl_slab_touch(&memory->slab, entry);
+
+	char *data = wuy_pool_alloc(r->pool, entry->size);
+	memcpy(data, entry->data, entry->size);
+
+	memset(&ctx->st_buf, 0, sizeof(struct stat));
+	ctx->st_buf.st_mode = S_IFREG;
+	ctx->st_buf.st_ino = entry->ino;
+	ctx->st_buf.st_mtime = entry->mtime;
+	ctx->st_buf.st_size = entry->size;
+
+	pthread_mutex_unlock(&memory->lock);
+
+	phl_request_log_at(r, conf->log, PHL_LOG_DEBUG, "hit memory cache %s", path);
+
+	ctx->mem_data = data;
+	return true;
+}
+
+static void phl_static_memory_evict(void *slot, void *data)
+{
+	struct phl_static_memory_entry *entry = slot;
+	wuy_nop_hlist_delete(&entry->hash_node, data);
+}
+
+/* Store the small file, which has been read by phl_static_open(),
+ * into memory cache, and set ctx->mem_data. */
+static void phl_static_memory_store(struct phl_request *r, const char *path)
+{
+	struct phl_static_conf *conf = r->conf_path->module_confs[phl_static_module.index];
+	struct phl_static_ctx *ctx = r->module_ctxs[phl_static_module.index];
+	struct phl_static_memory *memory = conf->memory;
+
+	char *data = ctx->read_buf;
+	off_t size = ctx->st_buf.st_size;
+	if (data == NULL) {
+		return;
+	}
+
+	uint64_t hash[2];
+	wuy_vhash128(path, strlen(path), hash);
+
+	pthread_mutex_lock(&memory->lock);
+
+	/* delete the old one if any */
+	struct phl_static_memory_entry *entry = phl_static_memory_search(memory, hash);
+	if (entry != NULL) {
+		phl_static_memory_free(memory, entry);
+	}
+
+	entry = phl_slab_alloc(&memory->slab, sizeof(struct phl_static_memory_entry) + size,
+			phl_static_memory_evict, memory);
+	if (entry == NULL) {
+		pthread_mutex_unlock(&memory->lock);
+		return;
+	}
+
+	entry->hash[0] = hash[0];
+	entry->hash[1] = hash[1];
+	entry->ino = ctx->st_buf.st_ino;
+	entry->mtime = ctx->st_buf.st_mtime;
+	entry->size = size;
+	entry->checked_at = time(NULL);
+	memcpy(entry->data, data, size);
+
+	wuy_nop_hlist_insert(&memory->buckets[hash[0] % memory->hash_buckets],
+			&entry->hash_node, memory);
+
+	pthread_mutex_unlock(&memory->lock);
+
+	phl_request_log_at(r, conf->log, PHL_LOG_DEBUG, "store memory cache %s", path);
+
+	ctx->mem_data = data;
+}
+
+static const char *phl_static_memory_init(struct phl_static_conf *conf)
+{
+	/* the page size is the max slot size */
+	int page_size = phl_slab_page_size(
+			sizeof(struct phl_static_memory_entry) + conf->memory_cache.max_file);
+	if (page_size == 0) {
+		return "too big memory_cache.max_file";
+	}
+	int page_num = conf->memory_cache.total / page_size;
+	if (page_num < 2) {
+		return "too small memory_cache.total";
+	}
+
+	int hash_buckets = page_num * 8;
+	size_t head_size = sizeof(struct phl_static_memory)
+			+ sizeof(wuy_nop_hlist_t) * hash_buckets;
+
+	conf->memory = wuy_shmpool_alloc(head_size + (size_t)page_size * page_num);
+
+	struct phl_static_memory *memory = conf->memory;
+	if (memory->has_inited) {
+		return WUY_CFLUA_OK;
+	}
+
+	memory->has_inited = true;
+	phl_slab_init(&memory->slab, (char *)memory + head_size, page_size, page_num);
+	memory->hash_buckets = hash_buckets;
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, 1);
+	pthread_mutex_init(&memory->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	return WUY_CFLUA_OK;
+}
+
+/* Open the precompressed sibling file accepted by client.
+ * Returns PHL_OK if opened, WUY_HTTP_404 if none, or PHL_AGAIN. */
+static int phl_static_open_precompressed(struct phl_request *r, const char *filename)
+{
+	struct phl_static_conf *conf = r->conf_path->module_confs[phl_static_module.index];
+	struct phl_static_ctx *ctx = r->module_ctxs[phl_static_module.index];
+
+	for (; ctx->encoding_try < PHL_STATIC_ENCODING_NUM; ctx->encoding_try++) {
+		if ((ctx->accept_encodings & (1 << ctx->encoding_try)) == 0) {
+			continue;
+		}
+
+		const struct phl_static_encoding *enc = &phl_static_encodings[ctx->encoding_try];
+		char path[strlen(filename) + 5];
+		sprintf(path, "%s%s", filename, enc->suffix);
+
+		/* not in aio processing */
+		if (ctx->task == NULL && conf->memory != NULL && phl_static_memory_load(r, path)) {
+			ctx->encoding = enc;
+			return PHL_OK;
+		}
+		if (ctx->task == NULL && phl_open_cache_is_enabled()) {
+			ctx->entry = phl_open_cache_get(conf->dirfd, path);
+			if (ctx->entry != NULL) {
+				ctx->st_buf = ctx->entry->st;
+				ctx->encoding = enc;
+				return PHL_OK;
+			}
+		}
+
+		int fd = phl_static_open(r, conf->dirfd, path);
+		if (fd == PHL_AGAIN) {
+			return PHL_AGAIN;
+		}
 		if (fd < 0) {
-			phl_request_log_at(r, conf->log, PHL_LOG_INFO,
-					"error to open index %s", strerror(errno));
-			return WUY_HTTP_404;
+			continue;
+		}
+		if (!S_ISREG(ctx->st_buf.st_mode)) {
+			close(fd);
+			continue;
 		}
 
-		fstat(fd, &st_buf);
-		ftype = st_buf.st_mode & S_IFMT;
+		phl_request_log_at(r, conf->log, PHL_LOG_DEBUG, "open precompressed %s", path);
+
+		if (conf->memory != NULL) {
+			phl_static_memory_store(r, path);
+		}
+
+		ctx->encoding = enc;
+		if (phl_open_cache_is_enabled()) {
+			ctx->entry = phl_open_cache_add(conf->dirfd, path, fd, &ctx->st_buf);
+		} else {
+			ctx->fd = fd;
+		}
+		return PHL_OK;
 	}
 
-	r->module_ctxs[phl_static_module.index] = (void *)(intptr_t)fd;
+	return WUY_HTTP_404;
+}
 
-	if (ftype != S_IFREG && ftype != S_IFLNK) {
-		phl_request_log_at(r, conf->log, PHL_LOG_INFO, "invalid file type");
-		return WUY_HTTP_404;
+static int phl_static_response_file(struct phl_request *r, int fd)
+{
+	struct phl_static_conf *conf = r->conf_path->module_confs[phl_static_module.index];
+	struct phl_static_ctx *ctx = r->module_ctxs[phl_static_module.index];
+	struct stat st_buf = ctx->st_buf;
+
+	/* the response varies even if not precompressed file is found */
+	if (conf->precompressed) {
+		phl_header_add_lite(&r->resp.headers, "Vary", "Accept-Encoding", 15, r->pool);
+	}
+
+	/* validators, precomputed if cached */
+	const char *last_modified, *etag;
+	int etag_len;
+	char etag_buf[40];
+	if (ctx->entry != NULL) {
+		last_modified = ctx->entry->last_modified;
+		etag = ctx->entry->etag;
+		etag_len = ctx->entry->etag_len;
+	} else {
+		last_modified = wuy_http_date_make(st_buf.st_mtime);
+		etag_len = snprintf(etag_buf, sizeof(etag_buf), "\"%lx-%lx\"",
+				(long)st_buf.st_mtime, (long)st_buf.st_size);
+		etag = etag_buf;
+	}
+
+	/* check If-None-Match */
+	struct phl_header *h = phl_header_get(&r->req.headers, "If-None-Match");
+	if (h != NULL) {
+		phl_request_log_at(r, conf->log, PHL_LOG_DEBUG, "check If-None-Match %s %s",
+				phl_header_value(h), etag);
+		if (h->value_len == etag_len && memcmp(phl_header_value(h), etag, etag_len) == 0) {
+			return WUY_HTTP_304;
+		}
 	}
 
 	/* check If-Modified-Since */
-	struct phl_header *h = phl_header_get(&r->req.headers, "If-Modified-Since");
+	h = phl_header_get(&r->req.headers, "If-Modified-Since");
 	if (h != NULL) {
 		time_t if_modified_since = wuy_http_date_parse(phl_header_value(h));
 		phl_request_log_at(r, conf->log, PHL_LOG_DEBUG, "check If-Modified-Since %ld %ld",
@@ -169,13 +538,24 @@ static int phl_static_generate_response_headers(struct phl_request *r)
 	}
 
 	/* OK, response the file */
-	r->resp.easy_fd = fd;
+	if (ctx->mem_data != NULL) {
+		r->resp.easy_string = ctx->mem_data;
+		r->resp.easy_str_len = st_buf.st_size;
+	} else {
+		r->resp.easy_fd = fd;
+	}
 
 	phl_header_add_lite(&r->resp.headers, "Last-Modified",
-			wuy_http_date_make(st_buf.st_mtime),
-			WUY_HTTP_DATE_LENGTH, r->pool);
+			last_modified, WUY_HTTP_DATE_LENGTH, r->pool);
+	phl_header_add_lite(&r->resp.headers, "ETag", etag, etag_len, r->pool);
 
-	const char *content_type = phl_static_mime_type(filename);
+	/* so the gzip filter is bypassed */
+	if (ctx->encoding != NULL) {
+		phl_header_add_lite(&r->resp.headers, "Content-Encoding",
+				ctx->encoding->name, ctx->encoding->name_len, r->pool);
+	}
+
+	const char *content_type = phl_static_mime_type(r->req.uri.path);
 	phl_header_add_lite(&r->resp.headers, "Content-Type",
 			content_type, strlen(content_type), r->pool);
 
@@ -183,7 +563,7 @@ static int phl_static_generate_response_headers(struct phl_request *r)
 	if (r->req.method == WUY_HTTP_GET) {
 		h = phl_header_get(&r->req.headers, "Range");
 		if (h != NULL) {
-			int ret = phl_static_range_headers(r, h, &st_buf, fd);
+			int ret = phl_static_range_headers(r, h, &st_buf);
 			if (ret != WUY_HTTP_200) {
 				return ret;
 			}
@@ -195,12 +575,158 @@ static int phl_static_generate_response_headers(struct phl_request *r)
 	return PHL_OK;
 }
 
-static void phl_static_ctx_free(struct phl_request *r)
+/* The path in memory cache and phl_open_cache. The index file is cached
+ * for directory ending with '/', so both the 2 open() are saved. */
+static const char *phl_static_cache_path(struct phl_request *r, const char *filename)
 {
-	int fd = (intptr_t)r->module_ctxs[phl_static_module.index];
-	if (fd != 0) {
+	struct phl_static_conf *conf = r->conf_path->module_confs[phl_static_module.index];
+
+	const char *path = r->req.uri.path;
+	if (conf->index == NULL || conf->list_dir || path[strlen(path) - 1] != '/') {
+		return filename;
+	}
+
+	int len = strlen(filename) + strlen(conf->index) + 2;
+	char *cache_path = wuy_pool_alloc(r->pool, len);
+	sprintf(cache_path, "%s/%s", filename, conf->index);
+	return cache_path;
+}
+
+static int phl_static_generate_response_headers(struct phl_request *r)
+{
+	struct phl_static_conf *conf = r->conf_path->module_confs[phl_static_module.index];
+
+	const char *filename = r->req.uri.path + 1;
+	if (filename[0] == '\0') { /* "/" */
+		filename = ".";
+	}
+
+	/* this may be called again after aio */
+	struct phl_static_ctx *ctx = r->module_ctxs[phl_static_module.index];
+	if (ctx == NULL) {
+		ctx = wuy_pool_alloc(r->pool, sizeof(struct phl_static_ctx));
+		r->module_ctxs[phl_static_module.index] = ctx;
+
+		phl_header_add_lite(&r->resp.headers, "Server", "phorklift", 5, r->pool);
+
+		ctx->cache_path = phl_static_cache_path(r, filename);
+
+		const char *path = r->req.uri.path;
+		if (conf->precompressed && path[strlen(path) - 1] != '/') {
+			ctx->accept_encodings = phl_static_accept_encodings(r);
+		}
+	}
+
+	/* try the precompressed files first */
+	if (ctx->accept_encodings != 0 && ctx->encoding_try < PHL_STATIC_ENCODING_NUM) {
+		int ret = phl_static_open_precompressed(r, filename);
+		if (ret == PHL_AGAIN) {
+			return PHL_AGAIN;
+		}
+		if (ret == PHL_OK) {
+			int fd = (ctx->entry != NULL) ? ctx->entry->fd : ctx->fd;
+			return phl_static_response_file(r, fd);
+		}
+	}
+
+	/* then the caches of the file itself */
+	if (!ctx->cache_checked) {
+		ctx->cache_checked = true;
+		if (conf->memory != NULL && phl_static_memory_load(r, ctx->cache_path)) {
+			return phl_static_response_file(r, 0);
+		}
+		if (phl_open_cache_is_enabled()) {
+			ctx->entry = phl_open_cache_get(conf->dirfd, ctx->cache_path);
+		}
+	}
+	if (ctx->entry != NULL) {
+		phl_request_log_at(r, conf->log, PHL_LOG_DEBUG, "hit open cache %s", ctx->cache_path);
+		ctx->st_buf = ctx->entry->st;
+		return phl_static_response_file(r, ctx->entry->fd);
+	}
+
+	int fd = ctx->fd;
+	if (fd == 0) {
+		phl_request_log_at(r, conf->log, PHL_LOG_DEBUG, "open file %s", filename);
+
+		fd = phl_static_open(r, conf->dirfd, filename);
+		if (fd == PHL_AGAIN) {
+			return PHL_AGAIN;
+		}
+		if (fd < 0) {
+			phl_request_log_at(r, conf->log, PHL_LOG_INFO, "error to open file %s %s",
+					filename, strerror(errno));
+			return WUY_HTTP_404;
+		}
+		ctx->fd = fd;
+	}
+
+	/* if directory */
+	mode_t ftype = ctx->st_buf.st_mode & S_IFMT;
+	if (ftype == S_IFDIR) {
+		if (conf->list_dir) {
+			ctx->fd = 0; /* closed in phl_static_dir_headers() */
+			return phl_static_dir_headers(r, fd);
+		}
+		if (conf->index == NULL) {
+			phl_request_log_at(r, conf->log, PHL_LOG_INFO, "request directory");
+			return WUY_HTTP_404;
+		}
+
+		int index_fd = phl_static_open(r, fd, conf->index);
+		if (index_fd == PHL_AGAIN) {
+			return PHL_AGAIN;
+		}
 		close(fd);
+		ctx->fd = 0;
+		fd = index_fd;
+		if (fd < 0) {
+			phl_request_log_at(r, conf->log, PHL_LOG_INFO,
+					"error to open index %s", strerror(errno));
+			return WUY_HTTP_404;
+		}
+		ctx->fd = fd;
+
+		ftype = ctx->st_buf.st_mode & S_IFMT;
+
+		if (ctx->cache_path == filename) { /* not keyed with the index */
+			ctx->cache_path = NULL;
+		}
+	} else if (ctx->cache_path != filename) {
+		ctx->cache_path = NULL;
 	}
+
+	if (ftype != S_IFREG && ftype != S_IFLNK) {
+		phl_request_log_at(r, conf->log, PHL_LOG_INFO, "invalid file type");
+		return WUY_HTTP_404;
+	}
+
+	if (ctx->cache_path != NULL && conf->memory != NULL) {
+		phl_static_memory_store(r, ctx->cache_path);
+	}
+
+	/* the fd is owned by the cache since now */
+	if (ctx->cache_path != NULL && phl_open_cache_is_enabled()) {
+		ctx->entry = phl_open_cache_add(conf->dirfd, ctx->cache_path, fd, &ctx->st_buf);
+		ctx->fd = 0;
+	}
+
+	return phl_static_response_file(r, fd);
+}
+
+static void phl_static_ctx_free(struct phl_request *r)
+{
+	struct phl_static_ctx *ctx = r->module_ctxs[phl_static_module.index];
+	if (ctx->task != NULL) {
+		phl_aio_cancel(ctx->task);
+	}
+	if (ctx->fd > 0) {
+		close(ctx->fd);
+	}
+	if (ctx->entry != NULL) {
+		phl_open_cache_put(ctx->entry);
+	}
+	free(ctx->read_buf);
 }
 
 
@@ -220,9 +746,37 @@ static const char *phl_static_conf_post(void *data)
 		return "fail to open dir";
 	}
 
+	if (conf->memory_cache.total > 0) {
+		return phl_static_memory_init(conf);
+	}
+
 	return WUY_CFLUA_OK;
 }
 
+static struct wuy_cflua_command phl_static_memory_cache_commands[] = {
+	{	.name = "max_file",
+		.description = "Max size of file to keep.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_static_conf, memory_cache.max_file),
+		.limits.n = WUY_CFLUA_LIMITS_POSITIVE,
+		.default_value.n = 32 * 1024,
+	},
+	{	.name = "total",
+		.description = "Size of shared-memory. Set 0 to disable.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_static_conf, memory_cache.total),
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+	},
+	{	.name = "valid_time",
+		.description = "Check whether the file is changed after this time.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_static_conf, memory_cache.valid_time),
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+		.default_value.n = 1,
+	},
+	{ NULL }
+};
+
 static struct wuy_cflua_command phl_static_conf_commands[] = {
 	{	.type = WUY_CFLUA_TYPE_STRING,
 		.description = "The directory.",
@@ -239,6 +793,17 @@ static struct wuy_cflua_command phl_static_conf_commands[] = {
 		.type = WUY_CFLUA_TYPE_STRING,
 		.offset = offsetof(struct phl_static_conf, index),
 	},
+	{	.name = "precompressed",
+		.description = "Serve the precompressed file.br, file.zst or file.gz instead "
+			"if it exists and is accepted by client.",
+		.type = WUY_CFLUA_TYPE_BOOLEAN,
+		.offset = offsetof(struct phl_static_conf, precompressed),
+	},
+	{	.name = "memory_cache",
+		.description = "Keep small files in shared-memory.",
+		.type = WUY_CFLUA_TYPE_TABLE,
+		.u.table = &(struct wuy_cflua_table) { phl_static_memory_cache_commands },
+	},
 	{	.name = "log",
 		.type = WUY_CFLUA_TYPE_TABLE,
 		.offset = offsetof(struct phl_static_conf, log),
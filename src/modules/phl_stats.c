@@ -78,6 +78,15 @@ static int phl_stats_generate_response_headers(struct phl_request *r)
 		phl_stats_dump_host(r->conf_host, &json);
 	} else if (memcmp(scope_str, "upstream", scope_len) == 0) {
 		phl_upstream_stats(&json);
+	} else if (memcmp(scope_str, "aio", scope_len) == 0) {
+		phl_aio_stats(&json);
+	} else if (memcmp(scope_str, "open_cache", scope_len) == 0) {
+		phl_open_cache_stats(&json);
+	} else if (memcmp(scope_str, "lua", scope_len) == 0) {
+		phl_lua_thread_stats(&json);
+		phl_lua_timer_stats(&json);
+	} else if (memcmp(scope_str, "shared", scope_len) == 0) {
+		phl_shared_dict_stats(&json);
 	} else {
 		printf("invalid query scope\n");
 		return WUY_HTTP_400;
@@ -0,0 +1,332 @@
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "phl_main.h"
+
+struct phl_aio_stats {
+	atomic_long	submit;
+	atomic_long	complete;
+	atomic_long	cancel;
+	atomic_long	error;
+	atomic_long	queue_depth;
+	atomic_long	queue_depth_max;
+	atomic_long	wait_acc_ms;
+	atomic_long	run_acc_ms;
+};
+
+static struct phl_aio_stats *phl_aio_stats_shm;
+
+/* pending tasks, consumed by threads */
+static pthread_mutex_t phl_aio_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t phl_aio_pending_cond = PTHREAD_COND_INITIALIZER;
+static struct phl_aio_task *phl_aio_pending_head;
+static struct phl_aio_task **phl_aio_pending_tail = &phl_aio_pending_head;
+
+/* finished tasks, consumed by phl_loop */
+static pthread_mutex_t phl_aio_finished_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct phl_aio_task *phl_aio_finished_head;
+
+static int phl_aio_eventfd = -1;
+static loop_stream_t *phl_aio_stream;
+
+/* wuy_time_ms() is cached by loop, so not used in threads */
+static long phl_aio_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *phl_aio_thread_routine(void *data)
+{
+	while (1) {
+		pthread_mutex_lock(&phl_aio_pending_lock);
+		while (phl_aio_pending_head == NULL) {
+			pthread_cond_wait(&phl_aio_pending_cond, &phl_aio_pending_lock);
+		}
+		struct phl_aio_task *task = phl_aio_pending_head;
+		phl_aio_pending_head = task->next;
+		if (phl_aio_pending_head == NULL) {
+			phl_aio_pending_tail = &phl_aio_pending_head;
+		}
+		pthread_mutex_unlock(&phl_aio_pending_lock);
+
+		long start_time = phl_aio_now_ms();
+		atomic_fetch_sub(&phl_aio_stats_shm->queue_depth, 1);
+		atomic_fetch_add(&phl_aio_stats_shm->wait_acc_ms, start_time - task->submit_time);
+
+		task->work(task);
+
+		atomic_fetch_add(&phl_aio_stats_shm->run_acc_ms, phl_aio_now_ms() - start_time);
+
+		pthread_mutex_lock(&phl_aio_finished_lock);
+		task->next = phl_aio_finished_head;
+		phl_aio_finished_head = task;
+		pthread_mutex_unlock(&phl_aio_finished_lock);
+
+		uint64_t one = 1;
+		if (write(phl_aio_eventfd, &one, sizeof(one)) < 0) {
+			/* the counter is overflow, never happen */
+		}
+	}
+	return NULL;
+}
+
+static void phl_aio_finish(struct phl_aio_task *task)
+{
+	atomic_fetch_add(&phl_aio_stats_shm->complete, 1);
+	if (task->ret < 0) {
+		atomic_fetch_add(&phl_aio_stats_shm->error, 1);
+	}
+
+	task->finished = true;
+
+	if (task->cancelled) {
+		if (task->opened_fd > 0) {
+			close(task->opened_fd);
+		}
+		phl_aio_task_free(task);
+		return;
+	}
+	task->done(task);
+}
+
+static void phl_aio_on_readable(loop_stream_t *s)
+{
+	uint64_t count;
+	if (read(phl_aio_eventfd, &count, sizeof(count)) < 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&phl_aio_finished_lock);
+	struct phl_aio_task *task = phl_aio_finished_head;
+	phl_aio_finished_head = NULL;
+	pthread_mutex_unlock(&phl_aio_finished_lock);
+
+	/* the list is reversed, while the order does not matter */
+	while (task != NULL) {
+		struct phl_aio_task *next = task->next;
+		phl_aio_finish(task);
+		task = next;
+	}
+}
+
+static loop_stream_ops_t phl_aio_ops = {
+	.on_readable = phl_aio_on_readable,
+};
+
+/* Start threads at the first submit, because threads are not
+ * inherited by fork() so we can not start them in master. */
+static bool phl_aio_start(void)
+{
+	phl_aio_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (phl_aio_eventfd < 0) {
+		phl_conf_log(PHL_LOG_ERROR, "aio: fail to create eventfd %s", strerror(errno));
+		return false;
+	}
+
+	/* signals are handled by the main thread only */
+	sigset_t set, oldset;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	int created = 0;
+	for (int i = 0; i < phl_conf_runtime->aio.threads; i++) {
+		pthread_t tid;
+		if (pthread_create(&tid, &attr, phl_aio_thread_routine, NULL) == 0) {
+			created++;
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (created == 0) {
+		phl_conf_log(PHL_LOG_ERROR, "aio: fail to create threads");
+		close(phl_aio_eventfd);
+		return false;
+	}
+
+	phl_aio_stream = loop_stream_new(phl_loop, phl_aio_eventfd, &phl_aio_ops, false);
+
+	phl_conf_log(PHL_LOG_INFO, "aio: start %d threads", created);
+	return true;
+}
+
+/* The caller should check this before submitting a task whose done()
+ * can not be called synchronously, e.g. phl_aio_done_request(). */
+bool phl_aio_is_enabled(void)
+{
+	if (phl_aio_stream != NULL) {
+		return true;
+	}
+	if (phl_conf_runtime->aio.threads == 0) {
+		return false;
+	}
+	if (!phl_aio_start()) {
+		phl_conf_runtime->aio.threads = 0;
+		return false;
+	}
+	return true;
+}
+
+struct phl_aio_task *phl_aio_task_new(void (*work)(struct phl_aio_task *),
+		void (*done)(struct phl_aio_task *), void *data)
+{
+	struct phl_aio_task *task = calloc(1, sizeof(struct phl_aio_task));
+	task->work = work;
+	task->done = done;
+	task->data = data;
+	task->offset = -1;
+	return task;
+}
+
+void phl_aio_task_free(struct phl_aio_task *task)
+{
+	free(task->path);
+	free(task->buf);
+	free(task);
+}
+
+/* If aio is not enabled, the task is run synchronously,
+ * and task->done() is called before return. */
+void phl_aio_submit(struct phl_aio_task *task)
+{
+	atomic_fetch_add(&phl_aio_stats_shm->submit, 1);
+
+	if (!phl_aio_is_enabled()) {
+		task->work(task);
+		phl_aio_finish(task);
+		return;
+	}
+
+	long depth = atomic_fetch_add(&phl_aio_stats_shm->queue_depth, 1) + 1;
+	long max = atomic_load(&phl_aio_stats_shm->queue_depth_max);
+	while (depth > max && !atomic_compare_exchange_weak(
+				&phl_aio_stats_shm->queue_depth_max, &max, depth));
+
+	task->submit_time = phl_aio_now_ms();
+	task->next = NULL;
+
+	pthread_mutex_lock(&phl_aio_pending_lock);
+	*phl_aio_pending_tail = task;
+	phl_aio_pending_tail = &task->next;
+	pthread_cond_signal(&phl_aio_pending_cond);
+	pthread_mutex_unlock(&phl_aio_pending_lock);
+}
+
+/* The owner of task is gone. The task can not be stopped if it is
+ * running, so free it later at finishing. */
+void phl_aio_cancel(struct phl_aio_task *task)
+{
+	if (task->finished) { /* but the result is not used */
+		if (task->opened_fd > 0) {
+			close(task->opened_fd);
+		}
+		phl_aio_task_free(task);
+		return;
+	}
+
+	atomic_fetch_add(&phl_aio_stats_shm->cancel, 1);
+	task->cancelled = true;
+	task->done = NULL;
+}
+
+/* common works */
+
+void phl_aio_work_open(struct phl_aio_task *task)
+{
+	task->fd = openat(task->dirfd, task->path, O_RDONLY);
+	if (task->fd < 0) {
+		task->ret = -1;
+		task->err = errno;
+		return;
+	}
+	task->opened_fd = task->fd;
+	task->ret = fstat(task->fd, &task->st);
+	task->err = errno;
+}
+
+void phl_aio_work_read(struct phl_aio_task *task)
+{
+	if (task->offset < 0) {
+		task->ret = read(task->fd, task->buf, task->len);
+	} else {
+		task->ret = pread(task->fd, task->buf, task->len, task->offset);
+	}
+	task->err = errno;
+}
+
+void phl_aio_work_write(struct phl_aio_task *task)
+{
+	if (task->offset < 0) {
+		task->ret = write(task->fd, task->buf, task->len);
+	} else {
+		task->ret = pwrite(task->fd, task->buf, task->len, task->offset);
+	}
+	task->err = errno;
+}
+
+void phl_aio_work_unlink(struct phl_aio_task *task)
+{
+	task->ret = unlinkat(task->dirfd, task->path, 0);
+	task->err = errno;
+}
+
+void phl_aio_done_request(struct phl_aio_task *task)
+{
+	phl_request_run(task->data, "aio done");
+}
+
+void phl_aio_done_free(struct phl_aio_task *task)
+{
+	phl_aio_task_free(task);
+}
+
+void phl_aio_stats(wuy_json_t *json)
+{
+	struct phl_aio_stats *stats = phl_aio_stats_shm;
+
+	wuy_json_object_object(json, "aio");
+	wuy_json_object_int(json, "threads", phl_conf_runtime->aio.threads);
+	wuy_json_object_int(json, "submit", atomic_load(&stats->submit));
+	wuy_json_object_int(json, "complete", atomic_load(&stats->complete));
+	wuy_json_object_int(json, "cancel", atomic_load(&stats->cancel));
+	wuy_json_object_int(json, "error", atomic_load(&stats->error));
+	wuy_json_object_int(json, "queue_depth", atomic_load(&stats->queue_depth));
+	wuy_json_object_int(json, "queue_depth_max", atomic_load(&stats->queue_depth_max));
+	wuy_json_object_int(json, "wait_acc_ms", atomic_load(&stats->wait_acc_ms));
+	wuy_json_object_int(json, "run_acc_ms", atomic_load(&stats->run_acc_ms));
+	wuy_json_object_close(json);
+}
+
+static const char *phl_conf_runtime_aio_post(void *data)
+{
+	phl_aio_stats_shm = wuy_shmpool_alloc(sizeof(struct phl_aio_stats));
+	return WUY_CFLUA_OK;
+}
+
+static struct wuy_cflua_command phl_conf_runtime_aio_commands[] = {
+	{	.name = "threads",
+		.description = "Number of threads in each worker to run disk I/O, "
+			"so the worker is not blocked by slow disk. "
+			"Set 0 to run disk I/O in worker directly.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_conf_runtime_aio, threads),
+		.limits.n = WUY_CFLUA_LIMITS(0, 256),
+		.default_value.n = 4,
+	},
+	{ NULL },
+};
+struct wuy_cflua_table phl_conf_runtime_aio_table = {
+	.commands = phl_conf_runtime_aio_commands,
+	.post = phl_conf_runtime_aio_post,
+};
@@ -0,0 +1,67 @@
+#ifndef PHL_AIO_H
+#define PHL_AIO_H
+
+#include <sys/stat.h>
+
+/* Asynchronous disk I/O.
+ *
+ * The blocking operations are run in a thread pool of each worker,
+ * and the completions are delivered back into phl_loop. */
+
+struct phl_aio_task {
+	/* run in the I/O thread */
+	void			(*work)(struct phl_aio_task *);
+
+	/* run in phl_loop after work(), unless cancelled */
+	void			(*done)(struct phl_aio_task *);
+	void			*data;
+
+	/* arguments */
+	int			dirfd;
+	int			fd;
+	char			*path; /* freed with task */
+	char			*buf; /* freed with task */
+	size_t			len;
+	off_t			offset; /* -1 for current position */
+
+	/* results */
+	ssize_t			ret;
+	int			err;
+	int			opened_fd; /* closed if cancelled */
+	struct stat		st;
+
+	/* internal */
+	bool			finished;
+	bool			cancelled;
+	long			submit_time;
+	struct phl_aio_task	*next;
+};
+
+struct phl_aio_task *phl_aio_task_new(void (*work)(struct phl_aio_task *),
+		void (*done)(struct phl_aio_task *), void *data);
+
+void phl_aio_task_free(struct phl_aio_task *task);
+
+bool phl_aio_is_enabled(void);
+
+void phl_aio_submit(struct phl_aio_task *task);
+
+void phl_aio_cancel(struct phl_aio_task *task);
+
+/* common works */
+void phl_aio_work_open(struct phl_aio_task *task);
+void phl_aio_work_read(struct phl_aio_task *task);
+void phl_aio_work_write(struct phl_aio_task *task);
+void phl_aio_work_unlink(struct phl_aio_task *task);
+
+/* common done: wake up the request in task->data */
+void phl_aio_done_request(struct phl_aio_task *task);
+
+/* common done: nobody waits for the result */
+void phl_aio_done_free(struct phl_aio_task *task);
+
+void phl_aio_stats(wuy_json_t *json);
+
+extern struct wuy_cflua_table phl_conf_runtime_aio_table;
+
+#endif
@@ -1,6 +1,4 @@
-#include <lua5.1/lua.h>
-#include <lua5.1/lualib.h>
-#include <lua5.1/lauxlib.h>
+#include "phl_lua.h"
 
 #include "phl_main.h"
 
@@ -35,6 +33,8 @@ bool phl_conf_parse(const char *conf_file)
 	luaL_openlibs(L);
 	lua_atpanic(L, phl_conf_lua_panic);
 
+	phl_key_conf_init(L);
+
 	/* load pre-defined functions */
 	assert(luaL_dostring(L, phl_conf_predefs_lua_str) == 0);
 
@@ -2,7 +2,7 @@
 #define PHL_CONF_H
 
 #include <stdbool.h>
-#include <lua5.1/lua.h>
+#include "phl_lua.h"
 
 #include "phl_module.h"
 #include "phl_dynamic.h"
@@ -84,6 +84,8 @@ struct phl_conf_host {
 	struct phl_conf_path	**paths;
 	struct phl_conf_path	*default_path;
 
+	struct phl_conf_path_router	*router; /* compiled from paths */
+
 	struct phl_ssl_conf	*ssl;
 
 	void			*module_confs[PHL_MODULE_MAX];
@@ -102,10 +104,9 @@ struct phl_conf_listen {
 	struct phl_conf_host	**hosts;
 	struct phl_conf_host	*default_host;
 
-	wuy_dict_t		*host_dict;
-	struct phl_conf_host	*host_wildcard;
-	bool			any_prefix_hostname;
-	bool			any_subfix_hostname;
+	struct phl_conf_host_trie	*host_trie;
+	struct phl_conf_host_trie	*host_subfix_trie;
+	struct phl_conf_host		*host_wildcard;
 
 	struct {
 		int		idle_timeout;
@@ -159,6 +160,23 @@ struct phl_conf_runtime {
 		int		ai_family;
 	} resolver;
 
+	struct phl_conf_runtime_aio {
+		int		threads;
+	} aio;
+
+	struct phl_conf_runtime_open_cache {
+		int		max_items;
+		int		valid_time;
+	} open_cache;
+
+	struct phl_conf_runtime_lua {
+		int			thread_pool;
+		int			timer_stats;
+		wuy_cflua_function_t	init_worker;
+	} lua;
+
+	struct phl_shared_dict	**shared;
+
 	struct phl_log		*error_log;
 
 	struct phl_module_dynamic *dynamic_modules;
@@ -180,6 +198,10 @@ struct phl_conf_host *phl_conf_host_locate(struct phl_conf_listen *conf_listen,
 struct phl_conf_path *phl_conf_path_locate(struct phl_conf_host *conf_host,
 		const char *name);
 
+void phl_conf_path_router_build(struct phl_conf_host *conf_host);
+
+void phl_conf_path_benchmark(void);
+
 void phl_conf_listen_init_worker(void);
 
 void phl_conf_path_stats(struct phl_conf_path *conf_path, wuy_json_t *json);
@@ -54,7 +54,9 @@ void phl_conf_doc(void)
 	printf("Under Listen scope. Accepts one or more hostnames as virtual server.\n\n"
 			"The hostname arguments may start or end with a wildcard `*`.\n"
 			"Especial the \"*\" is the default Host under the Listen scope to match any request.\n"
-			"Each request is matched in the order of longest match.\n\n");
+			"Each request is matched in the order of longest match.\n"
+			"Exact hostnames take precedence over wildcards starting with `*`, "
+			"which take precedence over wildcards ending with `*`.\n\n");
 	wuy_cflua_dump_table_markdown(&phl_conf_host_table, 0);
 
 	printf("\n# Path scope\n\n");
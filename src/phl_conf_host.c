@@ -1,11 +1,139 @@
 #include "phl_main.h"
 
-struct phl_conf_host_search_name {
-	const char		*name;
-	struct phl_conf_host	*conf_host;
-	wuy_dict_node_t		dict_node;
+/* Hostnames are compiled into 2 label tries at configuration time:
+ *
+ *   - host_trie, with labels in reversed order, e.g. "www.example.com"
+ *     is inserted as com -> example -> www, for exact names and leading
+ *     wildcard names like "*.example.com";
+ *   - host_subfix_trie, with labels in order, for tail wildcard names
+ *     like "www.example.*".
+ *
+ * So the lookup costs O(labels) no matter how many hostnames there are.
+ * The priority is: exact name, then the longest leading wildcard, then
+ * the longest tail wildcard, and at last the "*" one. */
+
+struct phl_conf_host_trie {
+	const char			*label;
+	int				label_len;
+
+	struct phl_conf_host		*exact;
+	struct phl_conf_host		*wildcard; /* match at least 1 more label */
+
+	/* sorted by label after built */
+	struct phl_conf_host_trie	**children;
+	int				child_num;
+
+	/* used only when building */
+	struct phl_conf_host_trie	*first_child;
+	struct phl_conf_host_trie	*next_sibling;
 };
 
+#define PHL_CONF_HOST_LABEL_MAX	128
+
+/* split @name into labels, ignoring the leading and tail dot.
+ * Return the label number, or -1 if invalid. */
+static int phl_conf_host_split(const char *name, const char **labels, int *lens)
+{
+	if (name[0] == '.') {
+		name++;
+	}
+
+	int num = 0;
+	const char *p = name;
+	while (*p != '\0') {
+		if (num == PHL_CONF_HOST_LABEL_MAX) {
+			return -1;
+		}
+		const char *dot = strchr(p, '.');
+		int len = dot ? dot - p : strlen(p);
+		if (len == 0) {
+			return -1;
+		}
+		labels[num] = p;
+		lens[num] = len;
+		num++;
+
+		if (dot == NULL) {
+			break;
+		}
+		p = dot + 1;
+	}
+	return num;
+}
+
+static int phl_conf_host_label_cmp(const char *a, int a_len, const char *b, int b_len)
+{
+	int ret = strncasecmp(a, b, a_len < b_len ? a_len : b_len);
+	return ret != 0 ? ret : a_len - b_len;
+}
+
+static int phl_conf_host_trie_sort_cmp(const void *a, const void *b)
+{
+	const struct phl_conf_host_trie *na = *(struct phl_conf_host_trie **)a;
+	const struct phl_conf_host_trie *nb = *(struct phl_conf_host_trie **)b;
+	return phl_conf_host_label_cmp(na->label, na->label_len, nb->label, nb->label_len);
+}
+
+/* used when building */
+static struct phl_conf_host_trie *phl_conf_host_trie_add(struct phl_conf_host_trie *node,
+		const char *label, int len)
+{
+	struct phl_conf_host_trie *child;
+	for (child = node->first_child; child != NULL; child = child->next_sibling) {
+		if (phl_conf_host_label_cmp(child->label, child->label_len, label, len) == 0) {
+			return child;
+		}
+	}
+
+	child = wuy_pool_alloc(wuy_cflua_pool, sizeof(struct phl_conf_host_trie));
+	memset(child, 0, sizeof(struct phl_conf_host_trie));
+	child->label = label;
+	child->label_len = len;
+	child->next_sibling = node->first_child;
+	node->first_child = child;
+	node->child_num++;
+	return child;
+}
+
+static void phl_conf_host_trie_finish(struct phl_conf_host_trie *node)
+{
+	if (node->child_num == 0) {
+		return;
+	}
+
+	node->children = wuy_pool_alloc(wuy_cflua_pool,
+			sizeof(struct phl_conf_host_trie *) * node->child_num);
+
+	int i = 0;
+	struct phl_conf_host_trie *child;
+	for (child = node->first_child; child != NULL; child = child->next_sibling) {
+		phl_conf_host_trie_finish(child);
+		node->children[i++] = child;
+	}
+	qsort(node->children, node->child_num, sizeof(struct phl_conf_host_trie *),
+			phl_conf_host_trie_sort_cmp);
+}
+
+static struct phl_conf_host_trie *phl_conf_host_trie_get(struct phl_conf_host_trie *node,
+		const char *label, int len)
+{
+	int low = 0, high = node->child_num - 1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		struct phl_conf_host_trie *child = node->children[mid];
+		int cmp = phl_conf_host_label_cmp(child->label, child->label_len, label, len);
+		if (cmp == 0) {
+			return child;
+		}
+		if (cmp < 0) {
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+	return NULL;
+}
+
 static const char *phl_conf_host_add_name(struct phl_conf_listen *conf_listen,
 		struct phl_conf_host *conf_host, char *name)
 {
@@ -33,6 +161,7 @@ static const char *phl_conf_host_add_name(struct phl_conf_listen *conf_listen,
 		len--;
 	}
 
+	bool any_prefix = false, any_subfix = false;
 	const char *wild = strchr(name, '*');
 	if (wild != NULL) {
 		if (wild == name) {
@@ -42,34 +171,57 @@ static const char *phl_conf_host_add_name(struct phl_conf_listen *conf_listen,
 			if (strchr(name + 1, '*') != NULL) {
 				return "at most 1 wildcast in hostname";
 			}
-			conf_listen->any_prefix_hostname = true;
+			any_prefix = true;
 		} else if (wild == name + len - 1) {
 			if (name[len-2] != '.') {
 				return "the front of tail wildcast `*` must be `.`";
 			}
-			conf_listen->any_subfix_hostname = true;
+			any_subfix = true;
 		} else {
 			return "wildcast `*` is not allowed in middle of hostname";
 		}
 	}
 
-	if (wuy_dict_get(conf_listen->host_dict, name) != NULL) {
-		return "duplicate hostname";
+	const char *labels[PHL_CONF_HOST_LABEL_MAX];
+	int lens[PHL_CONF_HOST_LABEL_MAX];
+	int num = phl_conf_host_split(name, labels, lens);
+	if (num <= 0) {
+		return "invalid host name";
 	}
 
-	struct phl_conf_host_search_name *node = wuy_pool_alloc(wuy_cflua_pool,
-			sizeof(struct phl_conf_host_search_name));
-	node->name = name;
-	node->conf_host = conf_host;
-	wuy_dict_add(conf_listen->host_dict, node);
+	struct phl_conf_host **slot;
+	if (any_subfix) {
+		if (conf_listen->host_subfix_trie == NULL) {
+			conf_listen->host_subfix_trie = wuy_pool_alloc(wuy_cflua_pool,
+					sizeof(struct phl_conf_host_trie));
+			memset(conf_listen->host_subfix_trie, 0, sizeof(struct phl_conf_host_trie));
+		}
+		struct phl_conf_host_trie *node = conf_listen->host_subfix_trie;
+		for (int i = 0; i < num - 1; i++) { /* omit the tail `*` */
+			node = phl_conf_host_trie_add(node, labels[i], lens[i]);
+		}
+		slot = &node->wildcard;
+	} else {
+		struct phl_conf_host_trie *node = conf_listen->host_trie;
+		int stop = any_prefix ? 1 : 0; /* omit the leading `*` */
+		for (int i = num - 1; i >= stop; i--) {
+			node = phl_conf_host_trie_add(node, labels[i], lens[i]);
+		}
+		slot = any_prefix ? &node->wildcard : &node->exact;
+	}
+
+	if (*slot != NULL) {
+		return "duplicate hostname";
+	}
+	*slot = conf_host;
 	return WUY_CFLUA_OK;
 }
 
 const char *phl_conf_host_register(struct phl_conf_listen *conf_listen)
 {
-	conf_listen->host_dict = wuy_dict_new_type(WUY_DICT_KEY_STRING,
-			offsetof(struct phl_conf_host_search_name, name),
-			offsetof(struct phl_conf_host_search_name, dict_node));
+	conf_listen->host_trie = wuy_pool_alloc(wuy_cflua_pool,
+			sizeof(struct phl_conf_host_trie));
+	memset(conf_listen->host_trie, 0, sizeof(struct phl_conf_host_trie));
 
 	struct phl_conf_host *conf_host;
 	for (int i = 0; (conf_host = conf_listen->hosts[i]) != NULL; i++) {
@@ -82,13 +234,20 @@ const char *phl_conf_host_register(struct phl_conf_listen *conf_listen)
 			}
 		}
 	}
+
+	phl_conf_host_trie_finish(conf_listen->host_trie);
+	if (conf_listen->host_subfix_trie != NULL) {
+		phl_conf_host_trie_finish(conf_listen->host_subfix_trie);
+	}
 	return WUY_CFLUA_OK;
 }
 
+/* The @name is matched case-insensitively, so the SNI name can
+ * be used directly. */
 struct phl_conf_host *phl_conf_host_locate(struct phl_conf_listen *conf_listen,
 		const char *name)
 {
-	if (conf_listen->host_dict == NULL) {
+	if (conf_listen->host_trie == NULL) {
 		return conf_listen->default_host;
 	}
 
@@ -96,43 +255,44 @@ struct phl_conf_host *phl_conf_host_locate(struct phl_conf_listen *conf_listen,
 		return conf_listen->host_wildcard;
 	}
 
-	struct phl_conf_host_search_name *node = wuy_dict_get(conf_listen->host_dict, name);
-	if (node != NULL) {
-		return node->conf_host;
+	const char *labels[PHL_CONF_HOST_LABEL_MAX];
+	int lens[PHL_CONF_HOST_LABEL_MAX];
+	int num = phl_conf_host_split(name, labels, lens);
+	if (num <= 0) {
+		return conf_listen->host_wildcard;
 	}
 
-	int name_len = strlen(name);
-	if (conf_listen->any_prefix_hostname) {
-		char pre_name[name_len + 1], *p = pre_name;
-		strcpy(pre_name, name);
-		if (p[0] == '.') {
-			p++;
+	/* exact name, or the longest leading wildcard */
+	struct phl_conf_host *wild_host = NULL;
+	struct phl_conf_host_trie *node = conf_listen->host_trie;
+	for (int i = num - 1; i >= 0; i--) {
+		node = phl_conf_host_trie_get(node, labels[i], lens[i]);
+		if (node == NULL) {
+			break;
 		}
-		while ((p = strchr(p, '.')) != NULL) {
-			p[-1] = '*';
-			node = wuy_dict_get(conf_listen->host_dict, p - 1);
-			if (node != NULL) {
-				return node->conf_host;
+		if (i == 0) {
+			if (node->exact != NULL) {
+				return node->exact;
 			}
-			p++;
+		} else if (node->wildcard != NULL) {
+			wild_host = node->wildcard;
 		}
 	}
-	if (conf_listen->any_subfix_hostname) {
-		char sub_name[name_len + 1], *p;
-		strcpy(sub_name, name);
-		if (sub_name[name_len - 1] == '.') {
-			sub_name[name_len - 1] = '\0';
-		}
-		while ((p = strrchr(sub_name, '.')) != NULL) {
-			p[1] = '*';
-			p[2] = '\0';
-			node = wuy_dict_get(conf_listen->host_dict, sub_name);
-			if (node != NULL) {
-				return node->conf_host;
-			}
-			p[0] = '\0';
+	if (wild_host != NULL) {
+		return wild_host;
+	}
+
+	/* the longest tail wildcard */
+	node = conf_listen->host_subfix_trie;
+	for (int i = 0; i < num - 1 && node != NULL; i++) {
+		node = phl_conf_host_trie_get(node, labels[i], lens[i]);
+		if (node != NULL && node->wildcard != NULL) {
+			wild_host = node->wildcard;
 		}
 	}
+	if (wild_host != NULL) {
+		return wild_host;
+	}
 
 	return conf_listen->host_wildcard;
 }
@@ -193,6 +353,8 @@ static const char *phl_conf_host_post(void *data)
 		return "Path overwrite";
 	}
 
+	phl_conf_path_router_build(conf_host);
+
 	conf_host->stats = wuy_shmpool_alloc(sizeof(struct phl_conf_host_stats));
 
 	return WUY_CFLUA_OK;
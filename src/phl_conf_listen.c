@@ -202,10 +202,6 @@ static void phl_conf_listen_free(void *data)
 	}
 
 	phl_connection_conf_timers_free(conf_listen);
-
-	if (conf_listen->host_dict != NULL) {
-		wuy_dict_destroy(conf_listen->host_dict);
-	}
 }
 
 static struct wuy_cflua_command phl_conf_listen_commands[] = {
@@ -1,3 +1,5 @@
+#include <limits.h>
+
 #include "phl_main.h"
 
 void phl_conf_path_stats(struct phl_conf_path *conf_path, wuy_json_t *json)
@@ -9,6 +11,10 @@ void phl_conf_path_stats(struct phl_conf_path *conf_path, wuy_json_t *json)
 	wuy_json_object_int(json, "react_acc_ms", atomic_load(&stats->react_acc_ms));
 	wuy_json_object_int(json, "resp_acc_ms", atomic_load(&stats->resp_acc_ms));
 	wuy_json_object_int(json, "total_acc_ms", atomic_load(&stats->total_acc_ms));
+	wuy_json_object_int(json, "lua_new", atomic_load(&stats->lua_new));
+	wuy_json_object_int(json, "lua_again", atomic_load(&stats->lua_again));
+	wuy_json_object_int(json, "lua_error", atomic_load(&stats->lua_error));
+	wuy_json_object_int(json, "lua_free", atomic_load(&stats->lua_free));
 
 	wuy_json_object_object(json, "status_codes");
 	int c;
@@ -41,13 +47,9 @@ static bool phl_conf_path_name_match(const char *def, const char *req)
 		abort();
 	}
 }
-struct phl_conf_path *phl_conf_path_locate(struct phl_conf_host *conf_host,
+static struct phl_conf_path *phl_conf_path_locate_linear(struct phl_conf_host *conf_host,
 		const char *name)
 {
-	if (conf_host->paths == NULL) {
-		return conf_host->default_path;
-	}
-
 	struct phl_conf_path *conf_path;
 	for (int i = 0; (conf_path = conf_host->paths[i]) != NULL; i++) {
 		char *pathname;
@@ -60,6 +62,363 @@ struct phl_conf_path *phl_conf_path_locate(struct phl_conf_host *conf_host,
 	return NULL;
 }
 
+/* === compiled router
+ *
+ * The pathnames of each host are compiled at configuration time into:
+ * a dict for '=' and '@', a radix tree for '/', and an ordered list for
+ * '~'. Each pathname is given an order as in the list, and the one with
+ * the smallest order among all matched wins, which keeps first-match.
+ * A '~' pattern is tried only if its order is smaller than the best
+ * found by dict and radix tree, and it is skipped quickly by its leading
+ * literal if it is anchored by '^'. */
+
+struct phl_conf_path_exact {
+	const char		*name;
+	int			order;
+	struct phl_conf_path	*conf_path;
+	wuy_dict_node_t		dict_node;
+};
+
+struct phl_conf_path_prefix {
+	const char		*label;
+	int			label_len;
+	int			order; /* INT_MAX if no pathname ends here */
+	struct phl_conf_path	*conf_path;
+
+	struct phl_conf_path_prefix	*children;
+	struct phl_conf_path_prefix	*next; /* sibling */
+};
+
+struct phl_conf_path_pattern {
+	const char		*pattern;
+	const char		*literal; /* leading literal if anchored */
+	int			literal_len;
+	int			order;
+	struct phl_conf_path	*conf_path;
+};
+
+struct phl_conf_path_router {
+	wuy_dict_t			*exact_dict;
+	struct phl_conf_path_prefix	prefix_root;
+	struct phl_conf_path_pattern	*patterns;
+	int				pattern_num;
+};
+
+static struct phl_conf_path_prefix *phl_conf_path_prefix_child(
+		struct phl_conf_path_prefix *node, char c)
+{
+	struct phl_conf_path_prefix *child;
+	for (child = node->children; child != NULL; child = child->next) {
+		if (child->label[0] == c) {
+			break;
+		}
+	}
+	return child;
+}
+
+static void phl_conf_path_prefix_insert(struct phl_conf_path_prefix *node,
+		const char *name, int order, struct phl_conf_path *conf_path)
+{
+	while (*name != '\0') {
+		struct phl_conf_path_prefix *child = phl_conf_path_prefix_child(node, *name);
+		if (child == NULL) {
+			child = wuy_pool_alloc(wuy_cflua_pool, sizeof(struct phl_conf_path_prefix));
+			child->label = name;
+			child->label_len = strlen(name);
+			child->order = order;
+			child->conf_path = conf_path;
+			child->children = NULL;
+			child->next = node->children;
+			node->children = child;
+			return;
+		}
+
+		int common = 0;
+		while (common < child->label_len && child->label[common] == name[common]) {
+			common++;
+		}
+
+		/* split the child, with a new node of the common part */
+		if (common < child->label_len) {
+			struct phl_conf_path_prefix *split = wuy_pool_alloc(wuy_cflua_pool,
+					sizeof(struct phl_conf_path_prefix));
+			*split = *child;
+			split->label += common;
+			split->label_len -= common;
+			split->next = NULL;
+
+			child->label_len = common;
+			child->order = INT_MAX;
+			child->conf_path = NULL;
+			child->children = split;
+		}
+
+		node = child;
+		name += common;
+	}
+
+	if (order < node->order) {
+		node->order = order;
+		node->conf_path = conf_path;
+	}
+}
+
+static struct phl_conf_path_prefix *phl_conf_path_prefix_lookup(
+		struct phl_conf_path_prefix *node, const char *name)
+{
+	struct phl_conf_path_prefix *best = NULL;
+	while (1) {
+		if (best == NULL || node->order < best->order) {
+			best = node;
+		}
+		if (*name == '\0') {
+			break;
+		}
+		node = phl_conf_path_prefix_child(node, *name);
+		if (node == NULL || strncmp(name, node->label, node->label_len) != 0) {
+			break;
+		}
+		name += node->label_len;
+	}
+	return best;
+}
+
+/* the literal prefix of Lua pattern anchored by '^' */
+static void phl_conf_path_pattern_literal(struct phl_conf_path_pattern *pattern)
+{
+	const char *p = pattern->pattern;
+	if (p[0] != '^') {
+		return;
+	}
+	p++;
+
+	int len = strcspn(p, "^$()%.[]*+-?");
+	if (len > 0 && strchr("*-?", p[len]) != NULL && p[len] != '\0') {
+		len--; /* the last char is optional */
+	}
+	if (len > 0) {
+		pattern->literal = p;
+		pattern->literal_len = len;
+	}
+}
+
+void phl_conf_path_router_build(struct phl_conf_host *conf_host)
+{
+	if (conf_host->paths == NULL) {
+		return;
+	}
+
+	struct phl_conf_path_router *router = wuy_pool_alloc(wuy_cflua_pool,
+			sizeof(struct phl_conf_path_router));
+	router->exact_dict = wuy_dict_new_type(WUY_DICT_KEY_STRING,
+			offsetof(struct phl_conf_path_exact, name),
+			offsetof(struct phl_conf_path_exact, dict_node));
+	router->prefix_root = (struct phl_conf_path_prefix){ .label = "", .order = INT_MAX };
+	router->pattern_num = 0;
+
+	int total = 0;
+	for (int i = 0; conf_host->paths[i] != NULL; i++) {
+		for (int j = 0; conf_host->paths[i]->pathnames[j] != NULL; j++) {
+			total++;
+		}
+	}
+	router->patterns = wuy_pool_alloc(wuy_cflua_pool,
+			sizeof(struct phl_conf_path_pattern) * total);
+
+	int order = 0;
+	struct phl_conf_path *conf_path;
+	for (int i = 0; (conf_path = conf_host->paths[i]) != NULL; i++) {
+		char *pathname;
+		for (int j = 0; (pathname = conf_path->pathnames[j]) != NULL; j++, order++) {
+			switch (pathname[0]) {
+			case '=':
+				if (pathname[1] == '@') { /* never matches */
+					break;
+				}
+				/* fall through */
+			case '@': {
+				const char *name = pathname[0] == '=' ? pathname + 1 : pathname;
+				if (wuy_dict_get(router->exact_dict, name) != NULL) {
+					break; /* the former one wins */
+				}
+				struct phl_conf_path_exact *exact = wuy_pool_alloc(wuy_cflua_pool,
+						sizeof(struct phl_conf_path_exact));
+				exact->name = name;
+				exact->order = order;
+				exact->conf_path = conf_path;
+				wuy_dict_add(router->exact_dict, exact);
+				break;
+			}
+			case '/':
+				phl_conf_path_prefix_insert(&router->prefix_root,
+						pathname, order, conf_path);
+				break;
+			case '~': {
+				struct phl_conf_path_pattern *pattern = &router->patterns[router->pattern_num++];
+				pattern->pattern = pathname + 1;
+				pattern->literal = NULL;
+				pattern->literal_len = 0;
+				pattern->order = order;
+				pattern->conf_path = conf_path;
+				phl_conf_path_pattern_literal(pattern);
+				break;
+			}
+			default:
+				abort();
+			}
+		}
+	}
+
+	conf_host->router = router;
+}
+
+struct phl_conf_path *phl_conf_path_locate(struct phl_conf_host *conf_host,
+		const char *name)
+{
+	if (conf_host->paths == NULL) {
+		return conf_host->default_path;
+	}
+
+	struct phl_conf_path_router *router = conf_host->router;
+
+	int best_order = INT_MAX;
+	struct phl_conf_path *best = NULL;
+
+	struct phl_conf_path_exact *exact = wuy_dict_get(router->exact_dict, name);
+	if (exact != NULL) {
+		best_order = exact->order;
+		best = exact->conf_path;
+	}
+
+	/* named path matches only by the dict */
+	if (name[0] == '@') {
+		return best;
+	}
+
+	struct phl_conf_path_prefix *prefix = phl_conf_path_prefix_lookup(&router->prefix_root, name);
+	if (prefix->order < best_order) {
+		best_order = prefix->order;
+		best = prefix->conf_path;
+	}
+
+	for (int i = 0; i < router->pattern_num; i++) {
+		struct phl_conf_path_pattern *pattern = &router->patterns[i];
+		if (pattern->order >= best_order) {
+			break;
+		}
+		if (pattern->literal != NULL && strncmp(name, pattern->literal, pattern->literal_len) != 0) {
+			continue;
+		}
+		if (wuy_luastr_find2(name, pattern->pattern)) {
+			return pattern->conf_path;
+		}
+	}
+
+	return best;
+}
+
+/* Compare the compiled router with the linear search, by sample names
+ * made from the pathnames. For `phorklift -b`. */
+static long phl_conf_path_benchmark_run(struct phl_conf_host *conf_host,
+		char **samples, int sample_num, int rounds, bool linear)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < sample_num; i++) {
+			if (linear) {
+				phl_conf_path_locate_linear(conf_host, samples[i]);
+			} else {
+				phl_conf_path_locate(conf_host, samples[i]);
+			}
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) * 1000000000L + end.tv_nsec - start.tv_nsec;
+}
+
+static void phl_conf_path_benchmark_host(struct phl_conf_host *conf_host)
+{
+	if (conf_host->paths == NULL) {
+		return;
+	}
+
+	int total = 0;
+	for (int i = 0; conf_host->paths[i] != NULL; i++) {
+		for (int j = 0; conf_host->paths[i]->pathnames[j] != NULL; j++) {
+			total++;
+		}
+	}
+
+	char **samples = malloc(sizeof(char *) * (total * 2 + 2));
+	int sample_num = 0;
+	samples[sample_num++] = strdup("/");
+	samples[sample_num++] = strdup("/phorklift/benchmark/not/found");
+
+	char *pathname;
+	for (int i = 0; conf_host->paths[i] != NULL; i++) {
+		for (int j = 0; (pathname = conf_host->paths[i]->pathnames[j]) != NULL; j++) {
+			switch (pathname[0]) {
+			case '/':
+				samples[sample_num++] = strdup(pathname);
+				samples[sample_num] = malloc(strlen(pathname) + 20);
+				sprintf(samples[sample_num++], "%s/sub/index.html", pathname);
+				break;
+			case '=':
+				samples[sample_num++] = strdup(pathname + 1);
+				break;
+			case '@':
+				samples[sample_num++] = strdup(pathname);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	int mismatch = 0;
+	for (int i = 0; i < sample_num; i++) {
+		if (phl_conf_path_locate(conf_host, samples[i])
+				!= phl_conf_path_locate_linear(conf_host, samples[i])) {
+			printf("    MISMATCH: %s\n", samples[i]);
+			mismatch++;
+		}
+	}
+
+	int rounds = 1000000 / sample_num + 1;
+	long linear_ns = phl_conf_path_benchmark_run(conf_host, samples, sample_num, rounds, true);
+	long router_ns = phl_conf_path_benchmark_run(conf_host, samples, sample_num, rounds, false);
+	long lookups = (long)rounds * sample_num;
+
+	printf("Host(%s): %d pathnames, %d samples, %ld lookups, %d mismatch\n",
+			conf_host->name, total, sample_num, lookups, mismatch);
+	printf("    linear: %.1f ns/lookup\n", (double)linear_ns / lookups);
+	printf("    router: %.1f ns/lookup\n", (double)router_ns / lookups);
+
+	for (int i = 0; i < sample_num; i++) {
+		free(samples[i]);
+	}
+	free(samples);
+}
+
+void phl_conf_path_benchmark(void)
+{
+	struct phl_conf_listen *conf_listen;
+	for (int i = 0; (conf_listen = phl_conf_listens[i]) != NULL; i++) {
+		printf("Listen(%s):\n", conf_listen->name);
+
+		struct phl_conf_host *conf_host;
+		if (conf_listen->hosts != NULL) {
+			for (int j = 0; (conf_host = conf_listen->hosts[j]) != NULL; j++) {
+				phl_conf_path_benchmark_host(conf_host);
+			}
+		}
+		phl_conf_path_benchmark_host(conf_listen->default_host);
+	}
+}
+
 bool phl_conf_path_check_overwrite(struct phl_conf_host *conf_host,
 		int stop, const char *pathname)
 {
@@ -59,6 +59,27 @@ static struct wuy_cflua_command phl_conf_runtime_commands[] = {
 		.offset = offsetof(struct phl_conf_runtime, resolver),
 		.u.table = &phl_conf_runtime_resolver_table,
 	},
+	{	.name = "aio",
+		.type = WUY_CFLUA_TYPE_TABLE,
+		.offset = offsetof(struct phl_conf_runtime, aio),
+		.u.table = &phl_conf_runtime_aio_table,
+	},
+	{	.name = "open_cache",
+		.type = WUY_CFLUA_TYPE_TABLE,
+		.offset = offsetof(struct phl_conf_runtime, open_cache),
+		.u.table = &phl_conf_runtime_open_cache_table,
+	},
+	{	.name = "lua",
+		.type = WUY_CFLUA_TYPE_TABLE,
+		.offset = offsetof(struct phl_conf_runtime, lua),
+		.u.table = &phl_conf_runtime_lua_table,
+	},
+	{	.name = "shared",
+		.description = "Shared dictionary list, used by Lua as `phl.shared.<name>`.",
+		.type = WUY_CFLUA_TYPE_TABLE,
+		.offset = offsetof(struct phl_conf_runtime, shared),
+		.u.table = &phl_conf_runtime_shared_table,
+	},
 	{	.name = "dynamic_modules",
 		.description = "Dynamic request module list.",
 		.type = WUY_CFLUA_TYPE_TABLE,
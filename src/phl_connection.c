@@ -120,24 +120,27 @@ int phl_connection_make_space(struct phl_connection *c, int size)
 	/* so flush this at phl_connection_defer_routine() */
 	phl_connection_put_defer(c);
 
-	/* allocate buffer */
+	/* use exist buffer */
+	if (c->send_buffer != NULL) {
+		int available = buf_size - c->send_buf_len;
+		if (available >= size) {
+			return available;
+		}
+
+		if (phl_connection_flush(c) == PHL_ERROR) {
+			return PHL_ERROR;
+		}
+	}
+
+	/* allocate buffer, or the buffer has been moved away by
+	 * subrequest's pipe in phl_connection_flush() */
 	if (c->send_buffer == NULL) {
 		c->send_buffer = malloc(buf_size);
 		c->send_buf_len = 0;
 		return c->send_buffer ? buf_size : PHL_ERROR;
 	}
 
-	/* use exist buffer */
 	int available = buf_size - c->send_buf_len;
-	if (available >= size) {
-		return available;
-	}
-
-	if (phl_connection_flush(c) == PHL_ERROR) {
-		return PHL_ERROR;
-	}
-
-	available = buf_size - c->send_buf_len;
 	return available >= size ? available : PHL_AGAIN;
 }
 
@@ -270,7 +273,8 @@ static bool phl_connection_on_accept(loop_tcp_listen_t *loop_listen,
 	}
 	static uint64_t phl_connection_id = 1;
 	c->id = phl_connection_id++;
-	c->client_addr = *addr;
+	memcpy(&c->client_addr, addr, addr->sa_family == AF_INET6 ?
+			sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
 	c->conf_listen = conf_listen;
 	c->loop_stream = s;
 	c->recv_timer = loop_group_timer_new(c);
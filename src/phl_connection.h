@@ -11,7 +11,10 @@ enum phl_connection_state {
 struct phl_connection {
 	/* set on created */
 	struct phl_conf_listen	*conf_listen;
-	struct sockaddr		client_addr; // XXX add padding
+	union {
+		struct sockaddr		client_addr;
+		struct sockaddr_in6	client_addr_in6; /* padding for IPv6 */
+	};
 	loop_stream_t		*loop_stream;
 
 	/* set by SSL SNI if any */
@@ -76,7 +76,6 @@ static bool phl_dynamic_need_get_conf(struct phl_dynamic_conf *sub_dyn,
 	return true;
 }
 
-#include <lua5.1/lauxlib.h>
 static bool phl_dynamic_load_str_conf(lua_State *L)
 {
 	size_t len;
@@ -169,61 +168,11 @@ static struct phl_dynamic_conf *phl_dynamic_new_holder(struct phl_dynamic_conf *
 	return sub_dyn;
 }
 
-void *phl_dynamic_get(struct phl_dynamic_conf *dynamic, struct phl_request *r)
+/* handle the return values of get_conf() at L's stack */
+static void *phl_dynamic_handle_conf(struct phl_dynamic_conf *dynamic,
+		struct phl_dynamic_conf *sub_dyn, const char *name,
+		struct phl_request *r, lua_State *L)
 {
-	/* call get_name() */
-	int name_len;
-	const char *name = phl_lua_call_lstring(r, dynamic->get_name, &name_len);
-	if (name == NULL) {
-		_log(PHL_LOG_ERROR, "fail to call get_name");
-		return PHL_PTR_ERROR;
-	}
-	if (name_len > 100) {
-		_log(PHL_LOG_ERROR, "too long name");
-		return PHL_PTR_ERROR;
-	}
-	_log(PHL_LOG_DEBUG, "get_name: %s", name);
-
-	/* search cache by name */
-	struct phl_dynamic_conf *sub_dyn = wuy_dict_get(dynamic->sub_dict, name);
-
-	if (sub_dyn == NULL) {
-		if (wuy_dict_count(dynamic->sub_dict) >= dynamic->sub_max) {
-			_log(PHL_LOG_ERROR, "fail to create new because of limited");
-			return PHL_PTR_ERROR;
-		}
-		sub_dyn = phl_dynamic_new_holder(dynamic, name);
-		goto get_conf;
-	}
-
-	/* cache hit */
-	if (phl_lua_thread_in_running(r, dynamic->get_conf)) {
-		goto get_conf;
-	}
-	if (sub_dyn->error_ret != 0) {
-		r->resp.status_code = sub_dyn->error_ret;
-		return PHL_PTR_ERROR;
-	}
-	if (sub_dyn->is_just_holder) {
-		wuy_list_append(&sub_dyn->holder_wait_head, &r->list_node);
-		return PHL_PTR_AGAIN;
-	}
-
-	loop_timer_set_after(sub_dyn->timer, sub_dyn->idle_timeout * 1000);
-
-	if (!phl_dynamic_need_get_conf(sub_dyn, r)) {
-		return phl_dynamic_to_container(sub_dyn); /* in most cases */
-	}
-
-	/* call get_conf() */
-get_conf:
-	_log(PHL_LOG_DEBUG, "get_conf");
-
-	lua_State *L = phl_lua_thread_run(r, dynamic->get_conf, "s", name);
-	if (L == PHL_PTR_ERROR || L == PHL_PTR_AGAIN) {
-		return L;
-	}
-
 	/* return value: optional status-code */
 	if (lua_isnumber(L, 1)) {
 		_log(PHL_LOG_DEBUG, "status-code: %ld", lua_tointeger(L, 1));
@@ -293,6 +242,68 @@ fail:
 	return phl_dynamic_to_container(sub_dyn); /* use stale */
 }
 
+void *phl_dynamic_get(struct phl_dynamic_conf *dynamic, struct phl_request *r)
+{
+	/* call get_name() */
+	int name_len;
+	const char *name = phl_key_get(r, dynamic->get_name, &name_len, NULL);
+	if (name == NULL) {
+		_log(PHL_LOG_ERROR, "fail to call get_name");
+		return PHL_PTR_ERROR;
+	}
+	if (name_len > 100) {
+		_log(PHL_LOG_ERROR, "too long name");
+		return PHL_PTR_ERROR;
+	}
+	_log(PHL_LOG_DEBUG, "get_name: %s", name);
+
+	/* search cache by name */
+	struct phl_dynamic_conf *sub_dyn = wuy_dict_get(dynamic->sub_dict, name);
+
+	if (sub_dyn == NULL) {
+		if (wuy_dict_count(dynamic->sub_dict) >= dynamic->sub_max) {
+			_log(PHL_LOG_ERROR, "fail to create new because of limited");
+			return PHL_PTR_ERROR;
+		}
+		sub_dyn = phl_dynamic_new_holder(dynamic, name);
+		goto get_conf;
+	}
+
+	/* cache hit */
+	if (phl_lua_thread_in_running(r, dynamic->get_conf)) {
+		goto get_conf;
+	}
+	if (sub_dyn->error_ret != 0) {
+		r->resp.status_code = sub_dyn->error_ret;
+		return PHL_PTR_ERROR;
+	}
+	if (sub_dyn->is_just_holder) {
+		wuy_list_append(&sub_dyn->holder_wait_head, &r->list_node);
+		return PHL_PTR_AGAIN;
+	}
+
+	loop_timer_set_after(sub_dyn->timer, sub_dyn->idle_timeout * 1000);
+
+	if (!phl_dynamic_need_get_conf(sub_dyn, r)) {
+		return phl_dynamic_to_container(sub_dyn); /* in most cases */
+	}
+
+	/* call get_conf() */
+get_conf:
+	_log(PHL_LOG_DEBUG, "get_conf");
+
+	lua_State *L = phl_lua_thread_run(r, dynamic->get_conf, "s", name);
+	if (L == PHL_PTR_ERROR || L == PHL_PTR_AGAIN) {
+		return L;
+	}
+
+	void *ret = phl_dynamic_handle_conf(dynamic, sub_dyn, name, r, L);
+
+	/* the return values are not used any more */
+	phl_lua_thread_done(r);
+	return ret;
+}
+
 void phl_dynamic_init(void)
 {
 	phl_dynamic_id = wuy_shmpool_alloc(sizeof(atomic_int));
@@ -352,7 +363,8 @@ static struct wuy_cflua_command phl_dynamic_conf_commands[] = {
 	{	.name = "get_name",
 		.description = "Set this and the following `get_conf` to enable dynamic. "
 			"This function should return a string as name of a sub-dynamic. "
-			"This function is called for each request, so it should be fast. "
+			"This function is called for each request, so it should be fast, "
+			"and `phl.key` is recommended. "
 			"You can not call blocking APIs (such as `subrequest`) in this function.",
 		.type = WUY_CFLUA_TYPE_FUNCTION,
 		.offset = offsetof(struct phl_dynamic_conf, get_name),
@@ -0,0 +1,464 @@
+#include "phl_lua.h"
+
+#include "phl_main.h"
+
+enum phl_key_type {
+	PHL_KEY_LITERAL,
+	PHL_KEY_HOST,
+	PHL_KEY_URI_PATH,
+	PHL_KEY_URI_RAW,
+	PHL_KEY_CLIENT_IP,
+	PHL_KEY_QUERY,
+	PHL_KEY_HEADER,
+	PHL_KEY_COOKIE,
+};
+
+struct phl_key_part {
+	enum phl_key_type	type;
+	const char		*arg;
+	int			arg_len;
+};
+
+/* compiled key expression, stored in Lua userdata */
+struct phl_key_expr {
+	int			part_num;
+	struct phl_key_part	*parts;
+	char			source[0]; /* args point into this */
+};
+
+struct phl_key_memo {
+	const void		*identity; /* of the Lua function */
+	const char		*str;
+	int			len;
+	bool			hashed;
+	uint64_t		hash;
+	struct phl_key_memo	*next;
+};
+
+/* registry fields of configuration Lua state */
+#define PHL_KEY_REG_FUNCS	"phl.key.funcs"		/* function -> expression */
+#define PHL_KEY_REG_SOURCES	"phl.key.sources"	/* source -> function */
+
+static const struct {
+	const char		*name;
+	enum phl_key_type	type;
+	bool			has_arg; /* name is prefix */
+} phl_key_variables[] = {
+	{ "host", PHL_KEY_HOST, false },
+	{ "uri_path", PHL_KEY_URI_PATH, false },
+	{ "uri_raw", PHL_KEY_URI_RAW, false },
+	{ "client_ip", PHL_KEY_CLIENT_IP, false },
+	{ "arg_", PHL_KEY_QUERY, true },
+	{ "http_", PHL_KEY_HEADER, true },
+	{ "cookie_", PHL_KEY_COOKIE, true },
+	{ NULL },
+};
+
+
+/* runtime */
+
+static const char *phl_key_part_value(struct phl_request *r,
+		struct phl_key_part *part, int *p_len)
+{
+	const char *value = NULL;
+	struct phl_header *h;
+	char *buf;
+	*p_len = -1;
+
+	switch (part->type) {
+	case PHL_KEY_LITERAL:
+		*p_len = part->arg_len;
+		return part->arg;
+
+	case PHL_KEY_HOST:
+		value = r->req.host;
+		break;
+
+	case PHL_KEY_URI_PATH:
+		value = r->req.uri.path;
+		break;
+
+	case PHL_KEY_URI_RAW:
+		value = r->req.uri.raw;
+		break;
+
+	case PHL_KEY_CLIENT_IP:
+		buf = wuy_pool_alloc(r->pool, 64);
+		wuy_sockaddr_dumps_iponly(&r->c->client_addr, buf, 64);
+		value = buf;
+		break;
+
+	case PHL_KEY_QUERY:
+		if (r->req.uri.query_pos == NULL) {
+			return NULL;
+		}
+		buf = wuy_pool_alloc(r->pool, r->req.uri.query_len + 1);
+		*p_len = wuy_http_uri_query_get(r->req.uri.query_pos, r->req.uri.query_len,
+				part->arg, part->arg_len, buf);
+		return *p_len >= 0 ? buf : NULL;
+
+	case PHL_KEY_HEADER:
+		phl_header_iter(&r->req.headers, h) {
+			if (h->name_len == part->arg_len
+					&& strncasecmp(h->str, part->arg, part->arg_len) == 0) {
+				*p_len = h->value_len;
+				return phl_header_value(h);
+			}
+		}
+		return NULL;
+
+	case PHL_KEY_COOKIE:
+		return phl_request_get_cookie(r, part->arg, part->arg_len, p_len);
+	}
+
+	if (value != NULL) {
+		*p_len = strlen(value);
+	}
+	return value;
+}
+
+/* missing values are treated as empty */
+static const char *phl_key_expr_eval(struct phl_request *r,
+		struct phl_key_expr *expr, int *p_len)
+{
+	const char *values[expr->part_num];
+	int lens[expr->part_num];
+	int total = 0;
+
+	for (int i = 0; i < expr->part_num; i++) {
+		values[i] = phl_key_part_value(r, &expr->parts[i], &lens[i]);
+		if (values[i] == NULL) {
+			lens[i] = 0;
+		}
+		total += lens[i];
+	}
+
+	char *str = wuy_pool_alloc(r->pool, total + 1);
+	char *p = str;
+	for (int i = 0; i < expr->part_num; i++) {
+		memcpy(p, values[i], lens[i]);
+		p += lens[i];
+	}
+	*p = '\0';
+
+	*p_len = total;
+	return str;
+}
+
+/* Resolved functions in this worker, indexed by the function reference.
+ * The function references are small integers. */
+struct phl_key_resolved {
+	const void		*identity;
+	struct phl_key_expr	*expr; /* NULL for normal Lua function */
+};
+
+static struct phl_key_resolved *phl_key_resolveds = NULL;
+static int phl_key_resolved_num = 0;
+static lua_State *phl_key_resolved_L = NULL;
+
+static struct phl_key_resolved *phl_key_resolve(wuy_cflua_function_t f)
+{
+	/* reset if configuration reloaded */
+	if (phl_key_resolved_L != phl_L) {
+		free(phl_key_resolveds);
+		phl_key_resolveds = NULL;
+		phl_key_resolved_num = 0;
+		phl_key_resolved_L = phl_L;
+	}
+
+	if (f >= phl_key_resolved_num) {
+		int num = f + 64;
+		phl_key_resolveds = realloc(phl_key_resolveds,
+				sizeof(struct phl_key_resolved) * num);
+		memset(phl_key_resolveds + phl_key_resolved_num, 0,
+				sizeof(struct phl_key_resolved) * (num - phl_key_resolved_num));
+		phl_key_resolved_num = num;
+	}
+
+	struct phl_key_resolved *resolved = &phl_key_resolveds[f];
+	if (resolved->identity != NULL) {
+		return resolved;
+	}
+
+	lua_rawgeti(phl_L, LUA_REGISTRYINDEX, f);
+	resolved->identity = lua_topointer(phl_L, -1);
+
+	lua_getfield(phl_L, LUA_REGISTRYINDEX, PHL_KEY_REG_FUNCS);
+	lua_pushvalue(phl_L, -2);
+	lua_rawget(phl_L, -2);
+	resolved->expr = lua_touserdata(phl_L, -1);
+	lua_pop(phl_L, 3);
+
+	return resolved;
+}
+
+const char *phl_key_get(struct phl_request *r, wuy_cflua_function_t f,
+		int *p_len, uint64_t *p_hash)
+{
+	if (!wuy_cflua_is_function_set(f)) {
+		return NULL;
+	}
+
+	struct phl_key_resolved *resolved = phl_key_resolve(f);
+
+	struct phl_key_memo *memo;
+	for (memo = r->key_memos; memo != NULL; memo = memo->next) {
+		if (memo->identity == resolved->identity) {
+			goto found;
+		}
+	}
+
+	int len;
+	const char *str;
+	if (resolved->expr != NULL) {
+		str = phl_key_expr_eval(r, resolved->expr, &len);
+	} else {
+		str = phl_lua_call_lstring(r, f, &len);
+		if (str == NULL) {
+			return NULL;
+		}
+		str = wuy_pool_strndup(r->pool, str, len);
+	}
+
+	memo = wuy_pool_alloc(r->pool, sizeof(struct phl_key_memo));
+	memo->identity = resolved->identity;
+	memo->str = str;
+	memo->len = len;
+	memo->hashed = false;
+	memo->next = r->key_memos;
+	r->key_memos = memo;
+
+found:
+	if (p_hash != NULL) {
+		if (!memo->hashed) {
+			memo->hash = wuy_vhash64(memo->str, memo->len);
+			memo->hashed = true;
+		}
+		*p_hash = memo->hash;
+	}
+	*p_len = memo->len;
+	return memo->str;
+}
+
+
+/* configuration */
+
+/* compile @source into @expr, and returns error string or NULL */
+static const char *phl_key_compile(struct phl_key_expr *expr)
+{
+	char *p = expr->source;
+	while (*p != '\0') {
+		struct phl_key_part *part = &expr->parts[expr->part_num++];
+
+		if (*p != '$' || p[1] == '$') {
+			/* literal, until next variable */
+			part->type = PHL_KEY_LITERAL;
+			part->arg = p;
+			if (*p == '$') { /* "$$" for '$' */
+				part->arg_len = 1;
+				p += 2;
+				continue;
+			}
+			char *end = strchr(p, '$');
+			part->arg_len = end ? end - p : strlen(p);
+			p += part->arg_len;
+			continue;
+		}
+
+		/* variable, "$name" or "${name}" */
+		const char *name;
+		int name_len;
+		p++;
+		if (*p == '{') {
+			name = p + 1;
+			char *end = strchr(name, '}');
+			if (end == NULL) {
+				return "miss `}`";
+			}
+			name_len = end - name;
+			p = end + 1;
+		} else {
+			name = p;
+			while (isalnum((unsigned char)*p) || *p == '_') {
+				p++;
+			}
+			name_len = p - name;
+		}
+
+		int i;
+		for (i = 0; phl_key_variables[i].name != NULL; i++) {
+			const char *vname = phl_key_variables[i].name;
+			int vlen = strlen(vname);
+			if (phl_key_variables[i].has_arg) {
+				if (name_len > vlen && memcmp(name, vname, vlen) == 0) {
+					break;
+				}
+			} else if (name_len == vlen && memcmp(name, vname, vlen) == 0) {
+				break;
+			}
+		}
+		if (phl_key_variables[i].name == NULL) {
+			return "unknown variable";
+		}
+
+		part->type = phl_key_variables[i].type;
+		if (phl_key_variables[i].has_arg) {
+			int vlen = strlen(phl_key_variables[i].name);
+			part->arg = name + vlen;
+			part->arg_len = name_len - vlen;
+		}
+
+		/* $http_user_agent for User-Agent */
+		if (part->type == PHL_KEY_HEADER) {
+			for (char *c = (char *)part->arg; c < part->arg + part->arg_len; c++) {
+				if (*c == '_') {
+					*c = '-';
+				}
+			}
+		}
+	}
+
+	if (expr->part_num == 0) {
+		return "empty";
+	}
+	return NULL;
+}
+
+/* called by Lua to evaluate the key directly */
+static int phl_key_lua_eval(lua_State *L)
+{
+	struct phl_request *r = phl_lua_api_current;
+	if (r == NULL) {
+		return 0;
+	}
+
+	struct phl_key_expr *expr = lua_touserdata(L, lua_upvalueindex(1));
+	int len;
+	const char *str = phl_key_expr_eval(r, expr, &len);
+	lua_pushlstring(L, str, len);
+	return 1;
+}
+
+/* push a function for the key expression @source */
+static int phl_key_lua_new(lua_State *L, const char *source, size_t len)
+{
+	/* reuse the same expression, which makes the memo shared */
+	lua_getfield(L, LUA_REGISTRYINDEX, PHL_KEY_REG_SOURCES);
+	lua_pushlstring(L, source, len);
+	lua_rawget(L, -2);
+	if (lua_isfunction(L, -1)) {
+		return 1;
+	}
+	lua_pop(L, 1);
+
+	/* the parts are at most twice of variables, plus 1 */
+	int max_parts = 1;
+	for (const char *p = source; *p != '\0'; p++) {
+		max_parts += (*p == '$') ? 2 : 0;
+	}
+
+	int source_size = (len + 1 + 7) & ~7; /* keep parts aligned */
+	struct phl_key_expr *expr = lua_newuserdata(L, sizeof(struct phl_key_expr)
+			+ source_size + sizeof(struct phl_key_part) * max_parts);
+	memcpy(expr->source, source, len + 1);
+	expr->parts = (struct phl_key_part *)(expr->source + source_size);
+	expr->part_num = 0;
+
+	const char *err = phl_key_compile(expr);
+	if (err != NULL) {
+		return luaL_error(L, "invalid key expression \"%s\": %s", source, err);
+	}
+
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, phl_key_lua_eval, 1); /* stack: sources, expr, func */
+
+	/* funcs[func] = expr */
+	lua_getfield(L, LUA_REGISTRYINDEX, PHL_KEY_REG_FUNCS);
+	lua_pushvalue(L, -2);
+	lua_pushvalue(L, -4);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+
+	/* sources[source] = func */
+	lua_pushlstring(L, source, len);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -5);
+	return 1;
+}
+
+/* phl.key(source) */
+static int phl_key_lua_call(lua_State *L)
+{
+	size_t len;
+	const char *source = luaL_checklstring(L, 2, &len);
+	return phl_key_lua_new(L, source, len);
+}
+
+static int phl_key_lua_new_variable(lua_State *L, const char *prefix)
+{
+	const char *name = luaL_checkstring(L, 1);
+	lua_pushfstring(L, "${%s%s}", prefix, name);
+
+	size_t len;
+	const char *source = lua_tolstring(L, -1, &len);
+	return phl_key_lua_new(L, source, len);
+}
+
+/* phl.key.cookie(name) */
+static int phl_key_lua_cookie(lua_State *L)
+{
+	return phl_key_lua_new_variable(L, "cookie_");
+}
+
+/* phl.key.header(name) */
+static int phl_key_lua_header(lua_State *L)
+{
+	return phl_key_lua_new_variable(L, "http_");
+}
+
+/* phl.key.query(name) */
+static int phl_key_lua_query(lua_State *L)
+{
+	return phl_key_lua_new_variable(L, "arg_");
+}
+
+/* Create `phl.key` in the configuration Lua state, before loading
+ * the configuration file. It is kept in runtime too. */
+void phl_key_conf_init(lua_State *L)
+{
+	/* funcs table, with weak keys */
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushstring(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, PHL_KEY_REG_FUNCS);
+
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, PHL_KEY_REG_SOURCES);
+
+	/* phl.key */
+	lua_getglobal(L, "phl");
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setglobal(L, "phl");
+	}
+
+	lua_newtable(L);
+	lua_pushcfunction(L, phl_key_lua_cookie);
+	lua_setfield(L, -2, "cookie");
+	lua_pushcfunction(L, phl_key_lua_header);
+	lua_setfield(L, -2, "header");
+	lua_pushcfunction(L, phl_key_lua_query);
+	lua_setfield(L, -2, "query");
+
+	lua_newtable(L); /* metatable */
+	lua_pushcfunction(L, phl_key_lua_call);
+	lua_setfield(L, -2, "__call");
+	lua_setmetatable(L, -2);
+
+	lua_setfield(L, -2, "key");
+	lua_pop(L, 1);
+}
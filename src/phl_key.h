@@ -0,0 +1,28 @@
+#ifndef PHL_KEY_H
+#define PHL_KEY_H
+
+#include "phl_request.h"
+
+/* Request keys, e.g. for cache, load-balance hash, or limit.
+ *
+ * A key is configured as a function, which may be a normal Lua function,
+ * or a key expression created by `phl.key`, for example:
+ *
+ *   key = phl.key "${host}${uri_path}",
+ *   key = phl.key.cookie "id",
+ *
+ * Key expressions are compiled at configuration time, and evaluated in C
+ * without calling Lua. Besides, keys are memorized in each request, so a
+ * function shared by several modules is called only once. */
+
+struct phl_key_memo;
+
+/* Returns the key and sets its length, or NULL on failure.
+ * Also sets the hash if @p_hash is not NULL.
+ * The key is valid until the request finishes. */
+const char *phl_key_get(struct phl_request *r, wuy_cflua_function_t f,
+		int *p_len, uint64_t *p_hash);
+
+void phl_key_conf_init(lua_State *L);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef PHL_LUA_H
+#define PHL_LUA_H
+
+/* Lua runtime headers.
+ * LuaJIT is used by default, and build with `make LUA=lua5.1` for
+ * the original Lua. See lua.mk. */
+
+#ifdef PHL_LUAJIT
+#include <luajit-2.1/lua.h>
+#include <luajit-2.1/lauxlib.h>
+#include <luajit-2.1/lualib.h>
+#include <luajit-2.1/luajit.h>
+#else
+#include <lua5.1/lua.h>
+#include <lua5.1/lauxlib.h>
+#include <lua5.1/lualib.h>
+#endif
+
+#endif
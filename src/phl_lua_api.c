@@ -1,6 +1,4 @@
-#include <lua5.1/lua.h>
-#include <lua5.1/lauxlib.h>
-#include <lua5.1/lualib.h>
+#include "phl_lua.h"
 
 #include "phl_main.h"
 
@@ -53,44 +51,125 @@ static int phl_lua_api_sleep(lua_State *L)
 	return lua_yield(L, 2);
 }
 
-static int phl_lua_api_subrequest_resume(lua_State *L)
+/* Move the body buffers out of the subrequest's pipe, into the list of
+ * strings at @bodies[@key], so the subrequest blocked by pipe's limit
+ * goes on. */
+static void phl_lua_api_subrequest_drain(lua_State *L, int bodies, int key,
+		struct phl_request *subr)
 {
-	struct phl_request *subr = lua_touserdata(L, -1);
-	lua_pop(L, 2); /* pop resume_handler and argument */
+	struct phl_request_pipe *pipe = &subr->subr_pipe;
+	if (pipe->head == NULL) {
+		return;
+	}
 
-	lua_newtable(L);
+	lua_rawgeti(L, bodies, key);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, bodies, key);
+	}
+
+	int n = lua_objlen(L, -1);
+	for (struct phl_buf *b = pipe->head; b != NULL; b = b->next) {
+		lua_pushlstring(L, (const char *)b->data, b->len);
+		lua_rawseti(L, -2, ++n);
+	}
+	lua_pop(L, 1);
+
+	phl_request_subr_pipe_consume(subr);
+}
+
+/* push the subrequest's response as a table */
+static void phl_lua_api_subrequest_push_result(lua_State *L, struct phl_request *subr,
+		int bodies, int key)
+{
+	lua_createtable(L, 0, 3);
 
 	lua_pushinteger(L, subr->resp.status_code);
 	lua_setfield(L, -2, "status_code");
 
-	lua_pushlstring(L, (char *)subr->c->send_buffer, subr->c->send_buf_len);
+	/* the body is in the drained list and then in pipe. A single buffer
+	 * is pushed directly, while multiple ones are joined by luaL_Buffer
+	 * chunk by chunk */
+	struct phl_request_pipe *pipe = &subr->subr_pipe;
+	lua_rawgeti(L, bodies, key);
+	if (lua_isnil(L, -1) && pipe->head == NULL) {
+		lua_pop(L, 1);
+		lua_pushliteral(L, "");
+	} else if (lua_isnil(L, -1) && pipe->head->next == NULL) {
+		lua_pop(L, 1);
+		lua_pushlstring(L, (const char *)pipe->head->data, pipe->head->len);
+	} else {
+		int drained = lua_gettop(L);
+		luaL_Buffer body;
+		luaL_buffinit(L, &body);
+		int n = lua_istable(L, drained) ? lua_objlen(L, drained) : 0;
+		for (int i = 1; i <= n; i++) {
+			lua_rawgeti(L, drained, i);
+			luaL_addvalue(&body);
+		}
+		for (struct phl_buf *b = pipe->head; b != NULL; b = b->next) {
+			luaL_addlstring(&body, (const char *)b->data, b->len);
+		}
+		luaL_pushresult(&body);
+		lua_remove(L, drained);
+	}
 	lua_setfield(L, -2, "body");
 
 	lua_newtable(L);
 	struct phl_header *h;
-	phl_header_iter(&phl_lua_api_current->resp.headers, h) {
+	phl_header_iter(&subr->resp.headers, h) {
 		lua_pushstring(L, phl_header_value(h));
 		lua_setfield(L, -2, h->str);
 	}
 	lua_setfield(L, -2, "headers");
+}
+
+static int phl_lua_api_subrequest_resume(lua_State *L)
+{
+	/* resume_handler @stack:1, subr @stack:2, drained bodies @stack:3 */
+	struct phl_request *subr = lua_touserdata(L, 2);
+
+	/* killed, e.g. the father is closing or redirecting */
+	if (phl_lua_thread_killing) {
+		phl_request_subr_close(subr);
+		lua_pop(L, 3);
+		return 0;
+	}
+	if (!subr->closed) {
+		phl_lua_api_subrequest_drain(L, 3, 1, subr);
+		return PHL_AGAIN;
+	}
+
+	phl_lua_api_subrequest_push_result(L, subr, 3, 1);
 
 	phl_request_subr_close(subr);
 
+	/* replace resume_handler and arguments by the result */
+	lua_replace(L, 1);
+	lua_settop(L, 1);
 	return 1;
 }
 
-static bool phl_lua_api_subrequest_options(lua_State *L, struct phl_request *subr)
+static void phl_lua_api_subrequest_body_release(void *data)
+{
+	luaL_unref(phl_L, LUA_REGISTRYINDEX, (intptr_t)data);
+}
+
+/* options in table at @index */
+static void phl_lua_api_subrequest_options(lua_State *L, int index, struct phl_request *subr)
 {
 	/* parse options one by one */
 
-	lua_getfield(L, 2, "method");
+	lua_getfield(L, index, "method");
 	enum wuy_http_method method = lua_tonumber(L, -1);
 	if (method > 0) {
 		subr->req.method = method;
 	}
 	lua_pop(L, 1);
 
-	lua_getfield(L, 2, "queries");
+	lua_getfield(L, index, "queries");
 	if (lua_isstring(L, -1)) {
 		size_t len;
 		const char *str = lua_tolstring(L, -1, &len);
@@ -114,7 +193,7 @@ static bool phl_lua_api_subrequest_options(lua_State *L, struct phl_request *sub
 	}
 	lua_pop(L, 1);
 
-	lua_getfield(L, 2, "headers");
+	lua_getfield(L, index, "headers");
 	if (lua_istable(L, -1)) {
 		lua_pushnil(L);
 		while (lua_next(L, -2) != 0) {
@@ -128,23 +207,18 @@ static bool phl_lua_api_subrequest_options(lua_State *L, struct phl_request *sub
 	}
 	lua_pop(L, 1);
 
-	lua_getfield(L, 2, "body");
+	/* refer to the body string without copy, and keep it from GC
+	 * until the subrequest is done */
+	lua_getfield(L, index, "body");
 	size_t body_len;
 	const void *body_buf = lua_tolstring(L, -1, &body_len);
 	if (body_buf != NULL) {
-		subr->req.content_length = body_len;
-		phl_request_append_body(subr, body_buf, body_len);
-	}
-	lua_pop(L, 1);
-
-	lua_getfield(L, 2, "detach"); /* at last */
-	if (lua_toboolean(L, -1)) {
-		phl_request_subr_detach(subr);
-		return false;
+		int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		phl_request_set_body_ref(subr, body_buf, body_len,
+				phl_lua_api_subrequest_body_release, (void *)(intptr_t)ref);
+	} else {
+		lua_pop(L, 1);
 	}
-	lua_pop(L, 1);
-
-	return true;
 }
 
 static int phl_lua_api_subrequest(lua_State *L)
@@ -159,15 +233,304 @@ static int phl_lua_api_subrequest(lua_State *L)
 
 	/* options @stack:2 */
 	if (lua_istable(L, 2)) {
-		if (!phl_lua_api_subrequest_options(L, subr)) {
+		phl_lua_api_subrequest_options(L, 2, subr);
+
+		lua_getfield(L, 2, "detach");
+		if (lua_toboolean(L, -1)) {
+			phl_request_subr_detach(subr);
 			return 0;
 		}
+		lua_pop(L, 1);
 	}
 
-	/* push resume_handler and argument */
+	/* push resume_handler and arguments */
 	lua_pushcfunction(L, phl_lua_api_subrequest_resume);
 	lua_pushlightuserdata(L, subr);
-	return lua_yield(L, 2);
+	lua_newtable(L);
+	return lua_yield(L, 3);
+}
+
+/* phl.subrequests(list, options) runs subrequests concurrently.
+ *
+ * Each member of @list is an URI, or a table with URI at [1] and the
+ * same options as phl.subrequest() plus `timeout` in seconds.
+ * The @options are:
+ *   wait:        "all" (default), "any", or number of success to wait for
+ *   concurrency: max number of running subrequests, 0 (default) for no limit
+ *   timeout:     default timeout in seconds for each, 0 (default) for none
+ *
+ * Returns a list of results in the order of @list, and number of success,
+ * which are the ones responding 2xx or 3xx status code.
+ * Each result is the same as phl.subrequest()'s, or `{ error = "..." }`
+ * if failed, timed out, or aborted after waiting is satisfied. */
+
+struct phl_lua_api_subrs;
+
+struct phl_lua_api_subrs_item {
+	enum {
+		PHL_LUA_API_SUBR_PENDING = 0,
+		PHL_LUA_API_SUBR_RUNNING,
+		PHL_LUA_API_SUBR_FINISHED,
+	}			state;
+	bool			timedout;
+	const char		*error; /* set if failed */
+	struct phl_request	*subr;
+	loop_timer_t		*timer;
+	struct phl_lua_api_subrs *subrs;
+};
+
+struct phl_lua_api_subrs {
+	struct phl_request		*r;
+	int				num;
+	int				started;
+	int				running;
+	int				finished;
+	int				succeeded;
+	int				wait;
+	int				concurrency;
+	double				timeout;
+	struct phl_lua_api_subrs_item	items[0];
+};
+
+static int64_t phl_lua_api_subrs_timeout(int64_t at, void *data)
+{
+	struct phl_lua_api_subrs_item *item = data;
+	item->timedout = true;
+	phl_request_run(item->subrs->r, "subrequests timeout");
+	return 0;
+}
+
+static void phl_lua_api_subrs_finish(struct phl_lua_api_subrs *subrs,
+		struct phl_lua_api_subrs_item *item, const char *error)
+{
+	if (item->state == PHL_LUA_API_SUBR_RUNNING) {
+		subrs->running--;
+	}
+	subrs->finished++;
+
+	item->state = PHL_LUA_API_SUBR_FINISHED;
+	item->error = error;
+	if (error == NULL) {
+		int status_code = item->subr->resp.status_code;
+		if (status_code >= 200 && status_code < 400) {
+			subrs->succeeded++;
+		}
+	} else if (item->subr != NULL) {
+		phl_request_subr_close(item->subr);
+		item->subr = NULL;
+	}
+
+	if (item->timer != NULL) {
+		loop_timer_delete(item->timer);
+		item->timer = NULL;
+	}
+}
+
+/* start pending subrequests from @list, as many as concurrency allows */
+static void phl_lua_api_subrs_start(lua_State *L, int list,
+		struct phl_lua_api_subrs *subrs)
+{
+	while (subrs->started < subrs->num && (subrs->concurrency == 0
+				|| subrs->running < subrs->concurrency)) {
+
+		struct phl_lua_api_subrs_item *item = &subrs->items[subrs->started++];
+
+		lua_rawgeti(L, list, subrs->started);
+		int member = lua_gettop(L);
+
+		/* the URI string is referred by @list, so valid after pop */
+		const char *uri;
+		if (lua_istable(L, member)) {
+			lua_rawgeti(L, member, 1);
+			uri = lua_tostring(L, -1);
+			lua_pop(L, 1);
+		} else {
+			uri = lua_tostring(L, member);
+		}
+
+		if (uri == NULL) {
+			phl_lua_api_subrs_finish(subrs, item, "invalid uri");
+			lua_pop(L, 1);
+			continue;
+		}
+		item->subr = phl_request_subr_new(subrs->r, uri);
+		if (item->subr == NULL) {
+			phl_lua_api_subrs_finish(subrs, item, "invalid uri");
+			lua_pop(L, 1);
+			continue;
+		}
+
+		double timeout = subrs->timeout;
+		if (lua_istable(L, member)) {
+			phl_lua_api_subrequest_options(L, member, item->subr);
+
+			lua_getfield(L, member, "timeout");
+			if (lua_isnumber(L, -1)) {
+				timeout = lua_tonumber(L, -1);
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+
+		if (timeout > 0) {
+			item->timer = loop_timer_new(phl_loop, phl_lua_api_subrs_timeout, item);
+			loop_timer_set_after(item->timer, timeout * 1000); /* second -> ms */
+		}
+
+		item->state = PHL_LUA_API_SUBR_RUNNING;
+		subrs->running++;
+	}
+}
+
+/* returns the results list and number of success */
+static int phl_lua_api_subrs_return(lua_State *L, struct phl_lua_api_subrs *subrs,
+		int bodies)
+{
+	lua_createtable(L, subrs->num, 0);
+
+	for (int i = 0; i < subrs->num; i++) {
+		struct phl_lua_api_subrs_item *item = &subrs->items[i];
+
+		if (item->state != PHL_LUA_API_SUBR_FINISHED) {
+			phl_lua_api_subrs_finish(subrs, item, "aborted");
+		}
+
+		if (item->error != NULL) {
+			lua_createtable(L, 0, 1);
+			lua_pushstring(L, item->error);
+			lua_setfield(L, -2, "error");
+		} else {
+			phl_lua_api_subrequest_push_result(L, item->subr, bodies, i + 1);
+			phl_request_subr_close(item->subr);
+			item->subr = NULL;
+		}
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	lua_pushinteger(L, subrs->succeeded);
+	return 2;
+}
+
+static bool phl_lua_api_subrs_is_done(struct phl_lua_api_subrs *subrs)
+{
+	return subrs->succeeded >= subrs->wait || subrs->finished == subrs->num;
+}
+
+static int phl_lua_api_subrequests_resume(lua_State *L)
+{
+	/* resume_handler @stack:1, subrs @stack:2, list @stack:3,
+	 * drained bodies @stack:4 */
+	struct phl_lua_api_subrs *subrs = lua_touserdata(L, 2);
+
+	/* killed, e.g. the request is closing or redirecting */
+	if (phl_lua_thread_killing) {
+		for (int i = 0; i < subrs->num; i++) {
+			struct phl_lua_api_subrs_item *item = &subrs->items[i];
+			if (item->timer != NULL) {
+				loop_timer_delete(item->timer);
+				item->timer = NULL;
+			}
+			if (item->subr != NULL) {
+				phl_request_subr_close(item->subr);
+				item->subr = NULL;
+			}
+		}
+		lua_pop(L, 4);
+		return 0;
+	}
+
+	for (int i = 0; i < subrs->num; i++) {
+		struct phl_lua_api_subrs_item *item = &subrs->items[i];
+		if (item->state != PHL_LUA_API_SUBR_RUNNING) {
+			continue;
+		}
+		if (item->subr->closed) {
+			phl_lua_api_subrs_finish(subrs, item, NULL);
+		} else if (item->timedout) {
+			phl_lua_api_subrs_finish(subrs, item, "timeout");
+		} else {
+			phl_lua_api_subrequest_drain(L, 4, i + 1, item->subr);
+		}
+	}
+
+	if (!phl_lua_api_subrs_is_done(subrs)) {
+		phl_lua_api_subrs_start(L, 3, subrs);
+		if (!phl_lua_api_subrs_is_done(subrs)) {
+			return PHL_AGAIN;
+		}
+	}
+
+	/* replace resume_handler and arguments by the results */
+	phl_lua_api_subrs_return(L, subrs, 4);
+	lua_replace(L, 2);
+	lua_replace(L, 1);
+	lua_settop(L, 2);
+	return 2;
+}
+
+static int phl_lua_api_subrequests(lua_State *L)
+{
+	struct phl_request *r = phl_lua_api_current;
+
+	/* argument list @stack:1 */
+	if (!lua_istable(L, 1)) {
+		lua_pushstring(L, "phl.subrequests(): invalid list");
+		return lua_error(L);
+	}
+	int num = lua_objlen(L, 1);
+
+	struct phl_lua_api_subrs *subrs = wuy_pool_alloc(r->pool,
+			sizeof(struct phl_lua_api_subrs)
+			+ sizeof(struct phl_lua_api_subrs_item) * num);
+	memset(subrs, 0, sizeof(struct phl_lua_api_subrs)
+			+ sizeof(struct phl_lua_api_subrs_item) * num);
+	subrs->r = r;
+	subrs->num = num;
+	subrs->wait = num;
+	for (int i = 0; i < num; i++) {
+		subrs->items[i].subrs = subrs;
+	}
+
+	/* options @stack:2 */
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "wait");
+		if (lua_isnumber(L, -1)) {
+			int wait = lua_tointeger(L, -1);
+			if (wait > 0 && wait < num) {
+				subrs->wait = wait;
+			}
+		} else if (lua_isstring(L, -1)) {
+			if (strcmp(lua_tostring(L, -1), "any") == 0) {
+				subrs->wait = 1;
+			} else if (strcmp(lua_tostring(L, -1), "all") != 0) {
+				lua_pushstring(L, "phl.subrequests(): invalid wait");
+				return lua_error(L);
+			}
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "concurrency");
+		subrs->concurrency = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "timeout");
+		subrs->timeout = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+
+	phl_lua_api_subrs_start(L, 1, subrs);
+
+	if (phl_lua_api_subrs_is_done(subrs)) { /* all failed, or empty list */
+		lua_newtable(L); /* no body drained */
+		return phl_lua_api_subrs_return(L, subrs, lua_gettop(L));
+	}
+
+	/* push resume_handler and arguments */
+	lua_pushcfunction(L, phl_lua_api_subrequests_resume);
+	lua_pushlightuserdata(L, subrs);
+	lua_pushvalue(L, 1);
+	lua_newtable(L);
+	return lua_yield(L, 4);
 }
 
 static int phl_lua_api_dump(lua_State *L, int start, char *buffer, int buf_size)
@@ -254,6 +617,7 @@ static int phl_lua_api_exit(lua_State *L)
 static const struct phl_lua_api_reg_func phl_lua_api_functions[] = {
 	{ "sleep", phl_lua_api_sleep },
 	{ "subrequest", phl_lua_api_subrequest },
+	{ "subrequests", phl_lua_api_subrequests },
 	{ "log", phl_lua_api_log },
 	{ "echo", phl_lua_api_echo },
 	{ "exit", phl_lua_api_exit },
@@ -315,7 +679,12 @@ PHL_LUAAPI_X_LIST
 
 void phl_lua_api_init(void)
 {
-	lua_newtable(phl_L);
+	/* `phl` may be created during configuration, e.g. phl.key */
+	lua_getglobal(phl_L, "phl");
+	if (!lua_istable(phl_L, -1)) {
+		lua_pop(phl_L, 1);
+		lua_newtable(phl_L);
+	}
 
 	phl_lua_api_add_const_ints(phl_lua_api_const_ints);
 	phl_lua_api_add_functions(phl_lua_api_functions);
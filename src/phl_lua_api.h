@@ -23,6 +23,18 @@ struct phl_lua_api_package {
 
 extern struct phl_request *phl_lua_api_current;
 
+/* FFI fast paths of the hottest accessors of current request, for LuaJIT.
+ * They return the length and set the pointer to the value in place, or
+ * return -1 if not found, so no Lua string is created. The values are
+ * valid during the request.
+ * They are exported to Lua by luapkgs/phl_ffi.lua, whose ffi.cdef()
+ * must be kept the same with these declarations. */
+int phl_ffi_req_uri_path(const char **p_value);
+int phl_ffi_req_host(const char **p_value);
+int phl_ffi_req_header(const char *name, int name_len, const char **p_value);
+int phl_ffi_req_cookie(const char *name, int name_len, const char **p_value);
+int phl_ffi_conn_client_ip(char *buf, int size);
+
 void phl_lua_api_init(void);
 
 #endif
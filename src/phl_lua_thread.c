@@ -1,24 +1,110 @@
-#include <lua5.1/lua.h>
-#include <lua5.1/lauxlib.h>
-#include <lua5.1/lualib.h>
+#include "phl_lua.h"
 
 #include "phl_main.h"
 
 #define _log(level, fmt, ...) phl_request_log(r, level, "lua: " fmt, ##__VA_ARGS__)
 
+/* Pool of idle Lua threads in each worker.
+ *
+ * Threads are anchored in one Lua table, which is referred in registry,
+ * to avoid GC. A thread that returns normally can be resumed again with
+ * a new function, so it is put back into the pool for next request, and
+ * the anchor is kept. Threads that are killed or fail are dead, so they
+ * are un-anchored and left to GC. */
+
+struct phl_lua_thread_stats {
+	bool		has_inited;
+	atomic_long	create;
+	atomic_long	reuse;
+	atomic_long	recycle;
+	atomic_long	drop;
+};
+
+static struct phl_lua_thread_stats *phl_lua_thread_stats_shm;
+
+struct phl_lua_thread_item {
+	lua_State		*L;
+	int			anchor;
+	wuy_list_node_t		list_node;
+};
+
+static lua_State *phl_lua_thread_pool_main = NULL; /* phl_L of the pool */
+static int phl_lua_thread_anchor_table = LUA_NOREF;
+static WUY_LIST(phl_lua_thread_pool_idle);
+static int phl_lua_thread_pool_count;
+
+/* the threads belong to the old phl_L if configuration reloaded */
+static void phl_lua_thread_pool_check(void)
+{
+	if (phl_lua_thread_pool_main == phl_L) {
+		return;
+	}
+
+	struct phl_lua_thread_item *item;
+	while (wuy_list_pop_type(&phl_lua_thread_pool_idle, item, list_node)) {
+		free(item);
+	}
+	phl_lua_thread_pool_count = 0;
+
+	lua_newtable(phl_L);
+	phl_lua_thread_anchor_table = luaL_ref(phl_L, LUA_REGISTRYINDEX);
+	phl_lua_thread_pool_main = phl_L;
+}
+
+static struct phl_lua_thread_item *phl_lua_thread_get(void)
+{
+	phl_lua_thread_pool_check();
+
+	struct phl_lua_thread_item *item;
+	if (wuy_list_pop_type(&phl_lua_thread_pool_idle, item, list_node)) {
+		atomic_fetch_add(&phl_lua_thread_stats_shm->reuse, 1);
+		phl_lua_thread_pool_count--;
+
+		/* clear the return values of last run */
+		lua_settop(item->L, 0);
+		return item;
+	}
+
+	atomic_fetch_add(&phl_lua_thread_stats_shm->create, 1);
+
+	item = malloc(sizeof(struct phl_lua_thread_item));
+	lua_rawgeti(phl_L, LUA_REGISTRYINDEX, phl_lua_thread_anchor_table);
+	item->L = lua_newthread(phl_L);
+	item->anchor = luaL_ref(phl_L, -2);
+	lua_pop(phl_L, 1);
+	return item;
+}
+
+static void phl_lua_thread_put(struct phl_lua_thread_item *item, bool reusable)
+{
+	if (phl_lua_thread_pool_main != phl_L) { /* stale */
+		free(item);
+		return;
+	}
+
+	if (reusable && phl_lua_thread_pool_count < phl_conf_runtime->lua.thread_pool) {
+		atomic_fetch_add(&phl_lua_thread_stats_shm->recycle, 1);
+		wuy_list_insert(&phl_lua_thread_pool_idle, &item->list_node);
+		phl_lua_thread_pool_count++;
+		return;
+	}
+
+	atomic_fetch_add(&phl_lua_thread_stats_shm->drop, 1);
+
+	lua_rawgeti(phl_L, LUA_REGISTRYINDEX, phl_lua_thread_anchor_table);
+	luaL_unref(phl_L, -1, item->anchor);
+	lua_pop(phl_L, 1);
+	free(item);
+}
+
 static int phl_lua_thread_start(struct phl_request *r,
 		wuy_cflua_function_t entry, const char *argf, va_list ap)
 {
 	_log(PHL_LOG_DEBUG, "start");
 	atomic_fetch_add(&r->conf_path->stats->lua_new, 1);
 
-	r->L = lua_newthread(phl_L);
-
-	/* mark it to avoid GC */
-	/* TODO i am not sure whether this is the right way ... */
-	lua_pushlightuserdata(phl_L, r->L); /* use pointer as key */
-	lua_insert(phl_L, -2); /* use thread as value */
-	lua_settable(phl_L, LUA_REGISTRYINDEX);
+	r->lua_thread = phl_lua_thread_get();
+	r->L = r->lua_thread->L;
 
 	/* push entry function */
 	lua_rawgeti(r->L, LUA_REGISTRYINDEX, entry);
@@ -47,32 +133,41 @@ static int phl_lua_thread_start(struct phl_request *r,
 	return strlen(argf);
 }
 
-static void phl_lua_thread_close(struct phl_request *r)
+static void phl_lua_thread_close(struct phl_request *r, bool reusable)
 {
 	_log(PHL_LOG_DEBUG, "close");
 	atomic_fetch_add(&r->conf_path->stats->lua_free, 1);
 
-	/* un-mark it for GC */
-	lua_pushlightuserdata(phl_L, r->L);
-	lua_pushnil(phl_L);
-	lua_settable(phl_L, LUA_REGISTRYINDEX);
+	phl_lua_thread_put(r->lua_thread, reusable);
 
+	r->lua_thread = NULL;
 	r->L = NULL;
 }
 
+bool phl_lua_thread_killing;
+
 void phl_lua_thread_kill(struct phl_request *r)
 {
 	if (r->L == NULL) {
 		return;
 	}
 
-	/* TODO clear resume-data, e.g. delete timer, close subr. is this OK? */
+	/* finished but phl_lua_thread_done() not called */
+	if (lua_status(r->L) != LUA_YIELD) {
+		phl_lua_thread_close(r, true);
+		return;
+	}
+
+	/* clear resume-data, e.g. delete timer, close subr */
 	if (lua_gettop(r->L) > 0) {
 		lua_CFunction resume_handler = lua_tocfunction(r->L, 1);
+		phl_lua_thread_killing = true;
 		resume_handler(r->L);
+		phl_lua_thread_killing = false;
 	}
 
-	phl_lua_thread_close(r);
+	/* the thread is suspended, so can not be reused */
+	phl_lua_thread_close(r, false);
 }
 
 lua_State *phl_lua_thread_run(struct phl_request *r,
@@ -81,7 +176,9 @@ lua_State *phl_lua_thread_run(struct phl_request *r,
 	phl_lua_api_current = r;
 
 	int argn = 0;
-	if (r->L == NULL || r->current_entry != entry) {
+	if (r->L == NULL || r->current_entry != entry || lua_status(r->L) != LUA_YIELD) {
+		phl_lua_thread_kill(r); /* the previous one if any */
+
 		r->current_entry = entry;
 
 		va_list ap;
@@ -100,7 +197,7 @@ lua_State *phl_lua_thread_run(struct phl_request *r,
 		if (argn == PHL_ERROR) {
 			_log(PHL_LOG_ERROR, "resume handler error: %d", argn);
 			atomic_fetch_add(&r->conf_path->stats->lua_error, 1);
-			phl_lua_thread_close(r);
+			phl_lua_thread_close(r, false);
 			return PHL_PTR_ERROR;
 		}
 	}
@@ -116,12 +213,77 @@ lua_State *phl_lua_thread_run(struct phl_request *r,
 	if (ret != 0) {
 		_log(PHL_LOG_ERROR, "resume error: %s", lua_tostring(r->L, -1));
 		atomic_fetch_add(&r->conf_path->stats->lua_error, 1);
-		phl_lua_thread_close(r);
+		phl_lua_thread_close(r, false);
 		return PHL_PTR_ERROR;
 	}
 
 	_log(PHL_LOG_DEBUG, "resume returns OK");
-	lua_State *L = r->L;
-	phl_lua_thread_close(r);
-	return L;
+	return r->L;
+}
+
+void phl_lua_thread_done(struct phl_request *r)
+{
+	if (r->L != NULL && lua_status(r->L) != LUA_YIELD) {
+		phl_lua_thread_close(r, true);
+	}
 }
+
+void phl_lua_thread_stats(wuy_json_t *json)
+{
+	struct phl_lua_thread_stats *stats = phl_lua_thread_stats_shm;
+
+	wuy_json_object_object(json, "lua_thread");
+	wuy_json_object_int(json, "pool_size", phl_conf_runtime->lua.thread_pool);
+	wuy_json_object_int(json, "create", atomic_load(&stats->create));
+	wuy_json_object_int(json, "reuse", atomic_load(&stats->reuse));
+	wuy_json_object_int(json, "recycle", atomic_load(&stats->recycle));
+	wuy_json_object_int(json, "drop", atomic_load(&stats->drop));
+	wuy_json_object_close(json);
+}
+
+static const char *phl_conf_runtime_lua_post(void *data)
+{
+	struct phl_lua_thread_stats *stats = wuy_shmpool_alloc(sizeof(struct phl_lua_thread_stats));
+	phl_lua_thread_stats_shm = stats;
+
+	/* keep the counters across reloads */
+	if (!stats->has_inited) {
+		stats->has_inited = true;
+		atomic_init(&stats->create, 0);
+		atomic_init(&stats->reuse, 0);
+		atomic_init(&stats->recycle, 0);
+		atomic_init(&stats->drop, 0);
+	}
+
+	return phl_lua_timer_conf_init(data);
+}
+
+static struct wuy_cflua_command phl_conf_runtime_lua_commands[] = {
+	{	.name = "thread_pool",
+		.description = "Max number of idle Lua threads cached in each worker "
+			"for reusing. Set 0 to disable.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_conf_runtime_lua, thread_pool),
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+		.default_value.n = 256,
+	},
+	{	.name = "timer_stats",
+		.description = "Max number of timers to keep stats, by name. "
+			"The others are counted as one.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_conf_runtime_lua, timer_stats),
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+		.default_value.n = 64,
+	},
+	{	.name = "init_worker",
+		.description = "Called in each worker at start, out of requests, "
+			"e.g. to create timers by `phl.timer`.",
+		.type = WUY_CFLUA_TYPE_FUNCTION,
+		.offset = offsetof(struct phl_conf_runtime_lua, init_worker),
+	},
+	{ NULL },
+};
+struct wuy_cflua_table phl_conf_runtime_lua_table = {
+	.commands = phl_conf_runtime_lua_commands,
+	.post = phl_conf_runtime_lua_post,
+};
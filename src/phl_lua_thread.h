@@ -1,19 +1,33 @@
 #ifndef PHL_LUA_THREAD_H
 #define PHL_LUA_THREAD_H
 
-#include <lua5.1/lua.h>
+#include "phl_lua.h"
 
 #include "phl_request.h"
 
+/* Returns the thread with the return values in its stack if the entry
+ * finishes. Call phl_lua_thread_done() after reading them, to put the
+ * thread back into pool. */
 lua_State *phl_lua_thread_run(struct phl_request *r,
 		wuy_cflua_function_t entry, const char *argf, ...);
 
+void phl_lua_thread_done(struct phl_request *r);
+
 static inline bool phl_lua_thread_in_running(struct phl_request *r,
 		wuy_cflua_function_t entry)
 {
-	return r->L != NULL && r->current_entry == entry;
+	return r->L != NULL && r->current_entry == entry
+			&& lua_status(r->L) == LUA_YIELD;
 }
 
 void phl_lua_thread_kill(struct phl_request *r);
 
+/* Set while phl_lua_thread_kill() calls the resume-handler, which
+ * should release the resources it waits for, and not block again. */
+extern bool phl_lua_thread_killing;
+
+void phl_lua_thread_stats(wuy_json_t *json);
+
+extern struct wuy_cflua_table phl_conf_runtime_lua_table;
+
 #endif
@@ -0,0 +1,251 @@
+#include <pthread.h>
+
+#include "phl_lua.h"
+
+#include "phl_main.h"
+
+#define _log(level, fmt, ...) phl_request_log(r, level, "lua-timer: " fmt, ##__VA_ARGS__)
+
+struct phl_lua_timer_stats {
+	char		name[64];
+	atomic_long	run;
+	atomic_long	error;
+	atomic_long	running;
+	atomic_long	total_ms;
+	atomic_long	max_ms;
+};
+
+/* items[0] is for the timers out of capacity */
+struct phl_lua_timer_stats_table {
+	pthread_mutex_t			lock;
+	bool				has_inited;
+	int				num;
+	int				capacity;
+	struct phl_lua_timer_stats	items[0];
+};
+
+static struct phl_lua_timer_stats_table *phl_lua_timer_stats_shm;
+
+struct phl_lua_timer {
+	loop_timer_t			*timer;
+	int				func_ref;
+	long				interval;
+
+	struct phl_request		*r; /* running, NULL if not */
+	long				start_time;
+	bool				in_handler;
+
+	struct phl_lua_timer_stats	*stats;
+};
+
+/* search by name, or add new */
+static struct phl_lua_timer_stats *phl_lua_timer_stats_get(const char *name)
+{
+	struct phl_lua_timer_stats_table *table = phl_lua_timer_stats_shm;
+
+	pthread_mutex_lock(&table->lock);
+
+	struct phl_lua_timer_stats *stats = &table->items[0];
+	for (int i = 1; i < table->num; i++) {
+		if (strcmp(table->items[i].name, name) == 0) {
+			stats = &table->items[i];
+			goto out;
+		}
+	}
+	if (table->num < table->capacity) {
+		stats = &table->items[table->num++];
+		snprintf(stats->name, sizeof(stats->name), "%s", name);
+	}
+out:
+	pthread_mutex_unlock(&table->lock);
+	return stats;
+}
+
+static void phl_lua_timer_free(struct phl_lua_timer *timer)
+{
+	luaL_unref(phl_L, LUA_REGISTRYINDEX, timer->func_ref);
+	loop_timer_delete(timer->timer);
+	free(timer);
+}
+
+/* returns the time to run next, or 0 if the timer is done and freed */
+static int64_t phl_lua_timer_next(struct phl_lua_timer *timer)
+{
+	if (timer->interval == 0) {
+		phl_lua_timer_free(timer);
+		return 0;
+	}
+	return timer->interval;
+}
+
+/* the background_run of request */
+static void phl_lua_timer_run(struct phl_request *r)
+{
+	struct phl_lua_timer *timer = r->background_data;
+
+	lua_State *L = phl_lua_thread_run(r, timer->func_ref, NULL);
+	if (L == PHL_PTR_AGAIN) {
+		return;
+	}
+
+	/* done */
+	struct phl_lua_timer_stats *stats = timer->stats;
+	long cost = wuy_time_ms() - timer->start_time;
+	atomic_fetch_add(&stats->run, 1);
+	atomic_fetch_sub(&stats->running, 1);
+	atomic_fetch_add(&stats->total_ms, cost);
+	long max = atomic_load(&stats->max_ms);
+	while (cost > max && !atomic_compare_exchange_weak(&stats->max_ms, &max, cost));
+
+	if (L == PHL_PTR_ERROR) {
+		atomic_fetch_add(&stats->error, 1);
+		_log(PHL_LOG_ERROR, "%s fails", stats->name);
+	} else {
+		_log(PHL_LOG_DEBUG, "%s done in %ld ms", stats->name, cost);
+		phl_lua_thread_done(r);
+	}
+
+	phl_request_background_close(r);
+	timer->r = NULL;
+
+	/* phl_lua_timer_handler() handles it if still in */
+	if (!timer->in_handler) {
+		int64_t next = phl_lua_timer_next(timer);
+		if (next != 0) {
+			loop_timer_set_after(timer->timer, next);
+		}
+	}
+}
+
+static int64_t phl_lua_timer_handler(int64_t at, void *data)
+{
+	struct phl_lua_timer *timer = data;
+
+	struct phl_request *r = phl_request_background_new(phl_lua_timer_run, timer);
+	if (r == NULL) {
+		phl_conf_log(PHL_LOG_ERROR, "lua-timer: fail to create request");
+		return phl_lua_timer_next(timer);
+	}
+
+	timer->r = r;
+	timer->start_time = wuy_time_ms();
+	atomic_fetch_add(&timer->stats->running, 1);
+
+	timer->in_handler = true;
+	phl_request_run(r, "lua timer");
+	timer->in_handler = false;
+
+	if (timer->r != NULL) { /* blocked, and continue in phl_lua_timer_run() */
+		return 0;
+	}
+	return phl_lua_timer_next(timer);
+}
+
+const char *phl_lua_timer_new(lua_State *L, int func_index, long delay,
+		long interval, const char *name)
+{
+	if (!lua_isfunction(L, func_index)) {
+		return "invalid function";
+	}
+	if (delay < 0 || interval < 0) {
+		return "invalid time";
+	}
+	if (phl_conf_listens == NULL || phl_conf_listens[0] == NULL) {
+		return "no Listen defined";
+	}
+
+	if (func_index < 0) {
+		func_index = lua_gettop(L) + func_index + 1;
+	}
+
+	/* name by the function's source */
+	char buf[64];
+	if (name == NULL) {
+		lua_Debug ar;
+		lua_pushvalue(L, func_index);
+		lua_getinfo(L, ">S", &ar);
+		snprintf(buf, sizeof(buf), "%s:%d", ar.short_src, ar.linedefined);
+		name = buf;
+	}
+
+	struct phl_lua_timer *timer = calloc(1, sizeof(struct phl_lua_timer));
+	timer->interval = interval;
+	timer->stats = phl_lua_timer_stats_get(name);
+
+	lua_pushvalue(L, func_index);
+	timer->func_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	timer->timer = loop_timer_new(phl_loop, phl_lua_timer_handler, timer);
+	loop_timer_set_after(timer->timer, delay);
+	return NULL;
+}
+
+void phl_lua_timer_worker_init(void)
+{
+	wuy_cflua_function_t init_worker = phl_conf_runtime->lua.init_worker;
+	if (init_worker == 0) {
+		return;
+	}
+
+	lua_rawgeti(phl_L, LUA_REGISTRYINDEX, init_worker);
+	const char *err = phl_lua_timer_new(phl_L, -1, 0, 0, "init_worker");
+	lua_pop(phl_L, 1);
+
+	if (err != NULL) {
+		phl_conf_log(PHL_LOG_ERROR, "lua-timer: fail to run init_worker: %s", err);
+	}
+}
+
+static void phl_lua_timer_stats_item(struct phl_lua_timer_stats *stats, wuy_json_t *json)
+{
+	wuy_json_new_object(json);
+	wuy_json_object_string(json, "name", stats->name);
+	wuy_json_object_int(json, "run", atomic_load(&stats->run));
+	wuy_json_object_int(json, "error", atomic_load(&stats->error));
+	wuy_json_object_int(json, "running", atomic_load(&stats->running));
+	wuy_json_object_int(json, "total_ms", atomic_load(&stats->total_ms));
+	wuy_json_object_int(json, "max_ms", atomic_load(&stats->max_ms));
+	wuy_json_object_close(json);
+}
+
+void phl_lua_timer_stats(wuy_json_t *json)
+{
+	struct phl_lua_timer_stats_table *table = phl_lua_timer_stats_shm;
+
+	wuy_json_object_array(json, "lua_timers");
+	for (int i = 1; i < table->num; i++) {
+		phl_lua_timer_stats_item(&table->items[i], json);
+	}
+	if (atomic_load(&table->items[0].run) != 0 || atomic_load(&table->items[0].running) != 0) {
+		phl_lua_timer_stats_item(&table->items[0], json);
+	}
+	wuy_json_array_close(json);
+}
+
+const char *phl_lua_timer_conf_init(struct phl_conf_runtime_lua *conf)
+{
+	int capacity = conf->timer_stats + 1;
+	struct phl_lua_timer_stats_table *table = wuy_shmpool_alloc(
+			sizeof(struct phl_lua_timer_stats_table)
+			+ sizeof(struct phl_lua_timer_stats) * capacity);
+
+	phl_lua_timer_stats_shm = table;
+
+	if (table->has_inited) {
+		return WUY_CFLUA_OK;
+	}
+
+	table->has_inited = true;
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, 1);
+	pthread_mutex_init(&table->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	table->num = 1;
+	table->capacity = capacity;
+	strcpy(table->items[0].name, "others");
+
+	return WUY_CFLUA_OK;
+}
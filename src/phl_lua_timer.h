@@ -0,0 +1,25 @@
+#ifndef PHL_LUA_TIMER_H
+#define PHL_LUA_TIMER_H
+
+#include "phl_lua.h"
+
+/* Timers to run Lua functions out of requests, in each worker.
+ *
+ * Each run is in a background request with its own Lua thread, so the
+ * blocking APIs, e.g. phl.sleep(), phl.subrequest() and phl.stream, work.
+ * Stats are kept by timer name in shared-memory. */
+
+/* Run the function at @func_index of @L after @delay ms, and then again
+ * @interval ms after each run finishes if @interval > 0.
+ * The stats are named by @name, or the function's source if NULL.
+ * Returns error message, or NULL if success. */
+const char *phl_lua_timer_new(lua_State *L, int func_index, long delay,
+		long interval, const char *name);
+
+void phl_lua_timer_worker_init(void);
+
+void phl_lua_timer_stats(wuy_json_t *json);
+
+const char *phl_lua_timer_conf_init(struct phl_conf_runtime_lua *conf);
+
+#endif
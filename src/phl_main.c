@@ -11,6 +11,7 @@
 #define PHL_VERSION "0.0.1"
 
 static bool opt_daemon = true;
+static bool opt_benchmark = false;
 
 static pid_t *phl_workers = NULL;
 
@@ -23,11 +24,12 @@ static const char *phl_getopt(int argc, char *const *argv)
 		"    -p PREFIX   change directory\n"
 		"    -f          run in foreground, but not daemon\n"
 		"    -r          show configration reference and quit\n"
+		"    -b          benchmark Path locating of conf_file and quit\n"
 		"    -v          show version and quit\n"
 		"    -h          show this help and quit\n";
 
 	int opt;
-	while ((opt = getopt(argc, argv, "p:rfvh")) != -1) {
+	while ((opt = getopt(argc, argv, "p:rbfvh")) != -1) {
 		switch (opt) {
 		case 'p':
 			if (chdir(optarg) != 0) {
@@ -38,6 +40,9 @@ static const char *phl_getopt(int argc, char *const *argv)
 		case 'f':
 			opt_daemon = false;
 			break;
+		case 'b':
+			opt_benchmark = true;
+			break;
 		case 'r':
 			phl_module_master_init();
 			phl_upstream_init();
@@ -94,6 +99,8 @@ static void phl_worker_entry(void)
 
 	phl_module_worker_init();
 
+	phl_lua_timer_worker_init();
+
 	/* go to work! */
 	loop_run(phl_loop);
 
@@ -239,6 +246,14 @@ int main(int argc, char * const *argv)
 
 	phl_module_master_init();
 
+	if (opt_benchmark) {
+		if (!phl_conf_parse(conf_file)) {
+			return PHL_EXIT_CONF;
+		}
+		phl_conf_path_benchmark();
+		return 0;
+	}
+
 	int ret = phl_run(conf_file);
 	if (ret != 0) {
 		fprintf(stderr, "FAIL TO START!!!\n");
@@ -46,9 +46,15 @@
 #include "phl_upstream.h"
 #include "phl_resolver.h"
 #include "phl_lua_thread.h"
+#include "phl_lua_timer.h"
 #include "phl_lua_call.h"
 #include "phl_lua_api.h"
+#include "phl_key.h"
 #include "phl_log.h"
+#include "phl_aio.h"
+#include "phl_open_cache.h"
+#include "phl_slab.h"
+#include "phl_shared_dict.h"
 
 /* return values */
 #define PHL_OK			0
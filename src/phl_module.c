@@ -235,8 +235,7 @@ int phl_module_filter_response_headers(struct phl_request *r)
 {
 	return phl_module_filter_run(r, PHL_MODULE_FILTER_RESPONSE_HEADERS);
 }
-int phl_module_filter_response_body(struct phl_request *r, uint8_t *data,
-		int data_len, int buf_len, bool *p_is_last)
+int phl_module_filter_response_body(struct phl_request *r, struct phl_buf_chain *chain)
 {
 	struct phl_module **modules = r->conf_path->filters->modules[PHL_MODULE_FILTER_RESPONSE_BODY];
 
@@ -246,12 +245,12 @@ int phl_module_filter_response_body(struct phl_request *r, uint8_t *data,
 		if (m == NULL) {
 			break;
 		}
-		data_len = m->filters.response_body(r, data, data_len, buf_len, p_is_last);
-		if (data_len < 0) {
-			return data_len;
+		int ret = m->filters.response_body(r, chain);
+		if (ret != PHL_OK) {
+			return ret;
 		}
 	}
-	return data_len;
+	return PHL_OK;
 }
 
 
@@ -44,8 +44,7 @@ struct phl_module {
 		int	(*process_headers)(struct phl_request *);
 		int	(*process_body)(struct phl_request *);
 		int	(*response_headers)(struct phl_request *);
-		int	(*response_body)(struct phl_request *, uint8_t *data,
-				int data_len, int buf_len, bool *p_is_last);
+		int	(*response_body)(struct phl_request *, struct phl_buf_chain *);
 
 		double	ranks[4];
 	} filters;
@@ -81,8 +80,7 @@ void phl_module_request_ctx_free(struct phl_request *r);
 int phl_module_filter_process_headers(struct phl_request *r);
 int phl_module_filter_process_body(struct phl_request *r);
 int phl_module_filter_response_headers(struct phl_request *r);
-int phl_module_filter_response_body(struct phl_request *r, uint8_t *data,
-		int data_len, int buf_len, bool *p_is_last);
+int phl_module_filter_response_body(struct phl_request *r, struct phl_buf_chain *chain);
 
 extern int phl_module_number;
 
@@ -0,0 +1,268 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "phl_main.h"
+
+struct phl_open_cache_stats {
+	atomic_long	hit;
+	atomic_long	miss;
+	atomic_long	changed;
+	atomic_long	evict;
+};
+
+static struct phl_open_cache_stats *phl_open_cache_stats_shm;
+
+static wuy_dict_t *phl_open_cache_dict;
+static WUY_LIST(phl_open_cache_lru);
+static int phl_open_cache_count;
+
+/* identities of directories, indexed by dirfd, to save fstat() */
+struct phl_open_cache_dir {
+	dev_t		dev;
+	ino_t		ino; /* 0 if unknown */
+};
+static struct phl_open_cache_dir *phl_open_cache_dirs;
+static int phl_open_cache_dir_num;
+
+bool phl_open_cache_is_enabled(void)
+{
+	return phl_conf_runtime->open_cache.max_items > 0;
+}
+
+static void phl_open_cache_free(struct phl_open_cache_entry *entry)
+{
+	close(entry->fd);
+	free(entry->key);
+	free(entry->data);
+	free(entry);
+}
+
+static void phl_open_cache_delete(struct phl_open_cache_entry *entry)
+{
+	wuy_dict_delete(phl_open_cache_dict, entry);
+	wuy_list_delete(&entry->lru_node);
+	phl_open_cache_count--;
+
+	/* free it later if it is still referred */
+	entry->removed = true;
+	if (entry->refs == 0) {
+		phl_open_cache_free(entry);
+	}
+}
+
+static struct phl_open_cache_dir *phl_open_cache_get_dir(int dirfd)
+{
+	if (dirfd < 0) {
+		return NULL;
+	}
+	if (dirfd >= phl_open_cache_dir_num) {
+		int num = dirfd + 16;
+		phl_open_cache_dirs = realloc(phl_open_cache_dirs,
+				sizeof(struct phl_open_cache_dir) * num);
+		memset(phl_open_cache_dirs + phl_open_cache_dir_num, 0,
+				sizeof(struct phl_open_cache_dir) * (num - phl_open_cache_dir_num));
+		phl_open_cache_dir_num = num;
+	}
+
+	struct phl_open_cache_dir *dir = &phl_open_cache_dirs[dirfd];
+	if (dir->ino == 0) {
+		struct stat st;
+		if (fstat(dirfd, &st) != 0) {
+			return NULL;
+		}
+		dir->dev = st.st_dev;
+		dir->ino = st.st_ino;
+	}
+	return dir;
+}
+
+static bool phl_open_cache_make_key(int dirfd, const char *path, char *key, int size)
+{
+	struct phl_open_cache_dir *dir = phl_open_cache_get_dir(dirfd);
+	if (dir == NULL) {
+		return false;
+	}
+	snprintf(key, size, "%lx:%lx:%s", (long)dir->dev, (long)dir->ino, path);
+	return true;
+}
+
+static struct phl_open_cache_entry *phl_open_cache_search(int dirfd, const char *path)
+{
+	if (phl_open_cache_dict == NULL) {
+		return NULL;
+	}
+
+	char key[PATH_MAX + 40];
+	if (!phl_open_cache_make_key(dirfd, path, key, sizeof(key))) {
+		return NULL;
+	}
+	return wuy_dict_get(phl_open_cache_dict, key);
+}
+
+/* returns the entry with a reference, or NULL if miss */
+struct phl_open_cache_entry *phl_open_cache_get(int dirfd, const char *path)
+{
+	struct phl_open_cache_entry *entry = phl_open_cache_search(dirfd, path);
+	if (entry == NULL) {
+		atomic_fetch_add(&phl_open_cache_stats_shm->miss, 1);
+		return NULL;
+	}
+
+	/* revalidate, in case of the file is changed */
+	time_t now = time(NULL);
+	if (now >= entry->valid_until) {
+		struct stat st;
+		if (fstatat(dirfd, path, &st, 0) != 0 || st.st_ino != entry->st.st_ino
+				|| st.st_mtime != entry->st.st_mtime
+				|| st.st_size != entry->st.st_size) {
+			atomic_fetch_add(&phl_open_cache_stats_shm->changed, 1);
+			phl_open_cache_delete(entry);
+			return NULL;
+		}
+		entry->valid_until = now + phl_conf_runtime->open_cache.valid_time;
+	}
+
+	atomic_fetch_add(&phl_open_cache_stats_shm->hit, 1);
+
+	wuy_list_delete(&entry->lru_node);
+	wuy_list_append(&phl_open_cache_lru, &entry->lru_node);
+
+	entry->refs++;
+	return entry;
+}
+
+/* The @fd is owned by the cache since now.
+ * Returns the entry with a reference. */
+struct phl_open_cache_entry *phl_open_cache_add(int dirfd, const char *path,
+		int fd, const struct stat *st)
+{
+	if (phl_open_cache_dict == NULL) {
+		phl_open_cache_dict = wuy_dict_new_type(WUY_DICT_KEY_STRING,
+				offsetof(struct phl_open_cache_entry, key),
+				offsetof(struct phl_open_cache_entry, dict_node));
+	}
+
+	struct phl_open_cache_entry *entry = calloc(1, sizeof(struct phl_open_cache_entry));
+	entry->fd = fd;
+	entry->st = *st;
+	entry->valid_until = time(NULL) + phl_conf_runtime->open_cache.valid_time;
+	entry->refs = 1;
+
+	/* precompute the validators */
+	memcpy(entry->last_modified, wuy_http_date_make(st->st_mtime), WUY_HTTP_DATE_LENGTH);
+	entry->etag_len = snprintf(entry->etag, sizeof(entry->etag), "\"%lx-%lx\"",
+			(long)st->st_mtime, (long)st->st_size);
+
+	/* fail to get the directory's identity, so not cache it, and
+	 * it is freed when the reference is put */
+	struct phl_open_cache_dir *dir = phl_open_cache_get_dir(dirfd);
+	if (dir == NULL) {
+		entry->removed = true;
+		return entry;
+	}
+
+	char key[PATH_MAX + 40];
+	phl_open_cache_make_key(dirfd, path, key, sizeof(key));
+	entry->key = strdup(key);
+	entry->dir_dev = dir->dev;
+	entry->dir_ino = dir->ino;
+
+	/* replace the old one if any */
+	struct phl_open_cache_entry *old = wuy_dict_get(phl_open_cache_dict, key);
+	if (old != NULL) {
+		phl_open_cache_delete(old);
+	}
+
+	/* evict the least recently used one */
+	if (phl_open_cache_count >= phl_conf_runtime->open_cache.max_items) {
+		wuy_list_first_type(&phl_open_cache_lru, old, lru_node);
+		if (old != NULL) {
+			atomic_fetch_add(&phl_open_cache_stats_shm->evict, 1);
+			phl_open_cache_delete(old);
+		}
+	}
+
+	wuy_dict_add(phl_open_cache_dict, entry);
+	wuy_list_append(&phl_open_cache_lru, &entry->lru_node);
+	phl_open_cache_count++;
+
+	return entry;
+}
+
+void phl_open_cache_put(struct phl_open_cache_entry *entry)
+{
+	entry->refs--;
+	if (entry->refs == 0 && entry->removed) {
+		phl_open_cache_free(entry);
+	}
+}
+
+/* called if the file is changed by us */
+void phl_open_cache_remove(int dirfd, const char *path)
+{
+	struct phl_open_cache_entry *entry = phl_open_cache_search(dirfd, path);
+	if (entry != NULL) {
+		phl_open_cache_delete(entry);
+	}
+}
+
+void phl_open_cache_remove_dir(int dirfd)
+{
+	if (dirfd < 0 || dirfd >= phl_open_cache_dir_num) {
+		return;
+	}
+	struct phl_open_cache_dir *dir = &phl_open_cache_dirs[dirfd];
+	if (dir->ino == 0) {
+		return;
+	}
+
+	struct phl_open_cache_entry *entry, *safe;
+	wuy_list_iter_safe_type(&phl_open_cache_lru, entry, safe, lru_node) {
+		if (entry->dir_dev == dir->dev && entry->dir_ino == dir->ino) {
+			phl_open_cache_delete(entry);
+		}
+	}
+
+	/* the dirfd number may be reused later */
+	dir->ino = 0;
+}
+
+void phl_open_cache_stats(wuy_json_t *json)
+{
+	struct phl_open_cache_stats *stats = phl_open_cache_stats_shm;
+
+	wuy_json_object_object(json, "open_cache");
+	wuy_json_object_int(json, "hit", atomic_load(&stats->hit));
+	wuy_json_object_int(json, "miss", atomic_load(&stats->miss));
+	wuy_json_object_int(json, "changed", atomic_load(&stats->changed));
+	wuy_json_object_int(json, "evict", atomic_load(&stats->evict));
+	wuy_json_object_close(json);
+}
+
+static const char *phl_conf_runtime_open_cache_post(void *data)
+{
+	phl_open_cache_stats_shm = wuy_shmpool_alloc(sizeof(struct phl_open_cache_stats));
+	return WUY_CFLUA_OK;
+}
+
+static struct wuy_cflua_command phl_conf_runtime_open_cache_commands[] = {
+	{	.name = "max_items",
+		.description = "Max number of opened files cached in each worker. Set 0 to disable.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_conf_runtime_open_cache, max_items),
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+	},
+	{	.name = "valid_time",
+		.description = "Check whether the cached file is changed after this time.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_conf_runtime_open_cache, valid_time),
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+		.default_value.n = 10,
+	},
+	{ NULL },
+};
+struct wuy_cflua_table phl_conf_runtime_open_cache_table = {
+	.commands = phl_conf_runtime_open_cache_commands,
+	.post = phl_conf_runtime_open_cache_post,
+};
@@ -0,0 +1,55 @@
+#ifndef PHL_OPEN_CACHE_H
+#define PHL_OPEN_CACHE_H
+
+#include <sys/stat.h>
+
+/* Cache of opened files in each worker, to save open() and fstat().
+ *
+ * The entries are referred by requests, so the fd should not be
+ * closed by users, and should be read by pread() because it may be
+ * shared by several requests.
+ *
+ * The entries are keyed by the identity (st_dev and st_ino) of the
+ * directory but not the dirfd, because the dirfd number may be reused
+ * by another directory after closed. */
+
+struct phl_open_cache_entry {
+	char			*key;
+	int			fd;
+	struct stat		st;
+	char			last_modified[WUY_HTTP_DATE_LENGTH + 1];
+	char			etag[40];
+	int			etag_len;
+
+	void			*data; /* attached by user, freed with entry */
+
+	dev_t			dir_dev;
+	ino_t			dir_ino;
+
+	time_t			valid_until;
+	int			refs;
+	bool			removed;
+
+	wuy_dict_node_t		dict_node;
+	wuy_list_node_t		lru_node;
+};
+
+bool phl_open_cache_is_enabled(void);
+
+struct phl_open_cache_entry *phl_open_cache_get(int dirfd, const char *path);
+
+struct phl_open_cache_entry *phl_open_cache_add(int dirfd, const char *path,
+		int fd, const struct stat *st);
+
+void phl_open_cache_put(struct phl_open_cache_entry *entry);
+
+void phl_open_cache_remove(int dirfd, const char *path);
+
+/* The directory is to be deleted or closed, so drop all its entries. */
+void phl_open_cache_remove_dir(int dirfd);
+
+void phl_open_cache_stats(wuy_json_t *json);
+
+extern struct wuy_cflua_table phl_conf_runtime_open_cache_table;
+
+#endif
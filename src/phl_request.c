@@ -3,6 +3,8 @@
 #define PHL_REQUEST_DETACHED_SUBR_FATHER (struct phl_request *)(-1L)
 
 static WUY_LIST(phl_request_defer_list);
+static WUY_LIST(phl_request_pipe_full_list);
+static WUY_LIST(phl_request_detached_list);
 
 struct phl_request *phl_request_new(struct phl_connection *c)
 {
@@ -46,6 +48,7 @@ void phl_request_reset_response(struct phl_request *r)
 	r->resp.content_generated_length = 0;
 	r->resp.sent_length = 0;
 	r->resp.content_length = PHL_CONTENT_LENGTH_INIT;
+	r->resp.body_out = (struct phl_buf_chain){ 0 };
 	wuy_slist_init(&r->resp.headers);
 }
 
@@ -53,9 +56,18 @@ static void phl_request_clear_stuff(struct phl_request *r)
 {
 	wuy_list_del_if(&r->list_node);
 
+	if (r->resp.easy_fd_task != NULL) {
+		phl_aio_cancel(r->resp.easy_fd_task);
+		r->resp.easy_fd_task = NULL;
+	}
+
 	phl_lua_thread_kill(r);
 
+	r->key_memos = NULL; /* the keys may change after redirecting */
+
 	phl_module_request_ctx_free(r);
+
+	r->resp.body_replaced = false;
 }
 
 static void phl_request_stats(struct phl_request *r)
@@ -143,11 +155,59 @@ static void phl_request_access_log(struct phl_request *r)
 			format);
 }
 
+/* move the subrequest's send buffer into pipe */
+static void phl_request_subr_pipe_push(struct phl_request *subr)
+{
+	struct phl_connection *c = subr->c;
+	if (c->send_buffer == NULL || c->send_buf_len == 0) {
+		return;
+	}
+
+	struct phl_request_pipe *pipe = &subr->subr_pipe;
+	if (pipe->discard) {
+		c->send_buf_len = 0;
+		return;
+	}
+
+	struct phl_buf *b = wuy_pool_alloc(subr->pool, sizeof(struct phl_buf));
+	b->data = c->send_buffer;
+	b->len = c->send_buf_len;
+	b->next = NULL;
+
+	if (pipe->tail != NULL) {
+		pipe->tail->next = b;
+	} else {
+		pipe->head = b;
+	}
+	pipe->tail = b;
+	pipe->length += b->len;
+
+	/* a new one will be allocated by phl_connection_make_space() */
+	c->send_buffer = NULL;
+	c->send_buf_len = 0;
+}
+
+static void phl_request_subr_pipe_free(struct phl_request_pipe *pipe)
+{
+	struct phl_buf *b = pipe->head;
+	while (b != NULL) {
+		struct phl_buf *next = b->next;
+		free((void *)b->data);
+		b = next;
+	}
+	pipe->head = pipe->tail = NULL;
+	pipe->length = 0;
+}
+
 static void phl_request_do_close(struct phl_request *r)
 {
 	phl_request_access_log(r);
 	phl_request_stats(r);
 
+	/* before closing subrequests, which may be referred by the
+	 * resume-handler of Lua thread */
+	phl_lua_thread_kill(r);
+
 	struct phl_request *subr;
 	while (wuy_list_pop_type(&r->subr_head, subr, list_node)) {
 		phl_request_subr_close(subr);
@@ -155,6 +215,10 @@ static void phl_request_do_close(struct phl_request *r)
 
 	phl_request_clear_stuff(r);
 
+	if (r->req.body_release != NULL) {
+		r->req.body_release(r->req.body_release_data);
+	}
+
 	wuy_list_append(&phl_request_defer_list, &r->list_node);
 }
 
@@ -171,6 +235,7 @@ void phl_request_close(struct phl_request *r)
 		if (r->father == PHL_REQUEST_DETACHED_SUBR_FATHER) {
 			phl_request_subr_close(r);
 		} else { /* wake up father, and should be closed by father later */
+			phl_request_subr_pipe_push(r);
 			phl_request_run(r->father, "subrequest done");
 		}
 		return;
@@ -189,6 +254,9 @@ void phl_request_subr_close(struct phl_request *r)
 {
 	phl_request_log(r, PHL_LOG_DEBUG, "subr done: %s", r->req.uri.raw);
 
+	phl_request_subr_pipe_free(&r->subr_pipe);
+	wuy_list_del_if(&r->subr_pipe.full_node);
+
 	struct phl_connection *c = r->c;
 	wuy_list_del_if(&c->list_node);
 	free(c->send_buffer);
@@ -247,12 +315,52 @@ bool phl_request_set_host(struct phl_request *r, const char *host_str, int host_
 		host[i] = tolower(host[i]);
 	}
 	r->req.host = host;
+	r->key_memos = NULL; /* the keys may refer to host */
 	return true;
 }
 
+/* returns the cookie value and sets its length in @p_len, or NULL if not found */
+const char *phl_request_get_cookie(struct phl_request *r,
+		const char *name, int name_len, int *p_len)
+{
+	struct phl_header *h;
+	wuy_slist_iter_type(&r->req.headers, h, list_node) {
+		if (strcasecmp(h->str, "Cookie") != 0) {
+			continue;
+		}
+		const char *p = phl_header_value(h);
+		int value_len = h->value_len;
+		while (1) {
+			if (value_len > name_len && memcmp(p, name, name_len) == 0
+					&& p[name_len] == '=') {
+				/* find */
+				p += name_len + 1;
+				value_len -= name_len + 1;
+				const char *end = memchr(p, ';', value_len);
+				if (end != NULL) {
+					value_len = end - p;
+				}
+				*p_len = value_len;
+				return p;
+			}
+
+			const char *end = memchr(p, ';', value_len);
+			if (end == NULL) {
+				break;
+			}
+			end++;
+			while (*end == ' ') end++;
+			value_len -= end - p;
+			p = end;
+		}
+	}
+	return NULL;
+}
+
 bool phl_request_set_uri(struct phl_request *r, const char *uri_str, int uri_len)
 {
 	r->req.uri.raw = wuy_pool_strndup(r->pool, uri_str, uri_len);
+	r->key_memos = NULL; /* the keys may refer to URI */
 
 	/* parse uri into host:path:query */
 	const char *host, *fragment;
@@ -318,6 +426,74 @@ int phl_request_append_body(struct phl_request *r, const void *buf, int len)
 	return PHL_OK;
 }
 
+/* Set the request body by reference without copy, mostly for subrequests.
+ * The @release, if not NULL, is called with @data when the request is done. */
+void phl_request_set_body_ref(struct phl_request *r, const void *buf, int len,
+		void (*release)(void *), void *data)
+{
+	r->req.body_buf = (uint8_t *)buf;
+	r->req.body_len = len;
+	r->req.content_length = len;
+	r->req.body_finished = true;
+	r->req.body_release = release;
+	r->req.body_release_data = data;
+}
+
+/* Parse Accept-Encoding, and set the q-value of each of @codings
+ * into @qvalues, where 0 means not accepted. */
+void phl_request_accept_encodings(struct phl_request *r,
+		const char *const *codings, int num, double *qvalues)
+{
+	for (int i = 0; i < num; i++) {
+		qvalues[i] = -1; /* not listed */
+	}
+
+	double any_qvalue = 0;
+	struct phl_header *h = phl_header_get(&r->req.headers, "Accept-Encoding");
+	const char *p = (h != NULL) ? phl_header_value(h) : "";
+	while (*p != '\0') {
+		/* coding name */
+		p += strspn(p, " \t,");
+		const char *name = p;
+		p += strcspn(p, " \t,;");
+		int name_len = p - name;
+		if (name_len == 0) { /* invalid */
+			p += strcspn(p, ",");
+			continue;
+		}
+
+		/* q-value, 1 by default */
+		double qvalue = 1;
+		p += strspn(p, " \t");
+		if (*p == ';') {
+			p++;
+			p += strspn(p, " \t");
+			if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+				qvalue = strtod(p + 2, NULL);
+			}
+			p += strcspn(p, ",");
+		}
+
+		if (name_len == 1 && name[0] == '*') {
+			any_qvalue = qvalue;
+			continue;
+		}
+		for (int i = 0; i < num; i++) {
+			if (strncasecmp(name, codings[i], name_len) == 0 && codings[i][name_len] == '\0') {
+				qvalues[i] = qvalue;
+				break;
+			}
+		}
+	}
+
+	/* "*" matches the not listed ones */
+	for (int i = 0; i < num; i++) {
+		if (qvalues[i] < 0) {
+			qvalues[i] = any_qvalue;
+		}
+	}
+}
+
 static int phl_request_receive_headers(struct phl_request *r)
 {
 	if (r->c->is_http2) {
@@ -345,7 +521,19 @@ static int phl_request_locate_conf_host(struct phl_request *r)
 		return PHL_OK;
 	}
 
-	r->conf_host = phl_conf_host_locate(r->c->conf_listen, r->req.host);
+	/* reuse the SNI result if the Host is same with the SNI name,
+	 * which is the most case */
+	struct phl_connection *c = r->c;
+	if (c->ssl_sni_conf_host != NULL && r->req.host != NULL) {
+		const char *sni_name = phl_ssl_stream_servername(c->loop_stream);
+		if (sni_name != NULL && strcasecmp(sni_name, r->req.host) == 0) {
+			r->conf_host = c->ssl_sni_conf_host;
+			r->conf_path = r->conf_host->default_path;
+			return PHL_OK;
+		}
+	}
+
+	r->conf_host = phl_conf_host_locate(c->conf_listen, r->req.host);
 	if (r->conf_host == NULL) {
 		phl_request_log(r, PHL_LOG_INFO, "no host matched: %s", r->req.host);
 		return PHL_ERROR;
@@ -353,8 +541,8 @@ static int phl_request_locate_conf_host(struct phl_request *r)
 
 	r->conf_path = r->conf_host->default_path;
 
-	if (r->c->ssl_sni_conf_host != NULL && r->conf_host != r->c->ssl_sni_conf_host) {
-		phl_request_log(r, PHL_LOG_DEBUG, "wanring: ssl_sni_conf_host not match");
+	if (c->ssl_sni_conf_host != NULL && r->conf_host != c->ssl_sni_conf_host) {
+		phl_request_log(r, PHL_LOG_DEBUG, "warning: ssl_sni_conf_host not match");
 	}
 	return PHL_OK;
 }
@@ -452,6 +640,59 @@ static inline int phl_request_simple_response_body(enum wuy_http_status_code cod
 			code, str, code, str);
 }
 
+/* read easy_fd in aio if enabled, and returns PHL_AGAIN if in process */
+static int phl_request_easy_fd_read(struct phl_request *r, uint8_t *buf, int len)
+{
+	/* use pread() because the fd may be shared in phl_open_cache */
+	off_t offset = r->resp.easy_fd_offset + r->resp.content_generated_length;
+
+	if (!phl_aio_is_enabled()) {
+		int ret = pread(r->resp.easy_fd, buf, len, offset);
+		if (ret < 0) {
+			phl_request_log(r, PHL_LOG_ERROR, "read body_fd erro: %s", strerror(errno));
+			return PHL_ERROR;
+		}
+		return ret;
+	}
+
+	struct phl_aio_task *task = r->resp.easy_fd_task;
+	if (task == NULL) {
+		task = phl_aio_task_new(phl_aio_work_read, phl_aio_done_request, r);
+		task->fd = r->resp.easy_fd;
+		task->buf = malloc(len);
+		task->len = len;
+		task->offset = offset;
+		phl_aio_submit(task);
+
+		r->resp.easy_fd_task = task;
+		r->resp.easy_fd_task_pos = 0;
+		return PHL_AGAIN;
+	}
+
+	if (!task->finished) {
+		return PHL_AGAIN;
+	}
+
+	if (task->ret < 0) {
+		phl_request_log(r, PHL_LOG_ERROR, "read body_fd erro: %s", strerror(task->err));
+		return PHL_ERROR;
+	}
+
+	/* the buffer space may be less than the read */
+	int copy_len = task->ret - r->resp.easy_fd_task_pos;
+	if (copy_len > len) {
+		copy_len = len;
+	}
+	memcpy(buf, task->buf + r->resp.easy_fd_task_pos, copy_len);
+	r->resp.easy_fd_task_pos += copy_len;
+
+	if (r->resp.easy_fd_task_pos >= task->ret) {
+		phl_aio_task_free(task);
+		r->resp.easy_fd_task = NULL;
+	}
+	return copy_len;
+}
+
 static int phl_request_response_headers_1(struct phl_request *r)
 {
 	if (r->req_end_time == 0) {
@@ -489,12 +730,10 @@ static int phl_request_response_headers_3(struct phl_request *r)
 	}
 }
 
-static int phl_request_response_body(struct phl_request *r)
+/* make space in send buffer for body, with the HTTP2 frame or HTTP1 chunked */
+static int phl_request_response_body_space(struct phl_request *r,
+		uint8_t **p_buf_pos, int *p_buf_len)
 {
-	if (r->resp_begin_time == 0) {
-		r->resp_begin_time = wuy_time_ms();
-	}
-
 	struct phl_connection *c = r->c;
 
 	int buf_len = phl_connection_make_space(c, 4096);
@@ -518,6 +757,96 @@ static int phl_request_response_body(struct phl_request *r)
 		phl_http1_response_body_packfix(r, &buf_pos, &buf_len);
 	}
 
+	*p_buf_pos = buf_pos;
+	*p_buf_len = buf_len;
+	return PHL_OK;
+}
+
+/* pack the body at @buf_pos, HTTP2 frame or HTTP1 chunked */
+static void phl_request_response_body_pack(struct phl_request *r,
+		uint8_t *buf_pos, int body_len, bool is_last)
+{
+	struct phl_connection *c = r->c;
+
+	/* an empty chunk means the end in HTTP1 chunked */
+	if (body_len == 0 && !is_last) {
+		return;
+	}
+
+	if (c->is_http2) {
+		body_len = phl_http2_response_body_pack(r, buf_pos, body_len, is_last);
+	} else {
+		body_len = phl_http1_response_body_pack(r, buf_pos, body_len, is_last);
+	}
+
+	r->resp.sent_length += body_len;
+	c->send_buf_len += body_len;
+}
+
+/* copy the buffers output by filters into send buffer */
+static int phl_request_response_body_output(struct phl_request *r)
+{
+	struct phl_buf_chain *out = &r->resp.body_out;
+
+	do {
+		uint8_t *buf_pos;
+		int buf_len;
+		int ret = phl_request_response_body_space(r, &buf_pos, &buf_len);
+		if (ret != PHL_OK) {
+			return ret;
+		}
+
+		int body_len = 0;
+		while (out->head != NULL && body_len < buf_len) {
+			struct phl_buf *b = out->head;
+			int copy_len = b->len - out->pos;
+			if (copy_len > buf_len - body_len) {
+				copy_len = buf_len - body_len;
+			}
+			memcpy(buf_pos + body_len, b->data + out->pos, copy_len);
+			body_len += copy_len;
+			out->pos += copy_len;
+
+			if (out->pos == b->len) {
+				out->head = b->next;
+				out->pos = 0;
+			}
+		}
+
+		phl_request_response_body_pack(r, buf_pos, body_len,
+				out->is_last && out->head == NULL);
+
+	} while (out->head != NULL);
+
+	return PHL_OK;
+}
+
+static int phl_request_response_body(struct phl_request *r)
+{
+	if (r->resp_begin_time == 0) {
+		r->resp_begin_time = wuy_time_ms();
+	}
+
+	struct phl_buf_chain *out = &r->resp.body_out;
+
+	/* send the output left by filters before generating more */
+	if (out->head != NULL) {
+		int ret = phl_request_response_body_output(r);
+		if (ret != PHL_OK) {
+			return ret;
+		}
+		if (out->is_last) {
+			return PHL_OK;
+		}
+	}
+
+	uint8_t *buf_pos;
+	int buf_len;
+	int ret = phl_request_response_body_space(r, &buf_pos, &buf_len);
+	if (ret != PHL_OK) {
+		return ret;
+	}
+
 	int body_len = 0;
 	bool is_last = true;
 
@@ -538,11 +867,7 @@ static int phl_request_response_body(struct phl_request *r)
 		if (body_len > buf_len) {
 			body_len = buf_len;
 		}
-		body_len = read(r->resp.easy_fd, buf_pos, body_len);
-		if (body_len < 0) {
-			phl_request_log(r, PHL_LOG_ERROR, "read body_fd erro: %s", strerror(errno));
-			body_len = PHL_ERROR;
-		}
+		body_len = phl_request_easy_fd_read(r, buf_pos, body_len);
 
 	} else if (!r->is_broken) {
 		body_len = r->conf_path->content->content.response_body(r, buf_pos, buf_len);
@@ -563,38 +888,72 @@ static int phl_request_response_body(struct phl_request *r)
 		is_last = body_len == 0;
 	}
 
-skip_generate:
+skip_generate:;
 
-	/* filter */
-	body_len = phl_module_filter_response_body(r, buf_pos, body_len, buf_len, &is_last);
-	if (body_len < 0) {
-		return body_len;
+	/* filter, the body is generated in send buffer already */
+	struct phl_buf buf = { .data = buf_pos, .len = body_len };
+	out->head = body_len > 0 ? &buf : NULL;
+	out->is_last = is_last;
+	out->pos = 0;
+
+	ret = phl_module_filter_response_body(r, out);
+	if (ret != PHL_OK) {
+		out->head = NULL;
+		return ret;
 	}
 
-	/* pack, HTTP2 frame or HTTP1 chunked */
-	if (c->is_http2) {
-		body_len = phl_http2_response_body_pack(r, buf_pos, body_len, is_last);
+	if (out->head == &buf) {
+		/* passed through, so pack it in place without copy */
+		out->head = NULL;
+		phl_request_response_body_pack(r, buf_pos, buf.len, out->is_last);
+
+	} else if (out->head == NULL) {
+		/* nothing output, or the last empty one */
+		phl_request_response_body_pack(r, buf_pos, 0, out->is_last);
+
 	} else {
-		body_len = phl_http1_response_body_pack(r, buf_pos, body_len, is_last);
+		/* replaced by filters */
+		ret = phl_request_response_body_output(r);
+		if (ret != PHL_OK) {
+			return ret;
+		}
 	}
 
-	r->resp.sent_length += body_len;
-	c->send_buf_len += body_len;
-
-	return is_last ? PHL_OK : phl_request_response_body(r);
+	return out->is_last ? PHL_OK : phl_request_response_body(r);
 }
 
+/* Start new subrequests, which are inserted at head.
+ * The list is checked from head again after each run, because the father
+ * may be waken up and close or create subrequests during the run. */
 static void phl_request_run_post(struct phl_request *r)
 {
-	struct phl_request *subr, *safe;
-	wuy_list_iter_safe_type(&r->subr_head, subr, safe, list_node) {
-		if (subr->state != PHL_REQUEST_STATE_LOCATE_CONF_HOST) {
+	while (!r->closed) {
+		struct phl_request *subr;
+		wuy_list_first_type(&r->subr_head, subr, list_node);
+		if (subr == NULL || subr->state != PHL_REQUEST_STATE_LOCATE_CONF_HOST) {
 			break;
 		}
 		wuy_list_delete(&subr->list_node);
 		wuy_list_append(&r->subr_head, &subr->list_node);
 		phl_request_run(subr, "run subrequest");
 	}
+
+	/* resume the subrequests whose pipes are consumed. Search from
+	 * the beginning each time, because the list may be changed. */
+	while (!r->closed) {
+		struct phl_request *subr, *consumed = NULL;
+		wuy_list_iter_type(&r->subr_head, subr, list_node) {
+			if (subr->subr_pipe.consumed) {
+				consumed = subr;
+				break;
+			}
+		}
+		if (consumed == NULL) {
+			break;
+		}
+		consumed->subr_pipe.consumed = false;
+		phl_request_run(consumed, "subrequest pipe consumed");
+	}
 }
 
 static int (*phl_request_steps[])(struct phl_request *) = {
@@ -616,6 +975,15 @@ void phl_request_run(struct phl_request *r, const char *from)
 		return;
 	}
 
+	if (r->background_run != NULL) {
+		phl_request_log(r, PHL_LOG_DEBUG, "background run, from %s", from);
+		r->background_run(r);
+		if (!r->closed) {
+			phl_request_run_post(r);
+		}
+		return;
+	}
+
 	phl_request_log(r, PHL_LOG_DEBUG, "{{{ phl_request_run %d, from %s", r->state, from);
 
 	if (r->state == PHL_REQUEST_STATE_DONE) {
@@ -669,6 +1037,7 @@ struct phl_request *phl_request_subr_new(struct phl_request *father, const char
 	subr->conf_path = subr->conf_host->default_path;
 	subr->state = PHL_REQUEST_STATE_LOCATE_CONF_HOST;
 	subr->father = father;
+	subr->subr_pipe.limit = PHL_REQUEST_SUBR_PIPE_LIMIT;
 	wuy_list_insert(&father->subr_head, &subr->list_node);
 
 	c->u.request = subr; /* HTTP/1 only */
@@ -693,26 +1062,95 @@ struct phl_request *phl_request_subr_new(struct phl_request *father, const char
 	return subr;
 }
 
+/* The detached subrequest lives independently of its father.
+ * It is started later in phl_request_detached_run(), so the caller
+ * can still set the request after this. */
 void phl_request_subr_detach(struct phl_request *subr)
 {
 	subr->father = PHL_REQUEST_DETACHED_SUBR_FATHER;
+	subr->subr_pipe.discard = true;
+	subr->subr_pipe.limit = 0;
+
+	wuy_list_delete(&subr->list_node);
+	wuy_list_append(&phl_request_detached_list, &subr->list_node);
+}
+
+/* The father has read all buffers in pipe, so free them. The subrequest
+ * blocked by pipe's limit is resumed in phl_request_run_post() of the
+ * father, but not here, because the father is running now. */
+void phl_request_subr_pipe_consume(struct phl_request *subr)
+{
+	struct phl_request_pipe *pipe = &subr->subr_pipe;
+
+	phl_request_subr_pipe_free(pipe);
+
+	if (pipe->blocked) {
+		pipe->blocked = false;
+		pipe->consumed = true;
+	}
 }
 
 int phl_request_subr_flush_connection(struct phl_connection *c)
 {
 	struct phl_request *subr = c->u.request;
-	struct phl_request *father = subr->father;
+	struct phl_request_pipe *pipe = &subr->subr_pipe;
 
-	/* drop response for detached subrequests */
-	if (father == PHL_REQUEST_DETACHED_SUBR_FATHER) {
-		c->send_buf_len = 0;
+	if (pipe->limit == 0 || pipe->length < pipe->limit) {
+		phl_request_subr_pipe_push(subr);
 		return PHL_OK;
 	}
 
-	phl_request_run(father, "subrequest flush");
+	/* The pipe is full. Wake up the father to consume later in
+	 * phl_request_pipe_full_run(), out of the subrequest's running. */
+	if (!pipe->blocked) {
+		pipe->blocked = true;
+		wuy_list_append(&phl_request_pipe_full_list, &pipe->full_node);
+	}
 	return PHL_AGAIN;
 }
 
+/* The background request is not from clients, but to run Lua out of
+ * requests, e.g. timers. It has no HTTP process, and @run is called
+ * instead when it is waken up, e.g. by timer or subrequest.
+ * It belongs to the first Listen, for the subrequests. */
+struct phl_request *phl_request_background_new(void (*run)(struct phl_request *),
+		void *data)
+{
+	if (phl_conf_listens == NULL || phl_conf_listens[0] == NULL) {
+		return NULL;
+	}
+
+	struct phl_connection *c = calloc(1, sizeof(struct phl_connection));
+	c->conf_listen = phl_conf_listens[0];
+
+	struct phl_request *r = phl_request_new(c);
+	r->req.method = WUY_HTTP_GET;
+	r->req.uri.raw = "[background]";
+	r->req.host = "";
+	r->background_run = run;
+	r->background_data = data;
+	return r;
+}
+
+/* no access log or stats */
+void phl_request_background_close(struct phl_request *r)
+{
+	r->closed = true;
+
+	phl_request_log(r, PHL_LOG_DEBUG, "background done");
+
+	struct phl_request *subr;
+	while (wuy_list_pop_type(&r->subr_head, subr, list_node)) {
+		phl_request_subr_close(subr);
+	}
+
+	phl_request_clear_stuff(r);
+
+	free(r->c);
+
+	wuy_list_append(&phl_request_defer_list, &r->list_node);
+}
+
 static void phl_request_defer_free(void *data)
 {
 	struct phl_request *r;
@@ -721,7 +1159,26 @@ static void phl_request_defer_free(void *data)
 	}
 }
 
+static void phl_request_pipe_full_run(void *data)
+{
+	struct phl_request_pipe *pipe;
+	while (wuy_list_pop_type(&phl_request_pipe_full_list, pipe, full_node)) {
+		struct phl_request *subr = wuy_containerof(pipe, struct phl_request, subr_pipe);
+		phl_request_run(subr->father, "subrequest pipe full");
+	}
+}
+
+static void phl_request_detached_run(void *data)
+{
+	struct phl_request *subr;
+	while (wuy_list_pop_type(&phl_request_detached_list, subr, list_node)) {
+		phl_request_run(subr, "detached subrequest");
+	}
+}
+
 void phl_request_init(void)
 {
 	loop_defer_add(phl_loop, phl_request_defer_free, NULL);
+	loop_defer_add(phl_loop, phl_request_detached_run, NULL);
+	loop_defer_add(phl_loop, phl_request_pipe_full_run, NULL);
 }
@@ -3,6 +3,50 @@
 
 struct phl_request;
 
+/* A piece of response body, passed through the response_body filters. */
+struct phl_buf {
+	const uint8_t		*data;
+	int			len;
+	struct phl_buf		*next;
+};
+
+/* The response body chunk passed through the response_body filters.
+ *
+ * A filter may leave the chain untouched to pass it through without copy
+ * (modifying the data in place is allowed, but not growing it), or replace
+ * the whole chain by its own buffers, any number of them including none.
+ * The buffers must stay valid until the filter is called next time or the
+ * request is done. The filter is not called next time until all the
+ * buffers have been sent into the connection, which is the backpressure. */
+struct phl_buf_chain {
+	struct phl_buf		*head;
+	bool			is_last;
+
+	int			pos; /* position in head, sent already */
+};
+
+/* The response body of subrequest, passed to the father without copy.
+ *
+ * The subrequest's send buffers are moved into the pipe when full or done.
+ * The father is waken up when the subrequest is done, to read the whole
+ * body. Besides, when @length reaches @limit, the subrequest is blocked
+ * and the father is waken up later, until the father calls
+ * phl_request_subr_pipe_consume(), which is the backpressure. The @limit
+ * is PHL_REQUEST_SUBR_PIPE_LIMIT by default, and 0 for no limit.
+ * The body is dropped if @discard is set. */
+struct phl_request_pipe {
+	struct phl_buf		*head;
+	struct phl_buf		*tail;
+	size_t			length;
+	size_t			limit;
+	bool			discard;
+	bool			blocked;
+	bool			consumed; /* to resume the blocked subrequest */
+	wuy_list_node_t		full_node; /* to wake up the father */
+};
+
+#define PHL_REQUEST_SUBR_PIPE_LIMIT	(256 * 1024)
+
 #include "phl_module.h"
 #include "phl_header.h"
 #include "phl_conf.h"
@@ -35,6 +79,10 @@ struct phl_request {
 		uint8_t			*body_buf;
 		int			body_len;
 		bool			body_finished;
+
+		/* set by phl_request_set_body_ref() */
+		void			(*body_release)(void *);
+		void			*body_release_data;
 	} req;
 
 	struct {
@@ -52,6 +100,13 @@ struct phl_request {
 		const char		*easy_string;
 		int			easy_str_len;
 		int			easy_fd;
+		off_t			easy_fd_offset; /* read by pread() from here */
+		struct phl_aio_task	*easy_fd_task; /* reading easy_fd in aio */
+		int			easy_fd_task_pos;
+
+		bool			body_replaced; /* by filter, so content's body is not read */
+
+		struct phl_buf_chain	body_out; /* output by filters and not sent yet */
 	} resp;
 
 	enum {
@@ -87,10 +142,18 @@ struct phl_request {
 	struct phl_dynamic_ctx	*dynamic_ctx;
 
 	lua_State		*L;
+	struct phl_lua_thread_item	*lua_thread;
 	wuy_cflua_function_t	current_entry;
 
+	struct phl_key_memo	*key_memos;
+
+	/* of background request, see phl_request_background_new() */
+	void			(*background_run)(struct phl_request *);
+	void			*background_data;
+
 	struct phl_request	*father; /* of subrequest */
 	wuy_list_t		subr_head;
+	struct phl_request_pipe	subr_pipe; /* of subrequest */
 
 	wuy_list_node_t		list_node;
 
@@ -114,7 +177,15 @@ void phl_request_close(struct phl_request *r);
 
 bool phl_request_set_uri(struct phl_request *r, const char *uri_str, int uri_len);
 bool phl_request_set_host(struct phl_request *r, const char *host_str, int host_len);
+
+const char *phl_request_get_cookie(struct phl_request *r,
+		const char *name, int name_len, int *p_len);
 int phl_request_append_body(struct phl_request *r, const void *buf, int len);
+void phl_request_set_body_ref(struct phl_request *r, const void *buf, int len,
+		void (*release)(void *), void *data);
+
+void phl_request_accept_encodings(struct phl_request *r,
+		const char *const *codings, int num, double *qvalues);
 
 void phl_request_reset_response(struct phl_request *r);
 
@@ -128,8 +199,14 @@ struct phl_request *phl_request_subr_new(struct phl_request *father, const char
 void phl_request_subr_detach(struct phl_request *subr);
 void phl_request_subr_close(struct phl_request *subr);
 
+void phl_request_subr_pipe_consume(struct phl_request *subr);
+
 int phl_request_subr_flush_connection(struct phl_connection *c);
 
+struct phl_request *phl_request_background_new(void (*run)(struct phl_request *),
+		void *data);
+void phl_request_background_close(struct phl_request *r);
+
 #define phl_request_do_log(r, log, level, fmt, ...) \
 	do { \
 		const char *_uri = (level >= PHL_LOG_ERROR) ? r->req.uri.raw : "-"; \
@@ -0,0 +1,494 @@
+#include <pthread.h>
+
+#include "phl_main.h"
+
+#define PHL_SHARED_DICT_ROUND(n, a)	(((n) + (a) - 1) / (a) * (a))
+
+/* stripes are aligned to cache line to avoid false sharing */
+#define PHL_SHARED_DICT_ALIGN		64
+
+struct phl_shared_dict_entry {
+	struct phl_slab_node	slab_node;
+	wuy_nop_hlist_node_t	hash_node;
+	uint64_t		hash;
+	long			expire_at; /* in ms, 0 for never */
+	uint8_t			type;
+	uint16_t		key_len;
+	int			value_len;
+	double			number;
+	char			data[0]; /* key, and then string value */
+};
+
+/* The dictionary is divided into stripes by key hash. Each stripe has
+ * its own lock, hash buckets and slab, so workers accessing different
+ * keys seldom contend. */
+struct phl_shared_dict_stripe {
+	pthread_mutex_t		lock;
+	bool			has_inited;
+	struct phl_slab		slab;
+	int			item_num;
+
+	/* protected by lock, except contended */
+	long			stats_get;
+	long			stats_hit;
+	long			stats_set;
+	long			stats_evict;
+	long			stats_expire;
+	long			stats_no_memory;
+	atomic_long		stats_contended;
+
+	int			hash_buckets;
+	wuy_nop_hlist_t		buckets[0];
+};
+
+/* to hold the string value for phl_shared_dict_get() */
+static char *phl_shared_dict_buf;
+static int phl_shared_dict_buf_size;
+
+/* shared by processes, so wuy_time_ms() is not used */
+static long phl_shared_dict_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct phl_shared_dict_stripe *phl_shared_dict_stripe(
+		struct phl_shared_dict *dict, uint64_t hash)
+{
+	return (void *)((char *)dict->shm + (long)dict->stripe_size * (hash % dict->stripes));
+}
+
+static void phl_shared_dict_lock(struct phl_shared_dict_stripe *stripe)
+{
+	if (pthread_mutex_trylock(&stripe->lock) != 0) {
+		atomic_fetch_add(&stripe->stats_contended, 1);
+		pthread_mutex_lock(&stripe->lock);
+	}
+}
+
+static wuy_nop_hlist_t *phl_shared_dict_bucket(struct phl_shared_dict *dict,
+		struct phl_shared_dict_stripe *stripe, uint64_t hash)
+{
+	return &stripe->buckets[(hash / dict->stripes) % stripe->hash_buckets];
+}
+
+static void phl_shared_dict_free(struct phl_shared_dict_stripe *stripe,
+		struct phl_shared_dict_entry *entry)
+{
+	wuy_nop_hlist_delete(&entry->hash_node, stripe);
+	phl_slab_free(&stripe->slab, entry);
+	stripe->item_num--;
+}
+
+/* search the entry, and free it if expired */
+static struct phl_shared_dict_entry *phl_shared_dict_search(struct phl_shared_dict *dict,
+		struct phl_shared_dict_stripe *stripe, uint64_t hash,
+		const char *key, int key_len, long now)
+{
+	wuy_nop_hlist_t *bucket = phl_shared_dict_bucket(dict, stripe, hash);
+
+	struct phl_shared_dict_entry *entry;
+	wuy_nop_hlist_iter_type(bucket, entry, hash_node, stripe) {
+		if (entry->hash != hash || entry->key_len != key_len
+				|| memcmp(entry->data, key, key_len) != 0) {
+			continue;
+		}
+		if (entry->expire_at != 0 && now >= entry->expire_at) {
+			stripe->stats_expire++;
+			phl_shared_dict_free(stripe, entry);
+			return NULL;
+		}
+		return entry;
+	}
+	return NULL;
+}
+
+struct phl_shared_dict_evict_arg {
+	struct phl_shared_dict_stripe	*stripe;
+	long				now;
+};
+static void phl_shared_dict_evict(void *slot, void *data)
+{
+	struct phl_shared_dict_evict_arg *arg = data;
+	struct phl_shared_dict_stripe *stripe = arg->stripe;
+	struct phl_shared_dict_entry *entry = slot;
+
+	if (entry->expire_at != 0 && arg->now >= entry->expire_at) {
+		stripe->stats_expire++;
+	} else {
+		stripe->stats_evict++;
+	}
+	wuy_nop_hlist_delete(&entry->hash_node, stripe);
+	stripe->item_num--;
+}
+
+/* allocate and insert a new entry, with key set only */
+static struct phl_shared_dict_entry *phl_shared_dict_insert(struct phl_shared_dict *dict,
+		struct phl_shared_dict_stripe *stripe, uint64_t hash,
+		const char *key, int key_len, int length, long now)
+{
+	struct phl_shared_dict_evict_arg arg = { .stripe = stripe, .now = now };
+	struct phl_shared_dict_entry *entry = phl_slab_alloc(&stripe->slab, length,
+			phl_shared_dict_evict, &arg);
+	if (entry == NULL) {
+		stripe->stats_no_memory++;
+		return NULL;
+	}
+
+	entry->hash = hash;
+	entry->key_len = key_len;
+	memcpy(entry->data, key, key_len);
+
+	wuy_nop_hlist_insert(phl_shared_dict_bucket(dict, stripe, hash), &entry->hash_node, stripe);
+	stripe->item_num++;
+	return entry;
+}
+
+static long phl_shared_dict_expire_at(double ttl, long now)
+{
+	return ttl > 0 ? now + (long)(ttl * 1000) : 0;
+}
+
+bool phl_shared_dict_get(struct phl_shared_dict *dict, const char *key, int key_len,
+		struct phl_shared_dict_value *value)
+{
+	uint64_t hash = wuy_vhash64(key, key_len);
+	struct phl_shared_dict_stripe *stripe = phl_shared_dict_stripe(dict, hash);
+
+	phl_shared_dict_lock(stripe); /* lock here */
+	stripe->stats_get++;
+
+	struct phl_shared_dict_entry *entry = phl_shared_dict_search(dict, stripe,
+			hash, key, key_len, phl_shared_dict_now_ms());
+	if (entry == NULL) {
+		pthread_mutex_unlock(&stripe->lock);
+		return false;
+	}
+
+	stripe->stats_hit++;
+	phl_slab_touch(&stripe->slab, entry);
+
+	value->type = entry->type;
+	value->number = entry->number;
+	if (entry->type == PHL_SHARED_DICT_STRING) {
+		if (entry->value_len > phl_shared_dict_buf_size) {
+			phl_shared_dict_buf_size = entry->value_len;
+			phl_shared_dict_buf = realloc(phl_shared_dict_buf, phl_shared_dict_buf_size);
+		}
+		memcpy(phl_shared_dict_buf, entry->data + entry->key_len, entry->value_len);
+		value->str = phl_shared_dict_buf;
+		value->len = entry->value_len;
+	}
+
+	pthread_mutex_unlock(&stripe->lock); /* unlock here */
+	return true;
+}
+
+int phl_shared_dict_set(struct phl_shared_dict *dict, const char *key, int key_len,
+		const struct phl_shared_dict_value *value, double ttl, bool only_add)
+{
+	if (value->type == PHL_SHARED_DICT_NIL) {
+		phl_shared_dict_delete(dict, key, key_len);
+		return PHL_OK;
+	}
+
+	int value_len = value->type == PHL_SHARED_DICT_STRING ? value->len : 0;
+	if (key_len > UINT16_MAX || key_len + value_len > dict->max_item) {
+		return PHL_SHARED_DICT_TOO_BIG;
+	}
+	int length = sizeof(struct phl_shared_dict_entry) + key_len + value_len;
+
+	uint64_t hash = wuy_vhash64(key, key_len);
+	struct phl_shared_dict_stripe *stripe = phl_shared_dict_stripe(dict, hash);
+
+	phl_shared_dict_lock(stripe); /* lock here */
+	stripe->stats_set++;
+
+	long now = phl_shared_dict_now_ms();
+	struct phl_shared_dict_entry *entry = phl_shared_dict_search(dict, stripe,
+			hash, key, key_len, now);
+	if (entry != NULL) {
+		if (only_add) {
+			pthread_mutex_unlock(&stripe->lock);
+			return PHL_SHARED_DICT_EXISTS;
+		}
+		/* overwrite in place if in the same class */
+		if (!phl_slab_resize(&stripe->slab, entry, length)) {
+			phl_shared_dict_free(stripe, entry);
+			entry = NULL;
+		}
+	}
+
+	if (entry == NULL) {
+		entry = phl_shared_dict_insert(dict, stripe, hash, key, key_len, length, now);
+		if (entry == NULL) {
+			pthread_mutex_unlock(&stripe->lock);
+			return PHL_SHARED_DICT_NO_MEMORY;
+		}
+	}
+
+	entry->type = value->type;
+	entry->number = value->number;
+	entry->value_len = value_len;
+	if (value_len > 0) {
+		memcpy(entry->data + key_len, value->str, value_len);
+	}
+	entry->expire_at = phl_shared_dict_expire_at(ttl, now);
+
+	pthread_mutex_unlock(&stripe->lock); /* unlock here */
+	return PHL_OK;
+}
+
+int phl_shared_dict_incr(struct phl_shared_dict *dict, const char *key, int key_len,
+		double n, const double *init, double ttl, double *p_result)
+{
+	if (key_len > UINT16_MAX || key_len > dict->max_item) {
+		return PHL_SHARED_DICT_TOO_BIG;
+	}
+
+	uint64_t hash = wuy_vhash64(key, key_len);
+	struct phl_shared_dict_stripe *stripe = phl_shared_dict_stripe(dict, hash);
+
+	phl_shared_dict_lock(stripe); /* lock here */
+
+	long now = phl_shared_dict_now_ms();
+	struct phl_shared_dict_entry *entry = phl_shared_dict_search(dict, stripe,
+			hash, key, key_len, now);
+
+	/* found, keep the expire time */
+	if (entry != NULL) {
+		if (entry->type != PHL_SHARED_DICT_NUMBER) {
+			pthread_mutex_unlock(&stripe->lock);
+			return PHL_SHARED_DICT_NOT_NUMBER;
+		}
+		entry->number += n;
+		*p_result = entry->number;
+		phl_slab_touch(&stripe->slab, entry);
+		pthread_mutex_unlock(&stripe->lock);
+		return PHL_OK;
+	}
+
+	if (init == NULL) {
+		pthread_mutex_unlock(&stripe->lock);
+		return PHL_SHARED_DICT_NOT_FOUND;
+	}
+
+	stripe->stats_set++;
+
+	entry = phl_shared_dict_insert(dict, stripe, hash, key, key_len,
+			sizeof(struct phl_shared_dict_entry) + key_len, now);
+	if (entry == NULL) {
+		pthread_mutex_unlock(&stripe->lock);
+		return PHL_SHARED_DICT_NO_MEMORY;
+	}
+
+	entry->type = PHL_SHARED_DICT_NUMBER;
+	entry->number = *init + n;
+	entry->value_len = 0;
+	entry->expire_at = phl_shared_dict_expire_at(ttl, now);
+	*p_result = entry->number;
+
+	pthread_mutex_unlock(&stripe->lock); /* unlock here */
+	return PHL_OK;
+}
+
+void phl_shared_dict_delete(struct phl_shared_dict *dict, const char *key, int key_len)
+{
+	uint64_t hash = wuy_vhash64(key, key_len);
+	struct phl_shared_dict_stripe *stripe = phl_shared_dict_stripe(dict, hash);
+
+	phl_shared_dict_lock(stripe);
+
+	struct phl_shared_dict_entry *entry = phl_shared_dict_search(dict, stripe,
+			hash, key, key_len, phl_shared_dict_now_ms());
+	if (entry != NULL) {
+		phl_shared_dict_free(stripe, entry);
+	}
+
+	pthread_mutex_unlock(&stripe->lock);
+}
+
+const char *phl_shared_dict_strerror(int ret)
+{
+	switch (ret) {
+	case PHL_OK:
+		return "ok";
+	case PHL_SHARED_DICT_EXISTS:
+		return "exists";
+	case PHL_SHARED_DICT_NOT_FOUND:
+		return "not found";
+	case PHL_SHARED_DICT_NOT_NUMBER:
+		return "not a number";
+	case PHL_SHARED_DICT_TOO_BIG:
+		return "too big";
+	case PHL_SHARED_DICT_NO_MEMORY:
+		return "no memory";
+	default:
+		return "unknown error";
+	}
+}
+
+void phl_shared_dict_stats(wuy_json_t *json)
+{
+	wuy_json_object_object(json, "shared");
+
+	struct phl_shared_dict **dicts = phl_conf_runtime->shared;
+	for (int i = 0; dicts != NULL && dicts[i] != NULL; i++) {
+		struct phl_shared_dict *dict = dicts[i];
+
+		/* read without lock, so they may be inaccurate a little */
+		long items = 0, get = 0, hit = 0, set = 0, evict = 0, expire = 0;
+		long no_memory = 0, contended = 0;
+		for (int j = 0; j < dict->stripes; j++) {
+			struct phl_shared_dict_stripe *stripe = phl_shared_dict_stripe(dict, j);
+			items += stripe->item_num;
+			get += stripe->stats_get;
+			hit += stripe->stats_hit;
+			set += stripe->stats_set;
+			evict += stripe->stats_evict;
+			expire += stripe->stats_expire;
+			no_memory += stripe->stats_no_memory;
+			contended += atomic_load(&stripe->stats_contended);
+		}
+
+		wuy_json_object_object(json, dict->name);
+		wuy_json_object_int(json, "size", dict->size);
+		wuy_json_object_int(json, "items", items);
+		wuy_json_object_int(json, "get", get);
+		wuy_json_object_int(json, "hit", hit);
+		wuy_json_object_int(json, "set", set);
+		wuy_json_object_int(json, "evict", evict);
+		wuy_json_object_int(json, "expire", expire);
+		wuy_json_object_int(json, "no_memory", no_memory);
+		wuy_json_object_int(json, "contended", contended);
+		wuy_json_object_close(json);
+	}
+
+	wuy_json_object_close(json);
+}
+
+/* configuration */
+
+static void phl_shared_dict_init_shm(struct phl_shared_dict *dict, int hash_buckets,
+		int pages_offset, int page_num)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, 1);
+
+	for (int i = 0; i < dict->stripes; i++) {
+		struct phl_shared_dict_stripe *stripe = phl_shared_dict_stripe(dict, i);
+		if (stripe->has_inited) {
+			continue;
+		}
+
+		stripe->has_inited = true;
+		pthread_mutex_init(&stripe->lock, &attr);
+		phl_slab_init(&stripe->slab, (char *)stripe + pages_offset,
+				dict->page_size, page_num);
+		stripe->hash_buckets = hash_buckets;
+	}
+
+	pthread_mutexattr_destroy(&attr);
+}
+
+static const char *phl_shared_dict_conf_post(void *data)
+{
+	struct phl_shared_dict *dict = data;
+
+	if (dict->name == NULL) {
+		return "name is required";
+	}
+
+	/* the page size is the max slot size */
+	dict->page_size = phl_slab_page_size(
+			sizeof(struct phl_shared_dict_entry) + dict->max_item);
+	if (dict->page_size == 0) {
+		wuy_cflua_post_arg = dict->name;
+		return "too big max_item";
+	}
+	dict->stripe_size = dict->size / dict->stripes
+			/ PHL_SHARED_DICT_ALIGN * PHL_SHARED_DICT_ALIGN;
+
+	int hash_buckets = dict->stripe_size / 512 + 1;
+	int pages_offset = PHL_SHARED_DICT_ROUND(sizeof(struct phl_shared_dict_stripe)
+			+ sizeof(wuy_nop_hlist_t) * hash_buckets, PHL_SHARED_DICT_ALIGN);
+	int page_num = (dict->stripe_size - pages_offset) / dict->page_size;
+	if (page_num < 2) {
+		wuy_cflua_post_arg = dict->name;
+		return "too small size";
+	}
+
+	dict->shm = wuy_shmpool_alloc(dict->size);
+	phl_shared_dict_init_shm(dict, hash_buckets, pages_offset, page_num);
+
+	return WUY_CFLUA_OK;
+}
+
+static const char *phl_conf_runtime_shared_post(void *data)
+{
+	struct phl_shared_dict **dicts = *(struct phl_shared_dict ***)data;
+	if (dicts == NULL) {
+		return WUY_CFLUA_OK;
+	}
+
+	for (int i = 0; dicts[i] != NULL; i++) {
+		for (int j = 0; j < i; j++) {
+			if (strcmp(dicts[i]->name, dicts[j]->name) == 0) {
+				wuy_cflua_post_arg = dicts[i]->name;
+				return "duplicate name";
+			}
+		}
+	}
+	return WUY_CFLUA_OK;
+}
+
+static struct wuy_cflua_command phl_shared_dict_conf_commands[] = {
+	{	.type = WUY_CFLUA_TYPE_STRING,
+		.description = "Name, used as `phl.shared.<name>` in Lua.",
+		.is_single_array = true,
+		.offset = offsetof(struct phl_shared_dict, name),
+	},
+	{	.name = "size",
+		.description = "Size of shared-memory.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_shared_dict, size),
+		.default_value.n = 1024*1024, /* 1 MiB */
+		.limits.n = WUY_CFLUA_LIMITS_LOWER(64*1024),
+	},
+	{	.name = "stripes",
+		.description = "Number of stripes of the dictionary, each with its own lock.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_shared_dict, stripes),
+		.default_value.n = 16,
+		.limits.n = WUY_CFLUA_LIMITS(1, 256),
+	},
+	{	.name = "max_item",
+		.description = "Max length of key and value of each item.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_shared_dict, max_item),
+		.default_value.n = 1024,
+		.limits.n = WUY_CFLUA_LIMITS(16, 1024*1024),
+	},
+	{ NULL }
+};
+
+static struct wuy_cflua_table phl_shared_dict_conf_table = {
+	.commands = phl_shared_dict_conf_commands,
+	.size = sizeof(struct phl_shared_dict),
+	.post = phl_shared_dict_conf_post,
+};
+
+static struct wuy_cflua_command phl_conf_runtime_shared_commands[] = {
+	{	.type = WUY_CFLUA_TYPE_TABLE,
+		.description = "Shared dictionary.",
+		.offset = 0,
+		.u.table = &phl_shared_dict_conf_table,
+	},
+	{ NULL }
+};
+struct wuy_cflua_table phl_conf_runtime_shared_table = {
+	.commands = phl_conf_runtime_shared_commands,
+	.post = phl_conf_runtime_shared_post,
+};
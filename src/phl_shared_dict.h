@@ -0,0 +1,66 @@
+#ifndef PHL_SHARED_DICT_H
+#define PHL_SHARED_DICT_H
+
+/* Key-value dictionaries in shared-memory, shared by all workers.
+ *
+ * They are defined in `Runtime.shared`, and used by Lua as `phl.shared.<name>`.
+ * Each one has fixed size, and the least recently used items are evicted
+ * if full. The memory is kept during reloading. */
+
+enum phl_shared_dict_type {
+	PHL_SHARED_DICT_NIL,
+	PHL_SHARED_DICT_NUMBER,
+	PHL_SHARED_DICT_BOOLEAN,
+	PHL_SHARED_DICT_STRING,
+};
+
+struct phl_shared_dict_value {
+	enum phl_shared_dict_type	type;
+	double				number; /* for NUMBER, and 0/1 for BOOLEAN */
+	const char			*str; /* for STRING */
+	int				len;
+};
+
+/* return values, except PHL_OK */
+#define PHL_SHARED_DICT_EXISTS		1
+#define PHL_SHARED_DICT_NOT_FOUND	2
+#define PHL_SHARED_DICT_NOT_NUMBER	3
+#define PHL_SHARED_DICT_TOO_BIG		4
+#define PHL_SHARED_DICT_NO_MEMORY	5
+
+struct phl_shared_dict {
+	const char	*name;
+	int		size;
+	int		stripes;
+	int		max_item;
+
+	int		stripe_size;
+	int		page_size;
+
+	void		*shm;
+};
+
+/* The string value is copied into a buffer of this worker,
+ * which is valid until next call. */
+bool phl_shared_dict_get(struct phl_shared_dict *dict, const char *key, int key_len,
+		struct phl_shared_dict_value *value);
+
+/* Set @value which expires after @ttl seconds, or never if 0.
+ * If @only_add is set, fails with PHL_SHARED_DICT_EXISTS if the key exists. */
+int phl_shared_dict_set(struct phl_shared_dict *dict, const char *key, int key_len,
+		const struct phl_shared_dict_value *value, double ttl, bool only_add);
+
+/* Add @n to the number value. If the key does not exist, @init is used
+ * if not NULL and the @ttl is applied. The result is set to @p_result. */
+int phl_shared_dict_incr(struct phl_shared_dict *dict, const char *key, int key_len,
+		double n, const double *init, double ttl, double *p_result);
+
+void phl_shared_dict_delete(struct phl_shared_dict *dict, const char *key, int key_len);
+
+const char *phl_shared_dict_strerror(int ret);
+
+void phl_shared_dict_stats(wuy_json_t *json);
+
+extern struct wuy_cflua_table phl_conf_runtime_shared_table;
+
+#endif
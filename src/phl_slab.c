@@ -0,0 +1,170 @@
+#include "phl_main.h"
+
+static int phl_slab_class(int length)
+{
+	int slot_class = 0;
+	int slot_size = PHL_SLAB_MIN_SLOT;
+	while (slot_size < length) {
+		slot_size <<= 1;
+		slot_class++;
+	}
+	return slot_class;
+}
+
+int phl_slab_page_size(int max_length)
+{
+	int slot_class = phl_slab_class(max_length);
+	if (slot_class >= PHL_SLAB_CLASSES) {
+		return 0;
+	}
+	return PHL_SLAB_MIN_SLOT << slot_class;
+}
+
+void phl_slab_init(struct phl_slab *slab, char *pages_start, int page_size, int page_num)
+{
+	slab->page_size = page_size;
+	slab->page_num = page_num;
+	slab->page_used = 0;
+	slab->pages_start = pages_start;
+}
+
+/* divide the page into free slots of the class */
+static void phl_slab_split(struct phl_slab *slab, char *page, int slot_class)
+{
+	int slot_size = PHL_SLAB_MIN_SLOT << slot_class;
+	for (char *p = page; p + slot_size <= page + slab->page_size; p += slot_size) {
+		struct phl_slab_node *node = (struct phl_slab_node *)p;
+		node->slot_class = slot_class;
+		node->length = 0;
+		wuy_nop_list_append(&slab->classes[slot_class].free_list, &node->list_node);
+	}
+	slab->classes[slot_class].pages++;
+}
+
+/* Take a page from the class with most pages, evict all its slots,
+ * and return it. The page of the least recently used slot is taken. */
+static char *phl_slab_reassign(struct phl_slab *slab, int slot_class,
+		phl_slab_evict_f *evict, void *data)
+{
+	int victim_class = -1;
+	for (int i = 0; i < PHL_SLAB_CLASSES; i++) {
+		if (i != slot_class && slab->classes[i].pages > 0 && (victim_class < 0
+					|| slab->classes[i].pages > slab->classes[victim_class].pages)) {
+			victim_class = i;
+		}
+	}
+	if (victim_class < 0) {
+		return NULL;
+	}
+
+	struct phl_slab_node *node;
+	if (!wuy_nop_list_first_type(&slab->classes[victim_class].lru_list, node, list_node)) {
+		wuy_nop_list_first_type(&slab->classes[victim_class].free_list, node, list_node);
+	}
+
+	long offset = ((char *)node - slab->pages_start) / slab->page_size * slab->page_size;
+	char *page = slab->pages_start + offset;
+
+	int slot_size = PHL_SLAB_MIN_SLOT << victim_class;
+	for (char *p = page; p + slot_size <= page + slab->page_size; p += slot_size) {
+		node = (struct phl_slab_node *)p;
+		if (node->length == 0) {
+			wuy_nop_list_delete(&slab->classes[victim_class].free_list, &node->list_node);
+			continue;
+		}
+		evict(node, data);
+		wuy_nop_list_delete(&slab->classes[victim_class].lru_list, &node->list_node);
+		slab->classes[victim_class].used -= node->length;
+	}
+	slab->classes[victim_class].pages--;
+	return page;
+}
+
+static struct phl_slab_node *phl_slab_get(struct phl_slab *slab, int slot_class,
+		phl_slab_evict_f *evict, void *data)
+{
+	wuy_nop_list_t *free_list = &slab->classes[slot_class].free_list;
+
+	/* reuse freed slot */
+	struct phl_slab_node *node;
+	wuy_nop_list_pop_type(free_list, node, list_node);
+	if (node != NULL) {
+		return node;
+	}
+
+	/* split a new page into slots */
+	if (slab->page_used < slab->page_num) {
+		phl_slab_split(slab, slab->pages_start + (long)slab->page_size * slab->page_used++,
+				slot_class);
+		wuy_nop_list_pop_type(free_list, node, list_node);
+		return node;
+	}
+
+	/* evict the least recently used one of this class */
+	wuy_nop_list_pop_type(&slab->classes[slot_class].lru_list, node, list_node);
+	if (node != NULL) {
+		evict(node, data);
+		slab->classes[slot_class].used -= node->length;
+		return node;
+	}
+
+	/* no slot of this class at all, so take a page from others */
+	char *page = phl_slab_reassign(slab, slot_class, evict, data);
+	if (page == NULL) {
+		return NULL;
+	}
+	phl_slab_split(slab, page, slot_class);
+	wuy_nop_list_pop_type(free_list, node, list_node);
+	return node;
+}
+
+void *phl_slab_alloc(struct phl_slab *slab, int length,
+		phl_slab_evict_f *evict, void *data)
+{
+	int slot_class = phl_slab_class(length);
+	if (slot_class >= PHL_SLAB_CLASSES
+			|| (PHL_SLAB_MIN_SLOT << slot_class) > slab->page_size) {
+		return NULL;
+	}
+
+	struct phl_slab_node *node = phl_slab_get(slab, slot_class, evict, data);
+	if (node == NULL) {
+		return NULL;
+	}
+
+	node->slot_class = slot_class;
+	node->length = length;
+	slab->classes[slot_class].used += length;
+	wuy_nop_list_append(&slab->classes[slot_class].lru_list, &node->list_node);
+	return node;
+}
+
+void phl_slab_free(struct phl_slab *slab, void *slot)
+{
+	struct phl_slab_node *node = slot;
+	wuy_nop_list_delete(&slab->classes[node->slot_class].lru_list, &node->list_node);
+	wuy_nop_list_append(&slab->classes[node->slot_class].free_list, &node->list_node);
+	slab->classes[node->slot_class].used -= node->length;
+	node->length = 0;
+}
+
+void phl_slab_touch(struct phl_slab *slab, void *slot)
+{
+	struct phl_slab_node *node = slot;
+	wuy_nop_list_t *lru_list = &slab->classes[node->slot_class].lru_list;
+	wuy_nop_list_delete(lru_list, &node->list_node);
+	wuy_nop_list_append(lru_list, &node->list_node);
+}
+
+bool phl_slab_resize(struct phl_slab *slab, void *slot, int length)
+{
+	struct phl_slab_node *node = slot;
+	if (phl_slab_class(length) != node->slot_class) {
+		return false;
+	}
+
+	slab->classes[node->slot_class].used += length - node->length;
+	node->length = length;
+	phl_slab_touch(slab, slot);
+	return true;
+}
@@ -0,0 +1,67 @@
+#ifndef PHL_SLAB_H
+#define PHL_SLAB_H
+
+/* Slab allocator of shared-memory, used by shared dictionaries, the
+ * memory cache of static, the gzip cache and the memory tier of file_cache.
+ *
+ * The memory is divided into pages of the same size, and each page is
+ * divided into slots of one class when it is used for the first time.
+ * The slot size of class N is (PHL_SLAB_MIN_SLOT << N). Each class has
+ * its own LRU list, and the least recently used slot of the class is
+ * evicted if there is no free slot or page left. If the class has no
+ * slot at all, a whole page is taken from the class with most pages,
+ * with all its slots evicted, and re-divided for this class.
+ *
+ * There is no lock inside, so the caller should hold its own. */
+
+#define PHL_SLAB_MIN_SLOT	128
+#define PHL_SLAB_CLASSES	16
+
+/* must be the first member of slot */
+struct phl_slab_node {
+	wuy_nop_list_node_t	list_node; /* on LRU or free list of the class */
+	int			slot_class;
+	int			length; /* 0 if free */
+};
+
+struct phl_slab {
+	int			page_size;
+	int			page_num;
+	int			page_used;
+	char			*pages_start;
+
+	struct {
+		wuy_nop_list_t	lru_list;
+		wuy_nop_list_t	free_list;
+		long		used; /* sum of lengths */
+		int		pages;
+	} classes[PHL_SLAB_CLASSES];
+};
+
+/* Returns the page size, which is also the max slot size, to hold
+ * @max_length bytes, or 0 if too big. */
+int phl_slab_page_size(int max_length);
+
+/* The @slab should be zeroed before. */
+void phl_slab_init(struct phl_slab *slab, char *pages_start, int page_size, int page_num);
+
+/* Called for each slot in use to be evicted, with its content kept,
+ * so the caller can remove it from its own index. */
+typedef void phl_slab_evict_f(void *slot, void *data);
+
+/* Allocate a slot to hold @length bytes, including the node, and append
+ * it to the LRU list. Slots in use may be evicted, see @evict.
+ * Returns NULL if no memory. */
+void *phl_slab_alloc(struct phl_slab *slab, int length,
+		phl_slab_evict_f *evict, void *data);
+
+void phl_slab_free(struct phl_slab *slab, void *slot);
+
+/* move to the tail of LRU list */
+void phl_slab_touch(struct phl_slab *slab, void *slot);
+
+/* Resize the slot to @length bytes if in the same class, and touch it.
+ * Returns false if not, and nothing is changed. */
+bool phl_slab_resize(struct phl_slab *slab, void *slot, int length);
+
+#endif
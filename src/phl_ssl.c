@@ -66,8 +66,11 @@ static int phl_ssl_sni_callback(SSL *ssl, int *ad, void *arg)
 	}
 
 	atomic_fetch_add(&stats->sni_ok, 1);
-	if (c->ssl_sni_conf_host->ssl->ctx != c->conf_listen->default_host->ssl->ctx) {
-		// SSL_set_ssl_ctx(ssl, c->ssl_sni_conf_host->ssl.ctx);
+
+	/* switch to the certificate of the matched Host */
+	SSL_CTX *ctx = c->ssl_sni_conf_host->ssl->ctx;
+	if (ctx != SSL_get_SSL_CTX(ssl)) {
+		SSL_set_ssl_ctx(ssl, ctx);
 	}
 
 	return SSL_TLSEXT_ERR_OK;
@@ -155,6 +158,16 @@ void phl_ssl_stream_set(loop_stream_t *s, SSL_CTX *ctx, bool is_server)
 	loop_stream_set_underlying(s, ssl);
 }
 
+/* the SNI name, or NULL if not SSL or no SNI */
+const char *phl_ssl_stream_servername(loop_stream_t *s)
+{
+	SSL *ssl = loop_stream_get_underlying(s);
+	if (ssl == NULL) {
+		return NULL;
+	}
+	return SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+}
+
 int phl_ssl_stream_handshake(loop_stream_t *s)
 {
 	SSL *ssl = loop_stream_get_underlying(s);
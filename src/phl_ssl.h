@@ -39,6 +39,7 @@ SSL_CTX *phl_ssl_ctx_new_client(void);
 
 void phl_ssl_stream_set(loop_stream_t *s, SSL_CTX *ctx, bool is_server);
 int phl_ssl_stream_handshake(loop_stream_t *s);
+const char *phl_ssl_stream_servername(loop_stream_t *s);
 
 int phl_ssl_stream_underlying_read(void *underlying, void *buffer, int buf_len);
 int phl_ssl_stream_underlying_write(void *underlying, const void *data, int len);
@@ -110,6 +110,7 @@ phl_upstream_get_connection(struct phl_upstream_conf *upstream, struct phl_reque
 		address->idle_num--;
 		atomic_fetch_add(&address->stats->reuse, 1);
 		upc->request = r;
+		upc->request_time = wuy_time_ms();
 		return upc;
 	}
 
@@ -136,6 +137,7 @@ phl_upstream_get_connection(struct phl_upstream_conf *upstream, struct phl_reque
 	upc->create_time = wuy_time_ms();
 
 	upc->request = r;
+	upc->request_time = upc->create_time;
 	return upc;
 }
 
@@ -197,6 +199,10 @@ void phl_upstream_release_connection(struct phl_upstream_connection *upc, bool i
 		}
 	}
 
+	if (upstream->outlier.interval != 0) {
+		phl_upstream_outlier_record(upc);
+	}
+
 	/* close the connection */
 	if (upc->error || !is_clean || loop_stream_is_closed(upc->loop_stream)) {
 		_log(PHL_LOG_DEBUG, "just close, state=%d", r->state);
@@ -364,6 +370,9 @@ bool phl_upstream_address_is_pickable(struct phl_upstream_address *address,
 	if (address->healthcheck.down_time != 0) {
 		return false;
 	}
+	if (address->outlier.eject_until != 0 && time(NULL) < address->outlier.eject_until) {
+		return false;
+	}
 	if (address->failure.down_time == 0) {
 		return true;
 	}
@@ -469,6 +478,10 @@ static const char *phl_upstream_conf_post(void *data)
 
 	conf->loadbalance->update(conf);
 
+	if (conf->outlier.interval != 0) {
+		phl_upstream_outlier_start(conf);
+	}
+
 	if (!phl_dynamic_is_sub(&conf->dynamic)) {
 		wuy_list_append(&phl_upstream_list, &conf->list_node);
 	}
@@ -488,6 +501,8 @@ static void phl_upstream_conf_free(void *data)
 		loop_stream_close(conf->resolve_stream);
 	}
 
+	phl_upstream_outlier_stop(conf);
+
 	if (conf->loadbalance != NULL) {
 		conf->loadbalance->ctx_free(conf->lb_ctx);
 	}
@@ -523,10 +538,21 @@ static void phl_upstream_conf_stats(struct phl_upstream_conf *conf, wuy_json_t *
 			wuy_json_object_close(json);
 		}
 
+		if (conf->outlier.interval != 0) {
+			wuy_json_object_object(json, "outlier");
+			wuy_json_object_int(json, "eject_until", address->outlier.eject_until);
+			wuy_json_object_int(json, "ejections", address->outlier.ejections);
+			wuy_json_object_int(json, "requests", address->outlier.requests);
+			wuy_json_object_int(json, "errors", address->outlier.errors);
+			wuy_json_object_int(json, "latency_acc_ms", address->outlier.latency_acc_ms);
+			wuy_json_object_close(json);
+		}
+
 		struct phl_upstream_address_stats *stats = address->stats;
 		wuy_json_object_int(json, "create_time", atomic_load(&stats->create_time));
 		wuy_json_object_int(json, "failure_down", atomic_load(&stats->failure_down));
 		wuy_json_object_int(json, "healthcheck_down", atomic_load(&stats->healthcheck_down));
+		wuy_json_object_int(json, "outlier_eject", atomic_load(&stats->outlier_eject));
 		wuy_json_object_int(json, "pick", atomic_load(&stats->pick));
 		wuy_json_object_int(json, "reuse", atomic_load(&stats->reuse));
 		wuy_json_object_int(json, "connected", atomic_load(&stats->connected));
@@ -663,6 +689,11 @@ static struct wuy_cflua_command phl_upstream_conf_commands[] = {
 		.type = WUY_CFLUA_TYPE_TABLE,
 		.u.table = &(struct wuy_cflua_table) { phl_upstream_healthcheck_commands },
 	},
+	{	.name = "outlier",
+		.description = "Eject addresses whose latency or error rate is much worse than others'",
+		.type = WUY_CFLUA_TYPE_TABLE,
+		.u.table = &(struct wuy_cflua_table) { phl_upstream_outlier_commands },
+	},
 	{	.name = "log",
 		.type = WUY_CFLUA_TYPE_TABLE,
 		.offset = offsetof(struct phl_upstream_conf, log),
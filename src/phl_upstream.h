@@ -31,6 +31,7 @@ struct phl_upstream_address_stats {
 	atomic_long		reuse;
 	atomic_long		failure_down;
 	atomic_long		healthcheck_down;
+	atomic_long		outlier_eject;
 	atomic_long		connected;
 	atomic_long		connect_acc_ms;
 };
@@ -50,6 +51,7 @@ struct phl_upstream_connection {
 	struct phl_request	*request; /* NULL if in idle state */
 
 	long			create_time;
+	long			request_time;
 
 	wuy_list_node_t		list_node;
 };
@@ -80,6 +82,14 @@ struct phl_upstream_address {
 		loop_stream_t	*stream;
 	} healthcheck; // TODO move to shmem
 
+	struct {
+		time_t		eject_until;
+		int		ejections;
+		int		requests;
+		int		errors;
+		long		latency_acc_ms;
+	} outlier;
+
 	/* lists of connections */
 	int			idle_num;
 	wuy_list_t		idle_head;
@@ -163,6 +173,17 @@ struct phl_upstream_conf {
 		int			resp_len;
 	} healthcheck;
 
+	struct {
+		int			interval;
+		int			min_requests;
+		double			latency_factor;
+		double			error_rate_margin;
+		int			base_eject_time;
+		int			max_eject_time;
+		int			max_eject_percent;
+		loop_timer_t		*timer;
+	} outlier;
+
 	struct phl_log			*log;
 
 	struct phl_dynamic_conf		dynamic;
@@ -252,6 +273,15 @@ extern struct wuy_cflua_command phl_upstream_healthcheck_commands[];
 /* }}} */
 
 
+/* {{{ defined in phl_upstream_outlier.c and used by phl_upstream.c */
+void phl_upstream_outlier_record(struct phl_upstream_connection *upc);
+void phl_upstream_outlier_start(struct phl_upstream_conf *upstream);
+void phl_upstream_outlier_stop(struct phl_upstream_conf *upstream);
+
+extern struct wuy_cflua_command phl_upstream_outlier_commands[];
+/* }}} */
+
+
 bool phl_upstream_address_is_pickable(struct phl_upstream_address *address,
 		struct phl_request *r);
 
@@ -143,7 +143,9 @@ void phl_upstream_content_ctx_free(struct phl_request *r)
 {
 	struct phl_upstream_content_ctx *ctx = r->module_ctxs[r->conf_path->content->index];
 	if (ctx->upc != NULL) {
-		phl_upstream_release_connection(ctx->upc, r->state == PHL_REQUEST_STATE_DONE);
+		/* the response body left unread if replaced by filter */
+		phl_upstream_release_connection(ctx->upc, r->state == PHL_REQUEST_STATE_DONE
+				&& !r->resp.body_replaced);
 	}
 }
 
@@ -0,0 +1,211 @@
+#include "phl_main.h"
+
+#define _log(level, fmt, ...) phl_log_level(upstream->log, level, \
+		"upstream outlier: %s " fmt, upstream->name, ##__VA_ARGS__)
+
+/* the median is meaningless for too few addresses */
+#define PHL_UPSTREAM_OUTLIER_MIN_ADDRESSES	3
+
+void phl_upstream_outlier_record(struct phl_upstream_connection *upc)
+{
+	struct phl_upstream_address *address = upc->address;
+
+	address->outlier.requests++;
+	if (upc->error) {
+		address->outlier.errors++;
+	}
+	if (upc->request_time != 0) {
+		address->outlier.latency_acc_ms += wuy_time_ms() - upc->request_time;
+		upc->request_time = 0;
+	}
+}
+
+static int phl_upstream_outlier_double_cmp(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+	return da < db ? -1 : da > db;
+}
+static double phl_upstream_outlier_median(double *values, int num)
+{
+	qsort(values, num, sizeof(double), phl_upstream_outlier_double_cmp);
+	return (num % 2 == 1) ? values[num / 2] : (values[num/2-1] + values[num/2]) / 2;
+}
+
+static void phl_upstream_outlier_eject(struct phl_upstream_address *address,
+		time_t now, const char *reason, double value, double median)
+{
+	struct phl_upstream_conf *upstream = address->upstream;
+
+	/* exponentially growing, by continuous ejections */
+	int shift = MIN(address->outlier.ejections, 16);
+	long period = (long)upstream->outlier.base_eject_time << shift;
+	if (period > upstream->outlier.max_eject_time) {
+		period = upstream->outlier.max_eject_time;
+	}
+
+	_log(PHL_LOG_ERROR, "eject %s for %ld seconds by %s: %.3f, median: %.3f",
+			address->name, period, reason, value, median);
+
+	address->outlier.eject_until = now + period;
+	address->outlier.ejections++;
+	atomic_fetch_add(&address->stats->outlier_eject, 1);
+}
+
+static int64_t phl_upstream_outlier_timer_handler(int64_t at, void *data)
+{
+	struct phl_upstream_conf *upstream = data;
+
+	time_t now = time(NULL);
+
+	/* recover expired ejections, and collect the candidates */
+	int ejected_num = 0, candidate_num = 0;
+	double latencies[upstream->address_num + 1];
+	double error_rates[upstream->address_num + 1];
+
+	struct phl_upstream_address *address;
+	wuy_list_iter_type(&upstream->address_head, address, upstream_node) {
+		if (address->outlier.eject_until != 0) {
+			if (now < address->outlier.eject_until) {
+				ejected_num++;
+				continue;
+			}
+			_log(PHL_LOG_ERROR, "recover %s", address->name);
+			address->outlier.eject_until = 0;
+		} else if (address->outlier.ejections > 0 && address->outlier.requests > 0) {
+			/* behaves well in the last period */
+			address->outlier.ejections--;
+		}
+
+		if (address->outlier.requests < upstream->outlier.min_requests) {
+			continue;
+		}
+		if (candidate_num == upstream->address_num) { /* in resolving */
+			break;
+		}
+		latencies[candidate_num] = (double)address->outlier.latency_acc_ms / address->outlier.requests;
+		error_rates[candidate_num] = (double)address->outlier.errors / address->outlier.requests;
+		candidate_num++;
+	}
+
+	if (candidate_num < PHL_UPSTREAM_OUTLIER_MIN_ADDRESSES) {
+		_log(PHL_LOG_DEBUG, "too few candidates: %d", candidate_num);
+		goto out;
+	}
+
+	double latency_median = phl_upstream_outlier_median(latencies, candidate_num);
+	double error_rate_median = phl_upstream_outlier_median(error_rates, candidate_num);
+
+	_log(PHL_LOG_DEBUG, "candidates: %d, latency median: %.3f, error rate median: %.3f",
+			candidate_num, latency_median, error_rate_median);
+
+	/* eject outliers */
+	int ejected_max = upstream->address_num * upstream->outlier.max_eject_percent / 100;
+
+	wuy_list_iter_type(&upstream->address_head, address, upstream_node) {
+		if (ejected_num >= ejected_max) {
+			_log(PHL_LOG_INFO, "reach max_eject_percent");
+			break;
+		}
+		if (address->outlier.eject_until != 0) {
+			continue;
+		}
+		if (address->outlier.requests < upstream->outlier.min_requests) {
+			continue;
+		}
+
+		double latency = (double)address->outlier.latency_acc_ms / address->outlier.requests;
+		double error_rate = (double)address->outlier.errors / address->outlier.requests;
+
+		if (error_rate > error_rate_median + upstream->outlier.error_rate_margin) {
+			phl_upstream_outlier_eject(address, now, "error rate",
+					error_rate, error_rate_median);
+			ejected_num++;
+
+		} else if (upstream->outlier.latency_factor > 0 &&
+				latency > latency_median * upstream->outlier.latency_factor) {
+			phl_upstream_outlier_eject(address, now, "latency",
+					latency, latency_median);
+			ejected_num++;
+		}
+	}
+
+out:
+	/* reset counters for next period */
+	wuy_list_iter_type(&upstream->address_head, address, upstream_node) {
+		address->outlier.requests = 0;
+		address->outlier.errors = 0;
+		address->outlier.latency_acc_ms = 0;
+	}
+
+	return upstream->outlier.interval * 1000;
+}
+
+void phl_upstream_outlier_start(struct phl_upstream_conf *upstream)
+{
+	upstream->outlier.timer = loop_timer_new(phl_loop,
+			phl_upstream_outlier_timer_handler, upstream);
+
+	loop_timer_set_after(upstream->outlier.timer,
+			upstream->outlier.interval * 1000 + random() % 1000);
+}
+
+void phl_upstream_outlier_stop(struct phl_upstream_conf *upstream)
+{
+	if (upstream->outlier.timer != NULL) {
+		loop_timer_delete(upstream->outlier.timer);
+	}
+}
+
+struct wuy_cflua_command phl_upstream_outlier_commands[] = {
+	{	.name = "interval",
+		.description = "Interval of detecting outliers. Set 0 to disable.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_upstream_conf, outlier.interval),
+		.default_value.n = 0,
+		.limits.n = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+	},
+	{	.name = "min_requests",
+		.description = "Addresses with less requests in an interval are not detected.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_upstream_conf, outlier.min_requests),
+		.default_value.n = 10,
+		.limits.n = WUY_CFLUA_LIMITS_POSITIVE,
+	},
+	{	.name = "latency_factor",
+		.description = "Eject an address if its average latency is larger than "
+			"the median of all addresses multiplied by this. Set 0 to disable.",
+		.type = WUY_CFLUA_TYPE_DOUBLE,
+		.offset = offsetof(struct phl_upstream_conf, outlier.latency_factor),
+		.default_value.d = 3.0,
+		.limits.d = WUY_CFLUA_LIMITS_NON_NEGATIVE,
+	},
+	{	.name = "error_rate_margin",
+		.description = "Eject an address if its error rate is larger than "
+			"the median of all addresses plus this.",
+		.type = WUY_CFLUA_TYPE_DOUBLE,
+		.offset = offsetof(struct phl_upstream_conf, outlier.error_rate_margin),
+		.default_value.d = 0.3,
+		.limits.d = WUY_CFLUA_LIMITS(0, 1),
+	},
+	{	.name = "base_eject_time",
+		.description = "Eject time is this multiplied by 2^N, where N is continuous ejections.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_upstream_conf, outlier.base_eject_time),
+		.default_value.n = 30,
+		.limits.n = WUY_CFLUA_LIMITS_POSITIVE,
+	},
+	{	.name = "max_eject_time",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_upstream_conf, outlier.max_eject_time),
+		.default_value.n = 300,
+		.limits.n = WUY_CFLUA_LIMITS_POSITIVE,
+	},
+	{	.name = "max_eject_percent",
+		.description = "Max percentage of ejected addresses, to avoid emptying the upstream.",
+		.type = WUY_CFLUA_TYPE_INTEGER,
+		.offset = offsetof(struct phl_upstream_conf, outlier.max_eject_percent),
+		.default_value.n = 50,
+		.limits.n = WUY_CFLUA_LIMITS(0, 100),
+	},
+	{ NULL }
+};
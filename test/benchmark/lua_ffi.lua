@@ -0,0 +1,56 @@
+-- Microbenchmark of the request accessors, comparing the ordinary
+-- `phl.req`/`phl.conn` APIs with `luapkgs/phl_ffi`.
+--
+-- Run it in src/ so that `require "luapkgs/phl_ffi"` works:
+--
+--   $ cd src/ && ./phorklift ../test/benchmark/lua_ffi.lua
+--
+-- REQUEST: curl -A bench -b 'theme=dark; id=12345' '127.0.0.1:8080/some/path?loops=1000000'
+--
+-- It outputs nanoseconds per call of each accessor. The `ffi` column is
+-- the same as `phl` if the runtime is not LuaJIT.
+
+Listen "8080" {
+    script = {
+        function()
+            local fast = require "luapkgs/phl_ffi"
+            local loops = tonumber(phl.req.get_uri_query("loops")) or 100000
+
+            local cases = {
+                { "uri_path",
+                  function() return phl.req.uri_path end,
+                  function() return fast.uri_path() end },
+                { "host",
+                  function() return phl.req.host end,
+                  function() return fast.host() end },
+                { "header",
+                  function() return phl.req.get_header("User-Agent") end,
+                  function() return fast.header("User-Agent") end },
+                { "header_is",
+                  function() return phl.req.get_header("User-Agent") == "bench" end,
+                  function() return fast.header_is("User-Agent", "bench") end },
+                { "cookie",
+                  function() return phl.req.get_cookie("id") end,
+                  function() return fast.cookie("id") end },
+                { "client_ip",
+                  function() return phl.conn.client_ip end,
+                  function() return fast.client_ip() end },
+            }
+
+            local out = { string.format("loops: %d, ffi: %s\n", loops, tostring(fast.is_ffi)) }
+            for _, c in ipairs(cases) do
+                local name, plain, ffi = c[1], c[2], c[3]
+
+                local t0 = os.clock()
+                for _ = 1, loops do plain() end
+                local t1 = os.clock()
+                for _ = 1, loops do ffi() end
+                local t2 = os.clock()
+
+                table.insert(out, string.format("%-10s  phl: %8.1f ns  ffi: %8.1f ns\n",
+                        name, (t1 - t0) * 1e9 / loops, (t2 - t1) * 1e9 / loops))
+            end
+            return table.concat(out)
+        end,
+    }
+}